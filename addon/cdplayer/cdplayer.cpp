@@ -28,7 +28,16 @@ LOGMODULE("cdplayer");
 
 CCDPlayer *CCDPlayer::s_pThis = 0;
 
-CCDPlayer::CCDPlayer(const char *pSoundDevice)
+CCDAudioReader::CCDAudioReader(CCDPlayer *pPlayer)
+    : m_pPlayer(pPlayer) {
+    SetName("cdreader");
+}
+
+void CCDAudioReader::Run(void) {
+    m_pPlayer->ReadAhead();
+}
+
+CCDPlayer::CCDPlayer(const char *pSoundDevice, unsigned nRingSectors)
     : m_pSoundDevice(pSoundDevice),
       //m_I2CMaster(CMachineInfo::Get()->GetDevice(DeviceI2CMaster), TRUE) {
       m_I2CMaster(CMachineInfo::Get()->GetDevice(DeviceI2CMaster), FALSE) {
@@ -40,13 +49,30 @@ CCDPlayer::CCDPlayer(const char *pSoundDevice)
     LOGNOTE("CD Player starting");
     SetName("cdplayer");
     Initialize();
+
+    // Power of two, so a slot is just the head or tail masked
+    m_nRingSectors = MIN_RING_SECTORS;
+    while (m_nRingSectors < nRingSectors)
+        m_nRingSectors <<= 1;
+    m_pRing = new u8[m_nRingSectors * SECTOR_SIZE];
+
+    // Smaller reads than this when the ring is tiny, so the reader can
+    // always find room for one
+    m_nReadBatch = m_nRingSectors / 2 < BATCH_SIZE ? m_nRingSectors / 2 : BATCH_SIZE;
+
+    LOGNOTE("CD Player buffers %u sectors ahead of the DAC", m_nRingSectors);
+    m_pReader = new CCDAudioReader(this);
 }
 
 boolean CCDPlayer::SetDevice(ICueDevice *pBinFileDevice) {
     LOGNOTE("CD Player setting device");
     state = NONE;
-    address = 0;
     m_pBinFileDevice = pBinFileDevice;
+    address = 0;
+    end_address = 0;
+
+    // Reads of the old disc still under way are dropped with the old generation
+    RestartReader(0, 0);
     return true;
 }
 
@@ -102,7 +128,7 @@ CCDPlayer::~CCDPlayer(void) {
 }
 
 u8 CCDPlayer::GetVolume() {
-    return volumeByte;
+    return volumeLeftByte < volumeRightByte ? volumeLeftByte : volumeRightByte;
 }
 
 boolean CCDPlayer::SetDefaultVolume(u8 vol) {
@@ -112,8 +138,13 @@ boolean CCDPlayer::SetDefaultVolume(u8 vol) {
 }
 
 boolean CCDPlayer::SetVolume(u8 vol) {
-    LOGNOTE("Setting volume to 0x%02x", vol);
-    volumeByte = vol;
+    return SetVolume(vol, vol);
+}
+
+boolean CCDPlayer::SetVolume(u8 left, u8 right) {
+    LOGNOTE("Setting volume to 0x%02x,0x%02x", left, right);
+    volumeLeftByte = left;
+    volumeRightByte = right;
     return true;
 }
 
@@ -214,140 +245,233 @@ boolean CCDPlayer::Play(u32 lba, u32 num_blocks) {
 // DACs don't support volume control, so we scale the data
 // accordingly instead
 void CCDPlayer::ScaleVolume(u8 *buffer, u32 byteCount) {
-    if (volumeByte == 0xff && defaultVolumeByte == 0xff)
+    if (volumeLeftByte == 0xff && volumeRightByte == 0xff && defaultVolumeByte == 0xff)
         return;
 
-    // Convert both to Q12 scale
-    u16 defaultScale = (defaultVolumeByte == 0xff) ? 4096 : (defaultVolumeByte << 4);  // max = 0xff << 4 = 4080
-    u16 volumeScale  = (volumeByte == 0xff)         ? 4096 : (volumeByte << 4);
+    // Convert each to Q12 scale
+    u16 defaultScale = (defaultVolumeByte == 0xff) ? VOLUME_SCALE_ONE : (defaultVolumeByte << 4);  // max = 0xff << 4 = 4080
+    u16 leftScale = (volumeLeftByte == 0xff) ? VOLUME_SCALE_ONE : (volumeLeftByte << 4);
+    u16 rightScale = (volumeRightByte == 0xff) ? VOLUME_SCALE_ONE : (volumeRightByte << 4);
+
+    // Combine: result is Q12 * Q12 >> 12 = Q12 again
+    CVolumeScaler::Scale(buffer, byteCount,
+                         (defaultScale * leftScale) >> VOLUME_SCALE_BITS,
+                         (defaultScale * rightScale) >> VOLUME_SCALE_BITS);
+}
+
+void CCDPlayer::RestartReader(u32 lba, u32 end) {
+    // Drop what is buffered. The reader never moves the tail, and it won't
+    // publish a read it started before the generation changed. Called from
+    // Run() and, via SetDevice(), from the gadget's task, which can't
+    // preempt Run() as tasks are cooperative
+    m_nRingTail = m_nRingHead;
+    m_nSectorOffset = 0;
+    m_nScaledBytes = 0;
+    m_bPrimed = FALSE;
+    m_bStarved = FALSE;
+
+    m_nRequestAddress = lba;
+    m_nRequestEnd = end;
+    DataMemBarrier();
+    m_nRequestGeneration = m_nRequestGeneration + 1;
+}
 
-    // Combine both: result is Q12 * Q12 >> 12 = Q12 again
-    u16 finalScale = (defaultScale * volumeScale) >> 12;
+// Runs in its own task. Keeps the ring full of the sectors following the
+// last one it read, up to the end of the range being played
+void CCDPlayer::ReadAhead(void) {
+    unsigned nMask = m_nRingSectors - 1;
 
-    for (u32 i = 0; i < byteCount; i += 2) {
-        short sample = (short)((buffer[i + 1] << 8) | buffer[i]);
-        int scaled = (sample * finalScale) >> 12;
-        buffer[i] = (u8)(scaled & 0xFF);
-        buffer[i + 1] = (u8)((scaled >> 8) & 0xFF);
+    while (true) {
+        unsigned nGeneration = m_nRequestGeneration;
+        if (nGeneration != m_nFillGeneration) {
+            DataMemBarrier();
+            m_nFillAddress = m_nRequestAddress;
+            m_nFillEnd = m_nRequestEnd;
+            m_bFillError = FALSE;
+            m_nFillGeneration = nGeneration;
+        }
+
+        ICueDevice *pDevice = m_pBinFileDevice;
+        u32 nRemaining = m_nFillAddress < m_nFillEnd ? m_nFillEnd - m_nFillAddress : 0;
+        unsigned nHead = m_nRingHead;
+        unsigned nFree = m_nRingSectors - (nHead - m_nRingTail);
+
+        // Wait for room for a whole batch rather than reading a sector at
+        // a time as the DAC frees them
+        unsigned nWant = nRemaining < m_nReadBatch ? nRemaining : m_nReadBatch;
+        if (pDevice == nullptr || m_bFillError || nRemaining == 0 || nFree < nWant) {
+            CScheduler::Get()->Yield();
+            continue;
+        }
+
+        // One read per contiguous run of slots
+        unsigned nSlot = nHead & nMask;
+        unsigned nCount = nFree;
+        if (nCount > m_nRingSectors - nSlot)
+            nCount = m_nRingSectors - nSlot;
+        if (nCount > nRemaining)
+            nCount = nRemaining;
+        if (nCount > BATCH_SIZE)
+            nCount = BATCH_SIZE;
+
+        // The audio cursor is ours alone, so the gadget's data reads
+        // can't move it between batches
+        int readCount = pDevice->ReadAt((u64)m_nFillAddress * SECTOR_SIZE, m_pRing + nSlot * SECTOR_SIZE,
+                                        nCount * SECTOR_SIZE, ICueDevice::CursorAudio);
+
+        // The range or the disc changed while we were reading
+        if (m_nRequestGeneration != nGeneration)
+            continue;
+
+        if (readCount < 0) {
+            LOGERR("File read error at sector %u", m_nFillAddress);
+            m_bFillError = TRUE;
+            continue;
+        }
+
+        unsigned nRead = (unsigned)readCount / SECTOR_SIZE;
+        if (nRead < nCount) {
+            // The image ends before the range does
+            LOGWARN("Partial read from file: Read %d, expected %u.", readCount, nCount * SECTOR_SIZE);
+            m_nFillEnd = m_nFillAddress + nRead;
+        }
+
+        // Publish the data before the head that covers it
+        DataMemBarrier();
+        m_nFillAddress = m_nFillAddress + nRead;
+        m_nRingHead = nHead + nRead;
+
+        CScheduler::Get()->Yield();
     }
 }
 
-void CCDPlayer::Run(void) {
+// Hands the DAC as much of the ring as it has room for, straight from the
+// ring so there is no copy
+void CCDPlayer::FeedSound(unsigned nQueueFrames) {
+    unsigned nTail = m_nRingTail;
+    unsigned nBuffered = m_nRingHead - nTail;
+
+    if (nBuffered == 0) {
+        // Nothing to play. If the reader is done with this range, so are we
+        if (m_nFillGeneration == m_nRequestGeneration) {
+            if (m_bFillError) {
+                state = STOPPED_ERROR;
+                LogStats();
+                return;
+            }
+            if (m_nFillAddress >= m_nFillEnd) {
+                LOGNOTE("Read 0 bytes, treating as end of track.");
+                state = STOPPED_OK;
+                LogStats();
+                return;
+            }
+        }
 
-    // Initialize buffer state variables.
-    m_BufferBytesValid = 0;
-    m_BufferReadPos = 0;
-    m_BytesProcessedInSector = 0;
+        // The DAC has played everything we gave it, so the listener hears
+        // a gap. Count it once per gap and not while starting up
+        if (m_bPrimed && !m_bStarved && m_pSound->GetQueueFramesAvail() == 0) {
+            m_nUnderruns++;
+            m_bStarved = TRUE;
+            LOGWARN("Audio underrun at sector %u", address);
+        }
+        return;
+    }
+
+    // Read the data only after seeing the head that covers it
+    DataMemBarrier();
+
+    if (m_bPrimed && nBuffered < m_nLowWater)
+        m_nLowWater = nBuffered;
+
+    unsigned int available_queue_size = nQueueFrames - m_pSound->GetQueueFramesAvail();
+    unsigned int bytes_for_sound_device = available_queue_size * BYTES_PER_FRAME;
+
+    // As far as the end of the ring, the rest goes next time round
+    unsigned nSlot = nTail & (m_nRingSectors - 1);
+    unsigned nContiguous = m_nRingSectors - nSlot;
+    if (nContiguous > nBuffered)
+        nContiguous = nBuffered;
+    unsigned int bytes_available = nContiguous * SECTOR_SIZE - m_nSectorOffset;
+
+    unsigned int bytes_to_process = bytes_for_sound_device < bytes_available ? bytes_for_sound_device : bytes_available;
+    bytes_to_process -= (bytes_to_process % BYTES_PER_FRAME);
+    if (bytes_to_process == 0)
+        return;
+
+    // We own the slots between tail and head, so scale them in place. What
+    // the DAC didn't take last time is scaled already and mustn't be again
+    u8 *pData = m_pRing + nSlot * SECTOR_SIZE + m_nSectorOffset;
+    if (bytes_to_process > m_nScaledBytes) {
+        ScaleVolume(pData + m_nScaledBytes, bytes_to_process - m_nScaledBytes);
+        m_nScaledBytes = bytes_to_process;
+    }
+
+    int writeCount = m_pSound->Write(pData, bytes_to_process);
+    if (writeCount < 0) {
+        LOGERR("Error writing to sound device.");
+        state = STOPPED_ERROR;
+        LogStats();
+        return;
+    }
+    if ((unsigned int)writeCount != bytes_to_process) {
+        // The rest goes next time round
+        LOGWARN("Truncated write to sound device. Wrote %d, expected %d", writeCount, bytes_to_process);
+    }
+
+    m_bPrimed = TRUE;
+    m_bStarved = FALSE;
+
+    m_nScaledBytes -= writeCount;
+    m_nSectorOffset += writeCount;
+    unsigned nDone = m_nSectorOffset / SECTOR_SIZE;
+    if (nDone > 0) {
+        m_nSectorOffset %= SECTOR_SIZE;
+        address += nDone;
+        m_nSectorsPlayed += nDone;
+
+        // Hand the slots back to the reader once we are done with them
+        DataMemBarrier();
+        m_nRingTail = nTail + nDone;
+    }
+
+    if (address >= end_address) {
+        LOGNOTE("Finished playing track range.");
+        state = STOPPED_OK;
+        LogStats();
+    }
+}
+
+void CCDPlayer::LogStats(void) {
+    LOGNOTE("Played %u sectors, %u underruns, lowest buffer %u of %u sectors",
+            m_nSectorsPlayed, m_nUnderruns, m_nLowWater, m_nRingSectors);
+}
+
+void CCDPlayer::Run(void) {
     unsigned int total_frames = m_pSound->GetQueueSizeFrames();
-    m_WriteChunk = new u8[total_frames * BYTES_PER_FRAME];
-    m_ReadBuffer = new u8[AUDIO_BUFFER_SIZE];
 
     LOGNOTE("CD Player Run Loop initializing. Queue Size is %d frames", total_frames);
 
     while (true) {
         if (state == SEEKING || state == SEEKING_PLAYING) {
             LOGNOTE("Seeking to sector %u (byte %u)", address, unsigned(address * SECTOR_SIZE));
-            u64 offset = m_pBinFileDevice->Seek(unsigned(address * SECTOR_SIZE));
 
-            // When we seek, the contents of our read buffer are now invalid.
-            m_BufferBytesValid = 0;
-            m_BufferReadPos = 0;
-            m_BytesProcessedInSector = 0; // Reset byte progress on seek
+            // Have the reader start filling from the new address. A plain
+            // seek doesn't know where playback will end, so reads nothing
+            boolean bPlay = state == SEEKING_PLAYING;
+            RestartReader(address, bPlay ? end_address : address);
+            m_nUnderruns = 0;
+            m_nLowWater = m_nRingSectors;
+            m_nSectorsPlayed = 0;
 
-            if (offset != (u64)(-1)) {
-                LOGNOTE("Seeking successful");
-                state = (state == SEEKING_PLAYING) ? PLAYING : STOPPED_OK;
-            } else {
-                LOGERR("Error seeking to byte position %u", address * SECTOR_SIZE);
-                state = STOPPED_ERROR;
-            }
+            state = bPlay ? PLAYING : STOPPED_OK;
         }
 
         if (state == PLAYING) {
-            // Fill the read buffer if it has been consumed.
-            if (m_BufferReadPos >= m_BufferBytesValid) {
-                m_BufferReadPos = 0; // Reset read position
-
-                u64 sectors_remaining = (address < end_address) ? (end_address - address) : 0;
-                if (sectors_remaining == 0) {
-                    LOGNOTE("Playback finished, no sectors remaining.");
-                    state = STOPPED_OK;
-                    m_BufferBytesValid = 0;
-                    continue;
-                }
-
-                u64 sectors_to_read_now = (AUDIO_BUFFER_SIZE / SECTOR_SIZE < sectors_remaining) ? (AUDIO_BUFFER_SIZE / SECTOR_SIZE) : sectors_remaining;
-                int bytes_to_read = sectors_to_read_now * SECTOR_SIZE;
-
-		// Because another task could have moved the file pointer after a Yield(),
-                // we MUST seek to our intended address before every read operation.
-                u64 offset = m_pBinFileDevice->Seek(unsigned(address * SECTOR_SIZE));
-                if (offset == (u64)(-1)) {
-                    LOGERR("Pre-read seek failed at position %u", address * SECTOR_SIZE);
-                    state = STOPPED_ERROR;
-                    continue; // Re-evaluate state in the next loop iteration.
-                }
-
-                //LOGDBG("Buffer exhausted. Reading %d bytes from file.", bytes_to_read);
-                int readCount = m_pBinFileDevice->Read(m_ReadBuffer, bytes_to_read);
-
-                if (readCount < 0) {
-                    LOGERR("File read error.");
-                    state = STOPPED_ERROR;
-                    m_BufferBytesValid = 0;
-                } else {
-                    if (readCount < bytes_to_read) {
-                        LOGWARN("Partial read from file: Read %d, expected %d.", readCount, bytes_to_read);
-                    }
-                    m_BufferBytesValid = readCount;
-                    if (m_BufferBytesValid == 0) {
-                       LOGNOTE("Read 0 bytes, treating as end of track.");
-                       state = STOPPED_OK;
-                    }
-                }
-            }
-
-            // Feed the sound device from our buffer, if we have valid data.
-            if (m_BufferBytesValid > 0 && state == PLAYING) {
-                unsigned int available_queue_size = total_frames - m_pSound->GetQueueFramesAvail();
-                unsigned int bytes_for_sound_device = available_queue_size * BYTES_PER_FRAME;
-
-                unsigned int bytes_available_in_buffer = m_BufferBytesValid - m_BufferReadPos;
-                unsigned int bytes_to_process = (bytes_for_sound_device < bytes_available_in_buffer) ? bytes_for_sound_device : bytes_available_in_buffer;
-
-                bytes_to_process -= (bytes_to_process % BYTES_PER_FRAME);
-
-                if (bytes_to_process > 0) {
-                    // copy from read buffer to write chunk.
-                    for (unsigned int i = 0; i < bytes_to_process; ++i) {
-                        m_WriteChunk[i] = m_ReadBuffer[m_BufferReadPos + i];
-                    }
-
-                    ScaleVolume(m_WriteChunk, bytes_to_process);
-
-                    int writeCount = m_pSound->Write(m_WriteChunk, bytes_to_process);
-                    if (writeCount < 0) {
-                         LOGERR("Error writing to sound device.");
-                         state = STOPPED_ERROR;
-                    } else {
-                        if ((unsigned int)writeCount != bytes_to_process) {
-                            LOGWARN("Truncated write to sound device. Wrote %d, expected %d", writeCount, bytes_to_process);
-                        }
-
-                        m_BufferReadPos += writeCount;
-
-                        m_BytesProcessedInSector += writeCount;
-                        if (m_BytesProcessedInSector >= SECTOR_SIZE) {
-                            address += m_BytesProcessedInSector / SECTOR_SIZE;
-                            m_BytesProcessedInSector %= SECTOR_SIZE;
-                        }
-
-                        if (address >= end_address) {
-                            LOGNOTE("Finished playing track range.");
-                            state = STOPPED_OK;
-                        }
-                    }
-                }
+            if (address >= end_address) {
+                LOGNOTE("Playback finished, no sectors remaining.");
+                state = STOPPED_OK;
+            } else {
+                FeedSound(total_frames);
             }
         }
         CScheduler::Get()->Yield();
@@ -37,6 +37,8 @@
 #include <linux/kernel.h>
 #include <discimage/cuebinfile.h>
 
+#include "volumescaler.h"
+
 #define SECTOR_SIZE 2352
 #define BATCH_SIZE 16 
 #define BYTES_PER_FRAME 4
@@ -50,20 +52,39 @@
 #define FORMAT SoundFormatSigned16
 #define DAC_I2C_ADDRESS 0
 
-#define VOLUME_SCALE_BITS 12 // 1.0 = 4096
 #define VOLUME_STEPS 16
 
 #define AUDIO_BUFFER_SIZE  DAC_BUFFER_SIZE_FRAMES * BYTES_PER_FRAME
 
+// Sectors of audio read ahead of the DAC, can be set with cd_audio_buffer.
+// 64 sectors hold a little under a second of sound
+#define DEFAULT_RING_SECTORS 64
+#define MIN_RING_SECTORS 4
+
+class CCDPlayer;
+
+// Reads the sectors being played into the player's ring, so a slow read
+// from the SD card doesn't hold up feeding the DAC
+class CCDAudioReader : public CTask {
+   public:
+    CCDAudioReader(CCDPlayer *pPlayer);
+    void Run(void);
+
+   private:
+    CCDPlayer *m_pPlayer;
+};
+
 class CCDPlayer : public CTask {
    public:
-    CCDPlayer(const char *pSoundDevice);
+    /// \param nRingSectors Sectors buffered ahead of the DAC, rounded up to a power of two
+    CCDPlayer(const char *pSoundDevice, unsigned nRingSectors = DEFAULT_RING_SECTORS);
     ~CCDPlayer(void);
     boolean Initialize();
     boolean SetDevice(ICueDevice *pBinFileDevice);
     boolean Pause();
     boolean Resume();
     boolean SetVolume(u8 vol);
+    boolean SetVolume(u8 left, u8 right);
     boolean SetDefaultVolume(u8 vol);
     u8 GetVolume();
     unsigned int GetState();
@@ -87,7 +108,16 @@ class CCDPlayer : public CTask {
     };
 
    private:
+    friend class CCDAudioReader;
+
     void ScaleVolume(u8 *buffer, u32 byteCount);
+
+    // Point the reader at a new range and drop what the ring holds
+    void RestartReader(u32 lba, u32 end);
+    void ReadAhead(void);
+    void FeedSound(unsigned nQueueFrames);
+    void LogStats(void);
+
    private:
     const char *m_pSoundDevice;
     CI2CMaster m_I2CMaster;
@@ -95,18 +125,50 @@ class CCDPlayer : public CTask {
     CSynchronizationEvent m_Event;
     static CCDPlayer *s_pThis;
     CSoundBaseDevice *m_pSound;
-    CDevice *m_pBinFileDevice;
+    ICueDevice *m_pBinFileDevice;
     u32 address;
     u32 end_address;
     PlayState state;
-    u8 volumeByte = 255;
+    u8 volumeLeftByte = 255;
+    u8 volumeRightByte = 255;
     u8 defaultVolumeByte = 255;
 
-    u8 *m_ReadBuffer = new u8[AUDIO_BUFFER_SIZE];
-    u8 *m_WriteChunk;
-    unsigned int m_BufferBytesValid = 0;
-    unsigned int m_BufferReadPos = 0;
-    unsigned int m_BytesProcessedInSector = 0;
+    u8 *m_ReadBuffer = new u8[AUDIO_BUFFER_SIZE];  // for SoundTest()
+
+    // Ring of whole sectors between the reader and Run(). Head and tail
+    // count sectors and only ever grow, the slot is the count masked
+    u8 *m_pRing;
+    unsigned m_nRingSectors;
+    unsigned m_nReadBatch;              // sectors the reader asks for at once
+    // The reader only writes the head. The tail is written by Run(), and
+    // by RestartReader() when SetDevice() calls it from the gadget's task.
+    // That is safe only because tasks are cooperative, so it never lands
+    // in the middle of FeedSound()
+    volatile unsigned m_nRingHead = 0;
+    volatile unsigned m_nRingTail = 0;
+    unsigned m_nSectorOffset = 0;       // bytes of the tail sector already played
+    unsigned m_nScaledBytes = 0;        // bytes after that already volume scaled
+
+    // What the reader should fetch. Each restart bumps the generation, so
+    // a read that was under way when the range changed is thrown away
+    volatile unsigned m_nRequestGeneration = 0;
+    volatile u32 m_nRequestAddress = 0;
+    volatile u32 m_nRequestEnd = 0;
+
+    // The reader's progress with the current request
+    volatile unsigned m_nFillGeneration = 0;
+    volatile u32 m_nFillAddress = 0;
+    volatile u32 m_nFillEnd = 0;
+    volatile boolean m_bFillError = FALSE;
+
+    CCDAudioReader *m_pReader;
+
+    // Playback statistics, logged when playback stops
+    boolean m_bPrimed = FALSE;   // played something since the last restart
+    boolean m_bStarved = FALSE;  // DAC ran dry and we have had no data since
+    unsigned m_nUnderruns = 0;
+    unsigned m_nLowWater = 0;    // fewest sectors buffered while playing
+    unsigned m_nSectorsPlayed = 0;
 };
 
 #endif
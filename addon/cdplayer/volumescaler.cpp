@@ -0,0 +1,93 @@
+//
+// Scales 16 bit stereo samples for the CD Player's volume control
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "volumescaler.h"
+
+#if AARCH == 64
+#include <arm_neon.h>
+#endif
+
+// Every version computes (sample * scale) >> 12 with an arithmetic shift,
+// so they all give the same result to the bit
+
+#if AARCH == 64
+
+// 8 samples, ie. 4 frames, per step. The products are widened to 32 bits
+// and narrowed again by the shift, so nothing can overflow
+void CVolumeScaler::Scale(u8 *pBuffer, u32 nByteCount, u16 nLeft, u16 nRight) {
+    s16 *pSamples = (s16 *)pBuffer;
+    u32 nSamples = nByteCount / 2;
+
+    const s16 Scales[4] = {(s16)nLeft, (s16)nRight, (s16)nLeft, (s16)nRight};
+    int16x4_t vScale = vld1_s16(Scales);
+
+    u32 i = 0;
+    for (; i + 8 <= nSamples; i += 8) {
+        int16x8_t vIn = vld1q_s16(pSamples + i);
+        int32x4_t vLow = vmull_s16(vget_low_s16(vIn), vScale);
+        int32x4_t vHigh = vmull_s16(vget_high_s16(vIn), vScale);
+        vst1q_s16(pSamples + i, vcombine_s16(vshrn_n_s32(vLow, VOLUME_SCALE_BITS),
+                                             vshrn_n_s32(vHigh, VOLUME_SCALE_BITS)));
+    }
+
+    // Up to 3 frames left over
+    ScaleReference(pBuffer + i * 2, nByteCount - i * 2, nLeft, nRight);
+}
+
+#else
+
+// A frame per 32 bit word, left in the lower half. Two frames per step
+// keep two loads in flight and the halves map onto SMULBB and SMULTB
+void CVolumeScaler::Scale(u8 *pBuffer, u32 nByteCount, u16 nLeft, u16 nRight) {
+    u32 *pFrames = (u32 *)pBuffer;
+    u32 nFrames = nByteCount / 4;
+    s32 nLeftScale = nLeft;
+    s32 nRightScale = nRight;
+
+    u32 i = 0;
+    for (; i + 2 <= nFrames; i += 2) {
+        u32 nFrame0 = pFrames[i];
+        u32 nFrame1 = pFrames[i + 1];
+
+        s32 nLeft0 = ((s32)(s16)nFrame0 * nLeftScale) >> VOLUME_SCALE_BITS;
+        s32 nRight0 = ((s32)nFrame0 >> 16) * nRightScale >> VOLUME_SCALE_BITS;
+        s32 nLeft1 = ((s32)(s16)nFrame1 * nLeftScale) >> VOLUME_SCALE_BITS;
+        s32 nRight1 = ((s32)nFrame1 >> 16) * nRightScale >> VOLUME_SCALE_BITS;
+
+        pFrames[i] = ((u32)nLeft0 & 0xFFFF) | ((u32)nRight0 << 16);
+        pFrames[i + 1] = ((u32)nLeft1 & 0xFFFF) | ((u32)nRight1 << 16);
+    }
+
+    if (i < nFrames)
+        ScaleReference(pBuffer + i * 4, 4, nLeft, nRight);
+}
+
+#endif
+
+void CVolumeScaler::ScaleReference(u8 *pBuffer, u32 nByteCount, u16 nLeft, u16 nRight) {
+    for (u32 i = 0; i + 4 <= nByteCount; i += 4) {
+        short left = (short)((pBuffer[i + 1] << 8) | pBuffer[i]);
+        short right = (short)((pBuffer[i + 3] << 8) | pBuffer[i + 2]);
+        int scaledLeft = (left * nLeft) >> VOLUME_SCALE_BITS;
+        int scaledRight = (right * nRight) >> VOLUME_SCALE_BITS;
+        pBuffer[i] = (u8)(scaledLeft & 0xFF);
+        pBuffer[i + 1] = (u8)((scaledLeft >> 8) & 0xFF);
+        pBuffer[i + 2] = (u8)(scaledRight & 0xFF);
+        pBuffer[i + 3] = (u8)((scaledRight >> 8) & 0xFF);
+    }
+}
@@ -0,0 +1,40 @@
+//
+// Scales 16 bit stereo samples for the CD Player's volume control
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _volumescaler_h
+#define _volumescaler_h
+
+#include <circle/types.h>
+
+#define VOLUME_SCALE_BITS 12  // 1.0 = 4096
+#define VOLUME_SCALE_ONE (1 << VOLUME_SCALE_BITS)
+
+class CVolumeScaler {
+   public:
+    /// \brief Multiply each sample by its channel's scale
+    /// \param pBuffer Little endian left and right samples, 4 byte aligned
+    /// \param nByteCount Multiple of 4, ie. whole frames
+    /// \param nLeft Left scale, VOLUME_SCALE_ONE is unchanged
+    /// \param nRight Right scale
+    static void Scale(u8 *pBuffer, u32 nByteCount, u16 nLeft, u16 nRight);
+
+    /// \brief One sample at a time, what Scale() must match
+    static void ScaleReference(u8 *pBuffer, u32 nByteCount, u16 nLeft, u16 nRight);
+};
+
+#endif
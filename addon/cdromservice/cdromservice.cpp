@@ -32,8 +32,10 @@ LOGMODULE("cdrom");
 
 CDROMService *CDROMService::s_pThis = 0;
 
-CDROMService::CDROMService()
-: CTask (CDROM_STACK_SIZE)
+CDROMService::CDROMService(unsigned nMaxBlocks, unsigned nReadAheadBlocks)
+: CTask (CDROM_STACK_SIZE),
+  m_nMaxBlocks (nMaxBlocks),
+  m_nReadAheadBlocks (nReadAheadBlocks)
 {
       
     // I am the one and only!
@@ -62,7 +64,8 @@ void CDROMService::SetDevice(ICueDevice* pBinFileDevice) {
 boolean CDROMService::Initialize() {
     LOGNOTE("CDROM Initializing");
     CInterruptSystem* m_Interrupt = CInterruptSystem::Get();
-    m_CDGadget = new CUSBCDGadget(m_Interrupt, CKernelOptions::Get()->GetUSBFullSpeed());
+    m_CDGadget = new CUSBCDGadget(m_Interrupt, CKernelOptions::Get()->GetUSBFullSpeed(), nullptr, m_nMaxBlocks,
+				   m_nReadAheadBlocks);
     LOGNOTE("Started USB CD gadget");
     return true;
 }
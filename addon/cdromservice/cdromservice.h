@@ -35,7 +35,7 @@
 
 class CDROMService : public CTask {
    public:
-    CDROMService();
+    CDROMService(unsigned nMaxBlocks = 0, unsigned nReadAheadBlocks = 0);
     ~CDROMService(void);
     boolean Initialize();
     void SetDevice(ICueDevice* pBinFileDevice);
@@ -44,6 +44,8 @@ class CDROMService : public CTask {
    private:
    private:
     CUSBCDGadget* m_CDGadget = nullptr;
+    unsigned m_nMaxBlocks;
+    unsigned m_nReadAheadBlocks;
     static CDROMService *s_pThis;
     bool isInitialized = false;
 };
@@ -59,8 +59,9 @@ const CUETrackInfo *CUEParser::next_track() {
 }
 
 const CUETrackInfo *CUEParser::next_track(uint64_t prev_file_size) {
-    // Previous track info is needed to track file offset
-    uint32_t prev_track_start = m_track_info.track_start;
+    // Previous track info is needed to track file offset. file_offset
+    // points at the data start (INDEX 01) of the previous track
+    uint32_t prev_data_start = m_track_info.data_start;
     m_track_info.cumulative_offset += m_track_info.unstored_pregap_length;
     uint32_t prev_sector_length = get_sector_length(m_track_info.file_mode, m_track_info.track_mode);  // Defaults to 2352 before first track
 
@@ -82,7 +83,7 @@ const CUETrackInfo *CUEParser::next_track(uint64_t prev_file_size) {
             m_track_info.file_offset = 0;
             m_track_info.file_index++;
             m_track_info.track_mode = CUETrack_AUDIO;
-            prev_track_start = 0;
+            prev_data_start = 0;
             prev_sector_length = get_sector_length(m_track_info.file_mode, m_track_info.track_mode);
             got_file = true;
         } else if (strncasecmp(m_parse_pos, "TRACK ", 6) == 0) {
@@ -131,8 +132,10 @@ const CUETrackInfo *CUEParser::next_track(uint64_t prev_file_size) {
 
     if (got_track && got_data) {
         if (!got_file) {
-            // Advance file position by the length of previous track
-            m_track_info.file_offset += (uint64_t)(m_track_info.track_start - (prev_track_start + m_track_info.cumulative_offset)) * prev_sector_length;
+            // Advance file position by the length of previous track. This is
+            // measured from its INDEX 01, where file_offset points. From its
+            // INDEX 00 the stored pregap would be counted a second time
+            m_track_info.file_offset += (uint64_t)(m_track_info.track_start - prev_data_start) * prev_sector_length;
         }
 
         // Advance file position by any stored pregap
@@ -0,0 +1,127 @@
+//
+// Reads a byte buffer as a stream of bits, most significant bit first
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _BITREADER_H
+#define _BITREADER_H
+
+#include <assert.h>
+#include <circle/types.h>
+
+// Reading past the end returns zero bits and sets the overflow flag, so
+// callers can decode a whole block and check once at the end
+class CMSBBitReader {
+   public:
+    CMSBBitReader(const u8* pData, size_t nLength)
+        : m_pData(pData),
+          m_nLength(nLength),
+          m_nPosition(0),
+          m_ullBuffer(0),
+          m_nBits(0) {
+    }
+
+    /// \return The next nCount bits (at most 32), without consuming them
+    u32 Peek(unsigned nCount) {
+        assert(nCount <= 32);
+        if (nCount == 0)
+            return 0;
+        if (m_nBits < nCount)
+            Refill();
+        return (u32)(m_ullBuffer >> (64 - nCount));
+    }
+
+    void Remove(unsigned nCount) {
+        if (m_nBits < nCount)
+            Refill();
+        m_ullBuffer <<= nCount;
+        m_nBits -= nCount;
+    }
+
+    u32 Read(unsigned nCount) {
+        u32 nValue = Peek(nCount);
+        Remove(nCount);
+        return nValue;
+    }
+
+    s32 ReadSigned(unsigned nCount) {
+        if (nCount == 0)
+            return 0;
+        u32 nValue = Read(nCount);
+        if (nCount < 32 && (nValue & (1U << (nCount - 1))))
+            nValue |= ~0U << nCount;
+        return (s32)nValue;
+    }
+
+    /// \brief Count and consume zero bits up to the next one bit, which is consumed too
+    unsigned ReadUnary(void) {
+        unsigned nZeros = 0;
+        for (;;) {
+            if (m_nBits == 0) {
+                if (Overflow())
+                    return nZeros;
+                Refill();
+            }
+
+            if (m_ullBuffer != 0) {
+                unsigned nLeading = __builtin_clzll(m_ullBuffer);
+                if (nLeading < m_nBits) {
+                    m_ullBuffer <<= nLeading;
+                    m_ullBuffer <<= 1;
+                    m_nBits -= nLeading + 1;
+                    return nZeros + nLeading;
+                }
+            }
+
+            nZeros += m_nBits;
+            m_ullBuffer = 0;
+            m_nBits = 0;
+        }
+    }
+
+    /// \brief Skip to the next byte boundary
+    void Align(void) {
+        Remove(m_nBits & 7);
+    }
+
+    /// \return Bytes consumed so far, counting a partly read byte
+    size_t GetBytePosition(void) const {
+        return m_nPosition - m_nBits / 8;
+    }
+
+    boolean Overflow(void) const {
+        return m_nPosition - m_nBits / 8 > m_nLength;
+    }
+
+   private:
+    void Refill(void) {
+        while (m_nBits <= 56) {
+            if (m_nPosition < m_nLength)
+                m_ullBuffer |= (u64)m_pData[m_nPosition] << (56 - m_nBits);
+            m_nPosition++;
+            m_nBits += 8;
+        }
+    }
+
+   private:
+    const u8* m_pData;
+    size_t m_nLength;
+    size_t m_nPosition;  // next byte to load, past the end is zero padding
+    u64 m_ullBuffer;     // m_nBits valid bits, left aligned
+    unsigned m_nBits;
+};
+
+#endif
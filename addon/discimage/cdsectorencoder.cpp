@@ -0,0 +1,263 @@
+//
+// Builds raw 2352 byte CD sectors around 2048 bytes of user data
+//
+// A Mode 1 sector is 12 sync bytes, a 4 byte header (BCD MSF address and
+// mode), 2048 bytes of user data, a 4 byte EDC (CRC over everything
+// before it), 8 zero bytes and 276 bytes of Reed-Solomon product code
+// (172 bytes P parity over columns, 104 bytes Q parity over diagonals),
+// as described in ECMA-130 Annex A. Raw rippers and copy protection
+// checks look at all of it, so images that only store the user data need
+// the rest generated.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "cdsectorencoder.h"
+
+#include <assert.h>
+#include <circle/util.h>
+
+#if AARCH == 64
+#include <arm_neon.h>
+#endif
+
+// Offsets into a Mode 1 sector
+#define SECTOR_HEADER   0x00C
+#define SECTOR_EDC      0x810
+#define SECTOR_ZERO     0x814
+#define SECTOR_P        0x81C
+#define SECTOR_Q        0x8C8
+
+// Reversed x^32 + x^31 + x^16 + x^15 + x^4 + x^3 + x + 1
+#define EDC_POLYNOMIAL  0xD8018001
+
+// x^8 + x^4 + x^3 + x^2 + 1, without the x^8 term
+#define ECC_POLYNOMIAL  0x1D
+
+// P parity runs down 86 columns of 24 bytes, Q along 52 diagonals of 43
+#define P_COLUMNS       86
+#define P_ROWS          24
+#define Q_DIAGONALS     52
+#define Q_LENGTH        43
+
+static const u8 s_Sync[12] = {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                              0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+
+static inline u8 ToBCD(unsigned nValue) {
+    return ((nValue / 10) << 4) | (nValue % 10);
+}
+
+CCDSectorEncoder::CCDSectorEncoder(void) {
+    for (unsigned i = 0; i < 256; i++) {
+        u32 edc = i;
+        for (unsigned bit = 0; bit < 8; bit++)
+            edc = (edc >> 1) ^ (edc & 1 ? EDC_POLYNOMIAL : 0);
+        m_EDCTable[i] = edc;
+
+        u8 forward = (i << 1) ^ (i & 0x80 ? ECC_POLYNOMIAL : 0);
+        m_ECCForward[i] = forward;
+        m_ECCBackward[i ^ forward] = i;
+    }
+}
+
+void CCDSectorEncoder::EncodeMode1(u8* pSector, u32 lba, boolean bEDCECC) const {
+    assert(pSector != 0);
+
+    memcpy(pSector, s_Sync, sizeof(s_Sync));
+
+    u32 address = lba + 150;  // the 2 second pregap
+    pSector[SECTOR_HEADER + 0] = ToBCD(address / (75 * 60));
+    pSector[SECTOR_HEADER + 1] = ToBCD((address / 75) % 60);
+    pSector[SECTOR_HEADER + 2] = ToBCD(address % 75);
+    pSector[SECTOR_HEADER + 3] = 0x01;  // Mode 1
+
+    if (!bEDCECC)
+        return;
+
+    u32 edc = ComputeEDC(pSector, SECTOR_EDC);
+    pSector[SECTOR_EDC + 0] = edc;
+    pSector[SECTOR_EDC + 1] = edc >> 8;
+    pSector[SECTOR_EDC + 2] = edc >> 16;
+    pSector[SECTOR_EDC + 3] = edc >> 24;
+    memset(pSector + SECTOR_ZERO, 0, SECTOR_P - SECTOR_ZERO);
+
+    // Q covers P, so P goes first
+    ComputeParityP(pSector);
+    ComputeParityQ(pSector);
+}
+
+void CCDSectorEncoder::GenerateECC(u8* pSector) const {
+    assert(pSector != 0);
+
+    ComputeParityP(pSector);
+    ComputeParityQ(pSector);
+}
+
+u32 CCDSectorEncoder::ComputeEDC(const u8* pData, size_t nLength) const {
+    u32 edc = 0;
+    while (nLength--)
+        edc = (edc >> 8) ^ m_EDCTable[(edc ^ *pData++) & 0xFF];
+    return edc;
+}
+
+#if AARCH == 64
+
+// Both codes come down to the same sum over the columns of a byte matrix:
+// a = alpha * (a ^ data) and b ^= data down each column, then the parity
+// is (alpha * a ^ b) / (alpha + 1). This does 16 neighbouring columns at
+// once. The last step overlaps the one before it when the width isn't a
+// multiple of 16, which just writes the same parity twice
+static void ComputeColumnParity(const u8* pSrc, unsigned nColumns, unsigned nRows,
+                                u8* pDest, const u8* pBackward) {
+    const uint8x16_t vPolynomial = vdupq_n_u8(ECC_POLYNOMIAL);
+
+    for (unsigned column = 0; column < nColumns; column += 16) {
+        if (column + 16 > nColumns)
+            column = nColumns - 16;
+
+        uint8x16_t a = vdupq_n_u8(0);
+        uint8x16_t b = vdupq_n_u8(0);
+        for (unsigned row = 0; row < nRows; row++) {
+            uint8x16_t data = vld1q_u8(pSrc + row * nColumns + column);
+            a = veorq_u8(a, data);
+            b = veorq_u8(b, data);
+            // Multiply by alpha: shift, and reduce where the top bit fell out
+            uint8x16_t carry = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(a), 7));
+            a = veorq_u8(vshlq_n_u8(a, 1), vandq_u8(carry, vPolynomial));
+        }
+
+        uint8x16_t carry = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(a), 7));
+        uint8x16_t sum = veorq_u8(veorq_u8(vshlq_n_u8(a, 1), vandq_u8(carry, vPolynomial)), b);
+
+        u8 bytesSum[16];
+        u8 bytesB[16];
+        vst1q_u8(bytesSum, sum);
+        vst1q_u8(bytesB, b);
+        for (unsigned i = 0; i < 16; i++) {
+            u8 parity = pBackward[bytesSum[i]];
+            pDest[column + i] = parity;
+            pDest[column + i + nColumns] = parity ^ bytesB[i];
+        }
+    }
+}
+
+// The P code words are the columns of the header, data and EDC area seen
+// as 24 rows of 86 bytes
+void CCDSectorEncoder::ComputeParityP(u8* pSector) const {
+    ComputeColumnParity(pSector + SECTOR_HEADER, P_COLUMNS, P_ROWS,
+                        pSector + SECTOR_P, m_ECCBackward);
+}
+
+// The Q code words run diagonally through the header, data, EDC and P
+// area, wrapping around at the end. Laid out with one diagonal per
+// column they are summed like P
+void CCDSectorEncoder::ComputeParityQ(u8* pSector) const {
+    const u8* pSrc = pSector + SECTOR_HEADER;
+    const unsigned nSize = Q_DIAGONALS * Q_LENGTH;
+    u8 matrix[Q_LENGTH * Q_DIAGONALS];
+
+    for (unsigned diagonal = 0; diagonal < Q_DIAGONALS; diagonal++) {
+        unsigned index = (diagonal >> 1) * P_COLUMNS + (diagonal & 1);
+        for (unsigned i = 0; i < Q_LENGTH; i++) {
+            matrix[i * Q_DIAGONALS + diagonal] = pSrc[index];
+            index += P_COLUMNS + 2;
+            if (index >= nSize)
+                index -= nSize;
+        }
+    }
+
+    ComputeColumnParity(matrix, Q_DIAGONALS, Q_LENGTH, pSector + SECTOR_Q, m_ECCBackward);
+}
+
+#else
+
+// The P code words are the columns of the header, data and EDC area seen
+// as 24 rows of 86 bytes (43 words of 16 bit, split into even and odd
+// bytes). Neighbouring columns are neighbouring bytes, so this works on 8
+// columns at once, multiplying every byte of a u64 by alpha in one go.
+// Only the final division by (alpha + 1) needs the table
+void CCDSectorEncoder::ComputeParityP(u8* pSector) const {
+    const u8* pSrc = pSector + SECTOR_HEADER;
+    u8* pDest = pSector + SECTOR_P;
+
+    const u64 nHighBits = 0x8080808080808080ULL;
+    const u64 nLowBits = 0x0101010101010101ULL;
+
+    unsigned column = 0;
+    for (; column + 8 <= P_COLUMNS; column += 8) {
+        u64 a = 0;
+        u64 b = 0;
+        for (unsigned row = 0; row < P_ROWS; row++) {
+            u64 data;
+            memcpy(&data, pSrc + row * P_COLUMNS + column, sizeof(data));
+            a ^= data;
+            b ^= data;
+            a = ((a & ~nHighBits) << 1) ^ (((a >> 7) & nLowBits) * ECC_POLYNOMIAL);
+        }
+
+        u8 bytesA[8];
+        u8 bytesB[8];
+        memcpy(bytesA, &a, sizeof(a));
+        memcpy(bytesB, &b, sizeof(b));
+        for (unsigned i = 0; i < 8; i++) {
+            u8 parity = m_ECCBackward[m_ECCForward[bytesA[i]] ^ bytesB[i]];
+            pDest[column + i] = parity;
+            pDest[column + i + P_COLUMNS] = parity ^ bytesB[i];
+        }
+    }
+
+    // The 6 columns left over
+    for (; column < P_COLUMNS; column++) {
+        u8 a = 0;
+        u8 b = 0;
+        for (unsigned row = 0; row < P_ROWS; row++) {
+            u8 data = pSrc[row * P_COLUMNS + column];
+            a = m_ECCForward[a ^ data];
+            b ^= data;
+        }
+
+        u8 parity = m_ECCBackward[m_ECCForward[a] ^ b];
+        pDest[column] = parity;
+        pDest[column + P_COLUMNS] = parity ^ b;
+    }
+}
+
+// The Q code words run diagonally through the header, data, EDC and P
+// area, wrapping around at the end
+void CCDSectorEncoder::ComputeParityQ(u8* pSector) const {
+    const u8* pSrc = pSector + SECTOR_HEADER;
+    u8* pDest = pSector + SECTOR_Q;
+    const unsigned nSize = Q_DIAGONALS * Q_LENGTH;
+
+    for (unsigned diagonal = 0; diagonal < Q_DIAGONALS; diagonal++) {
+        unsigned index = (diagonal >> 1) * P_COLUMNS + (diagonal & 1);
+        u8 a = 0;
+        u8 b = 0;
+        for (unsigned i = 0; i < Q_LENGTH; i++) {
+            u8 data = pSrc[index];
+            index += P_COLUMNS + 2;
+            if (index >= nSize)
+                index -= nSize;
+            a = m_ECCForward[a ^ data];
+            b ^= data;
+        }
+
+        u8 parity = m_ECCBackward[m_ECCForward[a] ^ b];
+        pDest[diagonal] = parity;
+        pDest[diagonal + Q_DIAGONALS] = parity ^ b;
+    }
+}
+
+#endif
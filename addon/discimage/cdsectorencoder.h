@@ -0,0 +1,52 @@
+//
+// Builds raw 2352 byte CD sectors around 2048 bytes of user data
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _CDSECTORENCODER_H
+#define _CDSECTORENCODER_H
+
+#include <circle/types.h>
+
+class CCDSectorEncoder {
+   public:
+    static const unsigned SectorSize = 2352;
+    static const unsigned UserDataOffset = 16;  // after sync and header
+
+    CCDSectorEncoder(void);
+
+    /// \brief Complete a Mode 1 sector
+    /// \param pSector SectorSize bytes, with the user data already at UserDataOffset
+    /// \param lba Logical block address, the header holds it as BCD MSF
+    /// \param bEDCECC Also generate the EDC and the P/Q parity, which is
+    ///        the expensive part. Otherwise that area is left untouched
+    void EncodeMode1(u8* pSector, u32 lba, boolean bEDCECC) const;
+
+    /// \brief Regenerate the P/Q parity of a Mode 1 sector from the rest of it
+    void GenerateECC(u8* pSector) const;
+
+   private:
+    u32 ComputeEDC(const u8* pData, size_t nLength) const;
+    void ComputeParityP(u8* pSector) const;
+    void ComputeParityQ(u8* pSector) const;
+
+   private:
+    u32 m_EDCTable[256];
+    u8 m_ECCForward[256];   // multiply by alpha in GF(2^8)
+    u8 m_ECCBackward[256];  // divide by (alpha + 1)
+};
+
+#endif
@@ -0,0 +1,985 @@
+//
+// A CDevice for CD images in MAME's compressed hunks of data (CHD) format
+//
+// A CHD v5 file holds the disc as fixed size hunks, each compressed on its
+// own with whichever codec did best, plus a map from hunk to file offset
+// and the track list as metadata. CD images use 2448 byte frames (2352
+// bytes of sector and 96 of subcode), each track padded to a multiple of
+// four frames, with audio stored big endian.
+//
+// Like CCueMultiFileDevice, this presents everything above it with a
+// plain image and a single FILE cue sheet built from the track list.
+// Frames lose their subcode and are cut to the track's sector size, audio
+// is swapped back to little endian, so the image reads just like the bin
+// the CHD was made from.
+//
+// Hunks are decompressed into a small cache, least recently used out, so
+// consecutive sectors and the CD player's and the gadget's reads of the
+// same area only decompress once. Parent (delta) CHDs aren't supported.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "chdfile.h"
+
+#include <assert.h>
+#include <circle/logger.h>
+#include <circle/string.h>
+#include <circle/timer.h>
+#include <circle/util.h>
+#include <stdlib.h>
+
+#include "bitreader.h"
+#include "util.h"
+
+LOGMODULE("CCHDFileDevice");
+
+#define CHD_HEADER_SIZE     124
+#define CHD_MAP_HEADER_SIZE 16
+#define CHD_META_HEADER_SIZE 16
+
+#define CD_FRAME_SIZE       2448
+#define CD_SECTOR_SIZE      2352
+#define CD_SUBCODE_SIZE     96
+#define CD_TRACK_PADDING    4
+
+#define FOURCC(a, b, c, d)  ((u32)(a) << 24 | (u32)(b) << 16 | (u32)(c) << 8 | (u32)(d))
+
+#define CODEC_ZLIB          FOURCC('z', 'l', 'i', 'b')
+#define CODEC_LZMA          FOURCC('l', 'z', 'm', 'a')
+#define CODEC_CD_ZLIB       FOURCC('c', 'd', 'z', 'l')
+#define CODEC_CD_LZMA       FOURCC('c', 'd', 'l', 'z')
+#define CODEC_CD_FLAC       FOURCC('c', 'd', 'f', 'l')
+
+#define META_CD_TRACK       FOURCC('C', 'H', 'T', 'R')
+#define META_CD_TRACK2      FOURCC('C', 'H', 'T', '2')
+#define META_CD_OLD         FOURCC('C', 'H', 'C', 'D')
+#define META_GDROM_TRACK    FOURCC('C', 'H', 'G', 'D')
+
+// Compression types in the compressed map, before they are resolved
+#define MAP_RLE_SMALL       7
+#define MAP_RLE_LARGE       8
+#define MAP_SELF_0          9
+#define MAP_SELF_1          10
+#define MAP_PARENT_SELF     11
+#define MAP_PARENT_0        12
+#define MAP_PARENT_1        13
+
+// The compressed map's types are Huffman coded, 16 codes of up to 8 bits
+#define MAP_HUFFMAN_CODES   16
+#define MAP_HUFFMAN_BITS    8
+
+// chdman's LZMA settings, which the stream doesn't record
+#define CHD_LZMA_LC         3
+#define CHD_LZMA_LP         0
+#define CHD_LZMA_PB         2
+
+static const struct {
+    const char* pCHDType;
+    const char* pCueMode;
+    unsigned nDataSize;
+} s_TrackTypes[] = {
+    {"MODE1", "MODE1/2048", 2048},
+    {"MODE1_RAW", "MODE1/2352", 2352},
+    {"MODE2", "MODE2/2336", 2336},
+    {"MODE2_FORM1", "MODE2/2048", 2048},
+    {"MODE2_FORM2", "MODE2/2324", 2324},
+    {"MODE2_FORM_MIX", "MODE2/2336", 2336},
+    {"MODE2_RAW", "MODE2/2352", 2352},
+    {"AUDIO", "AUDIO", 2352},
+};
+
+static const u8 s_Sync[12] = {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                              0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+
+static inline u32 GetBE16(const u8* p) {
+    return (u32)p[0] << 8 | p[1];
+}
+
+static inline u32 GetBE24(const u8* p) {
+    return (u32)p[0] << 16 | (u32)p[1] << 8 | p[2];
+}
+
+static inline u32 GetBE32(const u8* p) {
+    return (u32)p[0] << 24 | (u32)p[1] << 16 | (u32)p[2] << 8 | p[3];
+}
+
+static inline u64 GetBE48(const u8* p) {
+    return (u64)GetBE16(p) << 32 | GetBE32(p + 2);
+}
+
+static inline u64 GetBE64(const u8* p) {
+    return (u64)GetBE32(p) << 32 | GetBE32(p + 4);
+}
+
+static void FormatMSF(CString* pString, u32 frames) {
+    pString->Format("%02u:%02u:%02u", frames / (75 * 60), (frames / 75) % 60, frames % 75);
+}
+
+static void FormatCodec(char* pBuffer, u32 nCodec) {
+    for (unsigned i = 0; i < 4; i++) {
+        char c = nCodec >> (24 - 8 * i);
+        pBuffer[i] = c >= ' ' && c <= '~' ? c : '?';
+    }
+    pBuffer[4] = '\0';
+}
+
+// Copies the value of "KEY:value" from a track metadata string
+static boolean GetField(const char* pText, const char* pKey, char* pValue, size_t nSize) {
+    size_t nKeyLength = strlen(pKey);
+    for (const char* p = pText; *p != '\0'; p++) {
+        if ((p == pText || p[-1] == ' ') && strncmp(p, pKey, nKeyLength) == 0 && p[nKeyLength] == ':') {
+            p += nKeyLength + 1;
+            size_t i = 0;
+            while (p[i] != '\0' && p[i] != ' ' && i + 1 < nSize) {
+                pValue[i] = p[i];
+                i++;
+            }
+            pValue[i] = '\0';
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+CCHDFileDevice::CCHDFileDevice(FIL* pFile, const char* pPath)
+    : m_pFile(pFile),
+      m_pLinkMap(nullptr),
+      m_cue_str(nullptr),
+      m_nHunkCount(0),
+      m_pMap(nullptr),
+      m_nTracks(0),
+      m_ullSize(0),
+      m_ullPosition(0),
+      m_nUseCounter(0),
+      m_pScratch(nullptr),
+      m_pInflater(nullptr),
+      m_pLZMADecoder(nullptr),
+      m_pFLACDecoder(nullptr),
+      m_ullBytesRead(0),
+      m_nHunksDecoded(0),
+      m_nCacheHits(0),
+      m_nDecodeTicks(0) {
+    assert(pFile != nullptr);
+    assert(pPath != nullptr);
+
+    m_pCursorFile[CursorData] = pFile;
+    m_pPath = new char[strlen(pPath) + 1];
+    strcpy(m_pPath, pPath);
+
+    for (unsigned i = 0; i < CacheHunks; i++) {
+        m_Cache[i].nHunk = InvalidHunk;
+        m_Cache[i].nLastUsed = 0;
+        m_Cache[i].pData = nullptr;
+    }
+
+    for (unsigned i = 0; i < CursorCount; i++)
+        m_pCompressed[i] = nullptr;
+
+    // CRC-16/CCITT, as CHD uses for the map and each hunk
+    for (unsigned i = 0; i < 256; i++) {
+        u16 crc = i << 8;
+        for (unsigned bit = 0; bit < 8; bit++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        m_CRCTable[i] = crc;
+    }
+}
+
+CCHDFileDevice::~CCHDFileDevice(void) {
+    if (m_nHunksDecoded > 0) {
+        u64 ullDecoded = (u64)m_nHunksDecoded * m_nHunkBytes;
+        LOGNOTE("%u hunks decoded, %llu KB read from card for %llu KB (%u%%), %u cache hits, %u ms decoding",
+                m_nHunksDecoded, m_ullBytesRead / 1024, ullDecoded / 1024,
+                (unsigned)(m_ullBytesRead * 100 / ullDecoded), m_nCacheHits, m_nDecodeTicks / 1000);
+    }
+
+    for (unsigned i = 0; i < CursorCount; i++) {
+        if (m_pCursorFile[i] != nullptr && m_pCursorFile[i] != m_pFile) {
+            f_close(m_pCursorFile[i]);
+            m_pCursorFile[i]->cltbl = nullptr;
+            delete m_pCursorFile[i];
+        }
+        if (m_pCompressed[i] != nullptr)
+            delete[] m_pCompressed[i];
+    }
+
+    f_close(m_pFile);
+    m_pFile->cltbl = nullptr;
+    delete m_pFile;
+    if (m_pLinkMap != nullptr)
+        delete[] m_pLinkMap;
+
+    for (unsigned i = 0; i < CacheHunks; i++)
+        if (m_Cache[i].pData != nullptr)
+            delete[] m_Cache[i].pData;
+
+    if (m_pScratch != nullptr)
+        delete[] m_pScratch;
+    if (m_pInflater != nullptr)
+        delete m_pInflater;
+    if (m_pLZMADecoder != nullptr)
+        delete m_pLZMADecoder;
+    if (m_pFLACDecoder != nullptr)
+        delete m_pFLACDecoder;
+
+    if (m_pMap != nullptr)
+        delete[] m_pMap;
+    if (m_cue_str != nullptr)
+        delete[] m_cue_str;
+    delete[] m_pPath;
+}
+
+boolean CCHDFileDevice::Init(void) {
+    m_pLinkMap = createLinkMap(m_pFile);
+
+    if (!ReadHeader() || !ReadMap() || !ReadMetadata() || !BuildCueSheet())
+        return FALSE;
+
+    for (unsigned i = 0; i < CacheHunks; i++)
+        m_Cache[i].pData = new u8[m_nHunkBytes];
+    for (unsigned i = 0; i < CursorCount; i++)
+        m_pCompressed[i] = new u8[m_nHunkBytes];
+    m_pScratch = new u8[m_nHunkBytes];
+
+    // Deflate is needed for the subcode whatever the data codec is
+    m_pInflater = new CInflater();
+    for (unsigned i = 0; i < 4; i++) {
+        if ((m_Compressors[i] == CODEC_LZMA || m_Compressors[i] == CODEC_CD_LZMA) && m_pLZMADecoder == nullptr)
+            m_pLZMADecoder = new CLZMADecoder(CHD_LZMA_LC, CHD_LZMA_LP, CHD_LZMA_PB);
+        if (m_Compressors[i] == CODEC_CD_FLAC && m_pFLACDecoder == nullptr)
+            m_pFLACDecoder = new CFLACDecoder();
+    }
+
+    LOGNOTE("%u tracks, %u hunks of %u bytes, %llu byte image", m_nTracks, m_nHunkCount, m_nHunkBytes, m_ullSize);
+    return TRUE;
+}
+
+boolean CCHDFileDevice::ReadHeader(void) {
+    u8 header[CHD_HEADER_SIZE];
+    if (!ReadFile(0, header, sizeof(header), CursorData))
+        return FALSE;
+
+    if (memcmp(header, "MComprHD", 8) != 0) {
+        LOGERR("Not a CHD file");
+        return FALSE;
+    }
+
+    u32 nVersion = GetBE32(header + 12);
+    if (nVersion != 5) {
+        LOGERR("CHD version %u is not supported, convert it with chdman copy", nVersion);
+        return FALSE;
+    }
+
+    for (unsigned i = 0; i < 4; i++) {
+        m_Compressors[i] = GetBE32(header + 16 + 4 * i);
+        u32 nCodec = m_Compressors[i];
+        if (nCodec != 0 && nCodec != CODEC_ZLIB && nCodec != CODEC_LZMA && nCodec != CODEC_CD_ZLIB &&
+            nCodec != CODEC_CD_LZMA && nCodec != CODEC_CD_FLAC) {
+            char name[5];
+            FormatCodec(name, nCodec);
+            LOGERR("Codec %s is not supported, recompress with chdman -c cdlz,cdzl,cdfl", name);
+            return FALSE;
+        }
+    }
+
+    m_ullLogicalBytes = GetBE64(header + 32);
+    m_ullMapOffset = GetBE64(header + 40);
+    m_ullMetaOffset = GetBE64(header + 48);
+    m_nHunkBytes = GetBE32(header + 56);
+    m_nUnitBytes = GetBE32(header + 60);
+
+    for (unsigned i = 104; i < 124; i++) {
+        if (header[i] != 0) {
+            LOGERR("CHDs with a parent are not supported");
+            return FALSE;
+        }
+    }
+
+    if (m_nUnitBytes != CD_FRAME_SIZE || m_nHunkBytes == 0 || m_nHunkBytes % CD_FRAME_SIZE != 0) {
+        LOGERR("Not a CD image, %u byte units in %u byte hunks", m_nUnitBytes, m_nHunkBytes);
+        return FALSE;
+    }
+
+    if (m_nHunkBytes > MaxHunkBytes) {
+        LOGERR("Hunks of %u bytes are too big, recompress with chdman -hs %u", m_nHunkBytes, CD_FRAME_SIZE * 8);
+        return FALSE;
+    }
+
+    m_nHunkCount = (m_ullLogicalBytes + m_nHunkBytes - 1) / m_nHunkBytes;
+    return TRUE;
+}
+
+boolean CCHDFileDevice::ReadMap(void) {
+    m_pMap = new TMapEntry[m_nHunkCount];
+    if (m_Compressors[0] == 0)
+        return ReadUncompressedMap();
+    return ReadCompressedMap();
+}
+
+// One big endian u32 per hunk, its offset in units of the hunk size
+boolean CCHDFileDevice::ReadUncompressedMap(void) {
+    u8* pRaw = new u8[m_nHunkCount * 4];
+    boolean bOK = ReadFile(m_ullMapOffset, pRaw, m_nHunkCount * 4, CursorData);
+    if (bOK) {
+        for (u32 nHunk = 0; nHunk < m_nHunkCount; nHunk++) {
+            TMapEntry& entry = m_pMap[nHunk];
+            entry.ullOffset = (u64)GetBE32(pRaw + nHunk * 4) * m_nHunkBytes;
+            entry.nLength = m_nHunkBytes;
+            entry.nCRC = 0;
+            entry.nType = entry.ullOffset != 0 ? HunkUncompressed : HunkZero;
+            entry.bHasCRC = FALSE;
+        }
+    }
+
+    delete[] pRaw;
+    return bOK;
+}
+
+// The compressed map is a bit stream. First every hunk's type, Huffman
+// coded with run lengths, then per hunk whatever its type needs: length
+// and CRC for compressed hunks, the hunk number for copies of another.
+// The CRC at the end covers the map in MAME's 12 byte per hunk layout
+boolean CCHDFileDevice::ReadCompressedMap(void) {
+    u8 header[CHD_MAP_HEADER_SIZE];
+    if (!ReadFile(m_ullMapOffset, header, sizeof(header), CursorData))
+        return FALSE;
+
+    u32 nMapBytes = GetBE32(header + 0);
+    u64 ullOffset = GetBE48(header + 4);
+    u16 nMapCRC = GetBE16(header + 10);
+    unsigned nLengthBits = header[12];
+    unsigned nSelfBits = header[13];
+    unsigned nParentBits = header[14];
+    if (nLengthBits > 32 || nSelfBits > 32 || nParentBits > 32) {
+        LOGERR("Bad map header");
+        return FALSE;
+    }
+
+    u8* pCompressed = new u8[nMapBytes];
+    if (!ReadFile(m_ullMapOffset + CHD_MAP_HEADER_SIZE, pCompressed, nMapBytes, CursorData)) {
+        delete[] pCompressed;
+        return FALSE;
+    }
+
+    CMSBBitReader reader(pCompressed, nMapBytes);
+
+    // The code lengths, run length coded with 1 as the escape
+    u8 lengths[MAP_HUFFMAN_CODES];
+    unsigned nCode = 0;
+    while (nCode < MAP_HUFFMAN_CODES) {
+        unsigned nBits = reader.Read(4);
+        if (nBits != 1) {
+            lengths[nCode++] = nBits;
+            continue;
+        }
+
+        nBits = reader.Read(4);
+        if (nBits == 1) {
+            lengths[nCode++] = nBits;
+            continue;
+        }
+
+        unsigned nRepeat = reader.Read(4) + 3;
+        while (nRepeat-- && nCode < MAP_HUFFMAN_CODES)
+            lengths[nCode++] = nBits;
+    }
+
+    // Canonical codes, longest first as MAME assigns them
+    u32 start[33] = {0};
+    for (unsigned i = 0; i < MAP_HUFFMAN_CODES; i++)
+        if (lengths[i] <= MAP_HUFFMAN_BITS)
+            start[lengths[i]]++;
+    u32 nCurrent = 0;
+    for (int len = 32; len > 0; len--) {
+        u32 nNext = (nCurrent + start[len]) >> 1;
+        start[len] = nCurrent;
+        nCurrent = nNext;
+    }
+
+    u16 lookup[1 << MAP_HUFFMAN_BITS] = {0};
+    for (unsigned i = 0; i < MAP_HUFFMAN_CODES; i++) {
+        unsigned len = lengths[i];
+        if (len == 0 || len > MAP_HUFFMAN_BITS)
+            continue;
+        u32 code = start[len]++;
+        unsigned shift = MAP_HUFFMAN_BITS - len;
+        for (u32 fill = code << shift; fill < (code + 1) << shift && fill < (1U << MAP_HUFFMAN_BITS); fill++)
+            lookup[fill] = i << 5 | len;
+    }
+
+    // Types, with run lengths of the previous type
+    u8 nLastType = 0;
+    unsigned nRepeat = 0;
+    for (u32 nHunk = 0; nHunk < m_nHunkCount; nHunk++) {
+        if (nRepeat > 0) {
+            m_pMap[nHunk].nType = nLastType;
+            nRepeat--;
+            continue;
+        }
+
+        u16 entry = lookup[reader.Peek(MAP_HUFFMAN_BITS)];
+        reader.Remove(entry & 0x1F);
+        u8 nType = entry >> 5;
+
+        if (nType == MAP_RLE_SMALL) {
+            entry = lookup[reader.Peek(MAP_HUFFMAN_BITS)];
+            reader.Remove(entry & 0x1F);
+            nRepeat = 2 + (entry >> 5);
+            m_pMap[nHunk].nType = nLastType;
+        } else if (nType == MAP_RLE_LARGE) {
+            entry = lookup[reader.Peek(MAP_HUFFMAN_BITS)];
+            reader.Remove(entry & 0x1F);
+            nRepeat = 2 + 16 + ((entry >> 5) << 4);
+            entry = lookup[reader.Peek(MAP_HUFFMAN_BITS)];
+            reader.Remove(entry & 0x1F);
+            nRepeat += entry >> 5;
+            m_pMap[nHunk].nType = nLastType;
+        } else {
+            m_pMap[nHunk].nType = nLastType = nType;
+        }
+    }
+
+    // Offsets, lengths and CRCs
+    u64 ullLastSelf = 0;
+    u16 nCRC = 0xFFFF;
+    boolean bParent = FALSE;
+    for (u32 nHunk = 0; nHunk < m_nHunkCount; nHunk++) {
+        TMapEntry& entry = m_pMap[nHunk];
+        entry.ullOffset = ullOffset;
+        entry.nLength = 0;
+        entry.nCRC = 0;
+        entry.bHasCRC = FALSE;
+
+        switch (entry.nType) {
+            case HunkCodec0:
+            case HunkCodec1:
+            case HunkCodec2:
+            case HunkCodec3:
+                entry.nLength = reader.Read(nLengthBits);
+                entry.nCRC = reader.Read(16);
+                entry.bHasCRC = TRUE;
+                ullOffset += entry.nLength;
+                break;
+
+            case HunkUncompressed:
+                entry.nLength = m_nHunkBytes;
+                entry.nCRC = reader.Read(16);
+                entry.bHasCRC = TRUE;
+                ullOffset += entry.nLength;
+                break;
+
+            case HunkSelf:
+                entry.ullOffset = ullLastSelf = reader.Read(nSelfBits);
+                break;
+
+            case MAP_SELF_1:
+                ullLastSelf++;
+                // fall through
+            case MAP_SELF_0:
+                entry.nType = HunkSelf;
+                entry.ullOffset = ullLastSelf;
+                break;
+
+            case HunkParent:
+                entry.ullOffset = reader.Read(nParentBits);
+                bParent = TRUE;
+                break;
+
+            case MAP_PARENT_SELF:
+            case MAP_PARENT_0:
+            case MAP_PARENT_1:
+                entry.nType = HunkParent;
+                bParent = TRUE;
+                break;
+
+            default:
+                LOGERR("Bad hunk type %u in map", entry.nType);
+                delete[] pCompressed;
+                return FALSE;
+        }
+
+        // Parent hunks fail below anyway, so their offsets aren't worked out
+        u8 raw[12];
+        raw[0] = entry.nType;
+        raw[1] = entry.nLength >> 16;
+        raw[2] = entry.nLength >> 8;
+        raw[3] = entry.nLength;
+        for (unsigned i = 0; i < 6; i++)
+            raw[4 + i] = entry.ullOffset >> (40 - 8 * i);
+        raw[10] = entry.nCRC >> 8;
+        raw[11] = entry.nCRC;
+        for (unsigned i = 0; i < sizeof(raw); i++)
+            nCRC = (nCRC << 8) ^ m_CRCTable[(nCRC >> 8) ^ raw[i]];
+    }
+
+    boolean bOverflow = reader.Overflow();
+    delete[] pCompressed;
+
+    if (bParent) {
+        LOGERR("CHDs with a parent are not supported");
+        return FALSE;
+    }
+
+    if (bOverflow || nCRC != nMapCRC) {
+        LOGERR("Hunk map is corrupt");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// The track list is a chain of metadata entries, one text entry per track
+// like "TRACK:1 TYPE:MODE1_RAW SUBTYPE:NONE FRAMES:1234 PREGAP:0 ..."
+boolean CCHDFileDevice::ReadMetadata(void) {
+    u64 ullOffset = m_ullMetaOffset;
+    for (unsigned nEntries = 0; ullOffset != 0; nEntries++) {
+        u8 header[CHD_META_HEADER_SIZE];
+        if (nEntries > 1000 || !ReadFile(ullOffset, header, sizeof(header), CursorData)) {
+            LOGERR("Bad metadata");
+            return FALSE;
+        }
+
+        u32 nTag = GetBE32(header);
+        u32 nLength = GetBE24(header + 5);
+        u64 ullNext = GetBE64(header + 8);
+
+        if (nTag == META_CD_TRACK || nTag == META_CD_TRACK2) {
+            char text[256];
+            if (nLength >= sizeof(text)) {
+                LOGERR("Track metadata is too long");
+                return FALSE;
+            }
+            if (!ReadFile(ullOffset + CHD_META_HEADER_SIZE, text, nLength, CursorData))
+                return FALSE;
+            text[nLength] = '\0';
+
+            if (!ParseTrack(text))
+                return FALSE;
+        } else if (nTag == META_CD_OLD) {
+            LOGERR("Old style track metadata, convert it with chdman copy");
+            return FALSE;
+        } else if (nTag == META_GDROM_TRACK) {
+            LOGERR("GD-ROM images are not supported");
+            return FALSE;
+        }
+
+        ullOffset = ullNext;
+    }
+
+    if (m_nTracks == 0) {
+        LOGERR("No CD tracks, not a CD image");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+boolean CCHDFileDevice::ParseTrack(const char* pText) {
+    char value[32];
+
+    if (m_nTracks >= MaxTracks) {
+        LOGERR("More than %u tracks", MaxTracks);
+        return FALSE;
+    }
+
+    TTrack& track = m_Tracks[m_nTracks];
+    if (!GetField(pText, "TRACK", value, sizeof(value)) ||
+        (track.nNumber = strtoul(value, nullptr, 10)) != m_nTracks + 1) {
+        LOGERR("Bad track metadata %s", pText);
+        return FALSE;
+    }
+
+    if (!GetField(pText, "TYPE", value, sizeof(value))) {
+        LOGERR("No type in track metadata %s", pText);
+        return FALSE;
+    }
+
+    track.pCueMode = nullptr;
+    for (unsigned i = 0; i < sizeof(s_TrackTypes) / sizeof(s_TrackTypes[0]); i++) {
+        if (strcmp(value, s_TrackTypes[i].pCHDType) == 0) {
+            track.pCueMode = s_TrackTypes[i].pCueMode;
+            track.nDataSize = s_TrackTypes[i].nDataSize;
+        }
+    }
+    if (track.pCueMode == nullptr) {
+        LOGERR("Track %u has unknown type %s", track.nNumber, value);
+        return FALSE;
+    }
+    track.bAudio = strcmp(value, "AUDIO") == 0;
+
+    track.nFrames = GetField(pText, "FRAMES", value, sizeof(value)) ? strtoul(value, nullptr, 10) : 0;
+    track.nPregap = GetField(pText, "PREGAP", value, sizeof(value)) ? strtoul(value, nullptr, 10) : 0;
+    track.nPostgap = GetField(pText, "POSTGAP", value, sizeof(value)) ? strtoul(value, nullptr, 10) : 0;
+
+    // A pregap type starting with V means the pregap is in the image
+    track.bPregapStored = track.nPregap > 0 && GetField(pText, "PGTYPE", value, sizeof(value)) && value[0] == 'V';
+
+    if (track.nFrames == 0 || (track.bPregapStored && track.nPregap > track.nFrames)) {
+        LOGERR("Bad frame count in track metadata %s", pText);
+        return FALSE;
+    }
+
+    m_nTracks++;
+    return TRUE;
+}
+
+// Lays the tracks out one after another without their padding and
+// writes the cue sheet for that. A pregap that isn't stored, or the
+// postgap of the track before, becomes a PREGAP
+boolean CCHDFileDevice::BuildCueSheet(void) {
+    CString sheet;
+    CString line;
+    CString time;
+
+    sheet.Append("FILE \"image.bin\" BINARY\n");
+
+    u32 nCHDFrame = 0;
+    u32 nImageFrame = 0;
+    u64 ullStart = 0;
+    unsigned nPostgap = 0;
+    for (unsigned i = 0; i < m_nTracks; i++) {
+        TTrack& track = m_Tracks[i];
+        track.nCHDFrame = nCHDFrame;
+        track.nImageFrame = nImageFrame;
+        track.ullStart = ullStart;
+
+        line.Format("  TRACK %02u %s\n", track.nNumber, track.pCueMode);
+        sheet.Append(line);
+
+        u32 nUnstored = nPostgap + (track.bPregapStored ? 0 : track.nPregap);
+        if (nUnstored > 0) {
+            FormatMSF(&time, nUnstored);
+            line.Format("    PREGAP %s\n", (const char*)time);
+            sheet.Append(line);
+        }
+
+        if (track.bPregapStored) {
+            FormatMSF(&time, nImageFrame);
+            line.Format("    INDEX 00 %s\n", (const char*)time);
+            sheet.Append(line);
+
+            FormatMSF(&time, nImageFrame + track.nPregap);
+        } else {
+            FormatMSF(&time, nImageFrame);
+        }
+        line.Format("    INDEX 01 %s\n", (const char*)time);
+        sheet.Append(line);
+
+        nPostgap = track.nPostgap;
+        nImageFrame += track.nFrames;
+        ullStart += (u64)track.nFrames * track.nDataSize;
+        nCHDFrame += (track.nFrames + CD_TRACK_PADDING - 1) / CD_TRACK_PADDING * CD_TRACK_PADDING;
+    }
+
+    const TTrack& last = m_Tracks[m_nTracks - 1];
+    if ((u64)(last.nCHDFrame + last.nFrames) * CD_FRAME_SIZE > m_ullLogicalBytes) {
+        LOGERR("Tracks run past the end of the CHD");
+        return FALSE;
+    }
+
+    m_ullSize = ullStart;
+    m_cue_str = new char[sheet.GetLength() + 1];
+    strcpy(m_cue_str, sheet);
+    LOGNOTE("Cue sheet from CHD metadata %s", m_cue_str);
+    return TRUE;
+}
+
+unsigned CCHDFileDevice::FindTrack(u64 ullOffset) const {
+    unsigned nLow = 0;
+    unsigned nHigh = m_nTracks;
+    while (nHigh - nLow > 1) {
+        unsigned nMid = (nLow + nHigh) / 2;
+        if (m_Tracks[nMid].ullStart <= ullOffset)
+            nLow = nMid;
+        else
+            nHigh = nMid;
+    }
+    return nLow;
+}
+
+// Each cursor has its own FIL, as in CCueBinFileDevice. Returns the data
+// cursor's FIL if we can't open another one
+FIL* CCHDFileDevice::GetCursorFile(unsigned nCursor) {
+    if (m_pCursorFile[nCursor] != nullptr)
+        return m_pCursorFile[nCursor];
+
+    FIL* pFile = new FIL();
+    FRESULT result = f_open(pFile, m_pPath, FA_READ);
+    if (result == FR_OK) {
+        pFile->cltbl = m_pLinkMap;
+        m_pCursorFile[nCursor] = pFile;
+        return pFile;
+    }
+    LOGERR("Cannot open cursor %u on %s, err %d", nCursor, m_pPath, result);
+    delete pFile;
+
+    m_pCursorFile[nCursor] = m_pFile;
+    return m_pFile;
+}
+
+boolean CCHDFileDevice::ReadFile(u64 ullOffset, void* pBuffer, size_t nCount, unsigned nCursor) {
+    FIL* pFile = GetCursorFile(nCursor);
+
+    if (f_tell(pFile) != ullOffset) {
+        FRESULT result = f_lseek(pFile, ullOffset);
+        if (result != FR_OK) {
+            LOGERR("Seek to offset %llu is not ok, err %d", ullOffset, result);
+            return FALSE;
+        }
+    }
+
+    UINT nBytesRead = 0;
+    FRESULT result = f_read(pFile, pBuffer, nCount, &nBytesRead);
+    if (result != FR_OK || nBytesRead != nCount) {
+        LOGERR("Failed to read %u bytes at %llu, err %d", (unsigned)nCount, ullOffset, result);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// The compressed hunk is read into the cursor's own buffer, since the
+// read may block and let the other cursor in. Picking a cache entry and
+// decompressing into it happen after that, without blocking
+const u8* CCHDFileDevice::GetHunk(u32 nHunk, unsigned nCursor) {
+    if (nHunk >= m_nHunkCount)
+        return nullptr;
+
+    // Copies of an earlier hunk share its cache entry
+    while (m_pMap[nHunk].nType == HunkSelf) {
+        u64 ullSource = m_pMap[nHunk].ullOffset;
+        if (ullSource >= nHunk) {
+            LOGERR("Hunk %u refers to hunk %llu", nHunk, ullSource);
+            return nullptr;
+        }
+        nHunk = ullSource;
+    }
+
+    for (unsigned i = 0; i < CacheHunks; i++) {
+        if (m_Cache[i].nHunk == nHunk) {
+            m_Cache[i].nLastUsed = ++m_nUseCounter;
+            m_nCacheHits++;
+            return m_Cache[i].pData;
+        }
+    }
+
+    const TMapEntry& entry = m_pMap[nHunk];
+    u8* pSource = m_pCompressed[nCursor];
+    if (entry.nType != HunkZero) {
+        if (entry.nLength > m_nHunkBytes) {
+            LOGERR("Hunk %u is %u bytes", nHunk, entry.nLength);
+            return nullptr;
+        }
+        if (!ReadFile(entry.ullOffset, pSource, entry.nLength, nCursor))
+            return nullptr;
+        m_ullBytesRead += entry.nLength;
+    }
+
+    TCacheEntry* pVictim = &m_Cache[0];
+    for (unsigned i = 1; i < CacheHunks; i++)
+        if (m_Cache[i].nLastUsed < pVictim->nLastUsed)
+            pVictim = &m_Cache[i];
+
+    unsigned nStart = CTimer::GetClockTicks();
+    pVictim->nHunk = InvalidHunk;
+    if (!DecompressHunk(entry, pSource, pVictim->pData)) {
+        LOGERR("Cannot decompress hunk %u", nHunk);
+        return nullptr;
+    }
+    m_nDecodeTicks += CTimer::GetClockTicks() - nStart;
+    m_nHunksDecoded++;
+
+    pVictim->nHunk = nHunk;
+    pVictim->nLastUsed = ++m_nUseCounter;
+    return pVictim->pData;
+}
+
+boolean CCHDFileDevice::DecompressHunk(const TMapEntry& entry, const u8* pSource, u8* pDest) {
+    boolean bOK;
+    switch (entry.nType) {
+        case HunkCodec0:
+        case HunkCodec1:
+        case HunkCodec2:
+        case HunkCodec3: {
+            u32 nCodec = m_Compressors[entry.nType];
+            if (nCodec == CODEC_ZLIB)
+                bOK = m_pInflater->Inflate(pSource, entry.nLength, pDest, m_nHunkBytes) == (int)m_nHunkBytes;
+            else if (nCodec == CODEC_LZMA)
+                bOK = m_pLZMADecoder->Decode(pSource, entry.nLength, pDest, m_nHunkBytes) == (int)m_nHunkBytes;
+            else if (nCodec != 0)
+                bOK = DecompressCD(nCodec, pSource, entry.nLength, pDest);
+            else
+                bOK = FALSE;
+            break;
+        }
+
+        case HunkUncompressed:
+            memcpy(pDest, pSource, m_nHunkBytes);
+            bOK = TRUE;
+            break;
+
+        case HunkZero:
+            memset(pDest, 0, m_nHunkBytes);
+            bOK = TRUE;
+            break;
+
+        default:
+            bOK = FALSE;
+            break;
+    }
+
+    if (bOK && entry.bHasCRC && ComputeCRC(pDest, m_nHunkBytes) != entry.nCRC) {
+        LOGERR("Hunk CRC mismatch");
+        bOK = FALSE;
+    }
+
+    return bOK;
+}
+
+// The CD codecs compress the sectors and the subcode of all frames as two
+// separate streams. The sectors go first, after a bitmap of the frames
+// whose sync and ECC were dropped because they could be regenerated and
+// the length of the sector stream. FLAC frames carry their own length
+boolean CCHDFileDevice::DecompressCD(u32 nCodec, const u8* pSource, size_t nLength, u8* pDest) {
+    unsigned nFrames = m_nHunkBytes / CD_FRAME_SIZE;
+    unsigned nSectorBytes = nFrames * CD_SECTOR_SIZE;
+    unsigned nSubcodeBytes = nFrames * CD_SUBCODE_SIZE;
+    u8* pSectors = m_pScratch;
+    u8* pSubcode = m_pScratch + nSectorBytes;
+
+    unsigned nECCBytes = 0;
+    size_t nSubcodeStart;
+    if (nCodec == CODEC_CD_FLAC) {
+        int nUsed = m_pFLACDecoder->Decode(pSource, nLength, pSectors, nSectorBytes / 4, TRUE);
+        if (nUsed < 0)
+            return FALSE;
+        nSubcodeStart = nUsed;
+    } else {
+        nECCBytes = (nFrames + 7) / 8;
+        unsigned nHeaderBytes = nECCBytes + (m_nHunkBytes < 65536 ? 2 : 3);
+        if (nLength < nHeaderBytes)
+            return FALSE;
+
+        size_t nSectorLength = GetBE16(pSource + nECCBytes);
+        if (m_nHunkBytes >= 65536)
+            nSectorLength = nSectorLength << 8 | pSource[nECCBytes + 2];
+        if (nSectorLength > nLength - nHeaderBytes)
+            return FALSE;
+
+        const u8* pStream = pSource + nHeaderBytes;
+        int nDecoded;
+        if (nCodec == CODEC_CD_LZMA)
+            nDecoded = m_pLZMADecoder->Decode(pStream, nSectorLength, pSectors, nSectorBytes);
+        else
+            nDecoded = m_pInflater->Inflate(pStream, nSectorLength, pSectors, nSectorBytes);
+        if (nDecoded != (int)nSectorBytes)
+            return FALSE;
+        nSubcodeStart = nHeaderBytes + nSectorLength;
+    }
+
+    if (nSubcodeStart > nLength ||
+        m_pInflater->Inflate(pSource + nSubcodeStart, nLength - nSubcodeStart, pSubcode, nSubcodeBytes) !=
+            (int)nSubcodeBytes)
+        return FALSE;
+
+    for (unsigned nFrame = 0; nFrame < nFrames; nFrame++) {
+        u8* pFrame = pDest + nFrame * CD_FRAME_SIZE;
+        memcpy(pFrame, pSectors + nFrame * CD_SECTOR_SIZE, CD_SECTOR_SIZE);
+        memcpy(pFrame + CD_SECTOR_SIZE, pSubcode + nFrame * CD_SUBCODE_SIZE, CD_SUBCODE_SIZE);
+
+        if (nECCBytes > 0 && (pSource[nFrame / 8] & (1 << (nFrame % 8)))) {
+            memcpy(pFrame, s_Sync, sizeof(s_Sync));
+            m_SectorEncoder.GenerateECC(pFrame);
+        }
+    }
+
+    return TRUE;
+}
+
+u16 CCHDFileDevice::ComputeCRC(const u8* pData, size_t nLength) const {
+    u16 crc = 0xFFFF;
+    while (nLength--)
+        crc = (crc << 8) ^ m_CRCTable[(crc >> 8) ^ *pData++];
+    return crc;
+}
+
+int CCHDFileDevice::ReadAt(u64 nOffset, void* pBuffer, size_t nCount, unsigned nCursor) {
+    if (nCursor >= CursorCount) {
+        LOGERR("ReadAt bad cursor %u", nCursor);
+        return -1;
+    }
+
+    // One frame at a time, a frame never spans two hunks
+    u8* pDest = (u8*)pBuffer;
+    size_t nTotal = 0;
+    while (nCount > 0 && nOffset < m_ullSize) {
+        const TTrack& track = m_Tracks[FindTrack(nOffset)];
+        u64 ullTrackOffset = nOffset - track.ullStart;
+        u32 nFrame = ullTrackOffset / track.nDataSize;
+        unsigned nInFrame = ullTrackOffset % track.nDataSize;
+        size_t nChunk = track.nDataSize - nInFrame;
+        if (nChunk > nCount)
+            nChunk = nCount;
+
+        u64 ullCHDOffset = (u64)(track.nCHDFrame + nFrame) * CD_FRAME_SIZE;
+        const u8* pHunk = GetHunk(ullCHDOffset / m_nHunkBytes, nCursor);
+        if (pHunk == nullptr)
+            return -1;
+        const u8* pFrame = pHunk + ullCHDOffset % m_nHunkBytes;
+
+        if (track.bAudio) {
+            for (size_t i = 0; i < nChunk; i++)
+                pDest[i] = pFrame[(nInFrame + i) ^ 1];
+        } else {
+            memcpy(pDest, pFrame + nInFrame, nChunk);
+        }
+
+        pDest += nChunk;
+        nOffset += nChunk;
+        nCount -= nChunk;
+        nTotal += nChunk;
+    }
+
+    return nTotal;
+}
+
+int CCHDFileDevice::Read(void* pBuffer, size_t nCount) {
+    int nBytesRead = ReadAt(m_ullPosition, pBuffer, nCount, CursorData);
+    if (nBytesRead > 0)
+        m_ullPosition += nBytesRead;
+    return nBytesRead;
+}
+
+int CCHDFileDevice::Write(const void* pBuffer, size_t nCount) {
+    // Read-only device
+    return -1;
+}
+
+u64 CCHDFileDevice::Seek(u64 ullOffset) {
+    m_ullPosition = ullOffset;
+    return ullOffset;
+}
+
+u64 CCHDFileDevice::GetSize(void) const {
+    return m_ullSize;
+}
+
+u64 CCHDFileDevice::Tell() const {
+    return m_ullPosition;
+}
+
+const char* CCHDFileDevice::GetCueSheet() const {
+    return m_cue_str;
+}
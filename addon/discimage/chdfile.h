@@ -0,0 +1,157 @@
+//
+// A CDevice for CD images in MAME's compressed hunks of data (CHD) format
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _CHDFILE_H
+#define _CHDFILE_H
+
+#include <circle/types.h>
+#include <fatfs/ff.h>
+
+#include "cdsectorencoder.h"
+#include "cuedevice.h"
+#include "flacdecoder.h"
+#include "inflate.h"
+#include "lzmadecoder.h"
+
+class CCHDFileDevice : public ICueDevice {
+   public:
+    /// \param pFile Open CHD file, owned by the device from now on
+    /// \param pPath Path of the file, further cursors open their own FIL
+    CCHDFileDevice(FIL* pFile, const char* pPath);
+    ~CCHDFileDevice(void);
+
+    /// \brief Read the header, hunk map and track list
+    /// \return FALSE if this isn't a CD image we can read
+    boolean Init(void);
+
+    int Read(void* pBuffer, size_t nCount);
+    int ReadAt(u64 nOffset, void* pBuffer, size_t nCount, unsigned nCursor = CursorData);
+    int Write(const void* pBuffer, size_t nCount);
+    u64 Seek(u64 ullOffset);
+    u64 GetSize(void) const;
+    u64 Tell() const;
+    const char* GetCueSheet() const;
+
+   private:
+    // Hunk types in the map. The first seven are CHD's own, the pseudo
+    // types of the compressed map are resolved to these while reading it
+    enum THunkType {
+        HunkCodec0,
+        HunkCodec1,
+        HunkCodec2,
+        HunkCodec3,
+        HunkUncompressed,
+        HunkSelf,    // same data as an earlier hunk
+        HunkParent,  // in the parent CHD, which we don't support
+        HunkZero     // unallocated in an uncompressed map
+    };
+
+    struct TMapEntry {
+        u64 ullOffset;  // in the file, or the hunk number for HunkSelf
+        u32 nLength;
+        u16 nCRC;       // CRC16 of the decompressed hunk
+        u8 nType;
+        u8 bHasCRC;
+    };
+
+    struct TTrack {
+        unsigned nNumber;
+        const char* pCueMode;
+        unsigned nDataSize;  // bytes of each frame in the image
+        boolean bAudio;      // stored big endian in a CHD
+        unsigned nFrames;    // including a stored pregap
+        unsigned nPregap;
+        boolean bPregapStored;
+        unsigned nPostgap;
+        u32 nCHDFrame;       // first frame in the CHD
+        u32 nImageFrame;     // first frame in the image we present
+        u64 ullStart;        // offset in the image we present
+    };
+
+    struct TCacheEntry {
+        u32 nHunk;           // InvalidHunk if empty
+        unsigned nLastUsed;
+        u8* pData;
+    };
+
+    boolean ReadFile(u64 ullOffset, void* pBuffer, size_t nCount, unsigned nCursor);
+    FIL* GetCursorFile(unsigned nCursor);
+
+    boolean ReadHeader(void);
+    boolean ReadMap(void);
+    boolean ReadUncompressedMap(void);
+    boolean ReadCompressedMap(void);
+    boolean ReadMetadata(void);
+    boolean ParseTrack(const char* pText);
+    boolean BuildCueSheet(void);
+
+    unsigned FindTrack(u64 ullOffset) const;
+    const u8* GetHunk(u32 nHunk, unsigned nCursor);
+    boolean DecompressHunk(const TMapEntry& entry, const u8* pSource, u8* pDest);
+    boolean DecompressCD(u32 nCodec, const u8* pSource, size_t nLength, u8* pDest);
+    u16 ComputeCRC(const u8* pData, size_t nLength) const;
+
+   private:
+    static const unsigned MaxTracks = 99;
+    static const unsigned CacheHunks = 16;
+    static const unsigned MaxHunkBytes = 256 * 1024;
+    static const u32 InvalidHunk = 0xFFFFFFFF;
+
+    FIL* m_pFile;
+    FIL* m_pCursorFile[CursorCount] = {nullptr};  // lazily opened, except CursorData
+    char* m_pPath;
+    DWORD* m_pLinkMap;
+    char* m_cue_str;
+
+    // From the header
+    u32 m_Compressors[4];
+    u64 m_ullLogicalBytes;
+    u64 m_ullMapOffset;
+    u64 m_ullMetaOffset;
+    u32 m_nHunkBytes;
+    u32 m_nUnitBytes;
+    u32 m_nHunkCount;
+
+    TMapEntry* m_pMap;
+
+    TTrack m_Tracks[MaxTracks];
+    unsigned m_nTracks;
+    u64 m_ullSize;
+    u64 m_ullPosition;  // for Read() and Seek()
+
+    // Decompressed hunks, least recently used goes first
+    TCacheEntry m_Cache[CacheHunks];
+    unsigned m_nUseCounter;
+
+    // Compressed data is read per cursor, decompression is shared
+    u8* m_pCompressed[CursorCount];
+    u8* m_pScratch;
+    CInflater* m_pInflater;
+    CLZMADecoder* m_pLZMADecoder;
+    CFLACDecoder* m_pFLACDecoder;
+    CCDSectorEncoder m_SectorEncoder;
+    u16 m_CRCTable[256];
+
+    // For comparing against reading a bin
+    u64 m_ullBytesRead;
+    unsigned m_nHunksDecoded;
+    unsigned m_nCacheHits;
+    unsigned m_nDecodeTicks;
+};
+
+#endif
@@ -0,0 +1,489 @@
+//
+// A CDevice for ISO images compressed block by block, as CSO or ZSO
+//
+// Both formats split the ISO into fixed size blocks, usually 2048 bytes,
+// and compress each on its own, CSO with raw deflate and ZSO with LZ4.
+// After a 24 byte header comes an index with one little endian u32 per
+// block plus one marking the end of the last. The low 31 bits are the
+// block's file offset shifted right by the header's alignment, the top
+// bit marks a block stored as is because it wouldn't compress. CSO v2
+// uses the top bit for LZ4 instead, and stores a block whose compressed
+// size is the block size or more.
+//
+// The index is kept in RAM, four bytes a block, so any sector is a lookup
+// and one read away. Whole blocks are decompressed straight into the
+// caller's buffer, with the compressed data of consecutive blocks read in
+// one go, and runs of stored blocks are read directly into it. Parts of a
+// block go through a small cache, so the next read of the same block
+// doesn't decompress it again.
+//
+// ZSO's LZ4 decompresses several times faster than CSO's deflate, which
+// matters on a Pi Zero.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "compressediso.h"
+
+#include <assert.h>
+#include <circle/logger.h>
+#include <circle/timer.h>
+#include <circle/util.h>
+
+#include "lz4decoder.h"
+#include "util.h"
+
+LOGMODULE("CCompressedIsoDevice");
+
+#define CISO_HEADER_SIZE    24
+#define CISO_SECTOR_SIZE    2048
+#define CISO_FLAG           0x80000000
+#define CISO_OFFSET_MASK    0x7FFFFFFF
+
+static const char s_CueSheet[] =
+    "FILE \"image.iso\" BINARY\n"
+    "  TRACK 01 MODE1/2048\n"
+    "    INDEX 01 00:00:00\n";
+
+static inline u32 GetLE32(const u8* p) {
+    return (u32)p[3] << 24 | (u32)p[2] << 16 | (u32)p[1] << 8 | p[0];
+}
+
+static inline u64 GetLE64(const u8* p) {
+    return (u64)GetLE32(p + 4) << 32 | GetLE32(p);
+}
+
+CCompressedIsoDevice::CCompressedIsoDevice(FIL* pFile, const char* pPath)
+    : m_pFile(pFile),
+      m_pLinkMap(nullptr),
+      m_bZSO(FALSE),
+      m_nVersion(0),
+      m_ullSize(0),
+      m_nBlockSize(0),
+      m_nAlignBits(0),
+      m_nBlocks(0),
+      m_pIndex(nullptr),
+      m_ullPosition(0),
+      m_nUseCounter(0),
+      m_nReadBufferSize(0),
+      m_pInflater(nullptr),
+      m_ullBytesRead(0),
+      m_ullBytesDecoded(0),
+      m_nCacheHits(0),
+      m_nDecodeTicks(0) {
+    assert(pFile != nullptr);
+    assert(pPath != nullptr);
+
+    m_pCursorFile[CursorData] = pFile;
+    m_pPath = new char[strlen(pPath) + 1];
+    strcpy(m_pPath, pPath);
+
+    for (unsigned i = 0; i < CacheBlocks; i++) {
+        m_Cache[i].nBlock = InvalidBlock;
+        m_Cache[i].nLastUsed = 0;
+        m_Cache[i].pData = nullptr;
+    }
+
+    for (unsigned i = 0; i < CursorCount; i++)
+        m_pReadBuffer[i] = nullptr;
+}
+
+CCompressedIsoDevice::~CCompressedIsoDevice(void) {
+    if (m_ullBytesDecoded > 0) {
+        LOGNOTE("%llu KB read from card for %llu KB (%u%%), %u cache hits, %u ms decoding",
+                m_ullBytesRead / 1024, m_ullBytesDecoded / 1024,
+                (unsigned)(m_ullBytesRead * 100 / m_ullBytesDecoded), m_nCacheHits, m_nDecodeTicks / 1000);
+    }
+
+    for (unsigned i = 0; i < CursorCount; i++) {
+        if (m_pCursorFile[i] != nullptr && m_pCursorFile[i] != m_pFile) {
+            f_close(m_pCursorFile[i]);
+            m_pCursorFile[i]->cltbl = nullptr;
+            delete m_pCursorFile[i];
+        }
+        if (m_pReadBuffer[i] != nullptr)
+            delete[] m_pReadBuffer[i];
+    }
+
+    f_close(m_pFile);
+    m_pFile->cltbl = nullptr;
+    delete m_pFile;
+    if (m_pLinkMap != nullptr)
+        delete[] m_pLinkMap;
+
+    for (unsigned i = 0; i < CacheBlocks; i++)
+        if (m_Cache[i].pData != nullptr)
+            delete[] m_Cache[i].pData;
+
+    if (m_pInflater != nullptr)
+        delete m_pInflater;
+    if (m_pIndex != nullptr)
+        delete[] m_pIndex;
+    delete[] m_pPath;
+}
+
+boolean CCompressedIsoDevice::Init(void) {
+    m_pLinkMap = createLinkMap(m_pFile);
+
+    if (!ReadHeader() || !ReadIndex())
+        return FALSE;
+
+    for (unsigned i = 0; i < CacheBlocks; i++)
+        m_Cache[i].pData = new u8[m_nBlockSize];
+    for (unsigned i = 0; i < CursorCount; i++)
+        m_pReadBuffer[i] = new u8[m_nReadBufferSize];
+    if (!m_bZSO)
+        m_pInflater = new CInflater();
+
+    u64 ullCompressed = (u64)(m_pIndex[m_nBlocks] & CISO_OFFSET_MASK) << m_nAlignBits;
+    LOGNOTE("%s v%u, %u blocks of %u bytes, %llu byte image, compressed to %u%%",
+            m_bZSO ? "ZSO" : "CSO", m_nVersion, m_nBlocks, m_nBlockSize, m_ullSize,
+            (unsigned)(ullCompressed * 100 / m_ullSize));
+    if (!m_bZSO && m_nVersion < 2)
+        LOGNOTE("Deflate is slow to decompress on a Pi Zero, ZSO (LZ4) reads faster");
+    return TRUE;
+}
+
+boolean CCompressedIsoDevice::ReadHeader(void) {
+    u8 header[CISO_HEADER_SIZE];
+    if (!ReadFile(0, header, sizeof(header), CursorData))
+        return FALSE;
+
+    if (memcmp(header, "CISO", 4) == 0) {
+        m_bZSO = FALSE;
+    } else if (memcmp(header, "ZISO", 4) == 0) {
+        m_bZSO = TRUE;
+    } else {
+        LOGERR("Not a CSO or ZSO file");
+        return FALSE;
+    }
+
+    // The header size field is unreliable, some tools write 0
+    m_ullSize = GetLE64(header + 8);
+    m_nBlockSize = GetLE32(header + 16);
+    m_nVersion = header[20];
+    m_nAlignBits = header[21];
+
+    if (m_nVersion > (m_bZSO ? 1 : 2)) {
+        LOGERR("Version %u is not supported", m_nVersion);
+        return FALSE;
+    }
+
+    if (m_ullSize == 0 || m_nBlockSize < CISO_SECTOR_SIZE || m_nBlockSize % CISO_SECTOR_SIZE != 0 ||
+        m_nBlockSize > MaxBlockSize || m_nAlignBits > MaxAlignBits) {
+        LOGERR("Bad header, %llu bytes in blocks of %u, alignment %u", m_ullSize, m_nBlockSize, m_nAlignBits);
+        return FALSE;
+    }
+
+    u64 ullBlocks = (m_ullSize + m_nBlockSize - 1) / m_nBlockSize;
+    if (ullBlocks >= CISO_OFFSET_MASK) {
+        LOGERR("Image is too big, %llu blocks", ullBlocks);
+        return FALSE;
+    }
+    m_nBlocks = ullBlocks;
+
+    // A stored block may be followed by padding up to the alignment
+    m_nReadBufferSize = m_nBlockSize + (1 << m_nAlignBits);
+    if (m_nReadBufferSize < ReadBufferSize)
+        m_nReadBufferSize = ReadBufferSize;
+
+    return TRUE;
+}
+
+// The index is little endian, as is the Pi, so it is used as read
+boolean CCompressedIsoDevice::ReadIndex(void) {
+    m_pIndex = new u32[m_nBlocks + 1];
+    if (!ReadFile(CISO_HEADER_SIZE, m_pIndex, (m_nBlocks + 1) * sizeof(u32), CursorData))
+        return FALSE;
+
+    u64 ullFileSize = f_size(m_pFile);
+    for (u32 nBlock = 0; nBlock < m_nBlocks; nBlock++) {
+        u64 ullStart = (u64)(m_pIndex[nBlock] & CISO_OFFSET_MASK) << m_nAlignBits;
+        u64 ullEnd = (u64)(m_pIndex[nBlock + 1] & CISO_OFFSET_MASK) << m_nAlignBits;
+        if (ullEnd < ullStart || ullEnd > ullFileSize || ullEnd - ullStart > m_nReadBufferSize) {
+            LOGERR("Bad index entry for block %u, %llu to %llu", nBlock, ullStart, ullEnd);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Returns how the block is stored, and where. The length includes any
+// padding up to the next block
+CCompressedIsoDevice::TCodec CCompressedIsoDevice::GetBlock(u32 nBlock, u64* pOffset, size_t* pLength) const {
+    u32 nEntry = m_pIndex[nBlock];
+    *pOffset = (u64)(nEntry & CISO_OFFSET_MASK) << m_nAlignBits;
+    *pLength = ((u64)(m_pIndex[nBlock + 1] & CISO_OFFSET_MASK) << m_nAlignBits) - *pOffset;
+
+    if (m_bZSO)
+        return nEntry & CISO_FLAG ? CodecNone : CodecLZ4;
+    if (m_nVersion < 2)
+        return nEntry & CISO_FLAG ? CodecNone : CodecDeflate;
+
+    if (*pLength >= m_nBlockSize)
+        return CodecNone;
+    return nEntry & CISO_FLAG ? CodecLZ4 : CodecDeflate;
+}
+
+// Only the last block can be short
+size_t CCompressedIsoDevice::GetBlockSize(u32 nBlock) const {
+    if (nBlock + 1 < m_nBlocks)
+        return m_nBlockSize;
+    return m_ullSize - (u64)nBlock * m_nBlockSize;
+}
+
+// Each cursor has its own FIL, as in CCueBinFileDevice. Returns the data
+// cursor's FIL if we can't open another one
+FIL* CCompressedIsoDevice::GetCursorFile(unsigned nCursor) {
+    if (m_pCursorFile[nCursor] != nullptr)
+        return m_pCursorFile[nCursor];
+
+    FIL* pFile = new FIL();
+    FRESULT result = f_open(pFile, m_pPath, FA_READ);
+    if (result == FR_OK) {
+        pFile->cltbl = m_pLinkMap;
+        m_pCursorFile[nCursor] = pFile;
+        return pFile;
+    }
+    LOGERR("Cannot open cursor %u on %s, err %d", nCursor, m_pPath, result);
+    delete pFile;
+
+    m_pCursorFile[nCursor] = m_pFile;
+    return m_pFile;
+}
+
+boolean CCompressedIsoDevice::ReadFile(u64 ullOffset, void* pBuffer, size_t nCount, unsigned nCursor) {
+    FIL* pFile = GetCursorFile(nCursor);
+
+    if (f_tell(pFile) != ullOffset) {
+        FRESULT result = f_lseek(pFile, ullOffset);
+        if (result != FR_OK) {
+            LOGERR("Seek to offset %llu is not ok, err %d", ullOffset, result);
+            return FALSE;
+        }
+    }
+
+    UINT nBytesRead = 0;
+    FRESULT result = f_read(pFile, pBuffer, nCount, &nBytesRead);
+    if (result != FR_OK || nBytesRead != nCount) {
+        LOGERR("Failed to read %u bytes at %llu, err %d", (unsigned)nCount, ullOffset, result);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+boolean CCompressedIsoDevice::DecodeBlock(u32 nBlock, TCodec codec, const u8* pSource, size_t nLength, u8* pDest) {
+    size_t nSize = GetBlockSize(nBlock);
+    unsigned nStart = CTimer::GetClockTicks();
+
+    boolean bOK;
+    switch (codec) {
+        case CodecNone:
+            bOK = nLength >= nSize;
+            if (bOK)
+                memcpy(pDest, pSource, nSize);
+            break;
+
+        case CodecDeflate:
+            bOK = m_pInflater != nullptr && m_pInflater->Inflate(pSource, nLength, pDest, nSize) == (int)nSize;
+            break;
+
+        case CodecLZ4:
+            bOK = CLZ4Decoder::Decode(pSource, nLength, pDest, nSize) == (int)nSize;
+            break;
+
+        default:
+            bOK = FALSE;
+            break;
+    }
+
+    if (!bOK) {
+        LOGERR("Cannot decompress block %u", nBlock);
+        return FALSE;
+    }
+
+    m_nDecodeTicks += CTimer::GetClockTicks() - nStart;
+    m_ullBytesDecoded += nSize;
+    return TRUE;
+}
+
+// Reads whole blocks into the caller's buffer. A run of stored blocks
+// with no padding between them is a single read straight into it, other
+// blocks have their compressed data read together, as much as fits in
+// the cursor's buffer, then are decompressed one by one
+int CCompressedIsoDevice::ReadBlocks(u32 nBlock, unsigned nCount, u8* pDest, unsigned nCursor) {
+    u8* pStart = pDest;
+    while (nCount > 0) {
+        u64 ullOffset;
+        size_t nLength;
+        TCodec codec = GetBlock(nBlock, &ullOffset, &nLength);
+
+        unsigned nRun = 1;
+        if (codec == CodecNone) {
+            while (nRun < nCount) {
+                u64 ullNext;
+                size_t nNext;
+                if (GetBlock(nBlock + nRun, &ullNext, &nNext) != CodecNone ||
+                    ullNext != ullOffset + (u64)nRun * m_nBlockSize)
+                    break;
+                nRun++;
+            }
+
+            size_t nBytes = (size_t)(nRun - 1) * m_nBlockSize + GetBlockSize(nBlock + nRun - 1);
+            if (!ReadFile(ullOffset, pDest, nBytes, nCursor))
+                return -1;
+            m_ullBytesRead += nBytes;
+            m_ullBytesDecoded += nBytes;
+            pDest += nBytes;
+        } else {
+            u64 ullEnd = ullOffset + nLength;
+            while (nRun < nCount) {
+                u64 ullNext = (u64)(m_pIndex[nBlock + nRun + 1] & CISO_OFFSET_MASK) << m_nAlignBits;
+                if (ullNext - ullOffset > m_nReadBufferSize)
+                    break;
+                ullEnd = ullNext;
+                nRun++;
+            }
+
+            u8* pSource = m_pReadBuffer[nCursor];
+            if (!ReadFile(ullOffset, pSource, ullEnd - ullOffset, nCursor))
+                return -1;
+            m_ullBytesRead += ullEnd - ullOffset;
+
+            for (unsigned i = 0; i < nRun; i++) {
+                u64 ullBlockOffset;
+                size_t nBlockLength;
+                TCodec blockCodec = GetBlock(nBlock + i, &ullBlockOffset, &nBlockLength);
+                if (!DecodeBlock(nBlock + i, blockCodec, pSource + (ullBlockOffset - ullOffset), nBlockLength, pDest))
+                    return -1;
+                pDest += GetBlockSize(nBlock + i);
+            }
+        }
+
+        nBlock += nRun;
+        nCount -= nRun;
+    }
+
+    return pDest - pStart;
+}
+
+// As in CCHDFileDevice, the read goes into the cursor's own buffer, and
+// a cache entry is only picked once it has finished
+const u8* CCompressedIsoDevice::GetCachedBlock(u32 nBlock, unsigned nCursor) {
+    for (unsigned i = 0; i < CacheBlocks; i++) {
+        if (m_Cache[i].nBlock == nBlock) {
+            m_Cache[i].nLastUsed = ++m_nUseCounter;
+            m_nCacheHits++;
+            return m_Cache[i].pData;
+        }
+    }
+
+    u64 ullOffset;
+    size_t nLength;
+    TCodec codec = GetBlock(nBlock, &ullOffset, &nLength);
+    u8* pSource = m_pReadBuffer[nCursor];
+    if (!ReadFile(ullOffset, pSource, nLength, nCursor))
+        return nullptr;
+    m_ullBytesRead += nLength;
+
+    TCacheEntry* pVictim = &m_Cache[0];
+    for (unsigned i = 1; i < CacheBlocks; i++)
+        if (m_Cache[i].nLastUsed < pVictim->nLastUsed)
+            pVictim = &m_Cache[i];
+
+    pVictim->nBlock = InvalidBlock;
+    if (!DecodeBlock(nBlock, codec, pSource, nLength, pVictim->pData))
+        return nullptr;
+
+    pVictim->nBlock = nBlock;
+    pVictim->nLastUsed = ++m_nUseCounter;
+    return pVictim->pData;
+}
+
+int CCompressedIsoDevice::ReadAt(u64 nOffset, void* pBuffer, size_t nCount, unsigned nCursor) {
+    if (nCursor >= CursorCount) {
+        LOGERR("ReadAt bad cursor %u", nCursor);
+        return -1;
+    }
+
+    u8* pDest = (u8*)pBuffer;
+    size_t nTotal = 0;
+    while (nCount > 0 && nOffset < m_ullSize) {
+        u32 nBlock = nOffset / m_nBlockSize;
+        size_t nInBlock = nOffset % m_nBlockSize;
+        size_t nBlockSize = GetBlockSize(nBlock);
+
+        size_t nChunk;
+        if (nInBlock == 0 && nCount >= nBlockSize) {
+            u32 nWhole = nCount / m_nBlockSize;
+            if (nWhole > m_nBlocks - nBlock)
+                nWhole = m_nBlocks - nBlock;
+            if (nWhole == 0)
+                nWhole = 1;  // the short last block
+
+            int nBytes = ReadBlocks(nBlock, nWhole, pDest, nCursor);
+            if (nBytes < 0)
+                return -1;
+            nChunk = nBytes;
+        } else {
+            const u8* pBlock = GetCachedBlock(nBlock, nCursor);
+            if (pBlock == nullptr)
+                return -1;
+
+            nChunk = nBlockSize - nInBlock;
+            if (nChunk > nCount)
+                nChunk = nCount;
+            memcpy(pDest, pBlock + nInBlock, nChunk);
+        }
+
+        pDest += nChunk;
+        nOffset += nChunk;
+        nCount -= nChunk;
+        nTotal += nChunk;
+    }
+
+    return nTotal;
+}
+
+int CCompressedIsoDevice::Read(void* pBuffer, size_t nCount) {
+    int nBytesRead = ReadAt(m_ullPosition, pBuffer, nCount, CursorData);
+    if (nBytesRead > 0)
+        m_ullPosition += nBytesRead;
+    return nBytesRead;
+}
+
+int CCompressedIsoDevice::Write(const void* pBuffer, size_t nCount) {
+    // Read-only device
+    return -1;
+}
+
+u64 CCompressedIsoDevice::Seek(u64 ullOffset) {
+    m_ullPosition = ullOffset;
+    return ullOffset;
+}
+
+u64 CCompressedIsoDevice::GetSize(void) const {
+    return m_ullSize;
+}
+
+u64 CCompressedIsoDevice::Tell() const {
+    return m_ullPosition;
+}
+
+const char* CCompressedIsoDevice::GetCueSheet() const {
+    return s_CueSheet;
+}
@@ -0,0 +1,111 @@
+//
+// A CDevice for ISO images compressed block by block, as CSO or ZSO
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _COMPRESSEDISO_H
+#define _COMPRESSEDISO_H
+
+#include <circle/types.h>
+#include <fatfs/ff.h>
+
+#include "cuedevice.h"
+#include "inflate.h"
+
+class CCompressedIsoDevice : public ICueDevice {
+   public:
+    /// \param pFile Open CSO or ZSO file, owned by the device from now on
+    /// \param pPath Path of the file, further cursors open their own FIL
+    CCompressedIsoDevice(FIL* pFile, const char* pPath);
+    ~CCompressedIsoDevice(void);
+
+    /// \brief Read the header and the block index
+    /// \return FALSE if this isn't a CSO or ZSO we can read
+    boolean Init(void);
+
+    int Read(void* pBuffer, size_t nCount);
+    int ReadAt(u64 nOffset, void* pBuffer, size_t nCount, unsigned nCursor = CursorData);
+    int Write(const void* pBuffer, size_t nCount);
+    u64 Seek(u64 ullOffset);
+    u64 GetSize(void) const;
+    u64 Tell() const;
+    const char* GetCueSheet() const;
+
+   private:
+    enum TCodec {
+        CodecNone,  // stored as is
+        CodecDeflate,
+        CodecLZ4
+    };
+
+    struct TCacheEntry {
+        u32 nBlock;  // InvalidBlock if empty
+        unsigned nLastUsed;
+        u8* pData;
+    };
+
+    boolean ReadFile(u64 ullOffset, void* pBuffer, size_t nCount, unsigned nCursor);
+    FIL* GetCursorFile(unsigned nCursor);
+
+    boolean ReadHeader(void);
+    boolean ReadIndex(void);
+
+    TCodec GetBlock(u32 nBlock, u64* pOffset, size_t* pLength) const;
+    size_t GetBlockSize(u32 nBlock) const;
+    int ReadBlocks(u32 nBlock, unsigned nCount, u8* pDest, unsigned nCursor);
+    const u8* GetCachedBlock(u32 nBlock, unsigned nCursor);
+    boolean DecodeBlock(u32 nBlock, TCodec codec, const u8* pSource, size_t nLength, u8* pDest);
+
+   private:
+    static const unsigned CacheBlocks = 8;
+    static const unsigned MaxBlockSize = 1024 * 1024;
+    static const unsigned MaxAlignBits = 16;
+    static const unsigned ReadBufferSize = 64 * 1024;  // compressed blocks read in one go
+    static const u32 InvalidBlock = 0xFFFFFFFF;
+
+    FIL* m_pFile;
+    FIL* m_pCursorFile[CursorCount] = {nullptr};  // lazily opened, except CursorData
+    char* m_pPath;
+    DWORD* m_pLinkMap;
+
+    // From the header
+    boolean m_bZSO;
+    unsigned m_nVersion;
+    u64 m_ullSize;
+    u32 m_nBlockSize;
+    unsigned m_nAlignBits;
+
+    u32 m_nBlocks;
+    u32* m_pIndex;  // m_nBlocks + 1 entries, the last one marks the end
+    u64 m_ullPosition;  // for Read() and Seek()
+
+    // Blocks read in part, least recently used goes first
+    TCacheEntry m_Cache[CacheBlocks];
+    unsigned m_nUseCounter;
+
+    // Compressed data is read per cursor, decompression is shared
+    u8* m_pReadBuffer[CursorCount];
+    size_t m_nReadBufferSize;
+    CInflater* m_pInflater;
+
+    // For comparing against reading an ISO
+    u64 m_ullBytesRead;
+    u64 m_ullBytesDecoded;
+    unsigned m_nCacheHits;
+    unsigned m_nDecodeTicks;
+};
+
+#endif
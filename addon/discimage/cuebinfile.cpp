@@ -17,6 +17,7 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include "cuebinfile.h"
+#include "util.h"
 
 #include <assert.h>
 #include <circle/stdarg.h>
@@ -26,8 +27,14 @@
 
 LOGMODULE("CCueBinFileDevice");
 
-CCueBinFileDevice::CCueBinFileDevice(FIL *pFile, char *cue_str) {
+CCueBinFileDevice::CCueBinFileDevice(FIL *pFile, char *cue_str, const char *pPath) {
     m_pFile = pFile;
+    m_pCursorFile[CursorData] = pFile;
+    if (pPath != nullptr) {
+        // Keep the path so further cursors can open their own handle
+        m_pPath = new char[strlen(pPath) + 1];
+        strcpy(m_pPath, pPath);
+    }
     if (cue_str != nullptr) {
         // If we were given a cue sheet
         // copy it and own it
@@ -46,7 +53,20 @@ CCueBinFileDevice::CCueBinFileDevice(FIL *pFile, char *cue_str) {
 }
 
 CCueBinFileDevice::~CCueBinFileDevice(void) {
+    for (unsigned i = 0; i < CursorCount; i++) {
+        if (m_pCursorFile[i] != nullptr && m_pCursorFile[i] != m_pFile) {
+            f_close(m_pCursorFile[i]);
+            m_pCursorFile[i]->cltbl = nullptr;
+            delete m_pCursorFile[i];
+        }
+    }
+    if (m_pPath != nullptr)
+        delete[] m_pPath;
     f_close(m_pFile);
+    if (m_pFile != nullptr)
+        m_pFile->cltbl = nullptr;
+    if (m_pLinkMap != nullptr)
+        delete[] m_pLinkMap;
     if (m_cue_str != nullptr)
         delete[] m_cue_str;
 }
@@ -66,6 +86,61 @@ int CCueBinFileDevice::Read(void *pBuffer, size_t nSize) {
     return nBytesRead;
 }
 
+// Each cursor has its own FIL, and so its own file pointer and sector
+// buffer. Returns the data cursor's FIL if we can't open another one
+FIL *CCueBinFileDevice::GetCursorFile(unsigned nCursor) {
+    if (nCursor >= CursorCount)
+        return nullptr;
+
+    if (m_pCursorFile[nCursor] != nullptr)
+        return m_pCursorFile[nCursor];
+
+    if (m_pPath != nullptr) {
+        FIL *pFile = new FIL();
+        FRESULT result = f_open(pFile, m_pPath, FA_READ);
+        if (result == FR_OK) {
+            LOGNOTE("Opened cursor %u on %s", nCursor, m_pPath);
+            // Same file, same clusters, so the link map can be shared
+            pFile->cltbl = m_pLinkMap;
+            m_pCursorFile[nCursor] = pFile;
+            return pFile;
+        }
+        LOGERR("Cannot open cursor %u on %s, err %d", nCursor, m_pPath, result);
+        delete pFile;
+    }
+
+    // Fall back to sharing the data cursor. ReadAt() still seeks
+    // when needed, so this is only slower, not wrong
+    m_pCursorFile[nCursor] = m_pFile;
+    return m_pFile;
+}
+
+int CCueBinFileDevice::ReadAt(u64 nOffset, void *pBuffer, size_t nCount, unsigned nCursor) {
+    FIL *pFile = GetCursorFile(nCursor);
+    if (!pFile) {
+        LOGERR("ReadAt bad cursor %u", nCursor);
+        return -1;
+    }
+
+    // Sequential reads on a cursor are already in place, so this
+    // only walks the cluster chain when the consumer really jumps
+    if (f_tell(pFile) != nOffset) {
+        FRESULT result = f_lseek(pFile, nOffset);
+        if (result != FR_OK) {
+            LOGERR("ReadAt seek to offset %llu is not ok, err %d", nOffset, result);
+            return -1;
+        }
+    }
+
+    UINT nBytesRead = 0;
+    FRESULT result = f_read(pFile, pBuffer, nCount, &nBytesRead);
+    if (result != FR_OK) {
+        LOGERR("ReadAt failed to read %u bytes at %llu, err %d", (unsigned)nCount, nOffset, result);
+        return -1;
+    }
+    return nBytesRead;
+}
+
 int CCueBinFileDevice::Write(const void *pBuffer, size_t nSize) {
     // Read-only device
     return -1;
@@ -113,6 +188,27 @@ u64 CCueBinFileDevice::GetSize(void) const {
     return size;
 }
 
+// Builds the FatFs cluster link map for the image, so far seeks don't
+// follow the FAT chain. Called once at mount time, the table lives as
+// long as the device does
+boolean CCueBinFileDevice::CreateLinkMap(void) {
+    if (!m_pFile) {
+        LOGERR("CreateLinkMap !m_pFile");
+        return FALSE;
+    }
+
+    m_pLinkMap = createLinkMap(m_pFile);
+    if (m_pLinkMap == nullptr)
+        return FALSE;
+
+    // Give any cursors that are already open the map too
+    for (unsigned i = 0; i < CursorCount; i++) {
+        if (m_pCursorFile[i] != nullptr)
+            m_pCursorFile[i]->cltbl = m_pLinkMap;
+    }
+    return TRUE;
+}
+
 const char *CCueBinFileDevice::GetCueSheet() const {
     return m_cue_str;
 }
@@ -16,20 +16,33 @@
 
 #define DEFAULT_IMAGE_FILENAME "image.iso"
 
+// Initial size of the fast seek table in DWORDs. Enough for 31
+// fragments, the table is grown to fit when the image has more
+#define LINKMAP_INITIAL_ENTRIES 64
+
 class CCueBinFileDevice : public ICueDevice {
    public:
-    CCueBinFileDevice(FIL* pFile, char* cue_str = nullptr);
+    CCueBinFileDevice(FIL* pFile, char* cue_str = nullptr, const char* pPath = nullptr);
     ~CCueBinFileDevice(void);
 
     int Read(void* pBuffer, size_t nCount);
+    int ReadAt(u64 nOffset, void* pBuffer, size_t nCount, unsigned nCursor = CursorData);
     int Write(const void* pBuffer, size_t nCount);
     u64 Seek(u64 ullOffset);
     u64 GetSize(void) const;
     u64 Tell() const;
     const char* GetCueSheet() const;
 
+    boolean CreateLinkMap(void);
+
+   private:
+    FIL* GetCursorFile(unsigned nCursor);
+
    private:
     FIL* m_pFile;
+    FIL* m_pCursorFile[CursorCount] = {nullptr};  // lazily opened, except CursorData
+    char* m_pPath = nullptr;
+    DWORD* m_pLinkMap = nullptr;  // FatFs fast seek table, shared by all cursors
     FileType m_FileType = FileType::ISO;
     char* m_cue_str = nullptr;
     static constexpr const char* default_cue_sheet =
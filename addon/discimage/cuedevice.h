@@ -8,6 +8,22 @@ public:
     ICueDevice() = default;
     virtual ~ICueDevice() = default;
 
+    /// Independent read positions. Each consumer of the image reads through
+    /// its own cursor, so one can't move the file position under another
+    enum TCursor {
+        CursorData,   // USB gadget data reads
+        CursorAudio,  // CD player
+        CursorCount
+    };
+
+    /// \brief Read from an absolute offset without touching Seek()/Tell()
+    /// \return Number of bytes read, or < 0 on error
+    virtual int ReadAt(u64 nOffset, void* pBuffer, size_t nCount, unsigned nCursor = CursorData) {
+        if (Seek(nOffset) != nOffset)
+            return -1;
+        return Read(pBuffer, nCount);
+    }
+
     /// \return Current offset in the device, (u64)-1 on error
     virtual u64 Tell() const = 0;
 
@@ -0,0 +1,343 @@
+//
+// A CDevice for cue sheets that reference one file per track
+//
+// Redump images come as a cue sheet plus one bin per track. This device
+// presents the files as one image, concatenated in cue sheet order, and
+// hands out a cue sheet rewritten to a single FILE with the INDEX times
+// moved to match. Everything above it then sees a plain cue/bin.
+//
+// Files are opened on first use and kept in a small pool of FILs, least
+// recently used first out, so crossing a track boundary doesn't cost an
+// open. Each file's fast seek table is built the first time it is opened
+// and kept when its FIL is recycled.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "cuemultifile.h"
+
+#include <assert.h>
+#include <circle/logger.h>
+#include <circle/string.h>
+#include <circle/util.h>
+#include <cueparser/cueparser.h>
+
+#include "util.h"
+
+LOGMODULE("CCueMultiFileDevice");
+
+// Indexed by CUETrackMode
+static const char* const s_TrackModes[] = {
+    "AUDIO",
+    "CDG",
+    "MODE1/2048",
+    "MODE1/2352",
+    "MODE2/2048",
+    "MODE2/2324",
+    "MODE2/2336",
+    "MODE2/2352",
+    "CDI/2336",
+    "CDI/2352",
+};
+
+static void FormatMSF(CString* pString, u32 frames) {
+    pString->Format("%02u:%02u:%02u", frames / (75 * 60), (frames / 75) % 60, frames % 75);
+}
+
+CCueMultiFileDevice::CCueMultiFileDevice(const char* cue_str, const char* pCuePath)
+    : m_cue_str(nullptr),
+      m_nFiles(0),
+      m_ullSize(0),
+      m_ullPosition(0),
+      m_nUseCounter(0) {
+    assert(cue_str != nullptr);
+    assert(pCuePath != nullptr);
+
+    m_pSourceCue = new char[strlen(cue_str) + 1];
+    strcpy(m_pSourceCue, cue_str);
+
+    // FILE names are relative to the directory holding the cue sheet
+    const char* pSlash = strrchr(pCuePath, '/');
+    size_t nLength = pSlash ? pSlash - pCuePath + 1 : 0;
+    m_pDirectory = new char[nLength + 1];
+    memcpy(m_pDirectory, pCuePath, nLength);
+    m_pDirectory[nLength] = '\0';
+
+    for (unsigned i = 0; i < PoolSize; i++)
+        m_Pool[i].nFile = -1;
+}
+
+CCueMultiFileDevice::~CCueMultiFileDevice(void) {
+    for (unsigned i = 0; i < PoolSize; i++)
+        CloseHandle(&m_Pool[i]);
+
+    for (unsigned i = 0; i < m_nFiles; i++) {
+        delete[] m_Files[i].pPath;
+        if (m_Files[i].pLinkMap != nullptr)
+            delete[] m_Files[i].pLinkMap;
+    }
+
+    delete[] m_pSourceCue;
+    delete[] m_pDirectory;
+    if (m_cue_str != nullptr)
+        delete[] m_cue_str;
+}
+
+unsigned CCueMultiFileDevice::CountFiles(const char* cue_str) {
+    CUEParser parser(cue_str);
+    const CUETrackInfo* trackInfo;
+    int nFiles = 0;
+    while ((trackInfo = parser.next_track()) != nullptr)
+        nFiles = trackInfo->file_index;
+
+    return nFiles;
+}
+
+boolean CCueMultiFileDevice::Init(void) {
+    // Collect the files in the order the tracks use them
+    CUEParser parser(m_pSourceCue);
+    const CUETrackInfo* trackInfo;
+    while ((trackInfo = parser.next_track()) != nullptr) {
+        if ((unsigned)trackInfo->file_index <= m_nFiles)
+            continue;
+
+        if (m_nFiles >= MaxFiles) {
+            LOGERR("More than %u files in cue sheet", MaxFiles);
+            return FALSE;
+        }
+
+        if (trackInfo->file_mode != CUEFile_BINARY)
+            LOGWARN("%s is not BINARY, it will be read as if it was", trackInfo->filename);
+
+        TFile& file = m_Files[m_nFiles++];
+        size_t nLength = strlen(m_pDirectory) + strlen(trackInfo->filename) + 1;
+        file.pPath = new char[nLength];
+        strcpy(file.pPath, m_pDirectory);
+        strcat(file.pPath, trackInfo->filename);
+        file.pLinkMap = nullptr;
+
+        FILINFO info;
+        FRESULT result = f_stat(file.pPath, &info);
+        if (result != FR_OK) {
+            LOGERR("Cannot find %s, err %d", file.pPath, result);
+            return FALSE;
+        }
+
+        file.ullStart = m_ullSize;
+        file.ullSize = info.fsize;
+        m_ullSize += info.fsize;
+    }
+
+    if (m_nFiles == 0) {
+        LOGERR("No files in cue sheet");
+        return FALSE;
+    }
+
+    LOGNOTE("%u files, %llu bytes", m_nFiles, m_ullSize);
+    return BuildCueSheet();
+}
+
+// Rewrites the cue sheet for the concatenated files. The parser works
+// out where each file starts on the disc from the size of the one before,
+// those positions become the INDEX times of a single FILE
+boolean CCueMultiFileDevice::BuildCueSheet(void) {
+    CString sheet;
+    CString line;
+    CString time;
+
+    sheet.Append("FILE \"image.bin\" BINARY\n");
+
+    CUEParser parser(m_pSourceCue);
+    const CUETrackInfo* trackInfo;
+    u64 ullPrevFileSize = 0;
+    while ((trackInfo = parser.next_track(ullPrevFileSize)) != nullptr) {
+        if (trackInfo->file_index < 1 || (unsigned)trackInfo->file_index > m_nFiles ||
+            (unsigned)trackInfo->track_mode >= sizeof(s_TrackModes) / sizeof(s_TrackModes[0])) {
+            LOGERR("Bad track %d in cue sheet", trackInfo->track_number);
+            return FALSE;
+        }
+        ullPrevFileSize = m_Files[trackInfo->file_index - 1].ullSize;
+
+        line.Format("  TRACK %02d %s\n", trackInfo->track_number, s_TrackModes[trackInfo->track_mode]);
+        sheet.Append(line);
+
+        // Times in a cue sheet leave out the unstored pregaps before them
+        u32 nUnstored = trackInfo->unstored_pregap_length;
+        u32 nSkipped = trackInfo->cumulative_offset;
+        if (nUnstored > 0) {
+            FormatMSF(&time, nUnstored);
+            line.Format("    PREGAP %s\n", (const char*)time);
+            sheet.Append(line);
+        }
+
+        if (trackInfo->track_start + nUnstored < trackInfo->data_start) {
+            // Stored pregap, INDEX 00 and INDEX 01 both in the file
+            FormatMSF(&time, trackInfo->track_start - nSkipped);
+            line.Format("    INDEX 00 %s\n", (const char*)time);
+            sheet.Append(line);
+
+            FormatMSF(&time, trackInfo->data_start - nSkipped);
+        } else {
+            FormatMSF(&time, trackInfo->track_start - nSkipped);
+        }
+        line.Format("    INDEX 01 %s\n", (const char*)time);
+        sheet.Append(line);
+    }
+
+    m_cue_str = new char[sheet.GetLength() + 1];
+    strcpy(m_cue_str, sheet);
+    LOGNOTE("Merged cue sheet %s", m_cue_str);
+    return TRUE;
+}
+
+// Index of the file holding the byte at ullOffset
+unsigned CCueMultiFileDevice::FindFile(u64 ullOffset) const {
+    unsigned nLow = 0;
+    unsigned nHigh = m_nFiles;
+    while (nHigh - nLow > 1) {
+        unsigned nMid = (nLow + nHigh) / 2;
+        if (m_Files[nMid].ullStart <= ullOffset)
+            nLow = nMid;
+        else
+            nHigh = nMid;
+    }
+    return nLow;
+}
+
+// An open FIL for a file and cursor. Each cursor gets its own FIL, like
+// CCueBinFileDevice, so the CD player and the gadget don't move each
+// other's file pointer. When the pool is full the least recently used
+// FIL is closed
+CCueMultiFileDevice::THandle* CCueMultiFileDevice::GetHandle(unsigned nFile, unsigned nCursor) {
+    assert(nFile < m_nFiles);
+
+    THandle* pVictim = &m_Pool[0];
+    for (unsigned i = 0; i < PoolSize; i++) {
+        THandle* pHandle = &m_Pool[i];
+        if (pHandle->nFile == (int)nFile && pHandle->nCursor == nCursor) {
+            pHandle->nLastUsed = ++m_nUseCounter;
+            return pHandle;
+        }
+
+        if (pVictim->nFile >= 0 && (pHandle->nFile < 0 || pHandle->nLastUsed < pVictim->nLastUsed))
+            pVictim = pHandle;
+    }
+
+    CloseHandle(pVictim);
+
+    TFile& file = m_Files[nFile];
+    FRESULT result = f_open(&pVictim->File, file.pPath, FA_READ);
+    if (result != FR_OK) {
+        LOGERR("Cannot open %s, err %d", file.pPath, result);
+        return nullptr;
+    }
+
+    if (file.pLinkMap == nullptr)
+        file.pLinkMap = createLinkMap(&pVictim->File);
+    else
+        pVictim->File.cltbl = file.pLinkMap;
+
+    pVictim->nFile = nFile;
+    pVictim->nCursor = nCursor;
+    pVictim->nLastUsed = ++m_nUseCounter;
+    return pVictim;
+}
+
+void CCueMultiFileDevice::CloseHandle(THandle* pHandle) {
+    if (pHandle->nFile < 0)
+        return;
+
+    f_close(&pHandle->File);
+    pHandle->File.cltbl = nullptr;
+    pHandle->nFile = -1;
+}
+
+int CCueMultiFileDevice::ReadAt(u64 nOffset, void* pBuffer, size_t nCount, unsigned nCursor) {
+    if (nCursor >= CursorCount) {
+        LOGERR("ReadAt bad cursor %u", nCursor);
+        return -1;
+    }
+
+    // A read may run across the end of one file into the next
+    u8* pDest = (u8*)pBuffer;
+    size_t nTotal = 0;
+    while (nCount > 0 && nOffset < m_ullSize) {
+        unsigned nFile = FindFile(nOffset);
+        const TFile& file = m_Files[nFile];
+
+        u64 ullFileOffset = nOffset - file.ullStart;
+        size_t nChunk = nCount;
+        if (ullFileOffset + nChunk > file.ullSize)
+            nChunk = file.ullSize - ullFileOffset;
+
+        THandle* pHandle = GetHandle(nFile, nCursor);
+        if (pHandle == nullptr)
+            return -1;
+
+        if (f_tell(&pHandle->File) != ullFileOffset) {
+            FRESULT result = f_lseek(&pHandle->File, ullFileOffset);
+            if (result != FR_OK) {
+                LOGERR("ReadAt seek to offset %llu in %s is not ok, err %d", ullFileOffset, file.pPath, result);
+                return -1;
+            }
+        }
+
+        UINT nBytesRead = 0;
+        FRESULT result = f_read(&pHandle->File, pDest, nChunk, &nBytesRead);
+        if (result != FR_OK) {
+            LOGERR("ReadAt failed to read %u bytes from %s, err %d", (unsigned)nChunk, file.pPath, result);
+            return -1;
+        }
+
+        nTotal += nBytesRead;
+        if (nBytesRead < nChunk)
+            break;
+
+        pDest += nBytesRead;
+        nOffset += nBytesRead;
+        nCount -= nBytesRead;
+    }
+
+    return nTotal;
+}
+
+int CCueMultiFileDevice::Read(void* pBuffer, size_t nCount) {
+    int nBytesRead = ReadAt(m_ullPosition, pBuffer, nCount, CursorData);
+    if (nBytesRead > 0)
+        m_ullPosition += nBytesRead;
+    return nBytesRead;
+}
+
+int CCueMultiFileDevice::Write(const void* pBuffer, size_t nCount) {
+    // Read-only device
+    return -1;
+}
+
+u64 CCueMultiFileDevice::Seek(u64 ullOffset) {
+    m_ullPosition = ullOffset;
+    return ullOffset;
+}
+
+u64 CCueMultiFileDevice::GetSize(void) const {
+    return m_ullSize;
+}
+
+u64 CCueMultiFileDevice::Tell() const {
+    return m_ullPosition;
+}
+
+const char* CCueMultiFileDevice::GetCueSheet() const {
+    return m_cue_str;
+}
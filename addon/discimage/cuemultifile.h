@@ -0,0 +1,86 @@
+//
+// A CDevice for cue sheets that reference one file per track
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _CUEMULTIFILE_H
+#define _CUEMULTIFILE_H
+
+#include <circle/types.h>
+#include <fatfs/ff.h>
+
+#include "cuedevice.h"
+
+class CCueMultiFileDevice : public ICueDevice {
+   public:
+    /// \param cue_str Cue sheet with more than one FILE, copied
+    /// \param pCuePath Path of the cue sheet, FILE names are relative to it
+    CCueMultiFileDevice(const char* cue_str, const char* pCuePath);
+    ~CCueMultiFileDevice(void);
+
+    /// \brief Find the referenced files and build the merged cue sheet
+    /// \return FALSE if a file is missing or the sheet is unusable
+    boolean Init(void);
+
+    int Read(void* pBuffer, size_t nCount);
+    int ReadAt(u64 nOffset, void* pBuffer, size_t nCount, unsigned nCursor = CursorData);
+    int Write(const void* pBuffer, size_t nCount);
+    u64 Seek(u64 ullOffset);
+    u64 GetSize(void) const;
+    u64 Tell() const;
+    const char* GetCueSheet() const;
+
+    /// \return Number of FILEs in a cue sheet
+    static unsigned CountFiles(const char* cue_str);
+
+   private:
+    struct TFile {
+        char* pPath;
+        u64 ullStart;      // offset of the file in the device
+        u64 ullSize;
+        DWORD* pLinkMap;   // built on first open, kept across reopens
+    };
+
+    struct THandle {
+        FIL File;
+        int nFile;         // -1 if closed
+        unsigned nCursor;
+        unsigned nLastUsed;
+    };
+
+    boolean BuildCueSheet(void);
+    unsigned FindFile(u64 ullOffset) const;
+    THandle* GetHandle(unsigned nFile, unsigned nCursor);
+    void CloseHandle(THandle* pHandle);
+
+   private:
+    static const unsigned MaxFiles = 99;  // one per track at most
+    static const unsigned PoolSize = 4;   // open FILs, across all cursors
+
+    char* m_pSourceCue;
+    char* m_pDirectory;
+    char* m_cue_str;
+
+    TFile m_Files[MaxFiles];
+    unsigned m_nFiles;
+    u64 m_ullSize;
+    u64 m_ullPosition;  // for Read() and Seek()
+
+    THandle m_Pool[PoolSize];
+    unsigned m_nUseCounter;
+};
+
+#endif
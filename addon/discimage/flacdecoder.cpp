@@ -0,0 +1,325 @@
+//
+// Decoder for FLAC frames holding 16 bit stereo, as on an audio CD
+//
+// CHD images made by chdman compress audio hunks with FLAC. Each hunk is
+// a run of bare FLAC frames, without the "fLaC" marker or STREAMINFO,
+// so only 44.1kHz 16 bit stereo is handled and anything else in a frame
+// header is treated as corruption. Frame CRCs aren't checked, the hunk
+// CRC covers the decoded data.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "flacdecoder.h"
+
+#include <assert.h>
+#include <circle/util.h>
+
+#define FRAME_SYNC              0x3FFE
+
+// Channel assignments
+#define CHANNELS_INDEPENDENT    1  // for two channels
+#define CHANNELS_LEFT_SIDE      8
+#define CHANNELS_RIGHT_SIDE     9
+#define CHANNELS_MID_SIDE       10
+
+// Subframe types
+#define SUBFRAME_CONSTANT       0
+#define SUBFRAME_VERBATIM       1
+#define SUBFRAME_FIXED          8   // to 12, order 0 to 4
+#define SUBFRAME_LPC            32  // to 63, order 1 to 32
+
+CFLACDecoder::CFLACDecoder(void) {
+    for (unsigned i = 0; i < Channels; i++)
+        m_pChannel[i] = new s32[MaxBlockSize];
+}
+
+CFLACDecoder::~CFLACDecoder(void) {
+    for (unsigned i = 0; i < Channels; i++)
+        delete[] m_pChannel[i];
+}
+
+int CFLACDecoder::Decode(const u8* pIn, size_t nInLength, u8* pOut, unsigned nSamples, boolean bBigEndian) {
+    assert(pIn != 0);
+    assert(pOut != 0);
+
+    CMSBBitReader reader(pIn, nInLength);
+    while (nSamples > 0) {
+        unsigned nBlockSize;
+        if (!DecodeFrame(&reader, &nBlockSize) || reader.Overflow())
+            return -1;
+
+        unsigned nCount = nBlockSize < nSamples ? nBlockSize : nSamples;
+        const s32* pLeft = m_pChannel[0];
+        const s32* pRight = m_pChannel[1];
+        for (unsigned i = 0; i < nCount; i++) {
+            u16 left = pLeft[i];
+            u16 right = pRight[i];
+            if (bBigEndian) {
+                pOut[0] = left >> 8;
+                pOut[1] = left;
+                pOut[2] = right >> 8;
+                pOut[3] = right;
+            } else {
+                pOut[0] = left;
+                pOut[1] = left >> 8;
+                pOut[2] = right;
+                pOut[3] = right >> 8;
+            }
+            pOut += 4;
+        }
+        nSamples -= nCount;
+    }
+
+    return reader.GetBytePosition();
+}
+
+boolean CFLACDecoder::DecodeFrame(CMSBBitReader* pReader, unsigned* pBlockSize) {
+    if (pReader->Read(14) != FRAME_SYNC || pReader->Read(1) != 0)
+        return FALSE;
+    pReader->Read(1);  // fixed or variable block size, the same to us
+
+    unsigned nBlockSizeCode = pReader->Read(4);
+    unsigned nSampleRateCode = pReader->Read(4);
+    unsigned nChannelCode = pReader->Read(4);
+    unsigned nSampleSizeCode = pReader->Read(3);
+    if (pReader->Read(1) != 0)
+        return FALSE;
+
+    // Frame or sample number, UTF-8 style. Only its length matters
+    u32 nFirst = pReader->Read(8);
+    if (nFirst & 0x80) {
+        unsigned nExtra = 0;
+        while (nExtra < 7 && (nFirst & (0x40 >> nExtra)))
+            nExtra++;
+        if (nExtra == 0 || nExtra > 6)
+            return FALSE;
+        while (nExtra--)
+            if ((pReader->Read(8) & 0xC0) != 0x80)
+                return FALSE;
+    }
+
+    unsigned nBlockSize;
+    if (nBlockSizeCode == 1)
+        nBlockSize = 192;
+    else if (nBlockSizeCode >= 2 && nBlockSizeCode <= 5)
+        nBlockSize = 576 << (nBlockSizeCode - 2);
+    else if (nBlockSizeCode == 6)
+        nBlockSize = pReader->Read(8) + 1;
+    else if (nBlockSizeCode == 7)
+        nBlockSize = pReader->Read(16) + 1;
+    else if (nBlockSizeCode >= 8)
+        nBlockSize = 256 << (nBlockSizeCode - 8);
+    else
+        return FALSE;
+
+    if (nBlockSize > MaxBlockSize)
+        return FALSE;
+
+    if (nSampleRateCode == 12)
+        pReader->Read(8);
+    else if (nSampleRateCode == 13 || nSampleRateCode == 14)
+        pReader->Read(16);
+    else if (nSampleRateCode == 15)
+        return FALSE;
+
+    // 0 means "as in STREAMINFO", which for CD audio is 16 bits
+    if (nSampleSizeCode != 0 && nSampleSizeCode != 4)
+        return FALSE;
+
+    pReader->Read(8);  // CRC-8 of the header
+
+    // The side channel needs one bit more
+    unsigned nSideChannel;
+    if (nChannelCode == CHANNELS_INDEPENDENT)
+        nSideChannel = Channels;
+    else if (nChannelCode == CHANNELS_LEFT_SIDE || nChannelCode == CHANNELS_MID_SIDE)
+        nSideChannel = 1;
+    else if (nChannelCode == CHANNELS_RIGHT_SIDE)
+        nSideChannel = 0;
+    else
+        return FALSE;
+
+    for (unsigned i = 0; i < Channels; i++) {
+        unsigned nBits = BitsPerSample + (i == nSideChannel ? 1 : 0);
+        if (!DecodeSubframe(pReader, m_pChannel[i], nBlockSize, nBits))
+            return FALSE;
+    }
+
+    pReader->Align();
+    pReader->Read(16);  // CRC-16 of the frame
+
+    s32* pLeft = m_pChannel[0];
+    s32* pRight = m_pChannel[1];
+    switch (nChannelCode) {
+        case CHANNELS_LEFT_SIDE:
+            for (unsigned i = 0; i < nBlockSize; i++)
+                pRight[i] = pLeft[i] - pRight[i];
+            break;
+
+        case CHANNELS_RIGHT_SIDE:
+            for (unsigned i = 0; i < nBlockSize; i++)
+                pLeft[i] += pRight[i];
+            break;
+
+        case CHANNELS_MID_SIDE:
+            for (unsigned i = 0; i < nBlockSize; i++) {
+                s32 side = pRight[i];
+                s32 mid = (pLeft[i] << 1) | (side & 1);
+                pLeft[i] = (mid + side) >> 1;
+                pRight[i] = (mid - side) >> 1;
+            }
+            break;
+    }
+
+    *pBlockSize = nBlockSize;
+    return TRUE;
+}
+
+boolean CFLACDecoder::DecodeSubframe(CMSBBitReader* pReader, s32* pSamples, unsigned nBlockSize, unsigned nBits) {
+    if (pReader->Read(1) != 0)
+        return FALSE;
+    unsigned nType = pReader->Read(6);
+
+    // Wasted bits are low bits that are zero in every sample
+    unsigned nWasted = 0;
+    if (pReader->Read(1)) {
+        nWasted = pReader->ReadUnary() + 1;
+        if (nWasted >= nBits)
+            return FALSE;
+        nBits -= nWasted;
+    }
+
+    if (nType == SUBFRAME_CONSTANT) {
+        s32 value = pReader->ReadSigned(nBits);
+        for (unsigned i = 0; i < nBlockSize; i++)
+            pSamples[i] = value;
+    } else if (nType == SUBFRAME_VERBATIM) {
+        for (unsigned i = 0; i < nBlockSize; i++)
+            pSamples[i] = pReader->ReadSigned(nBits);
+    } else if (nType >= SUBFRAME_FIXED && nType <= SUBFRAME_FIXED + 4) {
+        unsigned nOrder = nType - SUBFRAME_FIXED;
+        if (nOrder > nBlockSize)
+            return FALSE;
+        for (unsigned i = 0; i < nOrder; i++)
+            pSamples[i] = pReader->ReadSigned(nBits);
+        if (!DecodeResidual(pReader, pSamples, nBlockSize, nOrder))
+            return FALSE;
+        RestoreFixed(pSamples, nBlockSize, nOrder);
+    } else if (nType >= SUBFRAME_LPC) {
+        unsigned nOrder = nType - SUBFRAME_LPC + 1;
+        if (nOrder > nBlockSize)
+            return FALSE;
+        for (unsigned i = 0; i < nOrder; i++)
+            pSamples[i] = pReader->ReadSigned(nBits);
+
+        unsigned nPrecision = pReader->Read(4) + 1;
+        if (nPrecision == 16)
+            return FALSE;
+        s32 nShift = pReader->ReadSigned(5);
+        if (nShift < 0)
+            return FALSE;
+
+        s32 coefficients[MaxLPCOrder];
+        for (unsigned i = 0; i < nOrder; i++)
+            coefficients[i] = pReader->ReadSigned(nPrecision);
+
+        if (!DecodeResidual(pReader, pSamples, nBlockSize, nOrder))
+            return FALSE;
+        RestoreLPC(pSamples, nBlockSize, coefficients, nOrder, nShift);
+    } else {
+        return FALSE;
+    }
+
+    if (nWasted > 0)
+        for (unsigned i = 0; i < nBlockSize; i++)
+            pSamples[i] <<= nWasted;
+
+    return TRUE;
+}
+
+// Rice coded residual, in 2^order partitions each with its own parameter.
+// The first partition is short by the predictor's warm up samples
+boolean CFLACDecoder::DecodeResidual(CMSBBitReader* pReader, s32* pSamples, unsigned nBlockSize, unsigned nOrder) {
+    unsigned nMethod = pReader->Read(2);
+    if (nMethod > 1)
+        return FALSE;
+    unsigned nParameterBits = nMethod == 0 ? 4 : 5;
+    unsigned nEscape = (1 << nParameterBits) - 1;
+
+    unsigned nPartitionOrder = pReader->Read(4);
+    unsigned nPartitionSize = nBlockSize >> nPartitionOrder;
+    if ((nPartitionSize << nPartitionOrder) != nBlockSize || nPartitionSize < nOrder)
+        return FALSE;
+
+    s32* pSample = pSamples + nOrder;
+    for (unsigned partition = 0; partition < (1U << nPartitionOrder); partition++) {
+        unsigned nCount = partition == 0 ? nPartitionSize - nOrder : nPartitionSize;
+        unsigned nParameter = pReader->Read(nParameterBits);
+
+        if (nParameter == nEscape) {
+            unsigned nRawBits = pReader->Read(5);
+            for (unsigned i = 0; i < nCount; i++)
+                *pSample++ = pReader->ReadSigned(nRawBits);
+            continue;
+        }
+
+        for (unsigned i = 0; i < nCount; i++) {
+            u32 value = (pReader->ReadUnary() << nParameter) | pReader->Read(nParameter);
+            *pSample++ = (s32)(value >> 1) ^ -(s32)(value & 1);
+        }
+
+        if (pReader->Overflow())
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+void CFLACDecoder::RestoreFixed(s32* pSamples, unsigned nBlockSize, unsigned nOrder) {
+    s32* s = pSamples;
+    switch (nOrder) {
+        case 1:
+            for (unsigned i = 1; i < nBlockSize; i++)
+                s[i] += s[i - 1];
+            break;
+
+        case 2:
+            for (unsigned i = 2; i < nBlockSize; i++)
+                s[i] += 2 * s[i - 1] - s[i - 2];
+            break;
+
+        case 3:
+            for (unsigned i = 3; i < nBlockSize; i++)
+                s[i] += 3 * (s[i - 1] - s[i - 2]) + s[i - 3];
+            break;
+
+        case 4:
+            for (unsigned i = 4; i < nBlockSize; i++)
+                s[i] += 4 * (s[i - 1] + s[i - 3]) - 6 * s[i - 2] - s[i - 4];
+            break;
+    }
+}
+
+void CFLACDecoder::RestoreLPC(s32* pSamples, unsigned nBlockSize, const s32* pCoefficients,
+                              unsigned nOrder, unsigned nShift) {
+    for (unsigned i = nOrder; i < nBlockSize; i++) {
+        s64 sum = 0;
+        const s32* pHistory = pSamples + i;
+        for (unsigned j = 0; j < nOrder; j++)
+            sum += (s64)pCoefficients[j] * *--pHistory;
+        pSamples[i] += (s32)(sum >> nShift);
+    }
+}
@@ -0,0 +1,55 @@
+//
+// Decoder for FLAC frames holding 16 bit stereo, as on an audio CD
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _FLACDECODER_H
+#define _FLACDECODER_H
+
+#include <circle/types.h>
+
+#include "bitreader.h"
+
+class CFLACDecoder {
+   public:
+    CFLACDecoder(void);
+    ~CFLACDecoder(void);
+
+    /// \brief Decode frames, with no stream header before them, until
+    ///        nSamples samples per channel are written
+    /// \param pOut nSamples * 4 bytes, left and right interleaved
+    /// \param bBigEndian Write the samples big endian rather than little
+    /// \return Number of bytes of pIn used, or -1 if the frames are bad
+    int Decode(const u8* pIn, size_t nInLength, u8* pOut, unsigned nSamples, boolean bBigEndian);
+
+   private:
+    static const unsigned Channels = 2;
+    static const unsigned BitsPerSample = 16;
+    static const unsigned MaxBlockSize = 16384;  // the FLAC subset limit
+    static const unsigned MaxLPCOrder = 32;
+
+    boolean DecodeFrame(CMSBBitReader* pReader, unsigned* pBlockSize);
+    boolean DecodeSubframe(CMSBBitReader* pReader, s32* pSamples, unsigned nBlockSize, unsigned nBits);
+    boolean DecodeResidual(CMSBBitReader* pReader, s32* pSamples, unsigned nBlockSize, unsigned nOrder);
+    static void RestoreFixed(s32* pSamples, unsigned nBlockSize, unsigned nOrder);
+    static void RestoreLPC(s32* pSamples, unsigned nBlockSize, const s32* pCoefficients,
+                           unsigned nOrder, unsigned nShift);
+
+   private:
+    s32* m_pChannel[Channels];  // MaxBlockSize samples each
+};
+
+#endif
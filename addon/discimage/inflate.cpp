@@ -0,0 +1,360 @@
+//
+// Decoder for raw deflate streams (RFC 1951), as zlib writes them
+//
+// CHD images compress most hunks with deflate. The whole hunk is decoded
+// into its buffer in one call, so there is no sliding window to keep,
+// matches copy from earlier in the output.
+//
+// Huffman codes of up to FastBits bits, which is nearly all of them, are
+// looked up in one step. Longer codes fall back to walking the canonical
+// code one bit at a time, as in zlib's puff.c.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "inflate.h"
+
+#include <assert.h>
+#include <circle/util.h>
+
+// Deflate packs bits least significant first
+struct CInflater::TState {
+    const u8* pIn;
+    size_t nInLength;
+    size_t nInPosition;
+    u64 ullBits;
+    unsigned nBitCount;
+
+    u8* pOut;
+    size_t nOutLength;
+    size_t nOutPosition;
+
+    void Refill(void) {
+        while (nBitCount <= 56) {
+            if (nInPosition < nInLength)
+                ullBits |= (u64)pIn[nInPosition] << nBitCount;
+            nInPosition++;  // past the end reads zeros, Overrun() catches it
+            nBitCount += 8;
+        }
+    }
+
+    u32 Peek(unsigned nCount) {
+        if (nBitCount < nCount)
+            Refill();
+        return (u32)(ullBits & ((1ULL << nCount) - 1));
+    }
+
+    void Remove(unsigned nCount) {
+        ullBits >>= nCount;
+        nBitCount -= nCount;
+    }
+
+    u32 Read(unsigned nCount) {
+        u32 nValue = Peek(nCount);
+        Remove(nCount);
+        return nValue;
+    }
+
+    boolean Overrun(void) const {
+        return nInPosition - nBitCount / 8 > nInLength;
+    }
+};
+
+static const u16 s_LengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const u8 s_LengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const u16 s_DistBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static const u8 s_DistExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Order the code length code lengths are sent in
+static const u8 s_CodeLengthOrder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+CInflater::CInflater(void) {
+    u8 lengths[MaxLitLenCodes];
+    unsigned i = 0;
+    for (; i < 144; i++)
+        lengths[i] = 8;
+    for (; i < 256; i++)
+        lengths[i] = 9;
+    for (; i < 280; i++)
+        lengths[i] = 7;
+    for (; i < MaxLitLenCodes; i++)
+        lengths[i] = 8;
+    BuildHuffman(&m_FixedLitLen, lengths, MaxLitLenCodes);
+
+    for (i = 0; i < 30; i++)
+        lengths[i] = 5;
+    BuildHuffman(&m_FixedDist, lengths, 30);
+}
+
+int CInflater::Inflate(const u8* pIn, size_t nInLength, u8* pOut, size_t nOutLength) {
+    assert(pIn != 0);
+    assert(pOut != 0);
+
+    TState state;
+    state.pIn = pIn;
+    state.nInLength = nInLength;
+    state.nInPosition = 0;
+    state.ullBits = 0;
+    state.nBitCount = 0;
+    state.pOut = pOut;
+    state.nOutLength = nOutLength;
+    state.nOutPosition = 0;
+
+    boolean bLast;
+    do {
+        bLast = state.Read(1);
+        boolean bOK;
+        switch (state.Read(2)) {
+            case 0:
+                bOK = InflateStored(&state);
+                break;
+
+            case 1:
+                bOK = InflateBlock(&state, &m_FixedLitLen, &m_FixedDist);
+                break;
+
+            case 2:
+                bOK = DecodeDynamicTables(&state, &m_LitLen, &m_Dist) &&
+                      InflateBlock(&state, &m_LitLen, &m_Dist);
+                break;
+
+            default:
+                bOK = FALSE;
+                break;
+        }
+
+        if (!bOK || state.Overrun())
+            return -1;
+    } while (!bLast);
+
+    return state.nOutPosition;
+}
+
+// Canonical codes from code lengths. Incomplete codes are allowed, a
+// missing code then fails in Decode()
+boolean CInflater::BuildHuffman(THuffman* pHuffman, const u8* pLengths, unsigned nCodes) {
+    memset(pHuffman->Count, 0, sizeof(pHuffman->Count));
+    for (unsigned i = 0; i < nCodes; i++)
+        pHuffman->Count[pLengths[i]]++;
+
+    // Over-subscribed code lengths can't be decoded
+    int left = 1;
+    for (unsigned len = 1; len <= MaxBits; len++) {
+        left <<= 1;
+        left -= pHuffman->Count[len];
+        if (left < 0)
+            return FALSE;
+    }
+
+    u16 offsets[MaxBits + 2];
+    offsets[1] = 0;
+    for (unsigned len = 1; len <= MaxBits; len++)
+        offsets[len + 1] = offsets[len] + pHuffman->Count[len];
+    for (unsigned i = 0; i < nCodes; i++)
+        if (pLengths[i] != 0)
+            pHuffman->Symbol[offsets[pLengths[i]]++] = i;
+
+    // Short codes go in the lookup table, bit reversed because deflate
+    // sends codes most significant bit first into an LSB first stream
+    memset(pHuffman->Fast, 0, sizeof(pHuffman->Fast));
+    unsigned code = 0;
+    unsigned index = 0;
+    for (unsigned len = 1; len <= FastBits; len++) {
+        for (unsigned i = 0; i < pHuffman->Count[len]; i++) {
+            unsigned reversed = 0;
+            for (unsigned bit = 0; bit < len; bit++)
+                reversed |= ((code >> bit) & 1) << (len - 1 - bit);
+
+            u16 entry = len << 9 | pHuffman->Symbol[index++];
+            for (unsigned fill = reversed; fill < (1U << FastBits); fill += 1U << len)
+                pHuffman->Fast[fill] = entry;
+            code++;
+        }
+        code <<= 1;
+    }
+
+    return TRUE;
+}
+
+int CInflater::Decode(TState* pState, const THuffman* pHuffman) {
+    u16 entry = pHuffman->Fast[pState->Peek(FastBits)];
+    if (entry != 0) {
+        pState->Remove(entry >> 9);
+        return entry & 0x1FF;
+    }
+
+    // A longer code, walk it bit by bit
+    u32 bits = pState->Peek(MaxBits);
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (unsigned len = 1; len <= MaxBits; len++) {
+        code |= (bits >> (len - 1)) & 1;
+        int count = pHuffman->Count[len];
+        if (code - count < first) {
+            pState->Remove(len);
+            return pHuffman->Symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+
+    return -1;
+}
+
+boolean CInflater::DecodeDynamicTables(TState* pState, THuffman* pLitLen, THuffman* pDist) {
+    unsigned nLitLen = pState->Read(5) + 257;
+    unsigned nDist = pState->Read(5) + 1;
+    unsigned nCodeLength = pState->Read(4) + 4;
+    if (nLitLen > 286 || nDist > 30)
+        return FALSE;
+
+    u8 lengths[MaxLitLenCodes + MaxDistCodes];
+    memset(lengths, 0, 19);
+    for (unsigned i = 0; i < nCodeLength; i++)
+        lengths[s_CodeLengthOrder[i]] = pState->Read(3);
+
+    // The code length code is decoded with the literal/length table,
+    // which gets rebuilt below anyway
+    if (!BuildHuffman(pLitLen, lengths, 19))
+        return FALSE;
+
+    unsigned i = 0;
+    while (i < nLitLen + nDist) {
+        int symbol = Decode(pState, pLitLen);
+        if (symbol < 0)
+            return FALSE;
+
+        if (symbol < 16) {
+            lengths[i++] = symbol;
+            continue;
+        }
+
+        u8 repeat = 0;
+        unsigned count;
+        if (symbol == 16) {
+            if (i == 0)
+                return FALSE;
+            repeat = lengths[i - 1];
+            count = 3 + pState->Read(2);
+        } else if (symbol == 17) {
+            count = 3 + pState->Read(3);
+        } else {
+            count = 11 + pState->Read(7);
+        }
+
+        if (i + count > nLitLen + nDist)
+            return FALSE;
+        while (count--)
+            lengths[i++] = repeat;
+    }
+
+    // Without an end of block code the block can't end
+    if (lengths[256] == 0)
+        return FALSE;
+
+    return BuildHuffman(pLitLen, lengths, nLitLen) &&
+           BuildHuffman(pDist, lengths + nLitLen, nDist);
+}
+
+boolean CInflater::InflateBlock(TState* pState, const THuffman* pLitLen, const THuffman* pDist) {
+    u8* pOut = pState->pOut;
+    size_t nOutLength = pState->nOutLength;
+    size_t nPosition = pState->nOutPosition;
+
+    for (;;) {
+        int symbol = Decode(pState, pLitLen);
+        if (symbol < 0)
+            return FALSE;
+
+        if (symbol < 256) {
+            if (nPosition >= nOutLength)
+                return FALSE;
+            pOut[nPosition++] = symbol;
+            continue;
+        }
+
+        if (symbol == 256)
+            break;
+
+        symbol -= 257;
+        if (symbol >= 29)
+            return FALSE;
+        unsigned length = s_LengthBase[symbol] + pState->Read(s_LengthExtra[symbol]);
+
+        symbol = Decode(pState, pDist);
+        if (symbol < 0 || symbol >= 30)
+            return FALSE;
+        size_t distance = s_DistBase[symbol] + pState->Read(s_DistExtra[symbol]);
+
+        if (distance > nPosition || length > nOutLength - nPosition)
+            return FALSE;
+
+        // Overlapping copies repeat the last distance bytes, so byte by byte
+        const u8* pFrom = pOut + nPosition - distance;
+        u8* pTo = pOut + nPosition;
+        nPosition += length;
+        while (length--)
+            *pTo++ = *pFrom++;
+
+        if (pState->Overrun())
+            return FALSE;
+    }
+
+    pState->nOutPosition = nPosition;
+    return TRUE;
+}
+
+boolean CInflater::InflateStored(TState* pState) {
+    // Discard the rest of the byte, then LEN and its complement
+    pState->Remove(pState->nBitCount & 7);
+    unsigned length = pState->Read(16);
+    if ((pState->Read(16) ^ 0xFFFF) != length)
+        return FALSE;
+
+    if (length > pState->nOutLength - pState->nOutPosition)
+        return FALSE;
+
+    // Drain whatever is still in the bit buffer before copying directly
+    u8* pTo = pState->pOut + pState->nOutPosition;
+    pState->nOutPosition += length;
+    while (length > 0 && pState->nBitCount >= 8) {
+        *pTo++ = pState->Read(8);
+        length--;
+    }
+
+    if (length == 0)
+        return TRUE;
+
+    // The bit buffer is empty now, so nInPosition is the next byte
+    if (pState->nInPosition > pState->nInLength ||
+        length > pState->nInLength - pState->nInPosition)
+        return FALSE;
+    memcpy(pTo, pState->pIn + pState->nInPosition, length);
+    pState->nInPosition += length;
+    return TRUE;
+}
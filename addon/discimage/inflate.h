@@ -0,0 +1,60 @@
+//
+// Decoder for raw deflate streams (RFC 1951), as zlib writes them
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _INFLATE_H
+#define _INFLATE_H
+
+#include <circle/types.h>
+
+class CInflater {
+   public:
+    CInflater(void);
+
+    /// \brief Decode a whole stream in one go, the output is the window
+    /// \return Number of bytes written, or -1 if the stream is bad or
+    ///         doesn't fit in nOutLength
+    int Inflate(const u8* pIn, size_t nInLength, u8* pOut, size_t nOutLength);
+
+   private:
+    static const unsigned MaxBits = 15;
+    static const unsigned FastBits = 10;
+    static const unsigned MaxLitLenCodes = 288;
+    static const unsigned MaxDistCodes = 32;
+
+    struct THuffman {
+        u16 Count[MaxBits + 1];         // number of codes of each length
+        u16 Symbol[MaxLitLenCodes];     // symbols in canonical order
+        u16 Fast[1 << FastBits];        // length << 9 | symbol, 0 for longer codes
+    };
+
+    struct TState;
+
+    static boolean BuildHuffman(THuffman* pHuffman, const u8* pLengths, unsigned nCodes);
+    static int Decode(TState* pState, const THuffman* pHuffman);
+    static boolean DecodeDynamicTables(TState* pState, THuffman* pLitLen, THuffman* pDist);
+    static boolean InflateBlock(TState* pState, const THuffman* pLitLen, const THuffman* pDist);
+    static boolean InflateStored(TState* pState);
+
+   private:
+    THuffman m_FixedLitLen;
+    THuffman m_FixedDist;
+    THuffman m_LitLen;
+    THuffman m_Dist;
+};
+
+#endif
@@ -0,0 +1,213 @@
+//
+// A pinned cache for the ISO9660 metadata sectors of a CD image
+//
+// During the mount and on every directory listing, hosts read the volume
+// descriptors, the path tables and the directory extents over and over.
+// These are found and read once when an image is mounted, and the gadget
+// answers reads of those sectors from RAM.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "isometadatacache.h"
+
+#include <assert.h>
+#include <circle/logger.h>
+#include <circle/util.h>
+
+LOGMODULE("isometadata");
+
+// ISO9660 stores most numbers in both byte orders, we use the little endian half
+static u32 GetLE32(const u8* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+CIsoMetadataCache::CIsoMetadataCache(void)
+    : m_pDevice(nullptr),
+      m_nBlockSize(0),
+      m_nSkipBytes(0),
+      m_nExtents(0),
+      m_nSectors(0),
+      m_nHits(0) {
+}
+
+CIsoMetadataCache::~CIsoMetadataCache(void) {
+    Clear();
+}
+
+void CIsoMetadataCache::Clear(void) {
+    for (unsigned i = 0; i < m_nExtents; i++)
+        delete[] m_Extents[i].pData;
+    m_nExtents = 0;
+    m_nSectors = 0;
+}
+
+boolean CIsoMetadataCache::Build(ICueDevice* pDevice, u32 nBlockSize, u32 nSkipBytes) {
+    Clear();
+    m_pDevice = pDevice;
+    m_nBlockSize = nBlockSize;
+    m_nSkipBytes = nSkipBytes;
+
+    if (!m_pDevice || nBlockSize == 0 || nSkipBytes + LogicalBlockSize > nBlockSize)
+        return FALSE;
+
+    // Find out how many volume descriptors there are, starting at LBA 16
+    u8* pSector = new u8[nBlockSize];
+    u32 nDescriptors = 0;
+    while (nDescriptors < MaxDescriptors) {
+        u32 lba = 16 + nDescriptors;
+        int nRead = m_pDevice->ReadAt((u64)lba * nBlockSize, pSector, nBlockSize, ICueDevice::CursorData);
+        if (nRead != (int)nBlockSize)
+            break;
+
+        const u8* pDescriptor = pSector + nSkipBytes;
+        if (memcmp(pDescriptor + 1, "CD001", 5) != 0)
+            break;
+
+        nDescriptors++;
+        if (pDescriptor[0] == 255)  // terminator
+            break;
+    }
+    delete[] pSector;
+
+    if (nDescriptors == 0) {
+        LOGNOTE("No ISO9660 file system, nothing pinned");
+        return FALSE;
+    }
+
+    if (!Pin(16, nDescriptors))
+        return FALSE;
+
+    // Path tables and root directories of the primary and any supplementary
+    // (Joliet) volume first, they are read on every mount
+    for (u32 i = 0; i < nDescriptors; i++) {
+        const u8* pDescriptor = GetUserData(16 + i);
+        if (pDescriptor[0] != 1 && pDescriptor[0] != 2)
+            continue;
+
+        u32 nPathTableSize = GetLE32(pDescriptor + 132);
+        u32 nPathSectors = (nPathTableSize + LogicalBlockSize - 1) / LogicalBlockSize;
+        Pin(GetLE32(pDescriptor + 140), nPathSectors);  // type L path table
+
+        // Type M path table, its location is big endian
+        const u8* p = pDescriptor + 148;
+        Pin((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3], nPathSectors);
+
+        const u8* pRoot = pDescriptor + 156;
+        Pin(GetLE32(pRoot + 2), (GetLE32(pRoot + 10) + LogicalBlockSize - 1) / LogicalBlockSize);
+    }
+
+    // Then the other directories, in path table order, while there is room
+    for (u32 i = 0; i < nDescriptors; i++) {
+        const u8* pDescriptor = GetUserData(16 + i);
+        if (pDescriptor[0] == 1 || pDescriptor[0] == 2)
+            PinPathTableDirectories(GetLE32(pDescriptor + 140), GetLE32(pDescriptor + 132));
+    }
+
+    LOGNOTE("Pinned %u metadata sectors in %u extents", m_nSectors, m_nExtents);
+    return TRUE;
+}
+
+// Walks a pinned type L path table and pins the directory of each entry
+void CIsoMetadataCache::PinPathTableDirectories(u32 lba, u32 nSize) {
+    u32 nOffset = 0;
+    while (nOffset + 8 <= nSize && m_nSectors < MaxSectors) {
+        // An entry may straddle a sector boundary, and the sectors of a
+        // raw image aren't contiguous, so fetch each byte through GetUserData
+        u8 Entry[8];
+        for (unsigned i = 0; i < sizeof Entry; i++) {
+            u32 nPos = nOffset + i;
+            const u8* pData = GetUserData(lba + nPos / LogicalBlockSize);
+            if (!pData)
+                return;
+            Entry[i] = pData[nPos % LogicalBlockSize];
+        }
+
+        u8 nNameLength = Entry[0];
+        if (nNameLength == 0)
+            break;
+
+        PinDirectory(GetLE32(Entry + 2));
+        nOffset += 8 + nNameLength + (nNameLength & 1);
+    }
+}
+
+// The size of a directory is in its own "." record
+void CIsoMetadataCache::PinDirectory(u32 lba) {
+    if (GetUserData(lba))
+        return;
+
+    u8* pSector = new u8[m_nBlockSize];
+    int nRead = m_pDevice->ReadAt((u64)lba * m_nBlockSize, pSector, m_nBlockSize, ICueDevice::CursorData);
+    if (nRead == (int)m_nBlockSize) {
+        const u8* pRecord = pSector + m_nSkipBytes;
+        u32 nSectors = (GetLE32(pRecord + 10) + LogicalBlockSize - 1) / LogicalBlockSize;
+        if (nSectors > 0 && nSectors <= MaxSectors - m_nSectors)
+            Pin(lba, nSectors);
+    }
+    delete[] pSector;
+}
+
+boolean CIsoMetadataCache::Pin(u32 lba, u32 nBlocks) {
+    if (nBlocks == 0)
+        return TRUE;
+
+    // Already there?
+    if (GetUserData(lba) && GetUserData(lba + nBlocks - 1))
+        return TRUE;
+
+    if (m_nExtents >= MaxExtents || nBlocks > MaxSectors - m_nSectors)
+        return FALSE;
+
+    size_t nSize = nBlocks * m_nBlockSize;
+    u8* pData = new u8[nSize];
+    int nRead = m_pDevice->ReadAt((u64)lba * m_nBlockSize, pData, nSize, ICueDevice::CursorData);
+    if (nRead != (int)nSize) {
+        LOGWARN("Cannot pin %u sectors at %u", nBlocks, lba);
+        delete[] pData;
+        return FALSE;
+    }
+
+    TExtent* pExtent = &m_Extents[m_nExtents++];
+    pExtent->lba = lba;
+    pExtent->count = nBlocks;
+    pExtent->pData = pData;
+    m_nSectors += nBlocks;
+    return TRUE;
+}
+
+const u8* CIsoMetadataCache::GetUserData(u32 lba) const {
+    for (unsigned i = 0; i < m_nExtents; i++) {
+        const TExtent* pExtent = &m_Extents[i];
+        if (lba >= pExtent->lba && lba < pExtent->lba + pExtent->count)
+            return pExtent->pData + (lba - pExtent->lba) * m_nBlockSize + m_nSkipBytes;
+    }
+    return nullptr;
+}
+
+boolean CIsoMetadataCache::Read(u32 lba, u32 nBlocks, u32 nBlockSize, u8* pBuffer) {
+    if (nBlockSize != m_nBlockSize || nBlocks == 0)
+        return FALSE;
+
+    for (unsigned i = 0; i < m_nExtents; i++) {
+        const TExtent* pExtent = &m_Extents[i];
+        if (lba >= pExtent->lba && lba + nBlocks <= pExtent->lba + pExtent->count) {
+            memcpy(pBuffer, pExtent->pData + (lba - pExtent->lba) * m_nBlockSize, nBlocks * m_nBlockSize);
+            m_nHits += nBlocks;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
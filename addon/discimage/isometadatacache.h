@@ -0,0 +1,78 @@
+//
+// A pinned cache for the ISO9660 metadata sectors of a CD image
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _ISOMETADATACACHE_H
+#define _ISOMETADATACACHE_H
+
+#include <circle/types.h>
+
+#include "cuedevice.h"
+
+class CIsoMetadataCache {
+   public:
+    CIsoMetadataCache(void);
+    ~CIsoMetadataCache(void);
+
+    /// \brief Find the volume descriptors, path tables and directories of
+    ///        the ISO9660 file system on the image and read them into RAM
+    /// \param pDevice Image to read from
+    /// \param nBlockSize Bytes per sector in the image (2048 or 2352)
+    /// \param nSkipBytes Offset of the user data in each image sector
+    /// \return FALSE if there is no ISO9660 file system
+    boolean Build(ICueDevice* pDevice, u32 nBlockSize, u32 nSkipBytes);
+
+    /// \brief Copy nBlocks image sectors starting at lba, if all are pinned
+    /// \return FALSE if any of them isn't pinned
+    boolean Read(u32 lba, u32 nBlocks, u32 nBlockSize, u8* pBuffer);
+
+    /// \return Number of pinned sectors
+    unsigned GetSectors(void) const { return m_nSectors; }
+
+    /// \return Sectors served from the cache
+    u64 GetHits(void) const { return m_nHits; }
+
+   private:
+    void Clear(void);
+    boolean Pin(u32 lba, u32 nBlocks);
+    const u8* GetUserData(u32 lba) const;
+    void PinDirectory(u32 lba);
+    void PinPathTableDirectories(u32 lba, u32 nSize);
+
+   private:
+    static const unsigned MaxExtents = 64;
+    static const unsigned MaxSectors = 128;       // the whole budget, about 300KB for raw images
+    static const unsigned MaxDescriptors = 16;    // volume descriptors looked at from LBA 16
+    static const unsigned LogicalBlockSize = 2048;
+
+    struct TExtent {
+        u32 lba;
+        u32 count;
+        u8* pData;
+    };
+
+    ICueDevice* m_pDevice;
+    u32 m_nBlockSize;
+    u32 m_nSkipBytes;
+
+    TExtent m_Extents[MaxExtents];
+    unsigned m_nExtents;
+    unsigned m_nSectors;
+    u64 m_nHits;
+};
+
+#endif
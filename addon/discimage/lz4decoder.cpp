@@ -0,0 +1,96 @@
+//
+// Decoder for LZ4 blocks, without the LZ4 frame around them
+//
+// A block is a series of sequences, each a token byte holding the number
+// of literals and the match length, the literals, then a two byte little
+// endian offset back into the output. Lengths of 15 carry on in further
+// bytes, added up until one is below 255. The last sequence has literals
+// only. There is no entropy coding, which is what makes LZ4 several times
+// faster than inflate on a small CPU.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "lz4decoder.h"
+
+#include <circle/util.h>
+
+#define LZ4_MIN_MATCH   4
+
+// Adds up a length that carries on past its four bits of the token.
+// Returns FALSE if the input ends first
+static boolean ReadLength(const u8** ppIn, const u8* pInEnd, size_t* pLength) {
+    if (*pLength != 15)
+        return TRUE;
+
+    u8 nByte;
+    do {
+        if (*ppIn >= pInEnd)
+            return FALSE;
+        nByte = *(*ppIn)++;
+        *pLength += nByte;
+    } while (nByte == 255);
+
+    return TRUE;
+}
+
+int CLZ4Decoder::Decode(const u8* pIn, size_t nInLength, u8* pOut, size_t nOutLength) {
+    const u8* pInEnd = pIn + nInLength;
+    u8* pOutStart = pOut;
+    u8* pOutEnd = pOut + nOutLength;
+
+    while (pIn < pInEnd) {
+        u8 nToken = *pIn++;
+
+        size_t nLiterals = nToken >> 4;
+        if (!ReadLength(&pIn, pInEnd, &nLiterals))
+            return -1;
+        if (nLiterals > (size_t)(pInEnd - pIn) || nLiterals > (size_t)(pOutEnd - pOut))
+            return -1;
+        memcpy(pOut, pIn, nLiterals);
+        pIn += nLiterals;
+        pOut += nLiterals;
+
+        // The last sequence ends after its literals
+        if (pOut == pOutEnd || pIn == pInEnd)
+            break;
+
+        if (pInEnd - pIn < 2)
+            return -1;
+        size_t nOffset = pIn[0] | pIn[1] << 8;
+        pIn += 2;
+        if (nOffset == 0 || nOffset > (size_t)(pOut - pOutStart))
+            return -1;
+
+        size_t nMatch = nToken & 0x0F;
+        if (!ReadLength(&pIn, pInEnd, &nMatch))
+            return -1;
+        nMatch += LZ4_MIN_MATCH;
+        if (nMatch > (size_t)(pOutEnd - pOut))
+            return -1;
+
+        // Matches may overlap their own output, repeating a short run
+        const u8* pMatch = pOut - nOffset;
+        if (nOffset >= nMatch) {
+            memcpy(pOut, pMatch, nMatch);
+            pOut += nMatch;
+        } else {
+            while (nMatch--)
+                *pOut++ = *pMatch++;
+        }
+    }
+
+    return pOut - pOutStart;
+}
@@ -0,0 +1,32 @@
+//
+// Decoder for LZ4 blocks, without the LZ4 frame around them
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _LZ4DECODER_H
+#define _LZ4DECODER_H
+
+#include <circle/types.h>
+
+class CLZ4Decoder {
+   public:
+    /// \brief Decode one block, stopping when the output is full, so
+    ///        padding after the block is ignored
+    /// \return Number of bytes written, or -1 if the block is bad
+    static int Decode(const u8* pIn, size_t nInLength, u8* pOut, size_t nOutLength);
+};
+
+#endif
@@ -0,0 +1,275 @@
+//
+// Decoder for raw LZMA streams, without the .lzma or .xz container
+//
+// CHD images made by chdman compress data hunks with LZMA by default. The
+// stream has no header, the properties are fixed by the codec, and it
+// decodes a whole hunk at once, so the output buffer is the dictionary.
+// This follows the reference decoder in the LZMA SDK's LzmaSpec.cpp.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "lzmadecoder.h"
+
+#include <assert.h>
+#include <circle/util.h>
+
+#define PROB_BITS       11
+#define PROB_INIT       (1 << (PROB_BITS - 1))
+#define PROB_MOVE_BITS  5
+#define TOP_VALUE       (1U << 24)
+#define MATCH_MIN_LEN   2
+#define END_MARKER      0xFFFFFFFF
+
+CLZMADecoder::CLZMADecoder(unsigned nLC, unsigned nLP, unsigned nPB)
+    : m_nLC(nLC),
+      m_nLP(nLP),
+      m_nPB(nPB) {
+    assert(nLC <= 8);
+    assert(nLP <= 4);
+    assert(nPB <= NumPosBitsMax);
+    m_pLiteral = new u16[0x300 << (nLC + nLP)];
+}
+
+CLZMADecoder::~CLZMADecoder(void) {
+    delete[] m_pLiteral;
+}
+
+void CLZMADecoder::InitProbs(void) {
+    unsigned nLiterals = 0x300 << (m_nLC + m_nLP);
+    for (unsigned i = 0; i < nLiterals; i++)
+        m_pLiteral[i] = PROB_INIT;
+
+    // Everything else is u16 probabilities, laid out one after another
+    u16* pFirst = m_IsMatch;
+    u16* pLast = (u16*)(&m_RepLength + 1);
+    for (u16* pProb = pFirst; pProb < pLast; pProb++)
+        *pProb = PROB_INIT;
+}
+
+inline u8 CLZMADecoder::NextByte(void) {
+    if (m_nInPosition < m_nInLength)
+        return m_pIn[m_nInPosition++];
+
+    m_bCorrupted = TRUE;
+    return 0;
+}
+
+inline void CLZMADecoder::Normalize(void) {
+    if (m_nRange < TOP_VALUE) {
+        m_nRange <<= 8;
+        m_nCode = (m_nCode << 8) | NextByte();
+    }
+}
+
+inline unsigned CLZMADecoder::DecodeBit(u16* pProb) {
+    unsigned nProb = *pProb;
+    u32 nBound = (m_nRange >> PROB_BITS) * nProb;
+    unsigned nBit;
+    if (m_nCode < nBound) {
+        *pProb = nProb + (((1 << PROB_BITS) - nProb) >> PROB_MOVE_BITS);
+        m_nRange = nBound;
+        nBit = 0;
+    } else {
+        *pProb = nProb - (nProb >> PROB_MOVE_BITS);
+        m_nCode -= nBound;
+        m_nRange -= nBound;
+        nBit = 1;
+    }
+    Normalize();
+    return nBit;
+}
+
+unsigned CLZMADecoder::DecodeDirectBits(unsigned nCount) {
+    u32 nResult = 0;
+    do {
+        m_nRange >>= 1;
+        m_nCode -= m_nRange;
+        u32 nMask = 0 - (m_nCode >> 31);
+        m_nCode += m_nRange & nMask;
+        if (m_nCode == m_nRange)
+            m_bCorrupted = TRUE;
+        Normalize();
+        nResult = (nResult << 1) + (nMask + 1);
+    } while (--nCount);
+    return nResult;
+}
+
+inline unsigned CLZMADecoder::DecodeTree(u16* pProbs, unsigned nBits) {
+    unsigned m = 1;
+    for (unsigned i = 0; i < nBits; i++)
+        m = (m << 1) + DecodeBit(&pProbs[m]);
+    return m - (1 << nBits);
+}
+
+inline unsigned CLZMADecoder::DecodeReverseTree(u16* pProbs, unsigned nBits) {
+    unsigned m = 1;
+    unsigned nSymbol = 0;
+    for (unsigned i = 0; i < nBits; i++) {
+        unsigned nBit = DecodeBit(&pProbs[m]);
+        m = (m << 1) + nBit;
+        nSymbol |= nBit << i;
+    }
+    return nSymbol;
+}
+
+unsigned CLZMADecoder::DecodeLength(TLengthProbs* pProbs, unsigned nPosState) {
+    if (DecodeBit(&pProbs->Choice) == 0)
+        return DecodeTree(pProbs->Low[nPosState], 3);
+    if (DecodeBit(&pProbs->Choice2) == 0)
+        return 8 + DecodeTree(pProbs->Mid[nPosState], 3);
+    return 16 + DecodeTree(pProbs->High, 8);
+}
+
+u32 CLZMADecoder::DecodeDistance(unsigned nLength) {
+    unsigned nLenState = nLength < NumLenToPosStates - 1 ? nLength : NumLenToPosStates - 1;
+    unsigned nPosSlot = DecodeTree(m_PosSlot[nLenState], 6);
+    if (nPosSlot < 4)
+        return nPosSlot;
+
+    unsigned nDirectBits = (nPosSlot >> 1) - 1;
+    u32 nDistance = (2 | (nPosSlot & 1)) << nDirectBits;
+    if (nPosSlot < EndPosModelIndex)
+        return nDistance + DecodeReverseTree(m_PosDecoders + nDistance - nPosSlot, nDirectBits);
+
+    nDistance += DecodeDirectBits(nDirectBits - NumAlignBits) << NumAlignBits;
+    return nDistance + DecodeReverseTree(m_Align, NumAlignBits);
+}
+
+int CLZMADecoder::Decode(const u8* pIn, size_t nInLength, u8* pOut, size_t nOutLength) {
+    assert(pIn != 0);
+    assert(pOut != 0);
+
+    m_pIn = pIn;
+    m_nInLength = nInLength;
+    m_nInPosition = 0;
+    m_bCorrupted = FALSE;
+    InitProbs();
+
+    // The range coder starts with a zero byte and the 32 bit code
+    if (NextByte() != 0)
+        return -1;
+    m_nRange = 0xFFFFFFFF;
+    m_nCode = 0;
+    for (unsigned i = 0; i < 4; i++)
+        m_nCode = (m_nCode << 8) | NextByte();
+    if (m_bCorrupted || m_nCode == m_nRange)
+        return -1;
+
+    unsigned nState = 0;
+    u32 nRep0 = 0;
+    u32 nRep1 = 0;
+    u32 nRep2 = 0;
+    u32 nRep3 = 0;
+    size_t nPosition = 0;
+    unsigned nPosMask = (1 << m_nPB) - 1;
+    unsigned nLiteralPosMask = (1 << m_nLP) - 1;
+
+    while (nPosition < nOutLength) {
+        if (m_bCorrupted)
+            return -1;
+
+        unsigned nPosState = nPosition & nPosMask;
+
+        if (DecodeBit(&m_IsMatch[(nState << NumPosBitsMax) + nPosState]) == 0) {
+            unsigned nPrevByte = nPosition > 0 ? pOut[nPosition - 1] : 0;
+            unsigned nLiteralState = ((nPosition & nLiteralPosMask) << m_nLC) + (nPrevByte >> (8 - m_nLC));
+            u16* pProbs = &m_pLiteral[0x300 * nLiteralState];
+
+            unsigned nSymbol = 1;
+            if (nState >= 7) {
+                // After a match, the byte at rep0 predicts this one until
+                // the first bit that differs
+                if (nRep0 >= nPosition)
+                    return -1;
+                unsigned nMatchByte = pOut[nPosition - nRep0 - 1];
+                do {
+                    unsigned nMatchBit = (nMatchByte >> 7) & 1;
+                    nMatchByte <<= 1;
+                    unsigned nBit = DecodeBit(&pProbs[((1 + nMatchBit) << 8) + nSymbol]);
+                    nSymbol = (nSymbol << 1) | nBit;
+                    if (nMatchBit != nBit)
+                        break;
+                } while (nSymbol < 0x100);
+            }
+            while (nSymbol < 0x100)
+                nSymbol = (nSymbol << 1) | DecodeBit(&pProbs[nSymbol]);
+
+            pOut[nPosition++] = nSymbol;
+            nState = nState < 4 ? 0 : (nState < 10 ? nState - 3 : nState - 6);
+            continue;
+        }
+
+        unsigned nLength;
+        if (DecodeBit(&m_IsRep[nState]) != 0) {
+            if (nPosition == 0)
+                return -1;
+
+            if (DecodeBit(&m_IsRepG0[nState]) == 0) {
+                if (DecodeBit(&m_IsRep0Long[(nState << NumPosBitsMax) + nPosState]) == 0) {
+                    // A single byte from rep0
+                    if (nRep0 >= nPosition)
+                        return -1;
+                    nState = nState < 7 ? 9 : 11;
+                    pOut[nPosition] = pOut[nPosition - nRep0 - 1];
+                    nPosition++;
+                    continue;
+                }
+            } else {
+                u32 nDistance;
+                if (DecodeBit(&m_IsRepG1[nState]) == 0) {
+                    nDistance = nRep1;
+                } else {
+                    if (DecodeBit(&m_IsRepG2[nState]) == 0) {
+                        nDistance = nRep2;
+                    } else {
+                        nDistance = nRep3;
+                        nRep3 = nRep2;
+                    }
+                    nRep2 = nRep1;
+                }
+                nRep1 = nRep0;
+                nRep0 = nDistance;
+            }
+
+            nLength = DecodeLength(&m_RepLength, nPosState);
+            nState = nState < 7 ? 8 : 11;
+        } else {
+            nRep3 = nRep2;
+            nRep2 = nRep1;
+            nRep1 = nRep0;
+            nLength = DecodeLength(&m_Length, nPosState);
+            nState = nState < 7 ? 7 : 10;
+            nRep0 = DecodeDistance(nLength);
+            if (nRep0 == END_MARKER)
+                break;
+        }
+
+        nLength += MATCH_MIN_LEN;
+        if (nRep0 >= nPosition || nLength > nOutLength - nPosition)
+            return -1;
+
+        const u8* pFrom = pOut + nPosition - nRep0 - 1;
+        u8* pTo = pOut + nPosition;
+        nPosition += nLength;
+        while (nLength--)
+            *pTo++ = *pFrom++;
+    }
+
+    if (m_bCorrupted)
+        return -1;
+
+    return nPosition;
+}
@@ -0,0 +1,92 @@
+//
+// Decoder for raw LZMA streams, without the .lzma or .xz container
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _LZMADECODER_H
+#define _LZMADECODER_H
+
+#include <circle/types.h>
+
+class CLZMADecoder {
+   public:
+    /// \param nLC Literal context bits
+    /// \param nLP Literal position bits
+    /// \param nPB Position bits
+    CLZMADecoder(unsigned nLC, unsigned nLP, unsigned nPB);
+    ~CLZMADecoder(void);
+
+    /// \brief Decode a whole stream in one go, the output is the dictionary
+    /// \return Number of bytes written, which is nOutLength unless the
+    ///         stream has an end marker before that, or -1 if it is bad
+    int Decode(const u8* pIn, size_t nInLength, u8* pOut, size_t nOutLength);
+
+   private:
+    static const unsigned NumStates = 12;
+    static const unsigned NumPosBitsMax = 4;
+    static const unsigned NumLenToPosStates = 4;
+    static const unsigned NumAlignBits = 4;
+    static const unsigned EndPosModelIndex = 14;
+    static const unsigned NumFullDistances = 1 << (EndPosModelIndex >> 1);
+
+    struct TLengthProbs {
+        u16 Choice;
+        u16 Choice2;
+        u16 Low[1 << NumPosBitsMax][1 << 3];
+        u16 Mid[1 << NumPosBitsMax][1 << 3];
+        u16 High[1 << 8];
+    };
+
+    void InitProbs(void);
+
+    u8 NextByte(void);
+    void Normalize(void);
+    unsigned DecodeBit(u16* pProb);
+    unsigned DecodeDirectBits(unsigned nCount);
+    unsigned DecodeTree(u16* pProbs, unsigned nBits);
+    unsigned DecodeReverseTree(u16* pProbs, unsigned nBits);
+    unsigned DecodeLength(TLengthProbs* pProbs, unsigned nPosState);
+    u32 DecodeDistance(unsigned nLength);
+
+   private:
+    unsigned m_nLC;
+    unsigned m_nLP;
+    unsigned m_nPB;
+
+    // Range decoder
+    const u8* m_pIn;
+    size_t m_nInLength;
+    size_t m_nInPosition;
+    u32 m_nRange;
+    u32 m_nCode;
+    boolean m_bCorrupted;
+
+    // Probabilities
+    u16* m_pLiteral;  // 0x300 for each literal state
+    u16 m_IsMatch[NumStates << NumPosBitsMax];
+    u16 m_IsRep[NumStates];
+    u16 m_IsRepG0[NumStates];
+    u16 m_IsRepG1[NumStates];
+    u16 m_IsRepG2[NumStates];
+    u16 m_IsRep0Long[NumStates << NumPosBitsMax];
+    u16 m_PosSlot[NumLenToPosStates][1 << 6];
+    u16 m_PosDecoders[1 + NumFullDistances - EndPosModelIndex];
+    u16 m_Align[1 << NumAlignBits];
+    TLengthProbs m_Length;
+    TLengthProbs m_RepLength;
+};
+
+#endif
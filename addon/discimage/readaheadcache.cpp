@@ -0,0 +1,183 @@
+//
+// An LBA indexed read-ahead cache for CD images
+//
+// Hosts read CD media as long sequential streams. When the last few reads
+// were back to back, Prefetch() reads ahead of the host, a chunk at a time,
+// into a ring of sectors, and the following reads are served from RAM.
+// Random access goes straight to the image and doesn't disturb the window.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "readaheadcache.h"
+
+#include <assert.h>
+#include <circle/logger.h>
+#include <circle/util.h>
+
+LOGMODULE("readahead");
+
+CReadAheadCache::CReadAheadCache(unsigned nSectors, unsigned nChunkSectors)
+    : m_pDevice(nullptr),
+      m_pBuffer(nullptr),
+      m_nBufferSize(nSectors * MaxSectorSize),
+      m_nChunkSectors(nChunkSectors ? nChunkSectors : 1),
+      m_nBlockSize(0),
+      m_nCapacity(0),
+      m_nTotalBlocks(0) {
+    if (m_nBufferSize > 0)
+        m_pBuffer = new u8[m_nBufferSize];
+    if (!m_pBuffer)
+        m_nBufferSize = 0;
+
+    Invalidate();
+    ResetStats();
+
+    LOGNOTE("Read-ahead window is %u sectors (%u bytes)", nSectors, (unsigned)m_nBufferSize);
+}
+
+CReadAheadCache::~CReadAheadCache(void) {
+    delete[] m_pBuffer;
+}
+
+void CReadAheadCache::SetDevice(ICueDevice* pDevice) {
+    if (m_pDevice != nullptr && m_nHits + m_nMisses > 0)
+        LOGNOTE("Previous image: %llu hits, %llu misses, %llu prefetched",
+                m_nHits, m_nMisses, m_nPrefetched);
+
+    m_pDevice = pDevice;
+    m_nBlockSize = 0;  // recomputed on the next read
+    Invalidate();
+    ResetStats();
+}
+
+void CReadAheadCache::Invalidate(void) {
+    m_nStart = 0;
+    m_nEnd = 0;
+    m_nNextLBA = 0;
+    m_nSequential = 0;
+}
+
+void CReadAheadCache::ResetStats(void) {
+    m_nHits = 0;
+    m_nMisses = 0;
+    m_nPrefetched = 0;
+}
+
+// Copy sectors out of the ring, which takes two goes if they wrap
+void CReadAheadCache::CopyOut(u32 lba, u32 nBlocks, u8* pBuffer) const {
+    while (nBlocks > 0) {
+        u32 nSlot = lba % m_nCapacity;
+        u32 nCount = m_nCapacity - nSlot;
+        if (nCount > nBlocks)
+            nCount = nBlocks;
+
+        memcpy(pBuffer, m_pBuffer + nSlot * m_nBlockSize, nCount * m_nBlockSize);
+
+        pBuffer += nCount * m_nBlockSize;
+        lba += nCount;
+        nBlocks -= nCount;
+    }
+}
+
+int CReadAheadCache::Read(u32 lba, u32 nBlocks, u32 nBlockSize, u8* pBuffer) {
+    if (!m_pDevice || nBlockSize == 0 || nBlockSize > MaxSectorSize)
+        return -1;
+
+    // The ring is laid out in image sectors, start over if they change size
+    if (nBlockSize != m_nBlockSize) {
+        m_nBlockSize = nBlockSize;
+        m_nCapacity = m_nBufferSize / nBlockSize;
+        m_nTotalBlocks = m_pDevice->GetSize() / nBlockSize;
+        Invalidate();
+    }
+
+    if (lba == m_nNextLBA) {
+        if (m_nSequential < SequentialThreshold)
+            m_nSequential++;
+    } else {
+        m_nSequential = 0;
+    }
+    m_nNextLBA = lba + nBlocks;
+
+    // Serve what we can from the window
+    u32 nDone = 0;
+    if (lba >= m_nStart && lba < m_nEnd) {
+        nDone = m_nEnd - lba;
+        if (nDone > nBlocks)
+            nDone = nBlocks;
+        CopyOut(lba, nDone, pBuffer);
+        m_nHits += nDone;
+    }
+
+    if (nDone == nBlocks)
+        return nDone * nBlockSize;
+
+    // And read the rest from the image
+    u32 nRemaining = nBlocks - nDone;
+    int nRead = m_pDevice->ReadAt((u64)(lba + nDone) * nBlockSize, pBuffer + nDone * nBlockSize,
+                                  nRemaining * nBlockSize, ICueDevice::CursorData);
+    m_nMisses += nRemaining;
+    if (nRead < 0)
+        return nRead;
+
+    return nDone * nBlockSize + nRead;
+}
+
+boolean CReadAheadCache::Prefetch(void) {
+    if (!m_pDevice || m_nCapacity == 0 || m_nSequential < SequentialThreshold)
+        return FALSE;
+
+    // The host has moved outside the window, start a new one where it is now
+    if (m_nNextLBA < m_nStart || m_nNextLBA > m_nEnd) {
+        m_nStart = m_nNextLBA;
+        m_nEnd = m_nNextLBA;
+    }
+
+    u32 nTarget = m_nNextLBA + m_nCapacity;
+    if (nTarget > m_nTotalBlocks)
+        nTarget = m_nTotalBlocks;
+    if (m_nEnd >= nTarget)
+        return FALSE;
+
+    u32 nCount = nTarget - m_nEnd;
+    if (nCount > m_nChunkSectors)
+        nCount = m_nChunkSectors;
+
+    // One contiguous read, stop at the end of the ring
+    u32 nSlot = m_nEnd % m_nCapacity;
+    if (nCount > m_nCapacity - nSlot)
+        nCount = m_nCapacity - nSlot;
+
+    // Drop the oldest sectors first, they live in the slots we're about to fill
+    if (m_nEnd + nCount - m_nStart > m_nCapacity)
+        m_nStart = m_nEnd + nCount - m_nCapacity;
+
+    int nRead = m_pDevice->ReadAt((u64)m_nEnd * m_nBlockSize, m_pBuffer + nSlot * m_nBlockSize,
+                                  nCount * m_nBlockSize, ICueDevice::CursorData);
+    if (nRead < (int)(nCount * m_nBlockSize)) {
+        // Keep whatever whole sectors we got, and stop streaming until
+        // the host shows us another sequential run
+        if (nRead > 0)
+            m_nEnd += nRead / m_nBlockSize;
+        m_nSequential = 0;
+        LOGWARN("Prefetch at %u stopped, read %d", m_nEnd, nRead);
+        return FALSE;
+    }
+
+    m_nEnd += nCount;
+    m_nPrefetched += nCount;
+    return TRUE;
+}
@@ -0,0 +1,86 @@
+//
+// An LBA indexed read-ahead cache for CD images
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _READAHEADCACHE_H
+#define _READAHEADCACHE_H
+
+#include <circle/types.h>
+
+#include "cuedevice.h"
+
+class CReadAheadCache {
+   public:
+    /// \param nSectors Window size in raw (2352 byte) sectors, 0 disables the cache
+    /// \param nChunkSectors Most sectors read by one Prefetch() call
+    CReadAheadCache(unsigned nSectors, unsigned nChunkSectors);
+    ~CReadAheadCache(void);
+
+    /// \brief Switch to a new image, drops everything cached
+    void SetDevice(ICueDevice* pDevice);
+
+    /// \brief Read nBlocks sectors of nBlockSize bytes starting at lba,
+    ///        from the window where possible and from the image otherwise
+    /// \return Number of bytes read, or < 0 on error
+    int Read(u32 lba, u32 nBlocks, u32 nBlockSize, u8* pBuffer);
+
+    /// \brief Read the next chunk ahead of the host if it is streaming.
+    ///        Call from task level while the gadget has nothing else to do
+    /// \return TRUE if anything was read
+    boolean Prefetch(void);
+
+    /// \return Sectors served from the window
+    u64 GetHits(void) const { return m_nHits; }
+
+    /// \return Sectors read from the image on demand
+    u64 GetMisses(void) const { return m_nMisses; }
+
+    /// \return Sectors read ahead by Prefetch()
+    u64 GetPrefetched(void) const { return m_nPrefetched; }
+
+    void ResetStats(void);
+
+   private:
+    void Invalidate(void);
+    void CopyOut(u32 lba, u32 nBlocks, u8* pBuffer) const;
+
+   private:
+    static const unsigned MaxSectorSize = 2352;
+    static const unsigned SequentialThreshold = 2;  // reads in a row before we prefetch
+
+    ICueDevice* m_pDevice;
+    u8* m_pBuffer;
+    size_t m_nBufferSize;
+    unsigned m_nChunkSectors;
+
+    // The window is [m_nStart, m_nEnd), sector lba lives in slot lba % m_nCapacity
+    u32 m_nBlockSize;
+    u32 m_nCapacity;
+    u32 m_nTotalBlocks;
+    u32 m_nStart;
+    u32 m_nEnd;
+
+    // Sequential stream detection
+    u32 m_nNextLBA;
+    unsigned m_nSequential;
+
+    u64 m_nHits;
+    u64 m_nMisses;
+    u64 m_nPrefetched;
+};
+
+#endif
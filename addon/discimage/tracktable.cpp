@@ -0,0 +1,149 @@
+//
+// A pre-parsed, immutable track table for a cue sheet
+//
+// The cue sheet is tokenised once when an image is mounted. All track
+// queries are then binary searches over a small sorted array.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "tracktable.h"
+
+#include <assert.h>
+#include <circle/logger.h>
+
+LOGMODULE("tracktable");
+
+CTrackTable::CTrackTable(void)
+    : m_nTracks(0),
+      m_nLeadoutLBA(0) {
+}
+
+CTrackTable::~CTrackTable(void) {
+}
+
+boolean CTrackTable::Build(const char* pCueSheet, u64 ullImageSize) {
+    m_nTracks = 0;
+    m_nLeadoutLBA = 0;
+
+    if (pCueSheet == nullptr)
+        return FALSE;
+
+    CUEParser parser(pCueSheet);
+    const CUETrackInfo* trackInfo;
+    while ((trackInfo = parser.next_track()) != nullptr) {
+        if (m_nTracks >= MaxTracks) {
+            LOGWARN("More than %u tracks, ignoring the rest", MaxTracks);
+            break;
+        }
+
+        TTrackEntry* entry = &m_Tracks[m_nTracks];
+        entry->track_number = trackInfo->track_number;
+        entry->track_mode = trackInfo->track_mode;
+        entry->sector_length = trackInfo->sector_length;
+        entry->track_start = trackInfo->track_start;
+        entry->data_start = trackInfo->data_start;
+        entry->file_offset = trackInfo->file_offset;
+
+        // Keep the table sorted by LBA. Cue sheets list tracks in order,
+        // so this is a no-op unless the sheet is damaged
+        unsigned i = m_nTracks++;
+        while (i > 0 && m_Tracks[i - 1].track_start > m_Tracks[i].track_start) {
+            TTrackEntry temp = m_Tracks[i - 1];
+            m_Tracks[i - 1] = m_Tracks[i];
+            m_Tracks[i] = temp;
+            i--;
+        }
+    }
+
+    if (m_nTracks == 0) {
+        LOGERR("No tracks in cue sheet");
+        return FALSE;
+    }
+
+    // We know the start position of the last track, and we know its sector length
+    // and we know the file size, so we can work out the LBA of the end of the last track
+    // We can't just divide the file size by sector size because sectors lengths might
+    // not be consistent (e.g. multi-mode cd where track 1 is 2048
+    const TTrackEntry* last = &m_Tracks[m_nTracks - 1];
+    if (ullImageSize < last->file_offset || last->sector_length == 0) {
+        // Some corrupted cd images might have a cue that references track that are
+        // outside the bin.
+        m_nLeadoutLBA = last->data_start;
+    } else {
+        m_nLeadoutLBA = last->data_start + (u32)((ullImageSize - last->file_offset) / last->sector_length);
+    }
+
+    LOGNOTE("%u tracks, leadout at LBA %u", m_nTracks, m_nLeadoutLBA);
+
+    return TRUE;
+}
+
+const TTrackEntry* CTrackTable::GetEntry(unsigned nIndex) const {
+    if (nIndex >= m_nTracks)
+        return nullptr;
+
+    return &m_Tracks[nIndex];
+}
+
+const TTrackEntry* CTrackTable::GetTrackForLBA(u32 lba) const {
+    if (m_nTracks == 0)
+        return nullptr;
+
+    // LBA zero is always in the first track
+    if (lba == 0)
+        return &m_Tracks[0];
+
+    // Find the last track starting at or before lba
+    unsigned nLow = 0;
+    unsigned nHigh = m_nTracks;
+    while (nLow < nHigh) {
+        unsigned nMid = (nLow + nHigh) / 2;
+        if (m_Tracks[nMid].track_start <= lba)
+            nLow = nMid + 1;
+        else
+            nHigh = nMid;
+    }
+
+    if (nLow == 0)
+        return nullptr;
+
+    return &m_Tracks[nLow - 1];
+}
+
+const TTrackEntry* CTrackTable::GetTrack(int nTrackNumber) const {
+    // Track numbers ascend with LBA
+    unsigned nLow = 0;
+    unsigned nHigh = m_nTracks;
+    while (nLow < nHigh) {
+        unsigned nMid = (nLow + nHigh) / 2;
+        if (m_Tracks[nMid].track_number == nTrackNumber)
+            return &m_Tracks[nMid];
+
+        if (m_Tracks[nMid].track_number < nTrackNumber)
+            nLow = nMid + 1;
+        else
+            nHigh = nMid;
+    }
+
+    return nullptr;
+}
+
+int CTrackTable::GetLastTrackNumber(void) const {
+    if (m_nTracks == 0)
+        return 1;
+
+    return m_Tracks[m_nTracks - 1].track_number;
+}
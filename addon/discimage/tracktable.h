@@ -0,0 +1,71 @@
+//
+// A pre-parsed, immutable track table for a cue sheet
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _TRACKTABLE_H
+#define _TRACKTABLE_H
+
+#include <circle/types.h>
+#include <cueparser/cueparser.h>
+
+struct TTrackEntry {
+    int track_number;         // -1 if not valid
+    CUETrackMode track_mode;
+    u32 sector_length;        // bytes per sector in the image
+    u32 track_start;          // LBA of INDEX 00, or INDEX 01 if there is no pregap
+    u32 data_start;           // LBA of INDEX 01
+    u64 file_offset;          // image offset of data_start in bytes
+};
+
+class CTrackTable {
+   public:
+    CTrackTable(void);
+    ~CTrackTable(void);
+
+    /// \brief Parse the cue sheet once and precompute the leadout
+    /// \param pCueSheet Cue sheet text
+    /// \param ullImageSize Size of the image in bytes
+    /// \return FALSE if the cue sheet has no usable tracks
+    boolean Build(const char* pCueSheet, u64 ullImageSize);
+
+    /// \return Number of tracks
+    unsigned GetCount(void) const { return m_nTracks; }
+
+    /// \return Track at nIndex (ascending LBA and track number order)
+    const TTrackEntry* GetEntry(unsigned nIndex) const;
+
+    /// \return Track containing lba, or nullptr if lba is before the first track
+    const TTrackEntry* GetTrackForLBA(u32 lba) const;
+
+    /// \return Track with this number, or nullptr if there is none
+    const TTrackEntry* GetTrack(int nTrackNumber) const;
+
+    /// \return Highest track number, 1 if the table is empty
+    int GetLastTrackNumber(void) const;
+
+    /// \return LBA of the leadout
+    u32 GetLeadoutLBA(void) const { return m_nLeadoutLBA; }
+
+   private:
+    static const unsigned MaxTracks = 99;
+
+    TTrackEntry m_Tracks[MaxTracks];
+    unsigned m_nTracks;
+    u32 m_nLeadoutLBA;
+};
+
+#endif
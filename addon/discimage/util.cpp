@@ -24,6 +24,12 @@
 
 LOGMODULE("cueparser-util");
 
+// The link maps need fast seek, which patches/circle/fatfs-fastseek.patch
+// turns on in Circle's ffconf.h
+#if !FF_USE_FASTSEEK
+#error "FF_USE_FASTSEEK is disabled, apply the patches (make apply-patches)"
+#endif
+
 char tolower(char c) {
     if (c >= 'A' && c <= 'Z')
         return c + ('a' - 'A');
@@ -66,6 +72,42 @@ bool hasIsoExtension(const char* imageName) {
     return false;
 }
 
+bool hasChdExtension(const char* imageName) {
+    size_t len = strlen(imageName);
+    if (len >= 4) {
+        const char* ext = imageName + len - 4;
+        return tolower(ext[0]) == '.' &&
+               tolower(ext[1]) == 'c' &&
+               tolower(ext[2]) == 'h' &&
+               tolower(ext[3]) == 'd';
+    }
+    return false;
+}
+
+bool hasCsoExtension(const char* imageName) {
+    size_t len = strlen(imageName);
+    if (len >= 4) {
+        const char* ext = imageName + len - 4;
+        return tolower(ext[0]) == '.' &&
+               tolower(ext[1]) == 'c' &&
+               tolower(ext[2]) == 's' &&
+               tolower(ext[3]) == 'o';
+    }
+    return false;
+}
+
+bool hasZsoExtension(const char* imageName) {
+    size_t len = strlen(imageName);
+    if (len >= 4) {
+        const char* ext = imageName + len - 4;
+        return tolower(ext[0]) == '.' &&
+               tolower(ext[1]) == 'z' &&
+               tolower(ext[2]) == 's' &&
+               tolower(ext[3]) == 'o';
+    }
+    return false;
+}
+
 void change_extension_to_bin(char* fullPath) {
     size_t len = strlen(fullPath);
     if (len >= 3) {
@@ -118,6 +160,41 @@ bool ReadFileToString(const char* fullPath, char** out_str) {
     return true;
 }
 
+// Builds the FatFs cluster link map for an open file. Without it, f_lseek()
+// follows the FAT chain from the start of the file, which on a large,
+// fragmented image gets slow for far seeks. With it, a seek is a lookup
+// in a table with two entries per fragment. The file uses the table from
+// now on, the caller owns it and must clear cltbl before freeing it
+DWORD* createLinkMap(FIL* pFile) {
+    // FatFs tells us the size it needs when the table is too small
+    DWORD nEntries = LINKMAP_INITIAL_ENTRIES;
+    DWORD* pLinkMap = nullptr;
+    while (pLinkMap == nullptr) {
+        DWORD* pTable = new DWORD[nEntries];
+        pTable[0] = nEntries;
+        pFile->cltbl = pTable;
+
+        FRESULT result = f_lseek(pFile, CREATE_LINKMAP);
+        if (result == FR_OK) {
+            pLinkMap = pTable;
+            break;
+        }
+
+        pFile->cltbl = nullptr;
+        DWORD nRequired = pTable[0];
+        delete[] pTable;
+
+        if (result != FR_NOT_ENOUGH_CORE || nRequired <= nEntries) {
+            LOGERR("Cannot create link map, err %d", result);
+            return nullptr;
+        }
+        nEntries = nRequired;
+    }
+
+    LOGDBG("Link map: %u fragments", (unsigned)((pLinkMap[0] - 1) / 2));
+    return pLinkMap;
+}
+
 ICueDevice* loadCueBinFileDevice(const char* imageName) {
     // Construct full path
     char fullPath[255];  // FIXME limits
@@ -126,6 +203,44 @@ ICueDevice* loadCueBinFileDevice(const char* imageName) {
     FIL* imageFile = new FIL();
     char* cue_str = nullptr;
 
+    // A CHD carries its own track list
+    if (hasChdExtension(fullPath)) {
+        FRESULT Result = f_open(imageFile, fullPath, FA_READ);
+        if (Result != FR_OK) {
+            LOGERR("Cannot open image file for reading");
+            delete imageFile;
+            return nullptr;
+        }
+        LOGNOTE("Opened CHD file %s", fullPath);
+
+        CCHDFileDevice* pCHDFileDevice = new CCHDFileDevice(imageFile, fullPath);
+        if (!pCHDFileDevice->Init()) {
+            LOGERR("Cannot load CHD image %s", fullPath);
+            delete pCHDFileDevice;
+            return nullptr;
+        }
+        return pCHDFileDevice;
+    }
+
+    // CSO and ZSO are ISOs compressed block by block
+    if (hasCsoExtension(fullPath) || hasZsoExtension(fullPath)) {
+        FRESULT Result = f_open(imageFile, fullPath, FA_READ);
+        if (Result != FR_OK) {
+            LOGERR("Cannot open image file for reading");
+            delete imageFile;
+            return nullptr;
+        }
+        LOGNOTE("Opened compressed ISO %s", fullPath);
+
+        CCompressedIsoDevice* pCompressedIsoDevice = new CCompressedIsoDevice(imageFile, fullPath);
+        if (!pCompressedIsoDevice->Init()) {
+            LOGERR("Cannot load compressed ISO %s", fullPath);
+            delete pCompressedIsoDevice;
+            return nullptr;
+        }
+        return pCompressedIsoDevice;
+    }
+
     // Is this a bin?
     if (hasBinExtension(fullPath)) {
         //LOGNOTE("This is a bin file, changing to cue");
@@ -141,6 +256,19 @@ ICueDevice* loadCueBinFileDevice(const char* imageName) {
         }
         LOGNOTE("Loaded cue %s", cue_str);
 
+        // Redump style images have one bin per track, named in the cue
+        if (CCueMultiFileDevice::CountFiles(cue_str) > 1) {
+            delete imageFile;
+            CCueMultiFileDevice* pMultiFileDevice = new CCueMultiFileDevice(cue_str, fullPath);
+            delete[] cue_str;
+            if (!pMultiFileDevice->Init()) {
+                LOGERR("Cannot load multi file image %s", fullPath);
+                delete pMultiFileDevice;
+                return nullptr;
+            }
+            return pMultiFileDevice;
+        }
+
         // Load a bin file with the same name
         change_extension_to_bin(fullPath);
         //LOGNOTE("Changed to bin %s", fullPath);
@@ -157,7 +285,11 @@ ICueDevice* loadCueBinFileDevice(const char* imageName) {
     LOGNOTE("Opened image file %s", fullPath);
 
     // Create our device
-    ICueDevice* ccueBinFileDevice = new CCueBinFileDevice(imageFile, cue_str);
+    CCueBinFileDevice* ccueBinFileDevice = new CCueBinFileDevice(imageFile, cue_str, fullPath);
+
+    // Build the fast seek table now, so random access into the image
+    // doesn't have to follow the cluster chain on every jump
+    ccueBinFileDevice->CreateLinkMap();
 
     // Cleanup
     if (cue_str != nullptr)
@@ -2,13 +2,21 @@
 #ifndef UTIL_H
 #define UTIL_H
 #include <circle/util.h>
+#include "chdfile.h"
+#include "compressediso.h"
 #include "cuebinfile.h"
+#include "cuemultifile.h"
 
 #define MAX_FILENAME 255
 
 char tolower(char c);
 bool hasBinExtension(const char* imageName);
+bool hasChdExtension(const char* imageName);
+bool hasCsoExtension(const char* imageName);
+bool hasZsoExtension(const char* imageName);
+void change_extension_to_bin(char* fullPath);
 void change_extension_to_cue(char* fullPath);
+DWORD* createLinkMap(FIL* pFile);
 ICueDevice* loadCueBinFileDevice(const char* imageName);
 
 #endif  // UTIL_H
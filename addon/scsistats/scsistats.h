@@ -0,0 +1,96 @@
+//
+// Per opcode counters for the SCSI commands handled by the USB gadgets.
+// Whichever gadget is active records into this, and the web interface
+// reads it back out
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef SCSI_STATS_H
+#define SCSI_STATS_H
+
+#include <circle/synchronize.h>
+#include <circle/types.h>
+#include <circle/util.h>
+
+struct TSCSICommandStats {
+    u32 nCount;
+    u32 nMaxTicks;     // CTimer clock ticks from CBW to CSW
+    u64 nTotalTicks;
+    u64 nBytes;        // data phase bytes, either direction
+};
+
+class SCSIStats {
+public:
+    static const unsigned MaxOpCodes = 256;
+
+    static SCSIStats& Get() {
+        static SCSIStats instance;
+        return instance;
+    }
+
+    // Called by a gadget when it sends the CSW of a command. That is from
+    // its IRQ handler or from its Update() task, one command at a time
+    void Record(u8 nOpCode, unsigned nTicks, u32 nBytes) {
+        TSCSICommandStats& stats = m_Stats[nOpCode];
+        stats.nCount++;
+        stats.nTotalTicks += nTicks;
+        if (nTicks > stats.nMaxTicks)
+            stats.nMaxTicks = nTicks;
+        stats.nBytes += nBytes;
+    }
+
+    // Copies all MaxOpCodes entries in one go, so they agree with each other.
+    // With bReset they are cleared in the same go, so no command recorded
+    // in between is lost
+    void GetSnapshot(TSCSICommandStats* pStats, boolean bReset = FALSE) {
+        EnterCritical(IRQ_LEVEL);
+        memcpy(pStats, m_Stats, sizeof(m_Stats));
+        if (bReset)
+            memset(m_Stats, 0, sizeof(m_Stats));
+        LeaveCritical();
+    }
+
+    void Reset() {
+        EnterCritical(IRQ_LEVEL);
+        memset(m_Stats, 0, sizeof(m_Stats));
+        LeaveCritical();
+    }
+
+    // Name of the gadget doing the recording, "cd" or "msd"
+    const char* GetGadget() const {
+        return m_pGadget;
+    }
+
+    void SetGadget(const char* pName) {
+        m_pGadget = pName;
+    }
+
+    SCSIStats(const SCSIStats&) = delete;
+    SCSIStats& operator=(const SCSIStats&) = delete;
+    SCSIStats(SCSIStats&&) = delete;
+    SCSIStats& operator=(SCSIStats&&) = delete;
+
+private:
+    SCSIStats() : m_pGadget("none") {
+        memset(m_Stats, 0, sizeof(m_Stats));
+    }
+    ~SCSIStats() = default;
+
+    TSCSICommandStats m_Stats[MaxOpCodes];
+    const char* m_pGadget;
+};
+
+#endif // SCSI_STATS_H
@@ -0,0 +1,367 @@
+//
+// The list of CD images on the SD card, persisted as a binary index
+//
+// Scanning a card with thousands of images used to mean reading the whole
+// directory and checking every cue sheet for a bin on each refresh. Now the
+// entries are kept in an index file, and a refresh only reads the directory
+// entries to see what changed. Images which are new or changed are opened
+// later, one at a time, to find their track count and volume label
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "imagecatalog.h"
+
+#include <assert.h>
+#include <circle/logger.h>
+#include <circle/util.h>
+#include <discimage/tracktable.h>
+#include <discimage/util.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+LOGMODULE("imagecatalog");
+
+static int CompareEntries(const void* a, const void* b) {
+    return strcasecmp(((const FileEntry*)a)->name, ((const FileEntry*)b)->name);
+}
+
+CImageCatalog::CImageCatalog(const char* pDirectory, const char* pIndexFile)
+    : m_pDirectory(pDirectory),
+      m_pIndexFile(pIndexFile),
+      m_pEntries(new FileEntry[MAX_FILES]),
+      m_pScanEntries(new FileEntry[MAX_FILES]),
+      m_nCount(0),
+      m_bLoaded(FALSE),
+      m_bDirty(FALSE),
+      m_nUnprobed(0),
+      m_nProbedSinceSave(0) {
+    assert(m_pEntries != nullptr && m_pScanEntries != nullptr);
+}
+
+CImageCatalog::~CImageCatalog(void) {
+    delete[] m_pEntries;
+    delete[] m_pScanEntries;
+}
+
+const FileEntry* CImageCatalog::GetEntry(size_t nIndex) const {
+    if (nIndex >= m_nCount)
+        return nullptr;
+    return &m_pEntries[nIndex];
+}
+
+int CImageCatalog::Find(const char* pName) const {
+    return FindIn(m_pEntries, m_nCount, pName);
+}
+
+int CImageCatalog::FindIn(const FileEntry* pEntries, size_t nCount, const char* pName) {
+    size_t nLow = 0;
+    size_t nHigh = nCount;
+    while (nLow < nHigh) {
+        size_t nMid = (nLow + nHigh) / 2;
+        int nCompare = strcasecmp(pName, pEntries[nMid].name);
+        if (nCompare == 0)
+            return (int)nMid;
+        if (nCompare < 0)
+            nHigh = nMid;
+        else
+            nLow = nMid + 1;
+    }
+    return -1;
+}
+
+TImageFormat CImageCatalog::GetFormat(const char* pName) {
+    const char* pExtension = strrchr(pName, '.');
+    if (pExtension == nullptr)
+        return ImageFormatUnknown;
+
+    if (strcasecmp(pExtension, ".iso") == 0)
+        return ImageFormatISO;
+    if (strcasecmp(pExtension, ".bin") == 0)
+        return ImageFormatCueBin;
+    if (strcasecmp(pExtension, ".cue") == 0)
+        return ImageFormatCueMultiFile;
+    if (strcasecmp(pExtension, ".chd") == 0)
+        return ImageFormatCHD;
+    if (strcasecmp(pExtension, ".cso") == 0)
+        return ImageFormatCSO;
+    if (strcasecmp(pExtension, ".zso") == 0)
+        return ImageFormatZSO;
+
+    return ImageFormatUnknown;
+}
+
+boolean CImageCatalog::Refresh(void) {
+    if (!m_bLoaded) {
+        LoadIndex();
+        m_bLoaded = TRUE;
+    }
+
+    DIR Directory;
+    FRESULT Result = f_opendir(&Directory, m_pDirectory);
+    if (Result != FR_OK) {
+        LOGERR("Cannot open %s (%d)", m_pDirectory, Result);
+        return FALSE;
+    }
+
+    size_t nCount = 0;
+    unsigned nReused = 0;
+    FILINFO FileInfo;
+    while (f_readdir(&Directory, &FileInfo) == FR_OK && FileInfo.fname[0] != 0) {
+        if (FileInfo.fattrib & AM_DIR)
+            continue;
+
+        TImageFormat Format = GetFormat(FileInfo.fname);
+        if (Format == ImageFormatUnknown)
+            continue;
+
+        if (nCount >= MAX_FILES) {
+            LOGWARN("Maximum image count reached (%u)", MAX_FILES);
+            break;
+        }
+
+        // Zeroed, so unchanged lists compare equal below
+        FileEntry* pEntry = &m_pScanEntries[nCount++];
+        memset(pEntry, 0, sizeof(*pEntry));
+        strncpy(pEntry->name, FileInfo.fname, MAX_FILENAME_LEN - 1);
+        pEntry->size = (DWORD)FileInfo.fsize;
+        pEntry->fdate = FileInfo.fdate;
+        pEntry->ftime = FileInfo.ftime;
+        pEntry->format = Format;
+
+        // The directory entry says if the file changed, without opening it
+        int nOld = FindIn(m_pEntries, m_nCount, pEntry->name);
+        if (nOld >= 0) {
+            const FileEntry* pOld = &m_pEntries[nOld];
+            if (pOld->size == pEntry->size && pOld->fdate == pEntry->fdate &&
+                pOld->ftime == pEntry->ftime && pOld->probed) {
+                pEntry->tracks = pOld->tracks;
+                pEntry->probed = pOld->probed;
+                memcpy(pEntry->label, pOld->label, sizeof(pEntry->label));
+                nReused++;
+            }
+        }
+    }
+    f_closedir(&Directory);
+
+    qsort(m_pScanEntries, nCount, sizeof(m_pScanEntries[0]), CompareEntries);
+
+    // A cue sheet with a bin of the same name is listed as the bin. Without
+    // one, it names one bin per track and is listed itself. This used to be
+    // an f_stat() per cue sheet, now it's a look up in the sorted list. They
+    // are marked first, so the list stays sorted while we look
+    for (size_t i = 0; i < nCount; i++) {
+        if (m_pScanEntries[i].format == ImageFormatCueMultiFile) {
+            char BinName[MAX_FILENAME_LEN + 4];
+            strcpy(BinName, m_pScanEntries[i].name);
+            change_extension_to_bin(BinName);
+            if (FindIn(m_pScanEntries, nCount, BinName) >= 0)
+                m_pScanEntries[i].format = ImageFormatUnknown;
+        }
+    }
+
+    size_t nKept = 0;
+    for (size_t i = 0; i < nCount; i++) {
+        if (m_pScanEntries[i].format == ImageFormatUnknown)
+            continue;
+        if (nKept != i)
+            memcpy(&m_pScanEntries[nKept], &m_pScanEntries[i], sizeof(FileEntry));
+        nKept++;
+    }
+    nCount = nKept;
+
+    unsigned nUnprobed = 0;
+    for (size_t i = 0; i < nCount; i++) {
+        if (!m_pScanEntries[i].probed)
+            nUnprobed++;
+    }
+
+    if (nCount != m_nCount || memcmp(m_pScanEntries, m_pEntries, nCount * sizeof(FileEntry)) != 0)
+        m_bDirty = TRUE;
+
+    FileEntry* pOldEntries = m_pEntries;
+    m_pEntries = m_pScanEntries;
+    m_pScanEntries = pOldEntries;
+    m_nCount = nCount;
+    m_nUnprobed = nUnprobed;
+
+    LOGNOTE("%u images, %u unchanged, %u to probe", (unsigned)m_nCount, nReused, m_nUnprobed);
+
+    if (m_bDirty && m_nUnprobed == 0)
+        SaveIndex();
+
+    return TRUE;
+}
+
+boolean CImageCatalog::ProbeNext(void) {
+    if (m_nUnprobed == 0)
+        return FALSE;
+
+    for (size_t i = 0; i < m_nCount; i++) {
+        if (m_pEntries[i].probed)
+            continue;
+
+        ProbeEntry(&m_pEntries[i]);
+        m_nUnprobed--;
+        m_bDirty = TRUE;
+
+        if (m_nUnprobed == 0 || ++m_nProbedSinceSave >= SaveInterval)
+            SaveIndex();
+
+        return TRUE;
+    }
+
+    // Only if the count was wrong
+    m_nUnprobed = 0;
+    return FALSE;
+}
+
+void CImageCatalog::ProbeEntry(FileEntry* pEntry) {
+    // Marked first, so an image we can't open isn't tried again and again
+    pEntry->probed = 1;
+    pEntry->tracks = 0;
+    pEntry->label[0] = '\0';
+
+    ICueDevice* pDevice = loadCueBinFileDevice(pEntry->name);
+    if (pDevice == nullptr) {
+        LOGWARN("Cannot open %s to probe it", pEntry->name);
+        return;
+    }
+
+    CTrackTable* pTracks = new CTrackTable;
+    if (pTracks->Build(pDevice->GetCueSheet(), pDevice->GetSize())) {
+        unsigned nTracks = pTracks->GetCount();
+        pEntry->tracks = nTracks > 255 ? 255 : (u8)nTracks;
+
+        // The volume label is in the primary volume descriptor at LBA 16
+        // of the first data track
+        for (unsigned i = 0; i < nTracks; i++) {
+            const TTrackEntry* pTrack = pTracks->GetEntry(i);
+            if (pTrack->track_mode == CUETrack_AUDIO)
+                continue;
+
+            u32 nSkipBytes = 0;
+            if (pTrack->track_mode == CUETrack_MODE1_2352)
+                nSkipBytes = 16;
+            else if (pTrack->track_mode == CUETrack_MODE2_2352)
+                nSkipBytes = 24;
+
+            u8 Descriptor[2048];
+            u64 ullOffset = pTrack->file_offset + 16ULL * pTrack->sector_length + nSkipBytes;
+            if (pDevice->ReadAt(ullOffset, Descriptor, sizeof(Descriptor)) == (int)sizeof(Descriptor) &&
+                Descriptor[0] == 1 && memcmp(Descriptor + 1, "CD001", 5) == 0) {
+                unsigned nLength = MAX_LABEL_LEN;
+                while (nLength > 0 && (Descriptor[40 + nLength - 1] == ' ' || Descriptor[40 + nLength - 1] == '\0'))
+                    nLength--;
+                memcpy(pEntry->label, Descriptor + 40, nLength);
+                pEntry->label[nLength] = '\0';
+            }
+            break;
+        }
+    }
+
+    delete pTracks;
+    delete pDevice;
+}
+
+boolean CImageCatalog::LoadIndex(void) {
+    FIL File;
+    if (f_open(&File, m_pIndexFile, FA_READ) != FR_OK) {
+        LOGNOTE("No image index yet, building %s", m_pIndexFile);
+        return FALSE;
+    }
+
+    TIndexHeader Header;
+    UINT nRead;
+    boolean bOK = f_read(&File, &Header, sizeof(Header), &nRead) == FR_OK && nRead == sizeof(Header) &&
+                  Header.nMagic == IndexMagic && Header.nVersion == IndexVersion &&
+                  Header.nEntrySize == sizeof(FileEntry) && Header.nCount <= MAX_FILES;
+    if (bOK) {
+        UINT nBytes = Header.nCount * sizeof(FileEntry);
+        bOK = f_read(&File, m_pEntries, nBytes, &nRead) == FR_OK && nRead == nBytes &&
+              Checksum(m_pEntries, nBytes) == Header.nChecksum;
+    }
+    f_close(&File);
+
+    if (!bOK) {
+        LOGWARN("Image index %s is not valid, rebuilding it", m_pIndexFile);
+        m_nCount = 0;
+        return FALSE;
+    }
+
+    // The entries are trusted to be sorted, the index is only written sorted
+    m_nCount = Header.nCount;
+    LOGNOTE("Loaded %u images from %s", (unsigned)m_nCount, m_pIndexFile);
+
+    return TRUE;
+}
+
+boolean CImageCatalog::SaveIndex(void) {
+    // Written next to the index and renamed over it, so a power cut can't
+    // leave half an index
+    char TempFile[64];
+    snprintf(TempFile, sizeof(TempFile), "%s.new", m_pIndexFile);
+
+    FIL File;
+    if (f_open(&File, TempFile, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+        LOGERR("Cannot create %s", TempFile);
+        return FALSE;
+    }
+
+    TIndexHeader Header;
+    Header.nMagic = IndexMagic;
+    Header.nVersion = IndexVersion;
+    Header.nEntrySize = sizeof(FileEntry);
+    Header.nCount = m_nCount;
+    Header.nChecksum = Checksum(m_pEntries, m_nCount * sizeof(FileEntry));
+
+    UINT nBytes = m_nCount * sizeof(FileEntry);
+    UINT nWritten;
+    boolean bOK = f_write(&File, &Header, sizeof(Header), &nWritten) == FR_OK && nWritten == sizeof(Header) &&
+                  f_write(&File, m_pEntries, nBytes, &nWritten) == FR_OK && nWritten == nBytes;
+    if (f_close(&File) != FR_OK)
+        bOK = FALSE;
+
+    if (!bOK) {
+        LOGERR("Cannot write %s", TempFile);
+        f_unlink(TempFile);
+        return FALSE;
+    }
+
+    f_unlink(m_pIndexFile);
+    if (f_rename(TempFile, m_pIndexFile) != FR_OK) {
+        LOGERR("Cannot rename %s", TempFile);
+        return FALSE;
+    }
+
+    m_bDirty = FALSE;
+    m_nProbedSinceSave = 0;
+    LOGNOTE("Saved %u images to %s", (unsigned)m_nCount, m_pIndexFile);
+
+    return TRUE;
+}
+
+u32 CImageCatalog::Checksum(const void* pData, size_t nLength) {
+    // FNV-1a
+    const u8* p = (const u8*)pData;
+    u32 nHash = 2166136261U;
+    while (nLength--) {
+        nHash ^= *p++;
+        nHash *= 16777619U;
+    }
+    return nHash;
+}
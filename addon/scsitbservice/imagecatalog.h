@@ -0,0 +1,124 @@
+//
+// The list of CD images on the SD card, persisted as a binary index
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _IMAGECATALOG_H
+#define _IMAGECATALOG_H
+
+#include <circle/types.h>
+#include <fatfs/ff.h>
+#include <stddef.h>
+
+#define MAX_FILES 2048
+#define MAX_FILENAME_LEN 255
+#define MAX_LABEL_LEN 32
+
+#define IMAGE_CATALOG_DIR "/images"
+#define IMAGE_CATALOG_INDEX "SD:/imagecatalog.bin"
+
+enum TImageFormat {
+    ImageFormatUnknown,
+    ImageFormatISO,
+    ImageFormatCueBin,        // a bin, with a cue sheet of the same name
+    ImageFormatCueMultiFile,  // a cue sheet naming one bin per track
+    ImageFormatCHD,
+    ImageFormatCSO,
+    ImageFormatZSO,
+    ImageFormatDirectory      // only in the library, see imagelibrary.h
+};
+
+struct FileEntry {
+    char name[MAX_FILENAME_LEN];
+    DWORD size;
+    WORD fdate;                      // as in FILINFO, to see if the file changed
+    WORD ftime;
+    u8 format;                       // TImageFormat
+    u8 tracks;                       // 0 if unknown
+    u8 probed;                       // tracks and label are valid
+    char label[MAX_LABEL_LEN + 1];   // ISO9660 volume identifier, may be empty
+};
+
+class CImageCatalog {
+   public:
+    CImageCatalog(const char* pDirectory = IMAGE_CATALOG_DIR, const char* pIndexFile = IMAGE_CATALOG_INDEX);
+    ~CImageCatalog(void);
+
+    /// \brief Read the directory and reconcile it with the entries we have,
+    ///        which come from the index file on the first call. Entries whose
+    ///        size and timestamp didn't change keep what was probed before
+    /// \return FALSE if the directory can't be read
+    boolean Refresh(void);
+
+    /// \brief Open the next entry which isn't probed yet, to find its track
+    ///        count and volume label. The index is saved once all are done
+    /// \return FALSE if there was nothing left to probe
+    boolean ProbeNext(void);
+
+    /// \return Number of entries, sorted by name
+    size_t GetCount(void) const { return m_nCount; }
+
+    /// \return Entry at nIndex, or nullptr if out of range
+    const FileEntry* GetEntry(size_t nIndex) const;
+
+    /// \return Index of the entry called pName, or -1 if there is none
+    int Find(const char* pName) const;
+
+    /// \return Entries which aren't probed yet
+    unsigned GetUnprobed(void) const { return m_nUnprobed; }
+
+    FileEntry* begin(void) { return m_pEntries; }
+    FileEntry* end(void) { return m_pEntries + m_nCount; }
+
+    /// \return Format of an image from its name, ImageFormatUnknown if we don't list it
+    static TImageFormat GetFormat(const char* pName);
+
+   private:
+    boolean LoadIndex(void);
+    boolean SaveIndex(void);
+    void ProbeEntry(FileEntry* pEntry);
+    static int FindIn(const FileEntry* pEntries, size_t nCount, const char* pName);
+    static u32 Checksum(const void* pData, size_t nLength);
+
+   private:
+    static const u32 IndexMagic = 0x58444955;  // "UIDX"
+    static const u32 IndexVersion = 1;
+    static const unsigned SaveInterval = 64;   // probes between saves, if there are many
+
+    struct TIndexHeader {
+        u32 nMagic;
+        u32 nVersion;
+        u32 nEntrySize;
+        u32 nCount;
+        u32 nChecksum;  // of the entries
+    };
+
+    const char* m_pDirectory;
+    const char* m_pIndexFile;
+
+    // The directory is read into the second array, which becomes the first
+    // when it's done, so readers never see a half built list
+    FileEntry* m_pEntries;
+    FileEntry* m_pScanEntries;
+    size_t m_nCount;
+
+    boolean m_bLoaded;
+    boolean m_bDirty;
+    unsigned m_nUnprobed;
+    unsigned m_nProbedSinceSave;
+};
+
+#endif
@@ -0,0 +1,295 @@
+//
+// The tree of directories below /images, read on demand
+//
+// Libraries are kept as /images/<system>/<game>/, with far more images in
+// them than fit in the flat catalog. Each directory is only read when it is
+// browsed, into a single allocation holding the entries and their names,
+// and only the most recently used directories are kept
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "imagelibrary.h"
+
+#include <assert.h>
+#include <circle/logger.h>
+#include <circle/util.h>
+#include <discimage/util.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+LOGMODULE("imagelibrary");
+
+// Subdirectories first, then images
+static int CompareEntries(const void* a, const void* b) {
+    const TLibraryEntry* pA = (const TLibraryEntry*)a;
+    const TLibraryEntry* pB = (const TLibraryEntry*)b;
+    boolean bDirectoryA = pA->nFormat == ImageFormatDirectory;
+    boolean bDirectoryB = pB->nFormat == ImageFormatDirectory;
+    if (bDirectoryA != bDirectoryB)
+        return bDirectoryA ? -1 : 1;
+    return strcasecmp(pA->pName, pB->pName);
+}
+
+static int FindIn(const TLibraryEntry* pEntries, unsigned nLow, unsigned nHigh, const char* pName) {
+    while (nLow < nHigh) {
+        unsigned nMid = (nLow + nHigh) / 2;
+        int nCompare = strcasecmp(pName, pEntries[nMid].pName);
+        if (nCompare == 0)
+            return (int)nMid;
+        if (nCompare < 0)
+            nHigh = nMid;
+        else
+            nLow = nMid + 1;
+    }
+    return -1;
+}
+
+// What we show of a directory. Hidden and system entries, and the ._ files
+// macOS leaves next to each image, are left out
+static TImageFormat GetEntryFormat(const FILINFO& FileInfo) {
+    if (FileInfo.fname[0] == '.' || (FileInfo.fattrib & (AM_HID | AM_SYS)))
+        return ImageFormatUnknown;
+    if (FileInfo.fattrib & AM_DIR)
+        return ImageFormatDirectory;
+    return CImageCatalog::GetFormat(FileInfo.fname);
+}
+
+CImageLibrary::CImageLibrary(const char* pRoot, unsigned nMaxDirectories)
+    : m_pRoot(pRoot),
+      m_nMaxDirectories(nMaxDirectories),
+      m_nUseCounter(0) {
+    if (m_nMaxDirectories < 2)
+        m_nMaxDirectories = 2;
+    else if (m_nMaxDirectories > MaxDirectories)
+        m_nMaxDirectories = MaxDirectories;
+
+    for (unsigned i = 0; i < MaxDirectories; i++)
+        m_pDirectories[i] = nullptr;
+}
+
+CImageLibrary::~CImageLibrary(void) {
+    Invalidate();
+}
+
+const TLibraryDirectory* CImageLibrary::GetDirectory(const char* pPath) {
+    // Without slashes at either end, so each directory has one name
+    char Path[MAX_IMAGE_PATH_LEN + 1];
+    while (*pPath == '/')
+        pPath++;
+    strncpy(Path, pPath, sizeof(Path) - 1);
+    Path[sizeof(Path) - 1] = '\0';
+    size_t nLength = strlen(Path);
+    while (nLength > 0 && Path[nLength - 1] == '/')
+        Path[--nLength] = '\0';
+
+    // The path comes from the web UI too, it mustn't leave the root. FatFs
+    // takes a backslash as a separator as well, and no name can contain
+    // one, so a path with one is refused before its parts are checked
+    if (strchr(Path, '\\') != nullptr)
+        return nullptr;
+    for (const char* p = Path; *p != '\0';) {
+        const char* pEnd = strchr(p, '/');
+        size_t nPart = pEnd != nullptr ? (size_t)(pEnd - p) : strlen(p);
+        if (nPart == 0 || (nPart == 1 && p[0] == '.') || (nPart == 2 && p[0] == '.' && p[1] == '.'))
+            return nullptr;
+        p += nPart;
+        if (*p == '/')
+            p++;
+    }
+
+    unsigned nVictim = 0;
+    for (unsigned i = 0; i < m_nMaxDirectories; i++) {
+        TLibraryDirectory* pDirectory = m_pDirectories[i];
+        if (pDirectory != nullptr && strcasecmp(pDirectory->pPath, Path) == 0) {
+            pDirectory->nLastUsed = ++m_nUseCounter;
+            return pDirectory;
+        }
+
+        // An empty slot, or else the least recently used
+        if (m_pDirectories[nVictim] != nullptr &&
+            (pDirectory == nullptr || pDirectory->nLastUsed < m_pDirectories[nVictim]->nLastUsed))
+            nVictim = i;
+    }
+
+    TLibraryDirectory* pDirectory = ReadDirectory(Path);
+    if (pDirectory == nullptr)
+        return nullptr;
+
+    FreeDirectory(m_pDirectories[nVictim]);
+    m_pDirectories[nVictim] = pDirectory;
+    pDirectory->nLastUsed = ++m_nUseCounter;
+
+    return pDirectory;
+}
+
+void CImageLibrary::Invalidate(void) {
+    for (unsigned i = 0; i < MaxDirectories; i++) {
+        FreeDirectory(m_pDirectories[i]);
+        m_pDirectories[i] = nullptr;
+    }
+}
+
+unsigned CImageLibrary::GetCached(void) const {
+    unsigned nCached = 0;
+    for (unsigned i = 0; i < m_nMaxDirectories; i++) {
+        if (m_pDirectories[i] != nullptr)
+            nCached++;
+    }
+    return nCached;
+}
+
+int CImageLibrary::Find(const TLibraryDirectory* pDirectory, const char* pName) {
+    int nIndex = FindIn(pDirectory->pEntries, 0, pDirectory->nDirectories, pName);
+    if (nIndex < 0)
+        nIndex = FindIn(pDirectory->pEntries, pDirectory->nDirectories, pDirectory->nEntries, pName);
+    return nIndex;
+}
+
+const char* CImageLibrary::SplitPath(const char* pPath, char* pDirectory, size_t nDirectorySize) {
+    assert(nDirectorySize > 0);
+    const char* pSlash = strrchr(pPath, '/');
+    if (pSlash == nullptr) {
+        pDirectory[0] = '\0';
+        return pPath;
+    }
+
+    size_t nLength = pSlash - pPath;
+    if (nLength >= nDirectorySize)
+        nLength = nDirectorySize - 1;
+    memcpy(pDirectory, pPath, nLength);
+    pDirectory[nLength] = '\0';
+
+    return pSlash + 1;
+}
+
+boolean CImageLibrary::JoinPath(const char* pDirectory, const char* pName, char* pPath, size_t nPathSize) {
+    int nLength = pDirectory[0] != '\0' ? snprintf(pPath, nPathSize, "%s/%s", pDirectory, pName)
+                                        : snprintf(pPath, nPathSize, "%s", pName);
+    return nLength >= 0 && (size_t)nLength < nPathSize;
+}
+
+TLibraryDirectory* CImageLibrary::ReadDirectory(const char* pPath) {
+    char FullPath[MAX_IMAGE_PATH_LEN + 16];
+    if (pPath[0] != '\0')
+        snprintf(FullPath, sizeof(FullPath), "%s/%s", m_pRoot, pPath);
+    else
+        snprintf(FullPath, sizeof(FullPath), "%s", m_pRoot);
+
+    // Counted first, so the entries and all names fit in one allocation
+    DIR Directory;
+    FRESULT Result = f_opendir(&Directory, FullPath);
+    if (Result != FR_OK) {
+        LOGWARN("Cannot open %s (%d)", FullPath, Result);
+        return nullptr;
+    }
+
+    unsigned nEntries = 0;
+    size_t nNameBytes = 0;
+    FILINFO FileInfo;
+    while (f_readdir(&Directory, &FileInfo) == FR_OK && FileInfo.fname[0] != 0) {
+        if (GetEntryFormat(FileInfo) == ImageFormatUnknown)
+            continue;
+
+        if (nEntries >= MaxEntries) {
+            LOGWARN("%s has more than %u entries", FullPath, MaxEntries);
+            break;
+        }
+
+        nEntries++;
+        nNameBytes += strlen(FileInfo.fname) + 1;
+    }
+    f_closedir(&Directory);
+
+    size_t nPathBytes = strlen(pPath) + 1;
+    size_t nBytes = sizeof(TLibraryDirectory) + nEntries * sizeof(TLibraryEntry) + nNameBytes + nPathBytes;
+    u8* pMemory = new u8[nBytes];
+    if (pMemory == nullptr) {
+        LOGERR("Not enough memory for %s (%u entries)", FullPath, nEntries);
+        return nullptr;
+    }
+
+    TLibraryDirectory* pDirectory = (TLibraryDirectory*)pMemory;
+    pDirectory->pEntries = (TLibraryEntry*)(pDirectory + 1);
+    char* pNames = (char*)(pDirectory->pEntries + nEntries);
+    pDirectory->pPath = pNames + nNameBytes;
+    memcpy(pDirectory->pPath, pPath, nPathBytes);
+
+    // The directory may have changed in between, what doesn't fit is left out
+    unsigned nRead = 0;
+    if (f_opendir(&Directory, FullPath) == FR_OK) {
+        char* pNamesEnd = pNames + nNameBytes;
+        while (nRead < nEntries && f_readdir(&Directory, &FileInfo) == FR_OK && FileInfo.fname[0] != 0) {
+            TImageFormat Format = GetEntryFormat(FileInfo);
+            if (Format == ImageFormatUnknown)
+                continue;
+
+            size_t nName = strlen(FileInfo.fname) + 1;
+            if (pNames + nName > pNamesEnd)
+                break;
+            memcpy(pNames, FileInfo.fname, nName);
+
+            TLibraryEntry* pEntry = &pDirectory->pEntries[nRead++];
+            pEntry->pName = pNames;
+            pEntry->nSize = (DWORD)FileInfo.fsize;
+            pEntry->nFormat = Format;
+            pNames += nName;
+        }
+        f_closedir(&Directory);
+    }
+
+    qsort(pDirectory->pEntries, nRead, sizeof(TLibraryEntry), CompareEntries);
+
+    unsigned nDirectories = 0;
+    while (nDirectories < nRead && pDirectory->pEntries[nDirectories].nFormat == ImageFormatDirectory)
+        nDirectories++;
+
+    // A cue sheet with a bin of the same name is listed as the bin, as in
+    // the catalog. Marked first, the look ups need the list still sorted
+    for (unsigned i = nDirectories; i < nRead; i++) {
+        TLibraryEntry* pEntry = &pDirectory->pEntries[i];
+        if (pEntry->nFormat == ImageFormatCueMultiFile) {
+            char BinName[MAX_FILENAME_LEN + 4];
+            strncpy(BinName, pEntry->pName, MAX_FILENAME_LEN);
+            BinName[MAX_FILENAME_LEN] = '\0';
+            change_extension_to_bin(BinName);
+            if (FindIn(pDirectory->pEntries, nDirectories, nRead, BinName) >= 0)
+                pEntry->nFormat = ImageFormatUnknown;
+        }
+    }
+
+    unsigned nKept = nDirectories;
+    for (unsigned i = nDirectories; i < nRead; i++) {
+        if (pDirectory->pEntries[i].nFormat == ImageFormatUnknown)
+            continue;
+        if (nKept != i)
+            pDirectory->pEntries[nKept] = pDirectory->pEntries[i];
+        nKept++;
+    }
+
+    pDirectory->nEntries = nKept;
+    pDirectory->nDirectories = nDirectories;
+    pDirectory->nLastUsed = 0;
+
+    LOGNOTE("Read %s, %u directories and %u images", FullPath, nDirectories, nKept - nDirectories);
+
+    return pDirectory;
+}
+
+void CImageLibrary::FreeDirectory(TLibraryDirectory* pDirectory) {
+    delete[] (u8*)pDirectory;
+}
@@ -0,0 +1,89 @@
+//
+// The tree of directories below /images, read on demand
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _IMAGELIBRARY_H
+#define _IMAGELIBRARY_H
+
+#include <circle/types.h>
+#include <fatfs/ff.h>
+
+#include "imagecatalog.h"
+
+#define MAX_IMAGE_PATH_LEN 255  // relative to /images, as loadCueBinFileDevice() takes it
+
+struct TLibraryEntry {
+    const char* pName;  // in the name pool of the directory
+    DWORD nSize;
+    u8 nFormat;         // TImageFormat, ImageFormatDirectory for a subdirectory
+};
+
+struct TLibraryDirectory {
+    char* pPath;              // relative to the root, "" for the root itself
+    unsigned nEntries;        // subdirectories first, then images, each sorted by name
+    unsigned nDirectories;
+    TLibraryEntry* pEntries;  // followed by the names, in the same allocation
+    unsigned nLastUsed;
+};
+
+class CImageLibrary {
+   public:
+    CImageLibrary(const char* pRoot = IMAGE_CATALOG_DIR, unsigned nMaxDirectories = DefaultMaxDirectories);
+    ~CImageLibrary(void);
+
+    /// \brief Get a directory, reading it if it isn't cached. The least
+    ///        recently used one is dropped to make room for it
+    /// \param pPath Relative to the root, "" for the root itself
+    /// \return nullptr if it can't be read. Valid until the next call
+    const TLibraryDirectory* GetDirectory(const char* pPath);
+
+    /// \brief Drop all cached directories, they are read again when asked for
+    void Invalidate(void);
+
+    /// \return Index of the entry called pName in pDirectory, or -1 if there is none
+    static int Find(const TLibraryDirectory* pDirectory, const char* pName);
+
+    /// \brief Split a path relative to the root into its directory and name
+    /// \param pDirectory Gets the part before the last slash, "" if there is none
+    /// \return The part after the last slash
+    static const char* SplitPath(const char* pPath, char* pDirectory, size_t nDirectorySize);
+
+    /// \brief Join a directory relative to the root and a name in it
+    /// \return FALSE if it doesn't fit
+    static boolean JoinPath(const char* pDirectory, const char* pName, char* pPath, size_t nPathSize);
+
+    /// \return Number of directories which are cached now
+    unsigned GetCached(void) const;
+
+    static const unsigned DefaultMaxDirectories = 16;
+
+   private:
+    TLibraryDirectory* ReadDirectory(const char* pPath);
+    static void FreeDirectory(TLibraryDirectory* pDirectory);
+
+   private:
+    static const unsigned MaxDirectories = 256;
+    static const unsigned MaxEntries = 8192;  // per directory
+
+    const char* m_pRoot;
+    unsigned m_nMaxDirectories;
+
+    TLibraryDirectory* m_pDirectories[MaxDirectories];
+    unsigned m_nUseCounter;
+};
+
+#endif
@@ -25,7 +25,6 @@
 #include <circle/sched/scheduler.h>
 #include <cstdlib>
 #include <string.h>
-#include <ctype.h>
 #include <assert.h>
 #include <discimage/cuebinfile.h>
 #include <discimage/cuedevice.h>
@@ -33,34 +32,12 @@
 
 LOGMODULE("scsitbservice");
 
-static size_t my_strnlen(const char *s, size_t maxlen) {
-    size_t i;
-    for (i = 0; i < maxlen; i++) {
-        if (s[i] == '\0') break;
-    }
-    return i;
-}
-
-static bool iequals(const char* a, const char* b) {
-    while (*a && *b) {
-        if (tolower((unsigned char)*a) != tolower((unsigned char)*b))
-            return false;
-        ++a; ++b;
-    }
-    return *a == *b;
-}
-
-int compareFileEntries(const void* a, const void* b) {
-    const FileEntry* fa = (const FileEntry*)a;
-    const FileEntry* fb = (const FileEntry*)b;
-    return strcasecmp(fa->name, fb->name);
-}
-
 SCSITBService *SCSITBService::s_pThis = 0;
 
-SCSITBService::SCSITBService(CPropertiesFatFsFile *pProperties)
+SCSITBService::SCSITBService(CPropertiesFatFsFile *pProperties, unsigned nLibraryDirectories)
 : 	m_pProperties (pProperties),
-	m_FileCount(0) 
+	m_pCatalog (new CImageCatalog),
+	m_pLibrary (new CImageLibrary(IMAGE_CATALOG_DIR, nLibraryDirectories))
 {
     LOGNOTE("SCSITBService::SCSITBService() called");
     
@@ -71,38 +48,42 @@ SCSITBService::SCSITBService(CPropertiesFatFsFile *pProperties)
     cdromservice = static_cast<CDROMService*>(CScheduler::Get()->GetTask("cdromservice"));
     assert(cdromservice != nullptr && "Failed to get cdromservice");
 
-    m_FileEntries = new FileEntry[MAX_FILES];
     bool ok = RefreshCache();
     assert(ok && "Failed to refresh SCSITBService on construction");
     SetName("scsitbservice");
 }
 
 SCSITBService::~SCSITBService() {
-    delete[] m_FileEntries;
+    delete m_pLibrary;
+    delete m_pCatalog;
 }
 
 size_t SCSITBService::GetCount() const {
-    return m_FileCount;
+    return m_pCatalog->GetCount();
 }
 
 const char* SCSITBService::GetName(size_t index) const {
-    if (index >= m_FileCount)
-        return nullptr;
-    return m_FileEntries[index].name;
+    const FileEntry* entry = m_pCatalog->GetEntry(index);
+    return entry != nullptr ? entry->name : nullptr;
 }
 
 DWORD SCSITBService::GetSize(size_t index) const {
-    if (index >= m_FileCount)
-        return 0;
-    return m_FileEntries[index].size;
+    const FileEntry* entry = m_pCatalog->GetEntry(index);
+    return entry != nullptr ? entry->size : 0;
 }
 
-FileEntry* SCSITBService::begin() { return m_FileEntries; }
-FileEntry* SCSITBService::end() { return m_FileEntries + m_FileCount; }
+FileEntry* SCSITBService::begin() { return m_pCatalog->begin(); }
+FileEntry* SCSITBService::end() { return m_pCatalog->end(); }
 const FileEntry* SCSITBService::GetFileEntry(size_t index) const {
-    if (index >= m_FileCount)
-        return nullptr;
-    return &m_FileEntries[index];
+    return m_pCatalog->GetEntry(index);
+}
+
+int SCSITBService::FindByName(const char* file_name) const {
+    return m_pCatalog->Find(file_name);
+}
+
+CImageLibrary* SCSITBService::GetLibrary() {
+    return m_pLibrary;
 }
 
 size_t SCSITBService::GetCurrentCD() {
@@ -111,25 +92,39 @@ size_t SCSITBService::GetCurrentCD() {
 
 bool SCSITBService::SetNextCD(size_t cd) {
     //TODO bounds checking
+    next_path[0] = '\0';
     next_cd = cd;
     return true;
 }
 
 const char* SCSITBService::GetCurrentCDName() {
-	return GetName(GetCurrentCD());
+	return current_name;
 }
 
 bool SCSITBService::SetNextCDByName(const char* file_name) {
 
 	LOGNOTE("SCSITBService::SetNextCDByName %s", file_name);
-	int index = 0;
-        for (const FileEntry* it = begin(); it != end(); ++it, ++index) {
-		//LOGNOTE("SCSITBService::SetNextCDByName testing %s", it->name);
-                if (strcmp(file_name, it->name) == 0) {
-			LOGNOTE("SCSITBService::SetNextCDByName found %s", it->name);
-                        return SetNextCD(index);
-                }
-        }
+	int index = FindByName(file_name);
+	if (index >= 0) {
+		LOGNOTE("SCSITBService::SetNextCDByName found %s", GetName(index));
+		return SetNextCD(index);
+	}
+
+	// Anything below the top directory is looked up in the library
+	char dir_path[MAX_IMAGE_PATH_LEN + 1];
+	const char* name = CImageLibrary::SplitPath(file_name, dir_path, sizeof(dir_path));
+	if (dir_path[0] != '\0' && strlen(file_name) <= MAX_IMAGE_PATH_LEN) {
+		const TLibraryDirectory* dir = m_pLibrary->GetDirectory(dir_path);
+		if (dir != nullptr) {
+			int entry = CImageLibrary::Find(dir, name);
+			if (entry >= 0 && dir->pEntries[entry].nFormat != ImageFormatDirectory) {
+				LOGNOTE("SCSITBService::SetNextCDByName found %s in %s", name, dir_path);
+				next_cd = -1;
+				strcpy(next_path, file_name);
+				return true;
+			}
+		}
+	}
 
 	LOGNOTE("SCSITBService::SetNextCDByName not found");
 	return false;
@@ -145,61 +140,26 @@ bool SCSITBService::RefreshCache() {
     const char* current_image = m_pProperties->GetString("current_image", DEFAULT_IMAGE_FILENAME);
     LOGNOTE("SCSITBService::RefreshCache() loaded current_image %s from config.txt", current_image);
 
-    m_FileCount = 0;
-
-    // Read our directory of images
-    // and populate m_FileEntries
-    DIR dir;
-    FRESULT fr = f_opendir(&dir, "/images");
-    if (fr != FR_OK) {
-        // TODO: handle error as needed
+    // Only what changed since the index was written is looked at again
+    if (!m_pCatalog->Refresh())
         return false;
-    }
-
-    LOGNOTE("SCSITBService::RefreshCache() opened directory");
-    FILINFO fno;
-    while (true) {
-        fr = f_readdir(&dir, &fno);
-        if (fr != FR_OK || fno.fname[0] == 0)
-            break;
-
-        if (strcmp(fno.fname, ".") == 0 || strcmp(fno.fname, "..") == 0)
-            continue;
-
-	//LOGNOTE("SCSITBService::RefreshCache() found file %s", fno.fname);
-        const char* ext = strrchr(fno.fname, '.');
-        if (ext != nullptr) {
-            if (iequals(ext, ".iso") || iequals(ext, ".bin")) {
-		if (m_FileCount >= MAX_FILES)
-                    break;
-                size_t len = my_strnlen(fno.fname, MAX_FILENAME_LEN - 1);
-                memcpy(m_FileEntries[m_FileCount].name, fno.fname, len);
-                m_FileEntries[m_FileCount].name[len] = '\0';
-
-                m_FileEntries[m_FileCount].size = fno.fsize;
-
-                m_FileCount++;
-
-            }
-        }
-    }
 
-    // Sort m_FileEntries by filename alphabetically
-    qsort(m_FileEntries, m_FileCount, sizeof(m_FileEntries[0]), compareFileEntries);
-
-    // Find the index of current_image in m_FileEntries
-    for (size_t i = 0; i < m_FileCount; ++i) {
-        if (strcmp(m_FileEntries[i].name, current_image) == 0) {
-	    
-	    // If we don't yet have a current_cd e.g. we've 
-	    // just booted, then mount it
-	    if (current_cd < 0) 
-		next_cd = i;
-	    else
-            	current_cd = i;
-		    
-            break;
-        }
+    // Subdirectories are read again when they are next browsed
+    m_pLibrary->Invalidate();
+
+    // Find the index of current_image in the catalog
+    bool booting = current_cd < 0 && current_name[0] == '\0';
+    int i = m_pCatalog->Find(current_image);
+    if (i >= 0) {
+	// If we don't yet have a current_cd e.g. we've 
+	// just booted, then mount it
+	if (booting) 
+	    next_cd = i;
+	else
+	    current_cd = i;
+    } else if (booting) {
+	// It may be in a subdirectory
+	SetNextCDByName(current_image);
     }
 
     //TODO handle case where we can't find the CD in the last, fall back to 
@@ -207,10 +167,24 @@ bool SCSITBService::RefreshCache() {
 
     LOGNOTE("SCSITBService::RefreshCache() RefreshCache() done");
 
-    f_closedir(&dir);
     return true;
 }
 
+void SCSITBService::Mount(const char* imageName) {
+	ICueDevice* cueBinFileDevice = loadCueBinFileDevice(imageName);
+	
+	// Set the new device in the CD gadget
+	cdromservice->SetDevice(cueBinFileDevice);
+
+	// Save current mounted image name
+	m_pProperties->SelectSection("usbode");
+	m_pProperties->SetString("current_image", imageName);
+	m_pProperties->Save();
+
+	strncpy(current_name, imageName, MAX_IMAGE_PATH_LEN);
+	current_name[MAX_IMAGE_PATH_LEN] = '\0';
+}
+
 void SCSITBService::Run() {
 	LOGNOTE("SCSITBService::Run started");
 
@@ -220,28 +194,33 @@ void SCSITBService::Run() {
 		if (next_cd > -1) {
 
 			// Check if it's valid
-			if (next_cd > (int)m_FileCount) {
+			if (next_cd >= (int)GetCount()) {
 				next_cd = -1;
 				continue;
 			}
 
 			// Load it
-			char* imageName = m_FileEntries[next_cd].name;
-			ICueDevice* cueBinFileDevice = loadCueBinFileDevice(imageName);
-			
-			// Set the new device in the CD gadget
-    			cdromservice->SetDevice(cueBinFileDevice);
-
-			// Save current mounted image name
-			m_pProperties->SelectSection("usbode");
-			m_pProperties->SetString("current_image", imageName);
-			m_pProperties->Save();
+			Mount(GetName(next_cd));
 
 			current_cd = next_cd;
 
 			// Mark done
 			next_cd = -1;
+		} else if (next_path[0] != '\0') {
+			Mount(next_path);
+
+			// Not in the catalog, so it has no index
+			current_cd = -1;
+			next_path[0] = '\0';
+		}
+
+		// Images new to the catalog are opened in between, one at
+		// a time, so mounting never waits for all of them
+		if (m_pCatalog->ProbeNext()) {
+			CScheduler::Get()->Yield();
+			continue;
 		}
+
 		CScheduler::Get()->MsSleep(100);
 	}
 }
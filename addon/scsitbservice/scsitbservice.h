@@ -8,43 +8,48 @@
 #include <usbcdgadget/usbcdgadget.h>
 #include <Properties/propertiesfatfsfile.h>
 #include <cdromservice/cdromservice.h>
-
-#define MAX_FILES 2048
-#define MAX_FILENAME_LEN 255
-
-struct FileEntry {
-    char name[MAX_FILENAME_LEN];
-    DWORD size; 
-};
+#include "imagecatalog.h"
+#include "imagelibrary.h"
 
 class SCSITBService : public CTask {
 public:
-    SCSITBService(CPropertiesFatFsFile *pProperties);
+    SCSITBService(CPropertiesFatFsFile *pProperties,
+                  unsigned nLibraryDirectories = CImageLibrary::DefaultMaxDirectories);
     ~SCSITBService();
     size_t GetCount() const;
     const char* GetName(size_t index) const;
     const char* GetCurrentCDName();
     DWORD GetSize(size_t index) const;
     const FileEntry* GetFileEntry(size_t index) const;
+    int FindByName(const char* file_name) const;
     FileEntry* begin();
     FileEntry* end();
 
     bool RefreshCache();
 
+    // The whole tree below /images, a directory at a time. The flat list
+    // above is the top directory only
+    CImageLibrary* GetLibrary();
+
     void Run(void);
     bool SetNextCD(size_t index);
     bool SetNextCDByName(const char* file_name);
     size_t GetCurrentCD();
 
 private:
+    void Mount(const char* file_name);
 
     static SCSITBService *s_pThis;
     CPropertiesFatFsFile *m_pProperties;
     CDROMService *cdromservice = nullptr;
-    FileEntry *m_FileEntries;
-    size_t m_FileCount;
+    CImageCatalog *m_pCatalog;
+    CImageLibrary *m_pLibrary;
     int next_cd = -1;
     int current_cd = -1;
+
+    // Images in subdirectories aren't in the catalog, they go by path
+    char next_path[MAX_IMAGE_PATH_LEN + 1] = "";
+    char current_name[MAX_IMAGE_PATH_LEN + 1] = "";
 };
 
 #endif
@@ -0,0 +1,162 @@
+//
+// A binary trace of the SCSI commands handled by the USB gadgets.
+// The active gadget appends one fixed size record per command as it sends
+// the CSW, and CSCSITraceDaemon drains them to a file on the SD card.
+// Decode the file with scripts/decode-scsitrace.py
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef SCSI_TRACE_H
+#define SCSI_TRACE_H
+
+#include <circle/macros.h>
+#include <circle/synchronize.h>
+#include <circle/types.h>
+
+enum TSCSITraceGadget {
+    SCSITraceGadgetCD = 0,
+    SCSITraceGadgetMSD = 1
+};
+
+// Little endian, as written to the trace file
+struct TSCSITraceRecord {
+    u32 nTimestamp;     // CTimer clock ticks at the CBW, wraps
+    u32 nServiceTicks;  // CBW to CSW
+    u32 nLBA;           // 0 for commands without one
+    u32 nBlocks;        // transfer length in blocks, 0 for commands without one
+    u32 nBytes;         // data phase bytes, either direction
+    u8 nOpCode;
+    u8 nStatus;         // CSW status
+    u8 nGadget;         // TSCSITraceGadget
+    u8 nReserved;
+} PACKED;
+
+class SCSITrace {
+public:
+    static const unsigned RingSize = 1024;  // records, power of two
+
+    static SCSITrace& Get() {
+        static SCSITrace instance;
+        return instance;
+    }
+
+    // Nothing is recorded until a daemon is there to drain the ring
+    boolean IsEnabled() const {
+        return m_bEnabled;
+    }
+
+    void SetEnabled(boolean bEnabled) {
+        m_bEnabled = bEnabled;
+    }
+
+    // Called by a gadget when it sends the CSW of a command, from its IRQ
+    // handler or its Update() task. The gadget is the only producer, so this needs no lock. A full
+    // ring drops the record rather than wait for the SD card
+    void Record(const u8* pCDB, u8 nStatus, u8 nGadget,
+                unsigned nStartTicks, unsigned nServiceTicks, u32 nBytes) {
+        if (!m_bEnabled)
+            return;
+
+        unsigned nHead = m_nHead;
+        if (nHead - m_nTail >= RingSize) {
+            m_nDropped++;
+            return;
+        }
+
+        TSCSITraceRecord& record = m_Ring[nHead & (RingSize - 1)];
+        record.nTimestamp = nStartTicks;
+        record.nServiceTicks = nServiceTicks;
+        GetAddress(pCDB, &record.nLBA, &record.nBlocks);
+        record.nBytes = nBytes;
+        record.nOpCode = pCDB[0];
+        record.nStatus = nStatus;
+        record.nGadget = nGadget;
+        record.nReserved = 0;
+
+        // Publish the record before moving the head past it
+        DataMemBarrier();
+        m_nHead = nHead + 1;
+    }
+
+    // Copies up to nMax records out of the ring, from task level.
+    // The daemon is the only consumer
+    unsigned Read(TSCSITraceRecord* pRecords, unsigned nMax) {
+        unsigned nTail = m_nTail;
+        unsigned nCount = m_nHead - nTail;
+        DataMemBarrier();
+
+        if (nCount > nMax)
+            nCount = nMax;
+
+        for (unsigned i = 0; i < nCount; i++)
+            pRecords[i] = m_Ring[(nTail + i) & (RingSize - 1)];
+
+        // Don't hand the slots back before we are done copying them
+        DataMemBarrier();
+        m_nTail = nTail + nCount;
+        return nCount;
+    }
+
+    u32 GetDropped() const {
+        return m_nDropped;
+    }
+
+    SCSITrace(const SCSITrace&) = delete;
+    SCSITrace& operator=(const SCSITrace&) = delete;
+    SCSITrace(SCSITrace&&) = delete;
+    SCSITrace& operator=(SCSITrace&&) = delete;
+
+private:
+    SCSITrace() : m_bEnabled(FALSE), m_nHead(0), m_nTail(0), m_nDropped(0) {}
+    ~SCSITrace() = default;
+
+    // The LBA and transfer length of the commands that move data
+    static void GetAddress(const u8* pCDB, u32* pLBA, u32* pBlocks) {
+        u32 lba = (pCDB[2] << 24) | (pCDB[3] << 16) | (pCDB[4] << 8) | pCDB[5];
+        switch (pCDB[0]) {
+            case 0x28:  // Read (10)
+            case 0x2A:  // Write (10)
+            case 0x2F:  // Verify (10)
+                *pLBA = lba;
+                *pBlocks = (pCDB[7] << 8) | pCDB[8];
+                break;
+
+            case 0xA8:  // Read (12)
+            case 0xAA:  // Write (12)
+                *pLBA = lba;
+                *pBlocks = (pCDB[6] << 24) | (pCDB[7] << 16) | (pCDB[8] << 8) | pCDB[9];
+                break;
+
+            case 0xBE:  // Read CD
+                *pLBA = lba;
+                *pBlocks = (pCDB[6] << 16) | (pCDB[7] << 8) | pCDB[8];
+                break;
+
+            default:
+                *pLBA = 0;
+                *pBlocks = 0;
+                break;
+        }
+    }
+
+    volatile boolean m_bEnabled;
+    volatile unsigned m_nHead;  // written by the gadget only
+    volatile unsigned m_nTail;  // written by the daemon only
+    volatile u32 m_nDropped;
+    TSCSITraceRecord m_Ring[RingSize];
+};
+
+#endif // SCSI_TRACE_H
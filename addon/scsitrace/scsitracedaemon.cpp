@@ -0,0 +1,116 @@
+//
+// Drains the SCSI trace ring to a file on the SD card
+//
+// The gadgets only ever touch the RAM ring. This task writes what has
+// piled up a chunk at a time, and syncs the file about once a second, so
+// tracing costs a gadget a few stores per command.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "scsitracedaemon.h"
+
+#include <circle/logger.h>
+#include <circle/sched/scheduler.h>
+#include <circle/timer.h>
+#include <circle/util.h>
+
+LOGMODULE("scsitrace");
+
+CSCSITraceDaemon::CSCSITraceDaemon(const char *pTraceFilePath)
+    : m_pTraceFilePath(pTraceFilePath),
+      m_bFileInitialized(FALSE) {
+    SetName("scsitrace");
+    Initialize();
+}
+
+CSCSITraceDaemon::~CSCSITraceDaemon(void) {
+    SCSITrace::Get().SetEnabled(FALSE);
+
+    if (m_bFileInitialized)
+        f_close(&m_TraceFile);
+}
+
+boolean CSCSITraceDaemon::Initialize(void) {
+    FRESULT Result = f_open(&m_TraceFile, m_pTraceFilePath, FA_WRITE | FA_CREATE_ALWAYS);
+    if (Result != FR_OK) {
+        LOGERR("Failed to open trace file %s (%d)", m_pTraceFilePath, Result);
+        return FALSE;
+    }
+
+    TSCSITraceFileHeader Header;
+    memcpy(Header.Magic, SCSI_TRACE_MAGIC, sizeof(Header.Magic));
+    Header.nVersion = SCSI_TRACE_VERSION;
+    Header.nRecordSize = sizeof(TSCSITraceRecord);
+    Header.nTicksPerSecond = CLOCKHZ;
+
+    UINT BytesWritten;
+    Result = f_write(&m_TraceFile, &Header, sizeof(Header), &BytesWritten);
+    if (Result != FR_OK || BytesWritten != sizeof(Header)) {
+        LOGERR("Failed to write header to trace file");
+        f_close(&m_TraceFile);
+        return FALSE;
+    }
+    f_sync(&m_TraceFile);
+
+    m_bFileInitialized = TRUE;
+    SCSITrace::Get().SetEnabled(TRUE);
+    LOGNOTE("Tracing SCSI commands to %s", m_pTraceFilePath);
+    return TRUE;
+}
+
+void CSCSITraceDaemon::Run(void) {
+    if (!m_bFileInitialized)
+        return;
+
+    SCSITrace &trace = SCSITrace::Get();
+    unsigned nLastSync = CTimer::Get()->GetTicks();
+    u32 nReportedDropped = 0;
+    boolean bDirty = FALSE;
+
+    while (m_bFileInitialized) {
+        unsigned nCount = trace.Read(m_Chunk, ChunkRecords);
+        if (nCount > 0) {
+            UINT nBytes = nCount * sizeof(TSCSITraceRecord);
+            UINT BytesWritten;
+            FRESULT Result = f_write(&m_TraceFile, m_Chunk, nBytes, &BytesWritten);
+            if (Result != FR_OK || BytesWritten != nBytes) {
+                LOGERR("Failed to write to trace file (%d), tracing stopped", Result);
+                trace.SetEnabled(FALSE);
+                f_close(&m_TraceFile);
+                m_bFileInitialized = FALSE;
+                break;
+            }
+            bDirty = TRUE;
+        }
+
+        unsigned nNow = CTimer::Get()->GetTicks();
+        if (bDirty && nNow - nLastSync >= SyncSeconds * HZ) {
+            f_sync(&m_TraceFile);
+            nLastSync = nNow;
+            bDirty = FALSE;
+
+            u32 nDropped = trace.GetDropped();
+            if (nDropped != nReportedDropped) {
+                LOGWARN("%u trace records dropped, the SD card can't keep up", nDropped - nReportedDropped);
+                nReportedDropped = nDropped;
+            }
+        }
+
+        // Let the ring fill up again unless there is a backlog
+        if (nCount < ChunkRecords)
+            CScheduler::Get()->MsSleep(PollMs);
+    }
+}
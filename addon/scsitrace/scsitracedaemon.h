@@ -0,0 +1,61 @@
+//
+// Drains the SCSI trace ring to a file on the SD card
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _SCSITRACEDAEMON_H
+#define _SCSITRACEDAEMON_H
+
+#include <circle/macros.h>
+#include <circle/sched/task.h>
+#include <circle/types.h>
+#include <fatfs/ff.h>
+#include <scsitrace/scsitrace.h>
+
+#define SCSI_TRACE_MAGIC "USBODETR"
+#define SCSI_TRACE_VERSION 1
+
+// Starts every trace file, followed by TSCSITraceRecords up to the end
+struct TSCSITraceFileHeader {
+    char Magic[8];           // SCSI_TRACE_MAGIC, not terminated
+    u16 nVersion;            // SCSI_TRACE_VERSION
+    u16 nRecordSize;         // sizeof (TSCSITraceRecord)
+    u32 nTicksPerSecond;     // unit of the record timestamps
+} PACKED;
+
+class CSCSITraceDaemon : public CTask {
+   public:
+    // The file is truncated, each boot starts a new trace
+    CSCSITraceDaemon(const char *pTraceFilePath);
+    ~CSCSITraceDaemon(void);
+
+    void Run(void);
+
+   private:
+    boolean Initialize(void);
+
+   private:
+    static const unsigned ChunkRecords = 128;    // records per f_write
+    static const unsigned PollMs = 20;           // when the ring is empty
+    static const unsigned SyncSeconds = 1;
+
+    const char *m_pTraceFilePath;
+    FIL m_TraceFile;
+    boolean m_bFileInitialized;
+    TSCSITraceRecord m_Chunk[ChunkRecords];
+};
+
+#endif
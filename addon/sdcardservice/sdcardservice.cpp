@@ -32,9 +32,11 @@ LOGMODULE("sdcard");
 
 SDCARDService *SDCARDService::s_pThis = 0;
 
-SDCARDService::SDCARDService(CDevice *pDevice)
+SDCARDService::SDCARDService(CDevice *pDevice, unsigned nMaxBlocks, unsigned nWriteBehindChunks)
 : CTask (SDCARD_STACK_SIZE),
-  m_pDevice(pDevice)
+  m_pDevice(pDevice),
+  m_nMaxBlocks(nMaxBlocks),
+  m_nWriteBehindChunks(nWriteBehindChunks)
 {
       
     // I am the one and only!
@@ -49,7 +51,8 @@ SDCARDService::SDCARDService(CDevice *pDevice)
 
 boolean SDCARDService::Initialize() {
     LOGNOTE("SDCARD Initializing");
-    m_MSDGadget = new CUSBMMSDGadget(CInterruptSystem::Get(), CKernelOptions::Get()->GetUSBFullSpeed(), m_pDevice);
+    m_MSDGadget = new CUSBMMSDGadget(CInterruptSystem::Get(), CKernelOptions::Get()->GetUSBFullSpeed(), m_pDevice,
+                                     m_nMaxBlocks, m_nWriteBehindChunks);
     if (!m_MSDGadget->Initialize()) {
         LOGERR("Failed to initialize USB MSD gadget");
         return false;
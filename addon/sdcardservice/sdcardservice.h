@@ -34,7 +34,10 @@
 
 class SDCARDService : public CTask {
    public:
-    SDCARDService(CDevice *pDevice);
+    /// \param nMaxBlocks Blocks per USB transfer, 0 for the gadget's default
+    /// \param nWriteBehindChunks Transfers buffered before they are written
+    SDCARDService(CDevice *pDevice, unsigned nMaxBlocks = 0,
+                  unsigned nWriteBehindChunks = CUSBMMSDGadget::DefaultWriteBehindChunks);
     ~SDCARDService(void);
     boolean Initialize();
     void Run(void);
@@ -42,6 +45,8 @@ class SDCARDService : public CTask {
    private:
    private:
     CDevice *m_pDevice;
+    unsigned m_nMaxBlocks;
+    unsigned m_nWriteBehindChunks;
     CUSBMMSDGadget* m_MSDGadget = nullptr;
     static SDCARDService *s_pThis;
     bool isInitialized = false;
@@ -0,0 +1,119 @@
+//
+// A cache of the replies to SCSI commands that only describe the disc
+//
+// READ TOC, READ DISC INFORMATION, MODE SENSE and GET CONFIGURATION replies
+// don't change while a disc is mounted, but some hosts poll them many times
+// a second. The full reply is kept, keyed on the CDB without its allocation
+// length and control bytes, so a hit is a copy trimmed to what the host
+// asked for. The gadget invalidates the cache whenever the disc changes.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include "scsiresponsecache.h"
+
+#include <assert.h>
+#include <circle/util.h>
+
+CSCSIResponseCache::CSCSIResponseCache(void)
+    : m_nNextEntry(0),
+      m_nHits(0),
+      m_nMisses(0) {
+    Invalidate();
+}
+
+boolean CSCSIResponseCache::IsCacheable(u8 opcode) {
+    switch (opcode) {
+        case 0x1A:  // Mode Sense (6)
+        case 0x43:  // Read TOC
+        case 0x46:  // Get Configuration
+        case 0x51:  // Read Disc Information
+        case 0x5A:  // Mode Sense (10)
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+int CSCSIResponseCache::Lookup(const u8* pCDB, u8* pBuffer) {
+    assert(IsCacheable(pCDB[0]));
+
+    u8 Key[KeySize];
+    GetKey(pCDB, Key);
+
+    for (unsigned i = 0; i < MaxEntries; i++) {
+        const TEntry& entry = m_Entries[i];
+        if (!entry.bValid || memcmp(entry.Key, Key, KeySize) != 0)
+            continue;
+
+        unsigned nLength = entry.nLength;
+        unsigned nAllocationLength = GetAllocationLength(pCDB);
+        if (nAllocationLength < nLength)
+            nLength = nAllocationLength;
+
+        memcpy(pBuffer, entry.Reply, nLength);
+        m_nHits++;
+        return nLength;
+    }
+
+    m_nMisses++;
+    return -1;
+}
+
+void CSCSIResponseCache::Store(const u8* pCDB, const u8* pReply, size_t nLength) {
+    assert(IsCacheable(pCDB[0]));
+
+    if (nLength > MaxReplySize)
+        return;
+
+    TEntry& entry = m_Entries[m_nNextEntry];
+    m_nNextEntry = (m_nNextEntry + 1) % MaxEntries;
+
+    GetKey(pCDB, entry.Key);
+    memcpy(entry.Reply, pReply, nLength);
+    entry.nLength = nLength;
+    entry.bValid = TRUE;
+}
+
+void CSCSIResponseCache::Invalidate(void) {
+    for (unsigned i = 0; i < MaxEntries; i++)
+        m_Entries[i].bValid = FALSE;
+
+    m_nNextEntry = 0;
+}
+
+// The key is the CDB with the allocation length and control bytes zeroed,
+// so hosts asking for the header first and the whole reply next share it
+void CSCSIResponseCache::GetKey(const u8* pCDB, u8* pKey) {
+    if (pCDB[0] == 0x1A) {
+        memcpy(pKey, pCDB, 6);
+        pKey[4] = 0;
+        pKey[5] = 0;
+        memset(pKey + 6, 0, KeySize - 6);
+    } else {
+        memcpy(pKey, pCDB, 10);
+        pKey[7] = 0;
+        pKey[8] = 0;
+        pKey[9] = 0;
+    }
+}
+
+unsigned CSCSIResponseCache::GetAllocationLength(const u8* pCDB) {
+    if (pCDB[0] == 0x1A)
+        return pCDB[4];
+
+    return (pCDB[7] << 8) | pCDB[8];
+}
@@ -0,0 +1,69 @@
+//
+// A cache of the replies to SCSI commands that only describe the disc
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _SCSIRESPONSECACHE_H
+#define _SCSIRESPONSECACHE_H
+
+#include <circle/types.h>
+
+class CSCSIResponseCache {
+   public:
+    CSCSIResponseCache(void);
+
+    /// \return TRUE if replies to this opcode may be cached
+    static boolean IsCacheable(u8 opcode);
+
+    /// \brief Look up the reply to a command
+    /// \param pCDB Command descriptor block, the opcode must be cacheable
+    /// \param pBuffer Receives the reply, trimmed to the allocation length
+    /// \return Number of bytes copied, or < 0 if the reply isn't cached
+    int Lookup(const u8* pCDB, u8* pBuffer);
+
+    /// \brief Remember the full (untrimmed) reply to a command
+    void Store(const u8* pCDB, const u8* pReply, size_t nLength);
+
+    /// \brief Forget everything, call when the disc or a mode page changes
+    void Invalidate(void);
+
+    u32 GetHits(void) const { return m_nHits; }
+    u32 GetMisses(void) const { return m_nMisses; }
+
+   private:
+    static void GetKey(const u8* pCDB, u8* pKey);
+    static unsigned GetAllocationLength(const u8* pCDB);
+
+   private:
+    static const unsigned MaxEntries = 16;
+    static const unsigned MaxReplySize = 1024;
+    static const unsigned KeySize = 10;
+
+    struct TEntry {
+        boolean bValid;
+        u8 Key[KeySize];
+        u16 nLength;
+        u8 Reply[MaxReplySize];
+    };
+
+    TEntry m_Entries[MaxEntries];
+    unsigned m_nNextEntry;  // round robin replacement
+
+    u32 m_nHits;
+    u32 m_nMisses;
+};
+
+#endif
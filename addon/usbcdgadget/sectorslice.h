@@ -0,0 +1,38 @@
+//
+// Copies the part of each sector a READ CD asked for out of a batch read
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef _SECTORSLICE_H
+#define _SECTORSLICE_H
+
+#include <circle/types.h>
+#include <circle/util.h>
+
+// pSrc holds nSectors sectors of nSectorSize bytes back to back. The
+// nSliceSize bytes at nSkip in each of them end up packed together in
+// pDest. Kept apart from the gadget so test/ can check it on the host
+static inline void CopySectorSlices(u8* pDest, const u8* pSrc, u32 nSectors,
+                                    u32 nSectorSize, u32 nSkip, u32 nSliceSize) {
+    const u8* pSlice = pSrc + nSkip;
+    for (u32 i = 0; i < nSectors; ++i) {
+        memcpy(pDest, pSlice, nSliceSize);
+        pSlice += nSectorSize;
+        pDest += nSliceSize;
+    }
+}
+
+#endif
@@ -29,6 +29,7 @@
 #include <circle/sysconfig.h>
 #include <usbcdgadget/usbcdgadget.h>
 #include <usbcdgadget/usbcdgadgetendpoint.h>
+#include <usbcdgadget/sectorslice.h>
 #include <circle/util.h>
 #include <math.h>
 #include <stddef.h>
@@ -145,13 +146,45 @@ const char* const CUSBCDGadget::s_StringDescriptorTemplate[] =
         "USBODE00001"         // Template Serial Number (index 3) - will be replaced with hardware serial
     };
 
-CUSBCDGadget::CUSBCDGadget(CInterruptSystem* pInterruptSystem, boolean isFullSpeed, ICueDevice* pDevice)
+CUSBCDGadget::TSCSIHandler CUSBCDGadget::s_SCSIHandlers[256];
+
+CUSBCDGadget::CUSBCDGadget(CInterruptSystem* pInterruptSystem, boolean isFullSpeed, ICueDevice* pDevice,
+                           unsigned nMaxBlocks, unsigned nReadAheadBlocks)
     : CDWUSBGadget(pInterruptSystem, isFullSpeed ? FullSpeed : HighSpeed),
-      m_pDevice(pDevice),
+      m_pDevice(nullptr),
       m_pEP{nullptr, nullptr, nullptr}
 {
     MLOGNOTE("CUSBCDGadget::CUSBCDGadget", "entered %d", isFullSpeed);
     m_IsFullSpeed = isFullSpeed;
+
+    InitSCSIHandlers();
+    SCSIStats::Get().SetGadget("cd");
+
+    // Size the transfer buffers. A raw sector batch must not need more
+    // packets than the endpoint can send in one go
+    size_t nPacketSize = isFullSpeed ? 64 : 512;
+    unsigned nHardwareLimit = MaxPacketsPerTransfer * nPacketSize / MaxSectorSize;
+    if (nMaxBlocks == 0)
+        nMaxBlocks = isFullSpeed ? DefaultMaxBlocksFullSpeed : DefaultMaxBlocksHighSpeed;
+    if (nMaxBlocks > nHardwareLimit)
+        nMaxBlocks = nHardwareLimit;
+    if (nMaxBlocks < MinMaxBlocks)
+        nMaxBlocks = MinMaxBlocks;
+    m_nMaxBlocksToRead = nMaxBlocks;
+    m_nMaxInMessageSize = m_nMaxBlocksToRead * MaxSectorSize;
+    MLOGNOTE("CUSBCDGadget::CUSBCDGadget", "Up to %u blocks (%u bytes) per transfer",
+             m_nMaxBlocksToRead, (unsigned)m_nMaxInMessageSize);
+
+    m_FileChunk = new u8[m_nMaxInMessageSize];
+    m_InBuffer = AllocateDMABuffer(m_nMaxInMessageSize);
+    m_ReadAheadBuffer = AllocateDMABuffer(m_nMaxInMessageSize);
+    m_pDataInBuffer[0] = m_InBuffer;
+    m_pDataInBuffer[1] = m_ReadAheadBuffer;
+
+    m_pTrackTable = new CTrackTable;
+    m_pReadAheadCache = new CReadAheadCache(nReadAheadBlocks, m_nMaxBlocksToRead);
+    m_pMetadataCache = new CIsoMetadataCache;
+
     // Fetch hardware serial number for unique USB device identification
     CBcmPropertyTags Tags;
     TPropertyTagSerial Serial;
@@ -182,6 +215,17 @@ CUSBCDGadget::~CUSBCDGadget(void) {
     assert(0);
 }
 
+// Returns a cache line aligned buffer with a cache line padded size, so that
+// it can be used for DMA. The gadget lives as long as the system, so these
+// buffers are never freed
+u8* CUSBCDGadget::AllocateDMABuffer(size_t nSize) {
+    const uintptr nAlign = DATA_CACHE_LINE_SIZE_MAX;
+    nSize = (nSize + nAlign - 1) & ~(nAlign - 1);
+    uintptr nBuffer = (uintptr) new u8[nSize + nAlign - 1];
+    assert(nBuffer != 0);
+    return (u8*)((nBuffer + nAlign - 1) & ~(nAlign - 1));
+}
+
 const void* CUSBCDGadget::GetDescriptor(u16 wValue, u16 wIndex, size_t* pLength) {
     MLOGNOTE("CUSBCDGadget::GetDescriptor", "entered");
     assert(pLength);
@@ -261,52 +305,137 @@ void CUSBCDGadget::AddEndpoints(void) {
 }
 
 // must set device before usb activation
+//
+// A disc swap goes through the media states. The old disc is reported gone
+// at once, while the new one's track table and metadata cache are built
+// here, off to the side. Update() then puts it in between two commands, so
+// no transfer is ever left reading a deleted device, and the next command
+// reports the change as a UNIT ATTENTION
 void CUSBCDGadget::SetDevice(ICueDevice* dev) {
     MLOGNOTE("CUSBCDGadget::SetDevice", "entered");
- 
-    // Are we changing the device?
-    if (m_pDevice && m_pDevice != dev) {
-        MLOGNOTE("CUSBCDGadget::SetDevice", "Changing device");
-
-        delete m_pDevice;
-        m_pDevice = nullptr;
-
-        // Tell the host the disc has changed
-	// TODO: implement a state engine to manage this transition
-        bmCSWStatus = CD_CSW_STATUS_FAIL;
-        m_SenseParams.bSenseKey = 0x02;           // Not Ready
-        m_SenseParams.bAddlSenseCode = 0x3a;      // MEDIUM NOT PRESENT
-        m_SenseParams.bAddlSenseCodeQual = 0x00;  
-	discChanged = true;
-    }
+    unsigned nStart = CTimer::GetClockTicks();
+
+    EnterCritical(IRQ_LEVEL);
+    if (m_MediaState != MediaNoMedium)
+        m_nMediaEvent = MediaEventRemoval;
+    m_MediaState = MediaEjecting;
+    m_nMediaChangeStart = nStart;
+    LeaveCritical();
+
+    CTrackTable* pTrackTable = new CTrackTable;
+    CIsoMetadataCache* pMetadataCache = new CIsoMetadataCache;
+    int nBlockSize = 2048;
+    int nSkipBytes = 0;
+    if (dev != nullptr) {
+        // Parse the cue sheet once
+        if (!pTrackTable->Build(dev->GetCueSheet(), dev->GetSize()))
+            MLOGERR("CUSBCDGadget::SetDevice", "Cannot parse the cue sheet");
+
+        const TTrackEntry* pFirstTrack = pTrackTable->GetEntry(0);
+        if (pFirstTrack != nullptr) {
+            nBlockSize = GetBlocksizeForTrack(*pFirstTrack);
+            nSkipBytes = GetSkipbytesForTrack(*pFirstTrack);
+        }
 
-    m_pDevice = dev;
+        // Pin the volume descriptors, path tables and directories, so the
+        // mount and directory listings don't have to go to the SD card
+        pMetadataCache->Build(dev, nBlockSize, nSkipBytes);
+    }
 
-    cueParser = CUEParser(m_pDevice->GetCueSheet());  // FIXME. Ensure cuesheet is not null or empty
+    // A disc set before this one and not put in yet is dropped
+    EnterCritical(IRQ_LEVEL);
+    ICueDevice* pOldDevice = nullptr;
+    CTrackTable* pOldTrackTable = nullptr;
+    CIsoMetadataCache* pOldMetadataCache = nullptr;
+    if (m_bMediaPending) {
+        pOldDevice = m_pPendingDevice;
+        pOldTrackTable = m_pPendingTrackTable;
+        pOldMetadataCache = m_pPendingMetadataCache;
+    }
+    m_pPendingDevice = dev;
+    m_pPendingTrackTable = pTrackTable;
+    m_pPendingMetadataCache = pMetadataCache;
+    m_nPendingBlockSize = nBlockSize;
+    m_nPendingSkipBytes = nSkipBytes;
+    m_bMediaPending = TRUE;
+    if (dev != nullptr)
+        m_MediaState = MediaBecomingReady;
+    LeaveCritical();
+
+    if (pOldDevice != nullptr && pOldDevice != dev && pOldDevice != m_pDevice)
+        delete pOldDevice;
+    delete pOldTrackTable;
+    delete pOldMetadataCache;
+
+    MLOGNOTE("CUSBCDGadget::SetDevice", "Next disc prepared in %u ms, block size is %d",
+             (CTimer::GetClockTicks() - nStart) / 1000, nBlockSize);
+
+    // Before the gadget is active nothing can be using the old disc
+    if (m_nState == TCDState::Init)
+        InstallPendingMedia();
+}
 
-    MLOGNOTE("CUSBCDGadget::SetDevice", "entered");
+// Puts in the disc prepared by SetDevice(). Called by Update() between two
+// commands, or by SetDevice() before the gadget is active
+void CUSBCDGadget::InstallPendingMedia(void) {
+    EnterCritical(IRQ_LEVEL);
+    if (!m_bMediaPending) {
+        LeaveCritical();
+        return;
+    }
 
-    data_skip_bytes = GetSkipbytes();
-    data_block_size = GetBlocksize();
+    ICueDevice* pOldDevice = m_pDevice;
+    CTrackTable* pOldTrackTable = m_pTrackTable;
+    CIsoMetadataCache* pOldMetadataCache = m_pMetadataCache;
+
+    m_pDevice = m_pPendingDevice;
+    m_pTrackTable = m_pPendingTrackTable;
+    m_pMetadataCache = m_pPendingMetadataCache;
+    data_block_size = m_nPendingBlockSize;
+    data_skip_bytes = m_nPendingSkipBytes;
+    m_bMediaPending = FALSE;
+
+    // Replies cached for the old disc go with it
+    m_ResponseCache.Invalidate();
+
+    m_CDReady = m_pDevice != nullptr;
+    if (m_pDevice != nullptr) {
+        m_MediaState = MediaUnitAttention;
+        m_nMediaEvent = MediaEventNewMedia;
+    } else {
+        m_MediaState = MediaNoMedium;
+    }
+    LeaveCritical();
 
-    m_CDReady = true;
-    MLOGNOTE("CUSBCDGadget::SetDevice", "Block size is %d, m_CDReady = %d", block_size, m_CDReady);
+    MLOGNOTE("CUSBCDGadget::InstallPendingMedia", "Response cache had %u hits, %u misses",
+             m_ResponseCache.GetHits(), m_ResponseCache.GetMisses());
+    m_pReadAheadCache->SetDevice(m_pDevice);
 
     // Hand the device to the CD Player
     CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
     if (cdplayer) {
-        cdplayer->SetDevice(dev);
-        MLOGNOTE("CUSBCDGadget::SetDevice", "Passed CueBinFileDevice to cd player");
+        cdplayer->SetDevice(m_pDevice);
+        MLOGNOTE("CUSBCDGadget::InstallPendingMedia", "Passed CueBinFileDevice to cd player");
+    }
+
+    if (pOldDevice != nullptr && pOldDevice != m_pDevice) {
+        MLOGNOTE("CUSBCDGadget::InstallPendingMedia", "Changing device");
+        delete pOldDevice;
     }
+    delete pOldTrackTable;
+    delete pOldMetadataCache;
+
+    MLOGNOTE("CUSBCDGadget::InstallPendingMedia", "%s after %u ms",
+             m_pDevice ? "New disc in" : "Disc removed",
+             (CTimer::GetClockTicks() - m_nMediaChangeStart) / 1000);
 }
 
 int CUSBCDGadget::GetBlocksize() {
-    cueParser.restart();
-    const CUETrackInfo* trackInfo = cueParser.next_track();
-    return GetBlocksizeForTrack(*trackInfo);
+    const TTrackEntry* trackInfo = m_pTrackTable->GetEntry(0);
+    return trackInfo ? GetBlocksizeForTrack(*trackInfo) : 2048;
 }
 
-int CUSBCDGadget::GetBlocksizeForTrack(CUETrackInfo trackInfo) {
+int CUSBCDGadget::GetBlocksizeForTrack(const TTrackEntry& trackInfo) {
     switch (trackInfo.track_mode) {
         case CUETrack_MODE1_2048:
             MLOGNOTE("CUSBCDGadget::GetBlocksizeForTrack", "CUETrack_MODE1_2048");
@@ -327,12 +456,11 @@ int CUSBCDGadget::GetBlocksizeForTrack(CUETrackInfo trackInfo) {
 }
 
 int CUSBCDGadget::GetSkipbytes() {
-    cueParser.restart();
-    const CUETrackInfo* trackInfo = cueParser.next_track();
-    return GetSkipbytesForTrack(*trackInfo);
+    const TTrackEntry* trackInfo = m_pTrackTable->GetEntry(0);
+    return trackInfo ? GetSkipbytesForTrack(*trackInfo) : 0;
 }
 
-int CUSBCDGadget::GetSkipbytesForTrack(CUETrackInfo trackInfo) {
+int CUSBCDGadget::GetSkipbytesForTrack(const TTrackEntry& trackInfo) {
     switch (trackInfo.track_mode) {
         case CUETrack_MODE1_2048:
             MLOGDEBUG("CUSBCDGadget::GetSkipbytesForTrack", "CUETrack_MODE1_2048");
@@ -354,119 +482,46 @@ int CUSBCDGadget::GetSkipbytesForTrack(CUETrackInfo trackInfo) {
 
 // Make an assumption about media type based on track 1 mode
 int CUSBCDGadget::GetMediumType() {
-    cueParser.restart();
-    const CUETrackInfo* trackInfo = nullptr;
-    cueParser.restart();
-    while ((trackInfo = cueParser.next_track()) != nullptr) {
-        if (trackInfo->track_number == 1 && trackInfo->track_mode == CUETrack_AUDIO)
-            // Audio CD
-            return 0x02;
-        else if (trackInfo->track_number > 1)
-            // Mixed mode
-            return 0x03;
-    }
+    const TTrackEntry* trackInfo = m_pTrackTable->GetEntry(0);
+    if (trackInfo && trackInfo->track_number == 1 && trackInfo->track_mode == CUETrack_AUDIO)
+        // Audio CD
+        return 0x02;
+    else if (m_pTrackTable->GetCount() > 1)
+        // Mixed mode
+        return 0x03;
+
     // Must be a data cd
     return 0x01;
 }
 
-CUETrackInfo CUSBCDGadget::GetTrackInfoForTrack(int track) {
-    const CUETrackInfo* trackInfo = nullptr;
-    cueParser.restart();
-    while ((trackInfo = cueParser.next_track()) != nullptr) {
-        if (trackInfo->track_number == track) {
-            return *trackInfo; // Safe copy — all fields are POD
-        }
-    }
+TTrackEntry CUSBCDGadget::GetTrackInfoForTrack(int track) {
+    const TTrackEntry* trackInfo = m_pTrackTable->GetTrack(track);
+    if (trackInfo != nullptr)
+        return *trackInfo;
 
-    CUETrackInfo invalid = {};
+    TTrackEntry invalid = {};
     invalid.track_number = -1;
     return invalid;
 }
 
-CUETrackInfo CUSBCDGadget::GetTrackInfoForLBA(u32 lba) {
-    const CUETrackInfo* trackInfo;
+TTrackEntry CUSBCDGadget::GetTrackInfoForLBA(u32 lba) {
     MLOGDEBUG("CUSBCDGadget::GetTrackInfoForLBA", "Searching for LBA %u", lba);
 
-    cueParser.restart();
-
-    // Shortcut for LBA zero
-    if (lba == 0) {
-        MLOGDEBUG("CUSBCDGadget::GetTrackInfoForLBA", "Shortcut lba == 0 returning first track");
-        const CUETrackInfo* firstTrack = cueParser.next_track();  // Return the first track
-	if (firstTrack != nullptr) {
-            return *firstTrack;
-        } else {
-            CUETrackInfo invalid = {};
-            invalid.track_number = -1;
-            return invalid;
-        }
-    }
-
-    // Iterate to find our track
-    CUETrackInfo lastTrack = {};
-    lastTrack.track_number = -1;
-    while ((trackInfo = cueParser.next_track()) != nullptr) {
-        MLOGDEBUG("CUSBCDGadget::GetTrackInfoForLBA", "Iterating: Current Track %d track_start is %lu", trackInfo->track_number, trackInfo->track_start);
-
-        //  Shortcut for when our LBA is the start address of this track
-        if (trackInfo->track_start == lba) {
-            MLOGDEBUG("CUSBCDGadget::GetTrackInfoForLBA", "Shortcut track_start == lba, returning track %d", trackInfo->track_number);
-            return *trackInfo;
-        }
-
-        if (lba < trackInfo->track_start) {
-            MLOGDEBUG("CUSBCDGadget::GetTrackInfoForLBA", "Found LBA %lu in track %d", lba, lastTrack.track_number);
-            return lastTrack;
-        }
-
-	lastTrack = *trackInfo;
-    }
+    const TTrackEntry* trackInfo = m_pTrackTable->GetTrackForLBA(lba);
+    if (trackInfo != nullptr)
+        return *trackInfo;
 
-    MLOGDEBUG("CUSBCDGadget::GetTrackInfoForLBA", "Returning last track");
-    return lastTrack;
+    TTrackEntry invalid = {};
+    invalid.track_number = -1;
+    return invalid;
 }
 
 u32 CUSBCDGadget::GetLeadoutLBA() {
-    const CUETrackInfo* trackInfo = nullptr;
-    u32 file_offset = 0;
-    u32 sector_length = 0;
-    u32 track_start = 0;
-
-    // Find the last track
-    cueParser.restart();
-    while ((trackInfo = cueParser.next_track()) != nullptr) {
-        file_offset = trackInfo->file_offset;
-        sector_length = trackInfo->sector_length;
-        track_start = trackInfo->data_start; // I think this is right
-    }
-
-    u32 deviceSize = (u32)m_pDevice->GetSize();
-
-    // We know the start position of the last track, and we know its sector length
-    // and we know the file size, so we can work out the LBA of the end of the last track
-    // We can't just divide the file size by sector size because sectors lengths might
-    // not be consistent (e.g. multi-mode cd where track 1 is 2048
-    u32 lastTrackBlocks = (deviceSize - file_offset) / sector_length;
-    u32 ret = track_start + lastTrackBlocks;
-    //MLOGNOTE("CUSBCDGadget::GetLeadoutLBA", "device size is %lu, last track file offset is %lu, last track sector_length is %lu, last track track_start is %lu, lastTrackBlocks = %lu, returning = %lu", deviceSize, file_offset, sector_length, track_start, lastTrackBlocks, ret);
-
-    // Some corrupted cd images might have a cue that references track that are
-    // outside the bin.
-    if (deviceSize < file_offset)
-        return track_start;
-
-    return ret;
+    return m_pTrackTable->GetLeadoutLBA();
 }
 
 int CUSBCDGadget::GetLastTrackNumber() {
-    const CUETrackInfo* trackInfo = nullptr;
-    int lastTrack = 1;
-    cueParser.restart();
-    while ((trackInfo = cueParser.next_track()) != nullptr) {
-        if (trackInfo->track_number > lastTrack)
-            lastTrack = trackInfo->track_number;
-    }
-    return lastTrack;
+    return m_pTrackTable->GetLastTrackNumber();
 }
 
 void CUSBCDGadget::CreateDevice(void) {
@@ -482,6 +537,7 @@ void CUSBCDGadget::OnSuspend(void) {
     delete m_pEP[EPIn];
     m_pEP[EPIn] = nullptr;
 
+    m_ReadAheadState = ReadAheadIdle;
     m_nState = TCDState::Init;
 }
 
@@ -522,6 +578,16 @@ int CUSBCDGadget::OnClassOrVendorRequest(const TSetupData* pSetupData, u8* pData
 void CUSBCDGadget::OnTransferComplete(boolean bIn, size_t nLength) {
     //MLOGNOTE("OnXferComplete", "state = %i, dir = %s, len=%i ",m_nState,bIn?"IN":"OUT",nLength);
     assert(m_nState != TCDState::Init);
+
+    // The handler running in Update() may not have set the state, the CSW
+    // status or the block count for this yet
+    if (m_bHandlerRunning) {
+        m_bCompletionDeferred = TRUE;
+        m_bDeferredIn = bIn;
+        m_nDeferredLength = nLength;
+        return;
+    }
+
     if (bIn)  // packet to host has been transferred
     {
         switch (m_nState) {
@@ -532,7 +598,15 @@ void CUSBCDGadget::OnTransferComplete(boolean bIn, size_t nLength) {
                 break;
             }
             case TCDState::DataIn: {
-                if (m_nnumber_blocks > 0) {
+                m_nCommandBytes += nLength;
+                if (m_ReadAheadState == ReadAheadReady) {
+                    BeginReadAheadTransfer();  // next batch is ready
+                } else if (m_ReadAheadState == ReadAheadBusy) {
+                    m_nState = TCDState::DataInWait;  // Update() sends it when read
+                } else if (m_ReadAheadState == ReadAheadFailed) {
+                    m_ReadAheadState = ReadAheadIdle;
+                    SendCSW();  // status set by FillDataInBuffer()
+                } else if (m_nnumber_blocks > 0) {
                     if (m_CDReady) {
                         m_nState = TCDState::DataInRead;  // see Update function
                     } else {
@@ -551,6 +625,7 @@ void CUSBCDGadget::OnTransferComplete(boolean bIn, size_t nLength) {
                 break;
             }
             case TCDState::SendReqSenseReply: {
+                m_nCommandBytes += nLength;
                 SendCSW();
                 break;
             }
@@ -569,19 +644,8 @@ void CUSBCDGadget::OnTransferComplete(boolean bIn, size_t nLength) {
                     m_pEP[EPIn]->StallRequest(true);
                     break;
                 }
-                memcpy(&m_CBW, m_OutBuffer, SIZE_CBW);
-                if (m_CBW.dCBWSignature != VALID_CBW_SIG) {
-                    MLOGERR("ReceiveCBW", "Invalid CBW sig = 0x%x",
-                            m_CBW.dCBWSignature);
-                    m_pEP[EPIn]->StallRequest(true);
-                    break;
-                }
-                m_CSW.dCSWTag = m_CBW.dCBWTag;
-                if (m_CBW.bCBWCBLength <= 16 && m_CBW.bCBWLUN == 0)  // meaningful CBW
-                {
-                    HandleSCSICommand();  // will update m_nstate
-                    break;
-                }  // TODO: response for not meaningful CBW
+                if (QueueCBW())
+                    m_nState = TCDState::CommandQueued;  // see Update function
                 break;
             }
 
@@ -589,8 +653,12 @@ void CUSBCDGadget::OnTransferComplete(boolean bIn, size_t nLength) {
                 MLOGNOTE("OnXferComplete", "state = %i, dir = %s, len=%i ", m_nState, bIn ? "IN" : "OUT", nLength);
                 // process block from host
                 // assert(m_nnumber_blocks>0);
+                m_nCommandBytes += nLength;
 
-                ProcessOut(nLength);
+                // The payload changes the player and the cached replies,
+                // so it is applied at task level
+                m_nDataOutLength = nLength;
+                m_nState = TCDState::DataOutReceived;  // see Update function
 
                 /*
                 if(m_CDReady)
@@ -607,7 +675,6 @@ void CUSBCDGadget::OnTransferComplete(boolean bIn, size_t nLength) {
                         SendCSW();
                 }
                 */
-                SendCSW();
                 break;
             }
 
@@ -635,6 +702,9 @@ void CUSBCDGadget::ProcessOut(size_t nLength) {
              m_OutBuffer[16], m_OutBuffer[17], m_OutBuffer[18], m_OutBuffer[19],
              m_OutBuffer[20], m_OutBuffer[21], m_OutBuffer[22], m_OutBuffer[23]);
 
+    // Mode pages may change, so cached Mode Sense replies are stale
+    m_ResponseCache.Invalidate();
+
     // Process our Parameter List
     u8 modePage = m_OutBuffer[9];
 
@@ -652,14 +722,20 @@ void CUSBCDGadget::ProcessOut(size_t nLength) {
 		// Mode Select (10), Volume is 255,0
 		// Mode Select (10), Volume is 74,255
 		// Mode Select (10), Volume is 255,74
-		// So, we'll pick the minimum of the two
+		// So when a page mirrors the one before it, we'll pick the minimum
+		// of the two. Otherwise each channel gets its own volume
+		u8 left = modePage->Output0Volume;
+		u8 right = modePage->Output1Volume;
+		boolean bMirrored = left != right && left == m_nLastVolume1 && right == m_nLastVolume0;
+		m_nLastVolume0 = left;
+		m_nLastVolume1 = right;
+		if (bMirrored) {
+		    left = left < right ? left : right;
+		    right = left;
+		}
 
             	MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "CDPlayer set volume"); 
-		cdplayer->SetVolume(
-		    modePage->Output0Volume < modePage->Output1Volume
-			? modePage->Output0Volume
-			: modePage->Output1Volume
-		);
+		cdplayer->SetVolume(left, right);
             } else {
             	MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Couldn't get CDPlayer");
 	    }
@@ -671,16 +747,61 @@ void CUSBCDGadget::ProcessOut(size_t nLength) {
 // will be called before vendor request 0xfe
 void CUSBCDGadget::OnActivate() {
     MLOGNOTE("CD OnActivate", "state = %i", m_nState);
-    m_CDReady = true;
     m_nState = TCDState::ReceiveCBW;
     m_pEP[EPOut]->BeginTransfer(CUSBCDGadgetEndpoint::TransferCBWOut, m_OutBuffer, SIZE_CBW);
 }
 
 void CUSBCDGadget::SendCSW() {
     // MLOGNOTE ("CUSBCDGadget::SendCSW", "entered");
-    memcpy(&m_InBuffer, &m_CSW, SIZE_CSW);
+    EndCommandStats();
+    memcpy(m_InBuffer, &m_CSW, SIZE_CSW);
+    m_nState = TCDState::SentCSW;  // before the transfer can complete
     m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferCSWIn, m_InBuffer, SIZE_CSW);
-    m_nState = TCDState::SentCSW;
+}
+
+void CUSBCDGadget::BeginCommandStats(unsigned nStartTicks) {
+    m_bCommandActive = TRUE;
+    m_nCommandStart = nStartTicks;
+    m_nCommandBytes = 0;
+}
+
+// A command ends with its CSW, whichever path it took to get there
+void CUSBCDGadget::EndCommandStats() {
+    if (!m_bCommandActive)
+        return;
+    m_bCommandActive = FALSE;
+    unsigned nTicks = CTimer::GetClockTicks() - m_nCommandStart;
+    SCSIStats::Get().Record(m_CBW.CBWCB[0], nTicks, m_nCommandBytes);
+    SCSITrace::Get().Record(m_CBW.CBWCB, m_CSW.bmCSWStatus, SCSITraceGadgetCD,
+                            m_nCommandStart, nTicks, m_nCommandBytes);
+}
+
+// Answer the command from the response cache if we can. Only while the disc
+// is ready and there's no error pending, since the handlers report those
+boolean CUSBCDGadget::SendCachedResponse() {
+    if (!m_CDReady || bmCSWStatus != CD_CSW_STATUS_OK)
+        return FALSE;
+
+    if (!CSCSIResponseCache::IsCacheable(m_CBW.CBWCB[0]))
+        return FALSE;
+
+    int length = m_ResponseCache.Lookup(m_CBW.CBWCB, m_InBuffer);
+    if (length < 0)
+        return FALSE;
+
+    // Everything the completion looks at is set before the transfer starts
+    m_nnumber_blocks = 0;  // nothing more after this send
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+    m_nState = TCDState::DataIn;
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
+    return TRUE;
+}
+
+// Called by the cacheable handlers with the full reply in m_InBuffer,
+// before it is trimmed to the allocation length
+void CUSBCDGadget::CacheResponse(size_t nLength) {
+    if (m_CDReady && bmCSWStatus == CD_CSW_STATUS_OK)
+        m_ResponseCache.Store(m_CBW.CBWCB, m_InBuffer, nLength);
 }
 
 u32 CUSBCDGadget::msf_to_lba(u8 minutes, u8 seconds, u8 frames) {
@@ -740,1781 +861,1996 @@ int CUSBCDGadget::GetSkipBytesFromMCS(uint8_t mainChannelSelection) {
     return offset;
 }
 
-// TODO: This entire method is a monster. Break up into a Function table of static methods
-//
-//  Each command lives in its own .cpp file with a class that has a static Handle() function.
-//  Then the table contains function pointers to those static methods.
-//
-//  This will mean we need to tidy up class global variables
-//
-//  e.g.
-//  "inquirycommand.h"
-//  class InquiryCommand {
-//  public:
-//      static void Handle(const uint8_t* cmd, void* context);
-//  };
-//
-//  "inquirycommand.cpp"
-//  #include "InquiryCommand.h"
-//  void InquiryCommand::Handle(const uint8_t* cmd, void* context) {
-//      // Fill m_InBuffer, set status, etc.
-//  }
-//
-//  ... and then the code in here
-//  #include "InquiryCommand.h"
-//  #include "RequestSenseCommand.h"
-//  etc...
-//
-//  typedef void (*SCSIHandler)(const uint8_t*, void*);
-//  SCSIHandler g_SCSIHandlers[256] = {
-//      /* initialized below */
-//  };
-//
-//  void InitSCSIHandlers() {
-//      g_SCSIHandlers[0x12] = InquiryCommand::Handle;
-//      g_SCSIHandlers[0x03] = RequestSenseCommand::Handle;
-//      ...
-//  }
-//
-//  https://chatgpt.com/share/683ecad4-e250-8012-b9aa-22c76de6e871
-//
-void CUSBCDGadget::HandleSCSICommand() {
-    //MLOGNOTE ("CUSBCDGadget::HandleSCSICommand", "SCSI Command is 0x%02x", m_CBW.CBWCB[0]);
-    switch (m_CBW.CBWCB[0]) {
-        case 0x00:  // Test unit ready
-        {
-            if (!m_CDReady) {
-                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Test Unit Ready (returning CD_CSW_STATUS_FAIL)");
-                bmCSWStatus = CD_CSW_STATUS_FAIL;
-                m_SenseParams.bSenseKey = 2;
-                m_SenseParams.bAddlSenseCode = 0x04;      // LOGICAL UNIT NOT READY
-                m_SenseParams.bAddlSenseCodeQual = 0x00;  // CAUSE NOT REPORTABLE
-            }
-	    
-            // MLOGNOTE ("CUSBCDGadget::HandleSCSICommand", "Test Unit Ready (returning CD_CSW_STATUS_FAIL)");
-            m_CSW.bmCSWStatus = bmCSWStatus;
-            SendCSW();
+// Checks the CBW in m_OutBuffer and queues it for Update(). Called from IRQ,
+// so nothing here decodes the command
+boolean CUSBCDGadget::QueueCBW(void) {
+    unsigned nHead = m_nCBWHead;
+    if (nHead - m_nCBWTail >= CBWQueueSize) {
+        MLOGERR("ReceiveCBW", "CBW queue full");
+        m_pEP[EPIn]->StallRequest(true);
+        return FALSE;
+    }
+
+    TQueuedCBW& entry = m_CBWQueue[nHead & (CBWQueueSize - 1)];
+    memcpy(&entry.CBW, m_OutBuffer, SIZE_CBW);
+    if (entry.CBW.dCBWSignature != VALID_CBW_SIG) {
+        MLOGERR("ReceiveCBW", "Invalid CBW sig = 0x%x",
+                entry.CBW.dCBWSignature);
+        m_pEP[EPIn]->StallRequest(true);
+        return FALSE;
+    }
+    if (entry.CBW.bCBWCBLength > 16 || entry.CBW.bCBWLUN != 0)
+        return FALSE;  // TODO: response for not meaningful CBW
+    entry.nTicks = CTimer::GetClockTicks();
+
+    // Publish the entry before moving the head past it
+    DataMemBarrier();
+    m_nCBWHead = nHead + 1;
+    return TRUE;
+}
+
+// Takes the queued CBW and runs its handler, at task level. The host waits
+// for our CSW before it sends another CBW, so only the newest entry is
+// live. Any older ones were left behind by a bus reset
+void CUSBCDGadget::HandleQueuedCBW(void) {
+    unsigned nHead = m_nCBWHead;
+    unsigned nTail = m_nCBWTail;
+    DataMemBarrier();
+    if (nHead == nTail)
+        return;
+    if (nHead - nTail > 1)
+        MLOGNOTE("HandleQueuedCBW", "Dropping %u stale CBWs", nHead - nTail - 1);
+
+    const TQueuedCBW& entry = m_CBWQueue[(nHead - 1) & (CBWQueueSize - 1)];
+    memcpy(&m_CBW, &entry.CBW, SIZE_CBW);
+    unsigned nStartTicks = entry.nTicks;
+
+    // Don't hand the slots back before we are done copying them
+    DataMemBarrier();
+    m_nCBWTail = nHead;
+
+    m_CSW.dCSWTag = m_CBW.dCBWTag;
+    m_nState = TCDState::CommandHandling;
+    m_bHandlerRunning = TRUE;
+    HandleSCSICommand(nStartTicks);  // will update m_nState
+
+    EnterCritical(IRQ_LEVEL);
+    m_bHandlerRunning = FALSE;
+    if (m_nState == TCDState::CommandHandling)
+        m_nState = TCDState::ReceiveCBW;  // the handler sent nothing
+
+    // Finish a transfer that completed while the handler was running, now
+    // that everything it sets is in place
+    if (m_bCompletionDeferred) {
+        m_bCompletionDeferred = FALSE;
+        OnTransferComplete(m_bDeferredIn, m_nDeferredLength);
+    }
+    LeaveCritical();
+}
+
+// Fails commands that need the disc while there isn't one loaded, with the
+// sense data of the media state, and reports a new disc as a UNIT ATTENTION
+// to the first command that isn't exempt from it
+boolean CUSBCDGadget::CheckMedium(void) {
+    u8 opcode = m_CBW.CBWCB[0];
+    switch (m_MediaState) {
+        case MediaLoaded:
+            return TRUE;
+
+        case MediaUnitAttention:
+            if (!ReportsUnitAttention(opcode))
+                return TRUE;
+            MLOGNOTE("CUSBCDGadget::CheckMedium", "Reporting the new disc, %u ms after the swap began",
+                     (CTimer::GetClockTicks() - m_nMediaChangeStart) / 1000);
+            m_MediaState = MediaLoaded;
+            m_SenseParams.bSenseKey = 0x06;           // Unit Attention
+            m_SenseParams.bAddlSenseCode = 0x28;      // NOT READY TO READY CHANGE
+            m_SenseParams.bAddlSenseCodeQual = 0x00;  // MEDIUM MAY HAVE CHANGED
             break;
-        }
 
-        case 0x03:  // Request sense CMD
-        {
-            // This command is the host asking why the last command generated a check condition
-            // We'll clear the reason after we've communicated it. If it's still an issue, we'll
-            // throw another Check Condition afterwards
-            //bool desc = m_CBW.CBWCB[1] & 0x01;
-            u8 blocks = (u8)(m_CBW.CBWCB[4]);
+        case MediaBecomingReady:
+            if (!NeedsMedium(opcode))
+                return TRUE;
+            m_SenseParams.bSenseKey = 0x02;           // Not Ready
+            m_SenseParams.bAddlSenseCode = 0x04;      // LOGICAL UNIT NOT READY
+            m_SenseParams.bAddlSenseCodeQual = 0x01;  // IN PROCESS OF BECOMING READY
+            break;
+
+        default:
+            if (!NeedsMedium(opcode))
+                return TRUE;
+            m_SenseParams.bSenseKey = 0x02;           // Not Ready
+            m_SenseParams.bAddlSenseCode = 0x3a;      // MEDIUM NOT PRESENT
+            m_SenseParams.bAddlSenseCodeQual = 0x00;
+            break;
+    }
+
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;
+    SendCSW();
+    return FALSE;
+}
+
+// Commands that read or play the disc, or report on it
+boolean CUSBCDGadget::NeedsMedium(u8 nOpCode) {
+    switch (nOpCode) {
+        case 0x00:  // TEST UNIT READY
+        case 0x25:  // READ CAPACITY
+        case 0x28:  // READ (10)
+        case 0x2B:  // SEEK
+        case 0x42:  // READ SUB-CHANNEL
+        case 0x43:  // READ TOC
+        case 0x45:  // PLAY AUDIO (10)
+        case 0x47:  // PLAY AUDIO MSF
+        case 0x4B:  // PAUSE/RESUME
+        case 0x4E:  // STOP PLAY/SCAN
+        case 0x51:  // READ DISC INFORMATION
+        case 0x52:  // READ TRACK INFORMATION
+        case 0xA5:  // PLAY AUDIO (12)
+        case 0xAD:  // READ DISC STRUCTURE
+        case 0xBE:  // READ CD
+            return TRUE;
 
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Request Sense CMD: bSenseKey 0x%02x, bAddlSenseCode 0x%02x, bAddlSenseCodeQual 0x%02x ", m_SenseParams.bSenseKey, m_SenseParams.bAddlSenseCode, m_SenseParams.bAddlSenseCodeQual);
+        default:
+            return FALSE;
+    }
+}
 
-            u8 length = sizeof(TUSBCDRequestSenseReply);
-            if (blocks < length)
-                length = blocks;
+// SPC and MMC let these through without reporting a unit attention, and so
+// do the toolbox's own commands, which aren't about the disc
+boolean CUSBCDGadget::ReportsUnitAttention(u8 nOpCode) {
+    switch (nOpCode) {
+        case 0x03:  // REQUEST SENSE
+        case 0x12:  // INQUIRY
+        case 0x46:  // GET CONFIGURATION
+        case 0x4A:  // GET EVENT STATUS NOTIFICATION
+        case 0xA0:  // REPORT LUNS
+            return FALSE;
 
-            m_ReqSenseReply.bSenseKey = m_SenseParams.bSenseKey;
-            m_ReqSenseReply.bAddlSenseCode = m_SenseParams.bAddlSenseCode;
-            m_ReqSenseReply.bAddlSenseCodeQual = m_SenseParams.bAddlSenseCodeQual;
+        default:
+            return nOpCode < 0xD0 || nOpCode > 0xDA;
+    }
+}
 
-            memcpy(&m_InBuffer, &m_ReqSenseReply, length);
+// SCSI commands are dispatched through a table indexed by opcode, with one
+// handler method per command. Each command is timed from the CBW to its CSW
+// and counted in SCSIStats. Called from Update() at task level, so handlers
+// may take their time without holding up other interrupts
+void CUSBCDGadget::HandleSCSICommand(unsigned nStartTicks) {
+    //MLOGNOTE ("CUSBCDGadget::HandleSCSICommand", "SCSI Command is 0x%02x", m_CBW.CBWCB[0]);
+    BeginCommandStats(nStartTicks);
+    if (!CheckMedium())
+        return;
+    if (SendCachedResponse())
+        return;
+    (this->*s_SCSIHandlers[m_CBW.CBWCB[0]])();
+}
 
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
-                                       m_InBuffer, length);
-
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-            m_nState = TCDState::SendReqSenseReply;
-
-	    // If we were "Not Ready", switch to Unit Attention
-	    if (m_SenseParams.bSenseKey == 0x02) { 
-                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Moving sense state to Unit Attention, Medium have have changed");
-	        bmCSWStatus = CD_CSW_STATUS_FAIL;
-        	m_SenseParams.bSenseKey = 0x06;           // Unit Attention
-        	m_SenseParams.bAddlSenseCode = 0x28;      // NOT READY TO READY CHANGE
-        	m_SenseParams.bAddlSenseCodeQual = 0x00;  // MEDIUM MAY HAVE CHANGED
-	    } else {
-                // Reset response params after send
-                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Moving sense state to OK");
-	    	bmCSWStatus = CD_CSW_STATUS_OK;
-            	m_SenseParams.bSenseKey = 0; // NO SENSE
-            	m_SenseParams.bAddlSenseCode = 0; // NO ADDITIONAL SENSE INFORMATION
-            	m_SenseParams.bAddlSenseCodeQual = 0; // NO ADDITIONAL SENSE INFORMATION
-	    }
-            break;
+void CUSBCDGadget::InitSCSIHandlers() {
+    for (unsigned i = 0; i < 256; i++)
+        s_SCSIHandlers[i] = &CUSBCDGadget::HandleUnknownCommand;
+
+    s_SCSIHandlers[0x00] = &CUSBCDGadget::HandleTestUnitReady;
+    s_SCSIHandlers[0x03] = &CUSBCDGadget::HandleRequestSense;
+    s_SCSIHandlers[0x12] = &CUSBCDGadget::HandleInquiry;
+    s_SCSIHandlers[0x1B] = &CUSBCDGadget::HandleStartStopUnit;
+    s_SCSIHandlers[0x1E] = &CUSBCDGadget::HandlePreventAllowMediumRemoval;
+    s_SCSIHandlers[0x25] = &CUSBCDGadget::HandleReadCapacity;
+    s_SCSIHandlers[0x28] = &CUSBCDGadget::HandleRead10;
+    s_SCSIHandlers[0xBE] = &CUSBCDGadget::HandleReadCD;
+    s_SCSIHandlers[0xBB] = &CUSBCDGadget::HandleUnimplemented;
+    s_SCSIHandlers[0x2F] = &CUSBCDGadget::HandleUnimplemented;
+    s_SCSIHandlers[0x43] = &CUSBCDGadget::HandleReadTOC;
+    s_SCSIHandlers[0x42] = &CUSBCDGadget::HandleReadSubChannel;
+    s_SCSIHandlers[0x52] = &CUSBCDGadget::HandleReadTrackInformation;
+    s_SCSIHandlers[0x4A] = &CUSBCDGadget::HandleGetEventStatusNotification;
+    s_SCSIHandlers[0xAD] = &CUSBCDGadget::HandleReadDiscStructure;
+    s_SCSIHandlers[0x51] = &CUSBCDGadget::HandleReadDiscInformation;
+    s_SCSIHandlers[0x46] = &CUSBCDGadget::HandleGetConfiguration;
+    s_SCSIHandlers[0x4B] = &CUSBCDGadget::HandlePauseResume;
+    s_SCSIHandlers[0x2B] = &CUSBCDGadget::HandleSeek;
+    s_SCSIHandlers[0x47] = &CUSBCDGadget::HandlePlayAudioMSF;
+    s_SCSIHandlers[0x4E] = &CUSBCDGadget::HandleStopScan;
+    s_SCSIHandlers[0x45] = &CUSBCDGadget::HandlePlayAudio10;
+    s_SCSIHandlers[0xA5] = &CUSBCDGadget::HandlePlayAudio12;
+    s_SCSIHandlers[0x55] = &CUSBCDGadget::HandleModeSelect10;
+    s_SCSIHandlers[0x1A] = &CUSBCDGadget::HandleModeSense6;
+    s_SCSIHandlers[0x5A] = &CUSBCDGadget::HandleModeSense10;
+    s_SCSIHandlers[0xAC] = &CUSBCDGadget::HandleGetPerformance;
+    s_SCSIHandlers[0xA4] = &CUSBCDGadget::HandleReportKey;
+    s_SCSIHandlers[0xD9] = &CUSBCDGadget::HandleToolboxListDevices;
+    s_SCSIHandlers[0xD2] = &CUSBCDGadget::HandleToolboxNumberOfFiles;
+    s_SCSIHandlers[0xDA] = &CUSBCDGadget::HandleToolboxNumberOfFiles;
+    s_SCSIHandlers[0xD0] = &CUSBCDGadget::HandleToolboxListFiles;
+    s_SCSIHandlers[0xD7] = &CUSBCDGadget::HandleToolboxListFiles;
+    s_SCSIHandlers[0xD8] = &CUSBCDGadget::HandleToolboxSetNextCD;
+}
+
+// Test unit ready (0x00)
+// Not ready and unit attention are reported by CheckMedium()
+void CUSBCDGadget::HandleTestUnitReady() {
+    // MLOGNOTE ("CUSBCDGadget::HandleSCSICommand", "Test Unit Ready (returning CD_CSW_STATUS_FAIL)");
+    m_CSW.bmCSWStatus = bmCSWStatus;
+    SendCSW();
+}
+
+// Request sense CMD (0x03)
+void CUSBCDGadget::HandleRequestSense() {
+    // This command is the host asking why the last command generated a check condition
+    // We'll clear the reason after we've communicated it. If it's still an issue, we'll
+    // throw another Check Condition afterwards
+    //bool desc = m_CBW.CBWCB[1] & 0x01;
+    u8 blocks = (u8)(m_CBW.CBWCB[4]);
+
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Request Sense CMD: bSenseKey 0x%02x, bAddlSenseCode 0x%02x, bAddlSenseCodeQual 0x%02x ", m_SenseParams.bSenseKey, m_SenseParams.bAddlSenseCode, m_SenseParams.bAddlSenseCodeQual);
+
+    u8 length = sizeof(TUSBCDRequestSenseReply);
+    if (blocks < length)
+        length = blocks;
+
+    // With nothing else to report, tell the host about the disc
+    if (m_SenseParams.bSenseKey == 0) {
+        switch (m_MediaState) {
+            case MediaUnitAttention:
+                m_MediaState = MediaLoaded;
+                m_SenseParams.bSenseKey = 0x06;           // Unit Attention
+                m_SenseParams.bAddlSenseCode = 0x28;      // NOT READY TO READY CHANGE
+                m_SenseParams.bAddlSenseCodeQual = 0x00;  // MEDIUM MAY HAVE CHANGED
+                break;
+
+            case MediaBecomingReady:
+                m_SenseParams.bSenseKey = 0x02;           // Not Ready
+                m_SenseParams.bAddlSenseCode = 0x04;      // LOGICAL UNIT NOT READY
+                m_SenseParams.bAddlSenseCodeQual = 0x01;  // IN PROCESS OF BECOMING READY
+                break;
+
+            case MediaEjecting:
+            case MediaNoMedium:
+                m_SenseParams.bSenseKey = 0x02;           // Not Ready
+                m_SenseParams.bAddlSenseCode = 0x3a;      // MEDIUM NOT PRESENT
+                m_SenseParams.bAddlSenseCodeQual = 0x00;
+                break;
+
+            default:
+                break;
         }
+    }
 
-        case 0x12:  // Inquiry
-        {
-            int allocationLength = (m_CBW.CBWCB[3] << 8) | m_CBW.CBWCB[4];
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry %0x, allocation length %d", m_CBW.CBWCB[1], allocationLength);
-
-            if ((m_CBW.CBWCB[1] & 0x01) == 0) {  // EVPD bit is 0: Standard Inquiry
-                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry (Standard Enquiry)");
-		
-		// Set response length
-		int datalen = SIZE_INQR;
-		if (allocationLength < datalen)
-		    datalen = allocationLength;
-
-                memcpy(&m_InBuffer, &m_InqReply, datalen);
-                m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, datalen);
+    m_ReqSenseReply.bSenseKey = m_SenseParams.bSenseKey;
+    m_ReqSenseReply.bAddlSenseCode = m_SenseParams.bAddlSenseCode;
+    m_ReqSenseReply.bAddlSenseCodeQual = m_SenseParams.bAddlSenseCodeQual;
+
+    memcpy(m_InBuffer, &m_ReqSenseReply, length);
+
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                               m_InBuffer, length);
+
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+    m_nState = TCDState::SendReqSenseReply;
+
+    // Reset response params after send. A disc that still isn't there is
+    // reported again by the next command that needs it
+    bmCSWStatus = CD_CSW_STATUS_OK;
+    m_SenseParams.bSenseKey = 0; // NO SENSE
+    m_SenseParams.bAddlSenseCode = 0; // NO ADDITIONAL SENSE INFORMATION
+    m_SenseParams.bAddlSenseCodeQual = 0; // NO ADDITIONAL SENSE INFORMATION
+}
+
+// Inquiry (0x12)
+void CUSBCDGadget::HandleInquiry() {
+    int allocationLength = (m_CBW.CBWCB[3] << 8) | m_CBW.CBWCB[4];
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry %0x, allocation length %d", m_CBW.CBWCB[1], allocationLength);
+
+    if ((m_CBW.CBWCB[1] & 0x01) == 0) {  // EVPD bit is 0: Standard Inquiry
+        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry (Standard Enquiry)");
+
+        // Set response length
+        int datalen = SIZE_INQR;
+        if (allocationLength < datalen)
+            datalen = allocationLength;
+
+        memcpy(m_InBuffer, &m_InqReply, datalen);
+        m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, datalen);
+        m_nState = TCDState::DataIn;
+        m_nnumber_blocks = 0;  // nothing more after this send
+        //m_CSW.bmCSWStatus = bmCSWStatus;
+        m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+    } else {  // EVPD bit is 1: VPD Inquiry
+        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry (VPD Inquiry)");
+        u8 vpdPageCode = m_CBW.CBWCB[2];
+        switch (vpdPageCode) {
+            case 0x00:  // Supported VPD Pages
+            {
+                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry (Supported VPD Pages)");
+
+                u8 SupportedVPDPageReply[] = {
+                    0x05,  // Byte 0: Peripheral Device Type (0x05 for Optical Memory Device)
+                    0x00,  // Byte 1: Page Code (0x00 for Supported VPD Pages page)
+                    0x00,  // Byte 2: Page Length (MSB) - total length of page codes following
+                    0x03,  // Byte 3: Page Length (LSB) - 3 supported page codes
+                    0x00,  // Byte 4: Supported VPD Page Code: Supported VPD Pages (this page itself)
+                    0x80,  // Byte 5: Supported VPD Page Code: Unit Serial Number
+                    0x83   // Byte 6: Supported VPD Page Code: Device Identification
+                };
+
+                // Set response length
+                int datalen = sizeof(SupportedVPDPageReply);
+                if (allocationLength < datalen)
+                    datalen = allocationLength;
+
+                memcpy(m_InBuffer, &SupportedVPDPageReply, sizeof(SupportedVPDPageReply));
+                m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                                           m_InBuffer, datalen);
                 m_nState = TCDState::DataIn;
                 m_nnumber_blocks = 0;  // nothing more after this send
                 //m_CSW.bmCSWStatus = bmCSWStatus;
                 m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-            } else {  // EVPD bit is 1: VPD Inquiry
-                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry (VPD Inquiry)");
-                u8 vpdPageCode = m_CBW.CBWCB[2];
-                switch (vpdPageCode) {
-                    case 0x00:  // Supported VPD Pages
-                    {
-                        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry (Supported VPD Pages)");
-
-                        u8 SupportedVPDPageReply[] = {
-                            0x05,  // Byte 0: Peripheral Device Type (0x05 for Optical Memory Device)
-                            0x00,  // Byte 1: Page Code (0x00 for Supported VPD Pages page)
-                            0x00,  // Byte 2: Page Length (MSB) - total length of page codes following
-                            0x03,  // Byte 3: Page Length (LSB) - 3 supported page codes
-                            0x00,  // Byte 4: Supported VPD Page Code: Supported VPD Pages (this page itself)
-                            0x80,  // Byte 5: Supported VPD Page Code: Unit Serial Number
-                            0x83   // Byte 6: Supported VPD Page Code: Device Identification
-                        };
-
-                        // Set response length
-                        int datalen = sizeof(SupportedVPDPageReply);
-                        if (allocationLength < datalen)
-                            datalen = allocationLength;
-
-                        memcpy(&m_InBuffer, &SupportedVPDPageReply, sizeof(SupportedVPDPageReply));
-                        m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
-                                                   m_InBuffer, datalen);
-                        m_nState = TCDState::DataIn;
-                        m_nnumber_blocks = 0;  // nothing more after this send
-                        //m_CSW.bmCSWStatus = bmCSWStatus;
-                        m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-                        break;
-                    }
+                break;
+            }
 
-                    case 0x80:  // Unit Serial Number Page
-                    {
-                        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry (Unit Serial number Page)");
-
-                        u8 UnitSerialNumberReply[] = {
-                            0x05,  // Byte 0: Peripheral Device Type (Optical Memory Device)
-                            0x80,  // Byte 1: Page Code (Unit Serial Number page)
-                            0x00,  // Byte 2: Page Length (MSB) - Length of serial number data
-                            0x0B,  // Byte 3: Page Length (LSB) - 11 bytes follow
-                            // Bytes 4 onwards: The actual serial number
-                            'U', 'S', 'B', 'O', 'D', 'E', '0', '0', '0', '0', '1'};
-
-                        // Set response length
-                        int datalen = sizeof(UnitSerialNumberReply);
-                        if (allocationLength < datalen)
-                            datalen = allocationLength;
-
-                        memcpy(&m_InBuffer, &UnitSerialNumberReply, sizeof(UnitSerialNumberReply));
-                        m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
-                                                   m_InBuffer, datalen);
-                        m_nState = TCDState::DataIn;
-                        m_nnumber_blocks = 0;  // nothing more after this send
-                        //m_CSW.bmCSWStatus = bmCSWStatus;
-                        m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-                        break;
-                    }
+            case 0x80:  // Unit Serial Number Page
+            {
+                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry (Unit Serial number Page)");
+
+                u8 UnitSerialNumberReply[] = {
+                    0x05,  // Byte 0: Peripheral Device Type (Optical Memory Device)
+                    0x80,  // Byte 1: Page Code (Unit Serial Number page)
+                    0x00,  // Byte 2: Page Length (MSB) - Length of serial number data
+                    0x0B,  // Byte 3: Page Length (LSB) - 11 bytes follow
+                    // Bytes 4 onwards: The actual serial number
+                    'U', 'S', 'B', 'O', 'D', 'E', '0', '0', '0', '0', '1'};
+
+                // Set response length
+                int datalen = sizeof(UnitSerialNumberReply);
+                if (allocationLength < datalen)
+                    datalen = allocationLength;
+
+                memcpy(m_InBuffer, &UnitSerialNumberReply, sizeof(UnitSerialNumberReply));
+                m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                                           m_InBuffer, datalen);
+                m_nState = TCDState::DataIn;
+                m_nnumber_blocks = 0;  // nothing more after this send
+                //m_CSW.bmCSWStatus = bmCSWStatus;
+                m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+                break;
+            }
 
-                    case 0x83: {
-                        u8 DeviceIdentificationReply[] = {
-                            0x05,  // Byte 0: Peripheral Device Type (Optical Memory Device)
-                            0x83,  // Byte 1: Page Code (Device Identification page)
-                            0x00,  // Byte 2: Page Length (MSB)
-                            0x0B,  // Byte 3: Page Length (LSB) - Total length of all designators combined (11 bytes in this example)
-
-                            // --- Start of First Designator (T10 Vendor ID) ---
-                            0x01,  // Byte 4: CODE SET (0x01 = ASCII)
-                                   //         PIV (0) + Assoc (0) + Type (0x01 = T10 Vendor ID)
-                            0x00,  // Byte 5: PROTOCOL IDENTIFIER (0x00 = SCSI)
-                            0x08,  // Byte 6: LENGTH (Length of the identifier data itself - 8 bytes)
-                            // Bytes 7-14: IDENTIFIER (Your T10 Vendor ID, padded to 8 bytes)
-                            'U', 'S', 'B', 'O', 'D', 'E', ' ', ' '  // "USBODE  " - padded to 8 bytes
-                            // --- End of First Designator ---
-                        };
-
-                        // Set response length
-                        int datalen = sizeof(DeviceIdentificationReply);
-                        if (allocationLength < datalen)
-                            datalen = allocationLength;
-
-                        memcpy(&m_InBuffer, &DeviceIdentificationReply, sizeof(DeviceIdentificationReply));
-                        m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
-                                                   m_InBuffer, datalen);
-                        m_nState = TCDState::DataIn;
-                        m_nnumber_blocks = 0;  // nothing more after this send
-                        //m_CSW.bmCSWStatus = bmCSWStatus;
-                        m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-                        break;
-                    }
+            case 0x83: {
+                u8 DeviceIdentificationReply[] = {
+                    0x05,  // Byte 0: Peripheral Device Type (Optical Memory Device)
+                    0x83,  // Byte 1: Page Code (Device Identification page)
+                    0x00,  // Byte 2: Page Length (MSB)
+                    0x0B,  // Byte 3: Page Length (LSB) - Total length of all designators combined (11 bytes in this example)
+
+                    // --- Start of First Designator (T10 Vendor ID) ---
+                    0x01,  // Byte 4: CODE SET (0x01 = ASCII)
+                           //         PIV (0) + Assoc (0) + Type (0x01 = T10 Vendor ID)
+                    0x00,  // Byte 5: PROTOCOL IDENTIFIER (0x00 = SCSI)
+                    0x08,  // Byte 6: LENGTH (Length of the identifier data itself - 8 bytes)
+                    // Bytes 7-14: IDENTIFIER (Your T10 Vendor ID, padded to 8 bytes)
+                    'U', 'S', 'B', 'O', 'D', 'E', ' ', ' '  // "USBODE  " - padded to 8 bytes
+                    // --- End of First Designator ---
+                };
+
+                // Set response length
+                int datalen = sizeof(DeviceIdentificationReply);
+                if (allocationLength < datalen)
+                    datalen = allocationLength;
+
+                memcpy(m_InBuffer, &DeviceIdentificationReply, sizeof(DeviceIdentificationReply));
+                m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                                           m_InBuffer, datalen);
+                m_nState = TCDState::DataIn;
+                m_nnumber_blocks = 0;  // nothing more after this send
+                //m_CSW.bmCSWStatus = bmCSWStatus;
+                m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+                break;
+            }
 
-                    default:  // Unsupported VPD Page
-                        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry (Unsupported Page)");
-                        //  m_nState = TCDState::DataIn;
-                        m_nnumber_blocks = 0;  // nothing more after this send
+            default:  // Unsupported VPD Page
+                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Inquiry (Unsupported Page)");
+                //  m_nState = TCDState::DataIn;
+                m_nnumber_blocks = 0;  // nothing more after this send
 
-                        m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
-                        m_SenseParams.bSenseKey = 0x05;
-                        m_SenseParams.bAddlSenseCode = 0x24;      // Invalid Field
-                        m_SenseParams.bAddlSenseCodeQual = 0x00;  // In CDB
-                        SendCSW();
-                        break;
-                }
-            }
-            break;
+                m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
+                m_SenseParams.bSenseKey = 0x05;
+                m_SenseParams.bAddlSenseCode = 0x24;      // Invalid Field
+                m_SenseParams.bAddlSenseCodeQual = 0x00;  // In CDB
+                SendCSW();
+                break;
         }
+    }
+}
 
-        case 0x1B:  // Start/stop unit
-        {
-            int start = m_CBW.CBWCB[4] & 1;
-            int loej = (m_CBW.CBWCB[4] >> 1) & 1;
-            // TODO: Emulate a disk eject/load
-            // loej Start Action
-            // 0    0     Stop the disc - no action for us
-            // 0    1     Start the disc - no action for us
-            // 1    0     Eject the disc - perhaps we need to throw a check condition?
-            // 1    1     Load the disc - perhaps we need to throw a check condition?
-
-            MLOGNOTE("HandleSCSI", "start/stop, start = %d, loej = %d", start, loej);
-            //m_CSW.bmCSWStatus = bmCSWStatus;
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-            SendCSW();
-            break;
+// Start/stop unit (0x1B)
+void CUSBCDGadget::HandleStartStopUnit() {
+    int start = m_CBW.CBWCB[4] & 1;
+    int loej = (m_CBW.CBWCB[4] >> 1) & 1;
+    // loej Start Action
+    // 0    0     Stop the disc - no action for us
+    // 0    1     Start the disc - no action for us
+    // 1    0     Eject the disc - no medium until it is loaded again
+    // 1    1     Load the disc - the mounted image comes back
+
+    MLOGNOTE("HandleSCSI", "start/stop, start = %d, loej = %d", start, loej);
+    if (loej) {
+        CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
+        if (!start && (m_MediaState == MediaLoaded || m_MediaState == MediaUnitAttention)) {
+            m_MediaState = MediaNoMedium;
+            m_nMediaEvent = MediaEventRemoval;
+            m_CDReady = false;
+            if (cdplayer)
+                cdplayer->SetDevice(nullptr);
+        } else if (start && m_MediaState == MediaNoMedium && m_pDevice != nullptr) {
+            m_nMediaChangeStart = CTimer::GetClockTicks();
+            m_MediaState = MediaUnitAttention;
+            m_nMediaEvent = MediaEventNewMedia;
+            m_CDReady = true;
+            if (cdplayer)
+                cdplayer->SetDevice(m_pDevice);
         }
+    }
+    //m_CSW.bmCSWStatus = bmCSWStatus;
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+    SendCSW();
+}
 
-        case 0x1E:  // PREVENT ALLOW MEDIUM REMOVAL
-        {
-            // Lie to the host
-            //m_CSW.bmCSWStatus = bmCSWStatus;
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-            SendCSW();
-            break;
-        }
+// PREVENT ALLOW MEDIUM REMOVAL (0x1E)
+void CUSBCDGadget::HandlePreventAllowMediumRemoval() {
+    // Lie to the host
+    //m_CSW.bmCSWStatus = bmCSWStatus;
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+    SendCSW();
+}
 
-        case 0x25:  // Read Capacity (10))
-        {
-            m_ReadCapReply.nLastBlockAddr = htonl(GetLeadoutLBA() - 1);  // this value is the Start address of last recorded lead-out minus 1
-            memcpy(&m_InBuffer, &m_ReadCapReply, SIZE_READCAPREP);
-            m_nnumber_blocks = 0;  // nothing more after this send
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
-                                       m_InBuffer, SIZE_READCAPREP);
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = bmCSWStatus;
-            break;
-        }
+// Read Capacity (10) (0x25)
+void CUSBCDGadget::HandleReadCapacity() {
+    m_ReadCapReply.nLastBlockAddr = htonl(GetLeadoutLBA() - 1);  // this value is the Start address of last recorded lead-out minus 1
+    memcpy(m_InBuffer, &m_ReadCapReply, SIZE_READCAPREP);
+    m_nnumber_blocks = 0;  // nothing more after this send
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                               m_InBuffer, SIZE_READCAPREP);
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = bmCSWStatus;
+}
 
-        case 0x28:  // Read (10)
-        {
-            if (m_CDReady) {
-                // MLOGNOTE ("CUSBCDGadget::HandleSCSICommand", "Read (10)");
-                // will be updated if read fails on any block
-                m_CSW.bmCSWStatus = bmCSWStatus;
+// Read (10) (0x28)
+void CUSBCDGadget::HandleRead10() {
+    if (m_CDReady) {
+        // MLOGNOTE ("CUSBCDGadget::HandleSCSICommand", "Read (10)");
+        // will be updated if read fails on any block
+        m_CSW.bmCSWStatus = bmCSWStatus;
 
-                // Where to start reading (LBA)
-                m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
+        // Where to start reading (LBA)
+        m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
 
-                // Number of blocks to read (LBA)
-                m_nnumber_blocks = (u32)((m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8]);
+        // Number of blocks to read (LBA)
+        m_nnumber_blocks = (u32)((m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8]);
 
-                // Transfer Block Size is the size of data to return to host
-                // Block Size and Skip Bytes is worked out from cue sheet
-                // For a CDROM, this is always 2048
-                transfer_block_size = 2048;
-                block_size = data_block_size;  // set at SetDevice
-                skip_bytes = data_skip_bytes;  // set at SetDevice;
-		mcs = 0;
+        // Transfer Block Size is the size of data to return to host
+        // Block Size and Skip Bytes is worked out from cue sheet
+        // For a CDROM, this is always 2048
+        transfer_block_size = 2048;
+        block_size = data_block_size;  // set at SetDevice
+        skip_bytes = data_skip_bytes;  // set at SetDevice;
+        mcs = 0;
 
-                m_nbyteCount = m_CBW.dCBWDataTransferLength;
+        m_nbyteCount = m_CBW.dCBWDataTransferLength;
 
-                // What is this?
-                if (m_nnumber_blocks == 0) {
-                    m_nnumber_blocks = 1 + (m_nbyteCount) / 2048;
-                }
-                m_CSW.bmCSWStatus = bmCSWStatus;
-                m_nState = TCDState::DataInRead;  // see Update() function
-            } else {
-                MLOGNOTE("handleSCSI Read(10)", "failed, %s", m_CDReady ? "ready" : "not ready");
-                m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;
-                m_SenseParams.bSenseKey = 0x02;
-                m_SenseParams.bAddlSenseCode = 0x04;      // LOGICAL UNIT NOT READY
-                m_SenseParams.bAddlSenseCodeQual = 0x00;  // CAUSE NOT REPORTABLE
-                SendCSW();
-            }
-            break;
+        // What is this?
+        if (m_nnumber_blocks == 0) {
+            m_nnumber_blocks = 1 + (m_nbyteCount) / 2048;
         }
+        m_CSW.bmCSWStatus = bmCSWStatus;
+        m_ReadAheadState = ReadAheadIdle;
+        m_nState = TCDState::DataInRead;  // see Update() function
+    } else {
+        MLOGNOTE("handleSCSI Read(10)", "failed, %s", m_CDReady ? "ready" : "not ready");
+        m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;
+        m_SenseParams.bSenseKey = 0x02;
+        m_SenseParams.bAddlSenseCode = 0x04;      // LOGICAL UNIT NOT READY
+        m_SenseParams.bAddlSenseCodeQual = 0x00;  // CAUSE NOT REPORTABLE
+        SendCSW();
+    }
+}
 
-        case 0xBE:  // READ CD
-        {
-            if (m_CDReady) {
+// READ CD (0xBE)
+void CUSBCDGadget::HandleReadCD() {
+    if (m_CDReady) {
+
+        // Expected Sector Type. We can use this to derive
+        // sector size and offset in most cases
+        int expectedSectorType = (m_CBW.CBWCB[1] >> 2) & 0x07;
 
-                // Expected Sector Type. We can use this to derive
-                // sector size and offset in most cases
-                int expectedSectorType = (m_CBW.CBWCB[1] >> 2) & 0x07;
+        // Where to start reading (LBA)
+        m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
 
-                // Where to start reading (LBA)
-                m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
-// Number of blocks to read (LBA)
-                m_nnumber_blocks = (u32)(m_CBW.CBWCB[6] << 16) | (u32)((m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8]);
+        // Number of blocks to read (LBA)
+        m_nnumber_blocks = (u32)(m_CBW.CBWCB[6] << 16) | (u32)((m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8]);
 
-		mcs = (m_CBW.CBWCB[9] >> 3) & 0x1F;
+        mcs = (m_CBW.CBWCB[9] >> 3) & 0x1F;
 
-                // MLOGNOTE ("CUSBCDGadget::HandleSCSICommand", "READ CD for %lu blocks at LBA %lu of type %02x", m_nnumber_blocks, m_nblock_address, expectedSectorType);
-                switch (expectedSectorType) {
-                    case 0x01: 
-		    {
-                        // CD-DA
+        // MLOGNOTE ("CUSBCDGadget::HandleSCSICommand", "READ CD for %lu blocks at LBA %lu of type %02x", m_nnumber_blocks, m_nblock_address, expectedSectorType);
+        switch (expectedSectorType) {
+            case 0x01: 
+            {
+                // CD-DA
+                block_size = 2352;
+                transfer_block_size = 2352;
+                skip_bytes = 0;
+                break;
+            }
+            case 0x02: 
+            {
+                // Mode 1
+                TTrackEntry trackInfo = GetTrackInfoForLBA(m_nblock_address);
+                skip_bytes = GetSkipbytesForTrack(trackInfo);
+                block_size = GetBlocksizeForTrack(trackInfo);
+                transfer_block_size = 2048;
+                break;
+            }
+            case 0x03:
+            {
+                // Mode 2 formless
+                skip_bytes = 16;
+                block_size = 2352;
+                transfer_block_size = 2336;
+                break;
+            }
+            case 0x04:
+            {
+                // Mode 2 form 1
+                TTrackEntry trackInfo = GetTrackInfoForLBA(m_nblock_address);
+                skip_bytes = GetSkipbytesForTrack(trackInfo);
+                block_size = GetBlocksizeForTrack(trackInfo);
+                transfer_block_size = 2048;
+                break;
+            }
+            case 0x05: 
+            {
+                // Mode 2 form 2
+                block_size = 2352;
+                skip_bytes = 24;
+                transfer_block_size = 2048;
+                break;
+            }
+            case 0x00:
+            default: 
+            {
+                // Client doesn't tell us what data type he's expecting. He expects us
+                // to work it out based on the MCS flags
+                TTrackEntry trackInfo = GetTrackInfoForLBA(m_nblock_address);
+
+                // Audio tracks have no concept of MCS, so we just return all 2352 bytes
+                if (trackInfo.track_mode == CUETrack_AUDIO) {
                         block_size = 2352;
                         transfer_block_size = 2352;
                         skip_bytes = 0;
-                        break;
-                    }
-                    case 0x02: 
-		    {
-                        // Mode 1
-                        CUETrackInfo trackInfo = GetTrackInfoForLBA(m_nblock_address);
-                        skip_bytes = GetSkipbytesForTrack(trackInfo);
-                        block_size = GetBlocksizeForTrack(trackInfo);
-                        transfer_block_size = 2048;
-                        break;
-                    }
-                    case 0x03:
-		    {
-                        // Mode 2 formless
-                        skip_bytes = 16;
-                        block_size = 2352;
-                        transfer_block_size = 2336;
-                        break;
-                    }
-                    case 0x04:
-		    {
-			// Mode 2 form 1
-                        CUETrackInfo trackInfo = GetTrackInfoForLBA(m_nblock_address);
-                        skip_bytes = GetSkipbytesForTrack(trackInfo);
+                } else {
+                        // This gives us a horrible situation where we might be using a
+                        // underlying image file with block sizes of 2048 but host requests 
+                        // block size of 2352, so the Update function at the end needs to 
+                        // synthesize some bytes to make up for the difference
                         block_size = GetBlocksizeForTrack(trackInfo);
-                        transfer_block_size = 2048;
-                        break;
-                    }
-                    case 0x05: 
-		    {
-                        // Mode 2 form 2
-                        block_size = 2352;
-                        skip_bytes = 24;
-                        transfer_block_size = 2048;
-                        break;
-                    }
-                    case 0x00:
-                    default: 
-		    {
-                        // Client doesn't tell us what data type he's expecting. He expects us
-			// to work it out based on the MCS flags
-			CUETrackInfo trackInfo = GetTrackInfoForLBA(m_nblock_address);
-
-			// Audio tracks have no concept of MCS, so we just return all 2352 bytes
-			if (trackInfo.track_mode == CUETrack_AUDIO) {
-				block_size = 2352;
-				transfer_block_size = 2352;
-				skip_bytes = 0;
-			} else {
-				// This gives us a horrible situation where we might be using a
-				// underlying image file with block sizes of 2048 but host requests 
-				// block size of 2352, so the Update function at the end needs to 
-				// synthesize some bytes to make up for the difference
-				block_size = GetBlocksizeForTrack(trackInfo);
-				transfer_block_size = GetSectorLengthFromMCS(mcs);
-				skip_bytes = GetSkipBytesFromMCS(mcs);
-			}
-                        break;
-                    }
+                        transfer_block_size = GetSectorLengthFromMCS(mcs);
+                        skip_bytes = GetSkipBytesFromMCS(mcs);
                 }
-
-                MLOGDEBUG ("CUSBCDGadget::HandleSCSICommand", "READ CD for %lu blocks at LBA %lu of type %02x, block_size = %d, skip_bytes = %d, transfer_block_ssize = %d", m_nnumber_blocks, m_nblock_address, expectedSectorType, block_size, skip_bytes, transfer_block_size);
-
-                // What is this?
-                m_nbyteCount = m_CBW.dCBWDataTransferLength;
-                if (m_nnumber_blocks == 0) {
-                    m_nnumber_blocks = 1 + (m_nbyteCount) / 2048;  // fixme?
-                }
-
-                m_nState = TCDState::DataInRead;  // see Update() function
-                m_CSW.bmCSWStatus = bmCSWStatus;
-            } else {
-                MLOGNOTE("handleSCSI READ CD", "failed, %s", m_CDReady ? "ready" : "not ready");
-                m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;
-                m_SenseParams.bSenseKey = 0x02;
-                m_SenseParams.bAddlSenseCode = 0x04;      // LOGICAL UNIT NOT READY
-                m_SenseParams.bAddlSenseCodeQual = 0x00;  // CAUSE NOT REPORTABLE
-                SendCSW();
+                break;
             }
-            break;
         }
 
-	// These commands are not implemented so we lie about it
-	case 0xBB: // Set CDROM Speed
-        case 0x2F: // Verify
-        {
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-            SendCSW();
-            break;
+        MLOGDEBUG ("CUSBCDGadget::HandleSCSICommand", "READ CD for %lu blocks at LBA %lu of type %02x, block_size = %d, skip_bytes = %d, transfer_block_ssize = %d", m_nnumber_blocks, m_nblock_address, expectedSectorType, block_size, skip_bytes, transfer_block_size);
+
+        // What is this?
+        m_nbyteCount = m_CBW.dCBWDataTransferLength;
+        if (m_nnumber_blocks == 0) {
+            m_nnumber_blocks = 1 + (m_nbyteCount) / 2048;  // fixme?
         }
 
-        case 0x43:  // READ TOC/PMA/ATIP
-        {
-            if (m_CDReady) {
-		    int msf = (m_CBW.CBWCB[1] >> 1) & 0x01;
-		    int format = m_CBW.CBWCB[2] & 0x07; // TODO implement formats. Currently we assume it's always 0x00
-		    int startingTrack = m_CBW.CBWCB[6];
-		    int allocationLength = (m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8];
-
-		    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Read TOC with format = %d, msf = %02x, starting track = %d, allocation length = %d, m_CDReady = %d", format, msf, startingTrack, allocationLength, m_CDReady);
-
-		    TUSBTOCData m_TOCData;
-		    TUSBTOCEntry *tocEntries;
-
-		    int numtracks = 0;
-		    int datalen = 0;
-
-		    if (format == 0x00) { // Read TOC Data Format (With Format Field = 00b) 
-
-			    const CUETrackInfo* trackInfo = nullptr;
-			    int lastTrackNumber = GetLastTrackNumber();
-
-			    // Header
-			    m_TOCData.FirstTrack = 0x01;
-			    m_TOCData.LastTrack = lastTrackNumber;
-			    datalen = SIZE_TOC_DATA;
-
-			    // Populate the track entries
-			    tocEntries = new TUSBTOCEntry[lastTrackNumber + 1];
-
-			    int index = 0;
-			    if (startingTrack != 0xAA) {  // Do we only want the leadout?
-				cueParser.restart();
-				while ((trackInfo = cueParser.next_track()) != nullptr) {
-				    if (trackInfo->track_number < startingTrack)
-					continue;
-				    boolean relative = false;
-				    //MLOGNOTE ("CUSBCDGadget::HandleSCSICommand", "Adding at index %d: track number = %d, track_start = %d, start lba or msf %d", index, trackInfo->track_number, trackInfo->track_start, GetAddress(trackInfo->track_start, msf));
-				    tocEntries[index].ADR_Control = 0x14;
-				    if (trackInfo->track_mode == CUETrack_AUDIO)
-					tocEntries[index].ADR_Control = 0x10;
-				    tocEntries[index].reserved = 0x00;
-				    tocEntries[index].TrackNumber = trackInfo->track_number;
-				    tocEntries[index].reserved2 = 0x00;
-				    tocEntries[index].address = GetAddress(trackInfo->track_start, msf);
-				    datalen += SIZE_TOC_ENTRY;
-				    numtracks++;
-				    index++;
-				}
-			    }
-
-			    // Lead-Out LBA
-			    u32 leadOutLBA = GetLeadoutLBA();
-			    tocEntries[index].ADR_Control = 0x10;
-			    tocEntries[index].reserved = 0x00;
-			    tocEntries[index].TrackNumber = 0xAA;
-			    tocEntries[index].reserved2 = 0x00;
-			    tocEntries[index].address = GetAddress(leadOutLBA, msf);
-			    datalen += SIZE_TOC_ENTRY;
-			    numtracks++;
-
-		    //} else if (format == 0x01) { // Read TOC Data Format (With Format Field = 01b)
-		    } else {
-						 
-			    CUETrackInfo trackInfo = GetTrackInfoForTrack(1);
-
-			    // Header
-			    m_TOCData.FirstTrack = 0x01;
-			    m_TOCData.LastTrack = 0x01; // In this format, this is the last session number
-			    datalen = SIZE_TOC_DATA;
-
-			    // Populate the track entries
-			    tocEntries = new TUSBTOCEntry[2];
-
-			    tocEntries[0].ADR_Control = 0x00;
-			    tocEntries[0].reserved = 0x00;
-			    tocEntries[0].TrackNumber = 1;
-			    tocEntries[0].reserved2 = 0x00;
-			    tocEntries[0].address = GetAddress(trackInfo.track_start, msf);
-			    datalen += SIZE_TOC_ENTRY;
-			    numtracks = 1;
-		    /*
-		    } else {
-                        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Read TOC unsupported format %d", format);
-                        m_nnumber_blocks = 0;  // nothing more after this send
-                        m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
-                        m_SenseParams.bSenseKey = 0x05;
-                        m_SenseParams.bAddlSenseCode = 0x24;      // Invalid Field
-                        m_SenseParams.bAddlSenseCodeQual = 0x00;  // In CDB
-                        SendCSW();
-		        delete[] tocEntries;
-                        break;
-	  	    */
-		    }
+        m_ReadAheadState = ReadAheadIdle;
+        m_nState = TCDState::DataInRead;  // see Update() function
+        m_CSW.bmCSWStatus = bmCSWStatus;
+    } else {
+        MLOGNOTE("handleSCSI READ CD", "failed, %s", m_CDReady ? "ready" : "not ready");
+        m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;
+        m_SenseParams.bSenseKey = 0x02;
+        m_SenseParams.bAddlSenseCode = 0x04;      // LOGICAL UNIT NOT READY
+        m_SenseParams.bAddlSenseCodeQual = 0x00;  // CAUSE NOT REPORTABLE
+        SendCSW();
+    }
+}
+
+// These commands are not implemented so we lie about it
+// Set CDROM Speed (0xBB), Verify (0x2F)
+void CUSBCDGadget::HandleUnimplemented() {
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+    SendCSW();
+}
 
-		    // Copy the TOC header
-		    m_TOCData.DataLength = htons(datalen - 2);
-		    memcpy(m_InBuffer, &m_TOCData, SIZE_TOC_DATA);
+// READ TOC/PMA/ATIP (0x43)
+void CUSBCDGadget::HandleReadTOC() {
+    if (m_CDReady) {
+            int msf = (m_CBW.CBWCB[1] >> 1) & 0x01;
+            int format = m_CBW.CBWCB[2] & 0x07; // TODO implement formats. Currently we assume it's always 0x00
+            int startingTrack = m_CBW.CBWCB[6];
+            int allocationLength = (m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8];
 
-		    // Copy the TOC entries immediately after the header
-		    memcpy(m_InBuffer + SIZE_TOC_DATA, tocEntries, numtracks * SIZE_TOC_ENTRY);
+            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Read TOC with format = %d, msf = %02x, starting track = %d, allocation length = %d, m_CDReady = %d", format, msf, startingTrack, allocationLength, m_CDReady);
+
+            TUSBTOCData m_TOCData;
+            TUSBTOCEntry *tocEntries;
+
+            int numtracks = 0;
+            int datalen = 0;
+
+            if (format == 0x00) { // Read TOC Data Format (With Format Field = 00b) 
+
+                    int lastTrackNumber = GetLastTrackNumber();
+
+                    // Header
+                    m_TOCData.FirstTrack = 0x01;
+                    m_TOCData.LastTrack = lastTrackNumber;
+                    datalen = SIZE_TOC_DATA;
+
+                    // Populate the track entries
+                    tocEntries = new TUSBTOCEntry[lastTrackNumber + 1];
+
+                    int index = 0;
+                    if (startingTrack != 0xAA) {  // Do we only want the leadout?
+                        const TTrackEntry* trackInfo = nullptr;
+                        for (unsigned i = 0; (trackInfo = m_pTrackTable->GetEntry(i)) != nullptr; i++) {
+                            if (trackInfo->track_number < startingTrack)
+                                continue;
+                            boolean relative = false;
+                            //MLOGNOTE ("CUSBCDGadget::HandleSCSICommand", "Adding at index %d: track number = %d, track_start = %d, start lba or msf %d", index, trackInfo->track_number, trackInfo->track_start, GetAddress(trackInfo->track_start, msf));
+                            tocEntries[index].ADR_Control = 0x14;
+                            if (trackInfo->track_mode == CUETrack_AUDIO)
+                                tocEntries[index].ADR_Control = 0x10;
+                            tocEntries[index].reserved = 0x00;
+                            tocEntries[index].TrackNumber = trackInfo->track_number;
+                            tocEntries[index].reserved2 = 0x00;
+                            tocEntries[index].address = GetAddress(trackInfo->track_start, msf);
+                            datalen += SIZE_TOC_ENTRY;
+                            numtracks++;
+                            index++;
+                        }
+                    }
 
-		    delete[] tocEntries;
+                    // Lead-Out LBA
+                    u32 leadOutLBA = GetLeadoutLBA();
+                    tocEntries[index].ADR_Control = 0x10;
+                    tocEntries[index].reserved = 0x00;
+                    tocEntries[index].TrackNumber = 0xAA;
+                    tocEntries[index].reserved2 = 0x00;
+                    tocEntries[index].address = GetAddress(leadOutLBA, msf);
+                    datalen += SIZE_TOC_ENTRY;
+                    numtracks++;
+
+            //} else if (format == 0x01) { // Read TOC Data Format (With Format Field = 01b)
+            } else {
 
-		    // Set response length
-		    if (allocationLength < datalen)
-			datalen = allocationLength;
+                    TTrackEntry trackInfo = GetTrackInfoForTrack(1);
 
-		    m_nnumber_blocks = 0;  // nothing more after this send
-		    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, datalen);
-		    m_nState = TCDState::DataIn;
-		    m_CSW.bmCSWStatus = bmCSWStatus;
+                    // Header
+                    m_TOCData.FirstTrack = 0x01;
+                    m_TOCData.LastTrack = 0x01; // In this format, this is the last session number
+                    datalen = SIZE_TOC_DATA;
 
+                    // Populate the track entries
+                    tocEntries = new TUSBTOCEntry[2];
 
+                    tocEntries[0].ADR_Control = 0x00;
+                    tocEntries[0].reserved = 0x00;
+                    tocEntries[0].TrackNumber = 1;
+                    tocEntries[0].reserved2 = 0x00;
+                    tocEntries[0].address = GetAddress(trackInfo.track_start, msf);
+                    datalen += SIZE_TOC_ENTRY;
+                    numtracks = 1;
+            /*
             } else {
-                MLOGNOTE("handleSCSI READ TOC", "failed, %s", m_CDReady ? "ready" : "not ready");
-                m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;
-                m_SenseParams.bSenseKey = 0x02;
-                m_SenseParams.bAddlSenseCode = 0x04;      // LOGICAL UNIT NOT READY
-                m_SenseParams.bAddlSenseCodeQual = 0x00;  // CAUSE NOT REPORTABLE
+                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Read TOC unsupported format %d", format);
+                m_nnumber_blocks = 0;  // nothing more after this send
+                m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
+                m_SenseParams.bSenseKey = 0x05;
+                m_SenseParams.bAddlSenseCode = 0x24;      // Invalid Field
+                m_SenseParams.bAddlSenseCodeQual = 0x00;  // In CDB
                 SendCSW();
+                delete[] tocEntries;
+                break;
+            */
             }
-            break;
-        }
 
-        case 0x42:  // READ SUB-CHANNEL CMD
-        {
-            unsigned int msf = (m_CBW.CBWCB[1] >> 1) & 0x01;
-            //unsigned int subq = (m_CBW.CBWCB[2] >> 6) & 0x01; //TODO We're ignoring subq for now
-            unsigned int parameter_list = m_CBW.CBWCB[3];
-            // unsigned int track_number = m_CBW.CBWCB[6]; // Ignore track number for now. It's used only for ISRC
-            int allocationLength = (m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8];
-            int length = 0;
+            // Copy the TOC header
+            m_TOCData.DataLength = htons(datalen - 2);
+            memcpy(m_InBuffer, &m_TOCData, SIZE_TOC_DATA);
 
-            // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "READ SUB-CHANNEL CMD (0x42), allocationLength = %d, msf = %u, subq = %u, parameter_list = 0x%02x, track_number = %u", allocationLength, msf, subq, parameter_list, track_number);
+            // Copy the TOC entries immediately after the header
+            memcpy(m_InBuffer + SIZE_TOC_DATA, tocEntries, numtracks * SIZE_TOC_ENTRY);
 
-            CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
+            delete[] tocEntries;
 
+            CacheResponse(datalen);
 
-	    if (parameter_list == 0x00 )
-		    parameter_list = 0x01; // 0x00 is "reserved" so let's assume they want cd info
-	    
-            switch (parameter_list) {
-                // Current Position Data request
-                case 0x01: {
-                    // Current Position Header
-                    TUSBCDSubChannelHeaderReply header;
-                    memset(&header, 0, SIZE_SUBCHANNEL_HEADER_REPLY);
-                    header.audioStatus = 0x00;  // Audio status not supported
-                    header.dataLength = SIZE_SUBCHANNEL_01_DATA_REPLY;
+            // Set response length
+            if (allocationLength < datalen)
+                datalen = allocationLength;
 
-                    // Override audio status by querying the player
-                    if (cdplayer) {
-                        unsigned int state = cdplayer->GetState();
-                        switch (state) {
-                            case CCDPlayer::PLAYING:
-                                header.audioStatus = 0x11;  // Playing
-                                break;
-                            case CCDPlayer::PAUSED:
-                                header.audioStatus = 0x12;  // Paused
-                                break;
-                            case CCDPlayer::STOPPED_OK:
-                                header.audioStatus = 0x13;  // Stopped without error
-                                break;
-                            case CCDPlayer::STOPPED_ERROR:
-                                header.audioStatus = 0x14;  // Stopped with error
-                                break;
-                            default:
-                                header.audioStatus = 0x15;  // No status to return
-                                break;
-                        }
-                    }
+            m_nnumber_blocks = 0;  // nothing more after this send
+            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, datalen);
+            m_nState = TCDState::DataIn;
+            m_CSW.bmCSWStatus = bmCSWStatus;
 
-                    // Current Position Data
-                    TUSBCDSubChannel01CurrentPositionReply data;
-                    memset(&data, 0, SIZE_SUBCHANNEL_01_DATA_REPLY);
-                    data.dataFormatCode = 0x01;
 
-                    u32 address = 0;
-                    if (cdplayer) {
-                        address = cdplayer->GetCurrentAddress();
-                        data.absoluteAddress = GetAddress(address, msf);
-                        CUETrackInfo trackInfo = GetTrackInfoForLBA(address);
-                        if (trackInfo.track_number != -1) {
-                            data.trackNumber = trackInfo.track_number;
-                            data.indexNumber = 0x01;  // Assume no pregap. Perhaps we need to handle pregap?
-                            data.relativeAddress = GetAddress(address - trackInfo.track_start, msf, true);
-                        }
-                    }
+    } else {
+        MLOGNOTE("handleSCSI READ TOC", "failed, %s", m_CDReady ? "ready" : "not ready");
+        m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;
+        m_SenseParams.bSenseKey = 0x02;
+        m_SenseParams.bAddlSenseCode = 0x04;      // LOGICAL UNIT NOT READY
+        m_SenseParams.bAddlSenseCodeQual = 0x00;  // CAUSE NOT REPORTABLE
+        SendCSW();
+    }
+}
 
-                    // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "READ SUB-CHANNEL CMD (0x42, 0x01) audio_status %02x, trackNumber %d, address %d, absoluteAddress %08x, relativeAddress %08x", header.audioStatus, data.trackNumber, address, data.absoluteAddress, data.relativeAddress);
+// READ SUB-CHANNEL CMD (0x42)
+void CUSBCDGadget::HandleReadSubChannel() {
+    unsigned int msf = (m_CBW.CBWCB[1] >> 1) & 0x01;
+    //unsigned int subq = (m_CBW.CBWCB[2] >> 6) & 0x01; //TODO We're ignoring subq for now
+    unsigned int parameter_list = m_CBW.CBWCB[3];
+    // unsigned int track_number = m_CBW.CBWCB[6]; // Ignore track number for now. It's used only for ISRC
+    int allocationLength = (m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8];
+    int length = 0;
 
-                    // Determine data lengths
-                    length = SIZE_SUBCHANNEL_HEADER_REPLY + SIZE_SUBCHANNEL_01_DATA_REPLY;
+    // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "READ SUB-CHANNEL CMD (0x42), allocationLength = %d, msf = %u, subq = %u, parameter_list = 0x%02x, track_number = %u", allocationLength, msf, subq, parameter_list, track_number);
 
-                    // Copy the header & Code Page
-                    memcpy(m_InBuffer, &header, SIZE_SUBCHANNEL_HEADER_REPLY);
-                    memcpy(m_InBuffer + SIZE_SUBCHANNEL_HEADER_REPLY, &data, SIZE_SUBCHANNEL_01_DATA_REPLY);
-                    break;
-                }
+    CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
 
-                case 0x02: {
-                    // Media Catalog Number (UPC Bar Code)
-                    break;
-                }
 
-                case 0x03: {
-                    // International Standard Recording Code (ISRC)
-	    	    // TODO We're ignoring track number because that's only valid here
-                    break;
+    if (parameter_list == 0x00 )
+            parameter_list = 0x01; // 0x00 is "reserved" so let's assume they want cd info
+
+    switch (parameter_list) {
+        // Current Position Data request
+        case 0x01: {
+            // Current Position Header
+            TUSBCDSubChannelHeaderReply header;
+            memset(&header, 0, SIZE_SUBCHANNEL_HEADER_REPLY);
+            header.audioStatus = 0x00;  // Audio status not supported
+            header.dataLength = SIZE_SUBCHANNEL_01_DATA_REPLY;
+
+            // Override audio status by querying the player
+            if (cdplayer) {
+                unsigned int state = cdplayer->GetState();
+                switch (state) {
+                    case CCDPlayer::PLAYING:
+                        header.audioStatus = 0x11;  // Playing
+                        break;
+                    case CCDPlayer::PAUSED:
+                        header.audioStatus = 0x12;  // Paused
+                        break;
+                    case CCDPlayer::STOPPED_OK:
+                        header.audioStatus = 0x13;  // Stopped without error
+                        break;
+                    case CCDPlayer::STOPPED_ERROR:
+                        header.audioStatus = 0x14;  // Stopped with error
+                        break;
+                    default:
+                        header.audioStatus = 0x15;  // No status to return
+                        break;
                 }
+            }
 
-                default: {
-                    // TODO Error
+            // Current Position Data
+            TUSBCDSubChannel01CurrentPositionReply data;
+            memset(&data, 0, SIZE_SUBCHANNEL_01_DATA_REPLY);
+            data.dataFormatCode = 0x01;
+
+            u32 address = 0;
+            if (cdplayer) {
+                address = cdplayer->GetCurrentAddress();
+                data.absoluteAddress = GetAddress(address, msf);
+                TTrackEntry trackInfo = GetTrackInfoForLBA(address);
+                if (trackInfo.track_number != -1) {
+                    data.trackNumber = trackInfo.track_number;
+                    data.indexNumber = 0x01;  // Assume no pregap. Perhaps we need to handle pregap?
+                    data.relativeAddress = GetAddress(address - trackInfo.track_start, msf, true);
                 }
             }
 
-            if (allocationLength < length)
-                length = allocationLength;
+            // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "READ SUB-CHANNEL CMD (0x42, 0x01) audio_status %02x, trackNumber %d, address %d, absoluteAddress %08x, relativeAddress %08x", header.audioStatus, data.trackNumber, address, data.absoluteAddress, data.relativeAddress);
 
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
-                                       m_InBuffer, length);
+            // Determine data lengths
+            length = SIZE_SUBCHANNEL_HEADER_REPLY + SIZE_SUBCHANNEL_01_DATA_REPLY;
 
-            m_nnumber_blocks = 0;  // nothing more after this send
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = bmCSWStatus;
+            // Copy the header & Code Page
+            memcpy(m_InBuffer, &header, SIZE_SUBCHANNEL_HEADER_REPLY);
+            memcpy(m_InBuffer + SIZE_SUBCHANNEL_HEADER_REPLY, &data, SIZE_SUBCHANNEL_01_DATA_REPLY);
+            break;
+        }
 
+        case 0x02: {
+            // Media Catalog Number (UPC Bar Code)
             break;
         }
 
-        case 0x52:  // READ TRACK INFORMATION
-        {
+        case 0x03: {
+            // International Standard Recording Code (ISRC)
+            // TODO We're ignoring track number because that's only valid here
+            break;
+        }
 
-	    u8 open = (m_CBW.CBWCB[1] >> 2) & 0x01;
-	    u8 addressType = m_CBW.CBWCB[1] & 0x03;
-	    u32 address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
-            u16 allocationLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
-	    u8 control = m_CBW.CBWCB[9];
+        default: {
+            // TODO Error
+        }
+    }
 
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Read Track Information");
+    if (allocationLength < length)
+        length = allocationLength;
 
-	    TUSBCDTrackInformationBlock response;
-	    memset(&response, 0, sizeof(TUSBCDTrackInformationBlock));
-	    response.dataLength = htons(46);
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                               m_InBuffer, length);
 
-	    switch (addressType) {
-		case 0x00:
-		{
-			// Logical Block Number
-			// TODO
-			break;
-		}
-		case 0x01:
-		{
-			// Logical Track Number
-			CUETrackInfo trackInfo = GetTrackInfoForTrack(int(address));
-			response.logicalTrackNumberLSB = address & 0xff;
-			response.sessionNumberLSB = 0x01; // no sessions
-			if (trackInfo.track_number != -1 && trackInfo.track_mode == CUETrack_AUDIO)
-				response.trackMode = 0x02; // audio
-			else
-				response.trackMode = 0x06; // data
-
-			response.dataMode = 0x01; // mode 1
-			if (trackInfo.track_number != -1)
-				response.logicalTrackStartAddress = htonl(trackInfo.track_start);
-			break;
-		}
-		case 0x02:
-		{
-			// Session Number
-			// TODO
-			break;
-		}
-	    }
+    m_nnumber_blocks = 0;  // nothing more after this send
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = bmCSWStatus;
+}
 
-	    int length = sizeof(TUSBCDTrackInformationBlock);
+// READ TRACK INFORMATION (0x52)
+void CUSBCDGadget::HandleReadTrackInformation() {
+    u8 open = (m_CBW.CBWCB[1] >> 2) & 0x01;
+    u8 addressType = m_CBW.CBWCB[1] & 0x03;
+    u32 address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
+    u16 allocationLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
+    u8 control = m_CBW.CBWCB[9];
 
-            if (allocationLength < length)
-                length = allocationLength;
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Read Track Information");
 
-            m_nnumber_blocks = 0;  // nothing more after this send
-	    memcpy(m_InBuffer, &response, sizeof(TUSBCDTrackInformationBlock));
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-            break;
+    TUSBCDTrackInformationBlock response;
+    memset(&response, 0, sizeof(TUSBCDTrackInformationBlock));
+    response.dataLength = htons(46);
+
+    switch (addressType) {
+        case 0x00:
+        {
+                // Logical Block Number
+                // TODO
+                break;
         }
+        case 0x01:
+        {
+                // Logical Track Number
+                TTrackEntry trackInfo = GetTrackInfoForTrack(int(address));
+                response.logicalTrackNumberLSB = address & 0xff;
+                response.sessionNumberLSB = 0x01; // no sessions
+                if (trackInfo.track_number != -1 && trackInfo.track_mode == CUETrack_AUDIO)
+                        response.trackMode = 0x02; // audio
+                else
+                        response.trackMode = 0x06; // data
 
-        case 0x4A:  // GET EVENT STATUS NOTIFICATION
+                response.dataMode = 0x01; // mode 1
+                if (trackInfo.track_number != -1)
+                        response.logicalTrackStartAddress = htonl(trackInfo.track_start);
+                break;
+        }
+        case 0x02:
         {
+                // Session Number
+                // TODO
+                break;
+        }
+    }
 
-	    u8 polled = m_CBW.CBWCB[1] & 0x01;
-	    u8 notificationClass = m_CBW.CBWCB[4]; // This is a bitmask
-            u16 allocationLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
+    int length = sizeof(TUSBCDTrackInformationBlock);
 
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Get Event Status Notification");
+    if (allocationLength < length)
+        length = allocationLength;
 
-	    if (polled = 0) {
-		// We don't support async mode
-                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Get Event Status Notification - we don't support async notifications");
-	        bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
-                m_SenseParams.bSenseKey = 0x05;		// ILLEGAL REQUEST
-                m_SenseParams.bAddlSenseCode = 0x24;      // INVALID FIELD IN CDB
-                m_SenseParams.bAddlSenseCodeQual = 0x00;
-            	m_CSW.bmCSWStatus = bmCSWStatus;
-                SendCSW();
-		break;
-	    }
+    m_nnumber_blocks = 0;  // nothing more after this send
+    memcpy(m_InBuffer, &response, sizeof(TUSBCDTrackInformationBlock));
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+}
 
-	    int length = 0;
-	    // Event Header
-	    TUSBCDEventStatusReplyHeader header;
-	    memset(&header, 0, sizeof(header));
-	    header.supportedEventClass = 0x10; // Only support media change events (10000b)
+// GET EVENT STATUS NOTIFICATION (0x4A)
+void CUSBCDGadget::HandleGetEventStatusNotification() {
+    u8 polled = m_CBW.CBWCB[1] & 0x01;
+    u8 notificationClass = m_CBW.CBWCB[4]; // This is a bitmask
+    u16 allocationLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
+
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Get Event Status Notification");
+
+    if (polled == 0) {
+        // We don't support async mode
+        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Get Event Status Notification - we don't support async notifications");
+        bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
+        m_SenseParams.bSenseKey = 0x05;		// ILLEGAL REQUEST
+        m_SenseParams.bAddlSenseCode = 0x24;      // INVALID FIELD IN CDB
+        m_SenseParams.bAddlSenseCodeQual = 0x00;
+        m_CSW.bmCSWStatus = bmCSWStatus;
+        SendCSW();
+        return;
+    }
 
-	    // Media Change Event Request
-	    if (notificationClass & (1<<4)) {
+    int length = 0;
+    // Event Header
+    TUSBCDEventStatusReplyHeader header;
+    memset(&header, 0, sizeof(header));
+    header.supportedEventClass = 0x10; // Only support media change events (10000b)
 
-                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Get Event Status Notification - media change event response");
+    // Media Change Event Request
+    if (notificationClass & (1<<4)) {
 
-		// Update header
-	    	header.eventDataLength = htons(0x04); // Always 4 because only return 1 event
+        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Get Event Status Notification - media change event response");
 
-		// Define the event
-		TUSBCDEventStatusReplyEvent event;
-		memset(&event, 0, sizeof(event));
-		header.notificationClass = 0x04; // 100b = media
-		event.data[0] = 0x02; // media present
+        // Update header
+        header.eventDataLength = htons(0x04); // Always 4 because only return 1 event
 
-		if (discChanged) {
-		    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Get Event Status Notification - sending NewMedia event");
-		    event.eventCode = 0x02; // NewMedia event
+        // Define the event
+        TUSBCDEventStatusReplyEvent event;
+        memset(&event, 0, sizeof(event));
+        header.notificationClass = 0x04; // 100b = media
+        if (m_MediaState == MediaLoaded || m_MediaState == MediaUnitAttention)
+            event.data[0] = 0x02; // media present
 
-		    // Only clear the disc changed event if we're
-		    // actually going to send it
-		    if (allocationLength > 4)
-			discChanged = false;
-		}
-		memcpy(m_InBuffer + sizeof(TUSBCDEventStatusReplyHeader), &event, sizeof(TUSBCDEventStatusReplyEvent));
-               	length += sizeof(TUSBCDEventStatusReplyEvent);
-	    }
+        if (m_nMediaEvent != MediaEventNone) {
+            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Get Event Status Notification - sending %s event",
+                     m_nMediaEvent == MediaEventNewMedia ? "NewMedia" : "MediaRemoval");
+            event.eventCode = m_nMediaEvent;
+
+            // Only clear the event if we're actually going to send it
+            if (allocationLength > 4)
+                m_nMediaEvent = MediaEventNone;
+        }
+        memcpy(m_InBuffer + sizeof(TUSBCDEventStatusReplyHeader), &event, sizeof(TUSBCDEventStatusReplyEvent));
+        length += sizeof(TUSBCDEventStatusReplyEvent);
+    }
 
-	    memcpy(m_InBuffer, &header, sizeof(TUSBCDEventStatusReplyHeader));
-	    length += sizeof(TUSBCDEventStatusReplyHeader);
+    memcpy(m_InBuffer, &header, sizeof(TUSBCDEventStatusReplyHeader));
+    length += sizeof(TUSBCDEventStatusReplyHeader);
 
-            if (allocationLength < length)
-                length = allocationLength;
+    if (allocationLength < length)
+        length = allocationLength;
 
-            m_nnumber_blocks = 0;  // nothing more after this send
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-            break;
-        }
+    m_nnumber_blocks = 0;  // nothing more after this send
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+}
 
-        case 0xAD:  // READ DISC STRUCTURE aka "The Command I Was Avoiding"
-        {
+// READ DISC STRUCTURE aka "The Command I Was Avoiding" (0xAD)
+void CUSBCDGadget::HandleReadDiscStructure() {
+    // We don't advertise any "features" which should require this command
+    // but certain versions of Windows e.g. Win2k sulk for a while if they
+    // don't get a response. So, we're implementing bare minimum here to
+    // keep them happy
+
+    u8 mediaType = m_CBW.CBWCB[2] && 0x0f;
+    u32 address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
+    u8 layer = m_CBW.CBWCB[6];
+    u8 format = m_CBW.CBWCB[7];
+    u16 allocationLength = m_CBW.CBWCB[8] << 8 | (m_CBW.CBWCB[9]);
+    u8 agid = (m_CBW.CBWCB[10] >> 6) & 0x03;
+    u8 control = m_CBW.CBWCB[12];
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Read Disc Structure, allocation length is %lu", allocationLength);
+
+    int length = 0;
+    switch (format) {
+
+            case 0x01: // Copyright Information
+            {
+                TUSBCDReadDiscStructureHeader header;
+                memset(&header, 0, sizeof(TUSBCDReadDiscStructureHeader));
+                header.dataLength = 6;
+                memcpy(m_InBuffer, &header, sizeof(TUSBCDReadDiscStructureHeader));
+                length += sizeof(TUSBCDReadDiscStructureHeader);
+
+                u8 payload[] = {
+                        0x00, // Copyright system type = none
+                        0x00, // 1 bit per region. 0x00 is region free
+                        0x00, // reserved
+                        0x00  // reserved
+                };
+                memcpy(m_InBuffer + sizeof(TUSBCDReadDiscStructureHeader), &payload, sizeof(payload));
+                length += sizeof(payload);
+                break;
+            }
 
-	    // We don't advertise any "features" which should require this command
-	    // but certain versions of Windows e.g. Win2k sulk for a while if they
-	    // don't get a response. So, we're implementing bare minimum here to
-	    // keep them happy
-
-	    u8 mediaType = m_CBW.CBWCB[2] && 0x0f;
-            u32 address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
-	    u8 layer = m_CBW.CBWCB[6];
-	    u8 format = m_CBW.CBWCB[7];
-            u16 allocationLength = m_CBW.CBWCB[8] << 8 | (m_CBW.CBWCB[9]);
-	    u8 agid = (m_CBW.CBWCB[10] >> 6) & 0x03;
-	    u8 control = m_CBW.CBWCB[12];
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Read Disc Structure, allocation length is %lu", allocationLength);
-
-	    int length = 0;
-	    switch (format) {
-		    
-		    case 0x01: // Copyright Information
-		    {
-                    	TUSBCDReadDiscStructureHeader header;
-                    	memset(&header, 0, sizeof(TUSBCDReadDiscStructureHeader));
-                    	header.dataLength = 6;
-			memcpy(m_InBuffer, &header, sizeof(TUSBCDReadDiscStructureHeader));
-			length += sizeof(TUSBCDReadDiscStructureHeader);
-
-			u8 payload[] = {
-				0x00, // Copyright system type = none
-				0x00, // 1 bit per region. 0x00 is region free
-				0x00, // reserved
-				0x00  // reserved
-			};
-			memcpy(m_InBuffer + sizeof(TUSBCDReadDiscStructureHeader), &payload, sizeof(payload));
-			length += sizeof(payload);
-			break;
-		    }
-
-		    default: // Empty payload
-		    {
-                    	TUSBCDReadDiscStructureHeader header;
-                    	memset(&header, 0, sizeof(TUSBCDReadDiscStructureHeader));
-                    	header.dataLength = 2; // just the header
-			memcpy(m_InBuffer, &header, sizeof(TUSBCDReadDiscStructureHeader));
-			length += sizeof(TUSBCDReadDiscStructureHeader);
-			break;
-		    }
-	    }
+            default: // Empty payload
+            {
+                TUSBCDReadDiscStructureHeader header;
+                memset(&header, 0, sizeof(TUSBCDReadDiscStructureHeader));
+                header.dataLength = 2; // just the header
+                memcpy(m_InBuffer, &header, sizeof(TUSBCDReadDiscStructureHeader));
+                length += sizeof(TUSBCDReadDiscStructureHeader);
+                break;
+            }
+    }
 
-            // Set response length
-            if (allocationLength < length)
-                length = allocationLength;
+    // Set response length
+    if (allocationLength < length)
+        length = allocationLength;
 
-            m_nnumber_blocks = 0;  // nothing more after this send
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = bmCSWStatus;
-            break;
-        }
+    m_nnumber_blocks = 0;  // nothing more after this send
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = bmCSWStatus;
+}
+
+// READ DISC INFORMATION CMD (0x51)
+void CUSBCDGadget::HandleReadDiscInformation() {
+    // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Read Disc Information");
+
+    m_DiscInfoReply.last_track_last_session = GetLastTrackNumber();
+    u32 leadoutLBA = GetLeadoutLBA();
+    m_DiscInfoReply.last_lead_in_start_time = htonl(leadoutLBA);
+    m_DiscInfoReply.last_possible_lead_out = htonl(leadoutLBA);
 
-        case 0x51:  // READ DISC INFORMATION CMD
+    // Set response length
+    u16 allocationLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
+    int length = sizeof(TUSBDiscInfoReply);
+    memcpy(m_InBuffer, &m_DiscInfoReply, length);
+    CacheResponse(length);
+
+    if (allocationLength < length)
+        length = allocationLength;
+
+    m_nnumber_blocks = 0;  // nothing more after this send
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = bmCSWStatus;
+}
+
+// Get Configuration (0x46)
+void CUSBCDGadget::HandleGetConfiguration() {
+    int rt = m_CBW.CBWCB[1] & 0x03;
+    int feature = (m_CBW.CBWCB[2] << 8) | m_CBW.CBWCB[3];
+    u16 allocationLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
+    //MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Get Configuration with rt = %d and feature %lu", rt, feature);
+
+    int dataLength = 0;
+
+    switch (rt) {
+        case 0x00:  // All features supported
+        case 0x01:  // All current features supported
         {
-            // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Read Disc Information");
+            // offset to make space for the header
+            dataLength += sizeof(header);
 
-            m_DiscInfoReply.last_track_last_session = GetLastTrackNumber();
-            u32 leadoutLBA = GetLeadoutLBA();
-            m_DiscInfoReply.last_lead_in_start_time = htonl(leadoutLBA);
-            m_DiscInfoReply.last_possible_lead_out = htonl(leadoutLBA);
+            // Copy all features
+            memcpy(m_InBuffer + dataLength, &profile_list, sizeof(profile_list));
+            dataLength += sizeof(profile_list);
 
-            // Set response length
-            u16 allocationLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
-            int length = sizeof(TUSBDiscInfoReply);
-            if (allocationLength < length)
-                length = allocationLength;
+            memcpy(m_InBuffer + dataLength, &cdrom_profile, sizeof(cdrom_profile));
+            dataLength += sizeof(cdrom_profile);
+
+            memcpy(m_InBuffer + dataLength, &core, sizeof(core));
+            dataLength += sizeof(core);
+
+            memcpy(m_InBuffer + dataLength, &morphing, sizeof(morphing));
+            dataLength += sizeof(morphing);
+
+            memcpy(m_InBuffer + dataLength, &mechanism, sizeof(mechanism));
+            dataLength += sizeof(mechanism);
+
+            memcpy(m_InBuffer + dataLength, &multiread, sizeof(multiread));
+            dataLength += sizeof(multiread);
+
+            memcpy(m_InBuffer + dataLength, &cdread, sizeof(cdread));
+            dataLength += sizeof(cdread);
+
+            memcpy(m_InBuffer + dataLength, &powermanagement, sizeof(powermanagement));
+            dataLength += sizeof(powermanagement);
+
+            memcpy(m_InBuffer + dataLength, &audioplay, sizeof(audioplay));
+            dataLength += sizeof(audioplay);
+
+            // Finally copy the header
+            header.dataLength = htonl(dataLength - 4);
+            memcpy(m_InBuffer, &header, sizeof(header));
 
-            memcpy(m_InBuffer, &m_DiscInfoReply, length);
-            m_nnumber_blocks = 0;  // nothing more after this send
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = bmCSWStatus;
             break;
         }
 
-        case 0x46:  // Get Configuration
+        case 0x02:  // starting at the feature requested
         {
-            int rt = m_CBW.CBWCB[1] & 0x03;
-            int feature = (m_CBW.CBWCB[2] << 8) | m_CBW.CBWCB[3];
-            u16 allocationLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
-            //MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Get Configuration with rt = %d and feature %lu", rt, feature);
-
-            int dataLength = 0;
+            // Offset for header
+            dataLength += sizeof(header);
 
-            switch (rt) {
-                case 0x00:  // All features supported
-                case 0x01:  // All current features supported
-                {
-                    // offset to make space for the header
-                    dataLength += sizeof(header);
-
-                    // Copy all features
+            switch (feature) {
+                case 0x00: {  // Profile list
                     memcpy(m_InBuffer + dataLength, &profile_list, sizeof(profile_list));
                     dataLength += sizeof(profile_list);
 
+                    // and its associated profile
                     memcpy(m_InBuffer + dataLength, &cdrom_profile, sizeof(cdrom_profile));
                     dataLength += sizeof(cdrom_profile);
+                }
 
+                case 0x01: {  // Core
                     memcpy(m_InBuffer + dataLength, &core, sizeof(core));
                     dataLength += sizeof(core);
+                }
 
+                case 0x02: {  // Morphing
                     memcpy(m_InBuffer + dataLength, &morphing, sizeof(morphing));
                     dataLength += sizeof(morphing);
+                }
 
+                case 0x03: {  // Removable Medium
                     memcpy(m_InBuffer + dataLength, &mechanism, sizeof(mechanism));
                     dataLength += sizeof(mechanism);
+                }
 
+                case 0x1d: {  // Multiread
                     memcpy(m_InBuffer + dataLength, &multiread, sizeof(multiread));
                     dataLength += sizeof(multiread);
+                }
 
+                case 0x1e: {  // CD-Read
                     memcpy(m_InBuffer + dataLength, &cdread, sizeof(cdread));
                     dataLength += sizeof(cdread);
+                }
 
+                case 0x100: {  // Power Management
                     memcpy(m_InBuffer + dataLength, &powermanagement, sizeof(powermanagement));
                     dataLength += sizeof(powermanagement);
+                }
 
+                case 0x103: {  // Analogue Audio Play
                     memcpy(m_InBuffer + dataLength, &audioplay, sizeof(audioplay));
                     dataLength += sizeof(audioplay);
-
-                    // Finally copy the header
-                    header.dataLength = htonl(dataLength - 4);
-                    memcpy(m_InBuffer, &header, sizeof(header));
-
-                    break;
                 }
+            }
 
-                case 0x02:  // starting at the feature requested
-                {
-                    // Offset for header
-                    dataLength += sizeof(header);
+            // Finally copy the header
+            header.dataLength = htonl(dataLength - 4);
+            memcpy(m_InBuffer, &header, sizeof(header));
+            break;
+        }
+    }
 
-                    switch (feature) {
-                        case 0x00: {  // Profile list
-                            memcpy(m_InBuffer + dataLength, &profile_list, sizeof(profile_list));
-                            dataLength += sizeof(profile_list);
+    CacheResponse(dataLength);
 
-                            // and its associated profile
-                            memcpy(m_InBuffer + dataLength, &cdrom_profile, sizeof(cdrom_profile));
-                            dataLength += sizeof(cdrom_profile);
-                        }
+    // Set response length
+    if (allocationLength < dataLength)
+        dataLength = allocationLength;
 
-                        case 0x01: {  // Core
-                            memcpy(m_InBuffer + dataLength, &core, sizeof(core));
-                            dataLength += sizeof(core);
-                        }
+    m_nnumber_blocks = 0;  // nothing more after this send
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, dataLength);
+    m_nState = TCDState::DataIn;
+    //m_CSW.bmCSWStatus = bmCSWStatus;
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+}
 
-                        case 0x02: {  // Morphing
-                            memcpy(m_InBuffer + dataLength, &morphing, sizeof(morphing));
-                            dataLength += sizeof(morphing);
-                        }
+// PAUSE/RESUME (0x4B)
+void CUSBCDGadget::HandlePauseResume() {
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PAUSE/RESUME");
+    int resume = m_CBW.CBWCB[8] & 0x01;
 
-                        case 0x03: {  // Removable Medium
-                            memcpy(m_InBuffer + dataLength, &mechanism, sizeof(mechanism));
-                            dataLength += sizeof(mechanism);
-                        }
+    CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
+    if (cdplayer) {
+        if (resume)
+            cdplayer->Resume();
+        else
+            cdplayer->Pause();
+    }
 
-                        case 0x1d: {  // Multiread
-                            memcpy(m_InBuffer + dataLength, &multiread, sizeof(multiread));
-                            dataLength += sizeof(multiread);
-                        }
+    m_CSW.bmCSWStatus = bmCSWStatus;
+    SendCSW();
+}
 
-                        case 0x1e: {  // CD-Read
-                            memcpy(m_InBuffer + dataLength, &cdread, sizeof(cdread));
-                            dataLength += sizeof(cdread);
-                        }
+// SEEK (0x2B)
+void CUSBCDGadget::HandleSeek() {
+    // Where to start reading (LBA)
+    m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
 
-                        case 0x100: {  // Power Management
-                            memcpy(m_InBuffer + dataLength, &powermanagement, sizeof(powermanagement));
-                            dataLength += sizeof(powermanagement);
-                        }
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SEEK to LBA %lu", m_nblock_address);
 
-                        case 0x103: {  // Analogue Audio Play
-                            memcpy(m_InBuffer + dataLength, &audioplay, sizeof(audioplay));
-                            dataLength += sizeof(audioplay);
-                        }
-                    }
+    CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
+    if (cdplayer) {
+        cdplayer->Seek(m_nblock_address);
+    }
 
-                    // Finally copy the header
-                    header.dataLength = htonl(dataLength - 4);
-                    memcpy(m_InBuffer, &header, sizeof(header));
-                    break;
+    m_CSW.bmCSWStatus = bmCSWStatus;
+    SendCSW();
+}
+
+// PLAY AUDIO MSF (0x47)
+void CUSBCDGadget::HandlePlayAudioMSF() {
+    // Start MSF
+    u8 SM = m_CBW.CBWCB[3];
+    u8 SS = m_CBW.CBWCB[4];
+    u8 SF = m_CBW.CBWCB[5];
+
+    // End MSF
+    u8 EM = m_CBW.CBWCB[6];
+    u8 ES = m_CBW.CBWCB[7];
+    u8 EF = m_CBW.CBWCB[8];
+
+    // Convert MSF to LBA
+    u32 start_lba = msf_to_lba(SM, SS, SF);
+    u32 end_lba = msf_to_lba(EM, ES, EF);
+    int num_blocks = end_lba - start_lba;
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO MSF. Start MSF %d:%d:%d, End MSF: %d:%d:%d, start LBA %u, end LBA %u", SM, SS, SF, EM, ES, EF, start_lba, end_lba);
+
+    TTrackEntry trackInfo = GetTrackInfoForLBA(start_lba);
+    if (trackInfo.track_number != -1 && trackInfo.track_mode == CUETrack_AUDIO) {
+            // Play the audio
+            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "CD Player found, sending command");
+            CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
+            if (cdplayer) {
+                if (start_lba == 0xFFFFFFFF) {
+                        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "CD Player found, Resume");
+                        cdplayer->Resume();
+                } else if (start_lba == end_lba) {
+                        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "CD Player found, Pause");
+                        cdplayer->Pause();
+                } else {
+                        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "CD Player found, Play");
+                        cdplayer->Play(start_lba, num_blocks);
                 }
             }
+    } else {
+           MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO MSF: Not an audio track");
+           bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
+           m_SenseParams.bSenseKey = 0x05;
+           m_SenseParams.bAddlSenseCode = 0x64;      // ILLEGAL MODE FOR THIS TRACK OR INCOMPATIBLE MEDIUM
+           m_SenseParams.bAddlSenseCodeQual = 0x00;  
+    }
 
-            // Set response length
-            if (allocationLength < dataLength)
-                dataLength = allocationLength;
+    m_CSW.bmCSWStatus = bmCSWStatus;
+    SendCSW();
+}
 
-            m_nnumber_blocks = 0;  // nothing more after this send
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, dataLength);
-            m_nState = TCDState::DataIn;
-            //m_CSW.bmCSWStatus = bmCSWStatus;
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-            break;
+// STOP / SCAN (0x4E)
+void CUSBCDGadget::HandleStopScan() {
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "STOP / SCAN");
+
+        CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
+        if (cdplayer) {
+                cdplayer->Pause();
         }
 
-        case 0x4B:  // PAUSE/RESUME
-        {
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PAUSE/RESUME");
-            int resume = m_CBW.CBWCB[8] & 0x01;
+    m_CSW.bmCSWStatus = bmCSWStatus;
+    SendCSW();
+}
 
-            CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
-            if (cdplayer) {
-                if (resume)
-                    cdplayer->Resume();
-                else
-                    cdplayer->Pause();
-            }
+// PLAY AUDIO (10) (0x45)
+void CUSBCDGadget::HandlePlayAudio10() {
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (10)");
 
-            m_CSW.bmCSWStatus = bmCSWStatus;
-            SendCSW();
-            break;
-        }
+    // Where to start reading (LBA)
+    m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
 
-        case 0x2B:  // SEEK
-        {
-
-            // Where to start reading (LBA)
-            m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
+    // Number of blocks to read (LBA)
+    m_nnumber_blocks = (u32)((m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8]);
 
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SEEK to LBA %lu", m_nblock_address);
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (10) Playing from %lu for %lu blocks", m_nblock_address, m_nnumber_blocks);
 
-            CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
-            if (cdplayer) {
-                cdplayer->Seek(m_nblock_address);
+    // Play the audio, but only if length > 0
+    if (m_nnumber_blocks > 0) {
+            TTrackEntry trackInfo = GetTrackInfoForLBA(m_nblock_address);
+            if (trackInfo.track_number != -1 && trackInfo.track_mode == CUETrack_AUDIO) {
+                CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
+                if (cdplayer) {
+                    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (10) Play command sent");
+                    if (m_nblock_address == 0xffffffff)
+                        cdplayer->Resume();
+                    else
+                        cdplayer->Play(m_nblock_address, m_nnumber_blocks);
+                }
+            } else {
+                bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
+                m_SenseParams.bSenseKey = 0x05;
+                m_SenseParams.bAddlSenseCode = 0x64;      // ILLEGAL MODE FOR THIS TRACK OR INCOMPATIBLE MEDIUM
+                m_SenseParams.bAddlSenseCodeQual = 0x00;  
             }
+    }
 
-            m_CSW.bmCSWStatus = bmCSWStatus;
-            SendCSW();
-            break;
-        }
+    m_CSW.bmCSWStatus = bmCSWStatus;
+    SendCSW();
+}
 
-        case 0x47:  // PLAY AUDIO MSF
-        {
-            // Start MSF
-            u8 SM = m_CBW.CBWCB[3];
-            u8 SS = m_CBW.CBWCB[4];
-            u8 SF = m_CBW.CBWCB[5];
-
-            // End MSF
-            u8 EM = m_CBW.CBWCB[6];
-            u8 ES = m_CBW.CBWCB[7];
-            u8 EF = m_CBW.CBWCB[8];
-
-            // Convert MSF to LBA
-            u32 start_lba = msf_to_lba(SM, SS, SF);
-            u32 end_lba = msf_to_lba(EM, ES, EF);
-            int num_blocks = end_lba - start_lba;
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO MSF. Start MSF %d:%d:%d, End MSF: %d:%d:%d, start LBA %u, end LBA %u", SM, SS, SF, EM, ES, EF, start_lba, end_lba);
-
-	    CUETrackInfo trackInfo = GetTrackInfoForLBA(start_lba);
-	    if (trackInfo.track_number != -1 && trackInfo.track_mode == CUETrack_AUDIO) {
-		    // Play the audio
-            	    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "CD Player found, sending command");
-		    CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
-		    if (cdplayer) {
-			if (start_lba == 0xFFFFFFFF) {
-            	    		MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "CD Player found, Resume");
-				cdplayer->Resume();
-			} else if (start_lba == end_lba) {
-            	    		MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "CD Player found, Pause");
-				cdplayer->Pause();
-			} else {
-            	    		MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "CD Player found, Play");
-				cdplayer->Play(start_lba, num_blocks);
-			}
-		    }
-	    } else {
-		   MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO MSF: Not an audio track");
-		   bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
-                   m_SenseParams.bSenseKey = 0x05;
-                   m_SenseParams.bAddlSenseCode = 0x64;      // ILLEGAL MODE FOR THIS TRACK OR INCOMPATIBLE MEDIUM
-                   m_SenseParams.bAddlSenseCodeQual = 0x00;  
-	    }
+// PLAY AUDIO (12) (0xA5)
+void CUSBCDGadget::HandlePlayAudio12() {
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (12)");
 
-            m_CSW.bmCSWStatus = bmCSWStatus;
-            SendCSW();
-            break;
-        }
+    // Where to start reading (LBA)
+    m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
 
-        case 0x4E:  // STOP / SCAN
-        {
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "STOP / SCAN");
+    // Number of blocks to read (LBA)
+    m_nnumber_blocks = (u32)(m_CBW.CBWCB[6] << 24) | (u32)(m_CBW.CBWCB[7] << 16) | (u32)(m_CBW.CBWCB[8] << 8) | m_CBW.CBWCB[9];
+
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (12) Playing from %lu for %lu blocks", m_nblock_address, m_nnumber_blocks);
 
+    // Play the audio, but only if length > 0
+    if (m_nnumber_blocks > 0) {
+            TTrackEntry trackInfo = GetTrackInfoForLBA(m_nblock_address);
+            if (trackInfo.track_number != -1 && trackInfo.track_mode == CUETrack_AUDIO) {
                 CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
                 if (cdplayer) {
-                        cdplayer->Pause();
+                    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (12) Play command sent");
+                    if (m_nblock_address == 0xffffffff)
+                        cdplayer->Resume();
+                    else
+                        cdplayer->Play(m_nblock_address, m_nnumber_blocks);
                 }
+            } else {
+                bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
+                m_SenseParams.bSenseKey = 0x05;
+                m_SenseParams.bAddlSenseCode = 0x64;      // ILLEGAL MODE FOR THIS TRACK OR INCOMPATIBLE MEDIUM
+                m_SenseParams.bAddlSenseCodeQual = 0x00;  
+            }
+    }
 
-            m_CSW.bmCSWStatus = bmCSWStatus;
-            SendCSW();
-            break;
-        }
+    m_CSW.bmCSWStatus = bmCSWStatus;
+    SendCSW();
+}
 
-        case 0x45:  // PLAY AUDIO (10)
-        {
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (10)");
-
-            // Where to start reading (LBA)
-            m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
-
-            // Number of blocks to read (LBA)
-            m_nnumber_blocks = (u32)((m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8]);
-	    
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (10) Playing from %lu for %lu blocks", m_nblock_address, m_nnumber_blocks);
-
-	    // Play the audio, but only if length > 0
-	    if (m_nnumber_blocks > 0) {
-		    CUETrackInfo trackInfo = GetTrackInfoForLBA(m_nblock_address);
-		    if (trackInfo.track_number != -1 && trackInfo.track_mode == CUETrack_AUDIO) {
-			CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
-			if (cdplayer) {
-			    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (10) Play command sent");
-			    if (m_nblock_address == 0xffffffff)
-				cdplayer->Resume();
-			    else
-				cdplayer->Play(m_nblock_address, m_nnumber_blocks);
-			}
-		    } else {
-			bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
-			m_SenseParams.bSenseKey = 0x05;
-			m_SenseParams.bAddlSenseCode = 0x64;      // ILLEGAL MODE FOR THIS TRACK OR INCOMPATIBLE MEDIUM
-			m_SenseParams.bAddlSenseCodeQual = 0x00;  
-		    }
-	    }
+// Mode Select (10) (0x55)
+void CUSBCDGadget::HandleModeSelect10() {
+    u16 transferLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
+    // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Select (10), transferLength is %u", transferLength);
 
-            m_CSW.bmCSWStatus = bmCSWStatus;
-            SendCSW();
-            break;
-        }
+    // Read the data from the host but don't do anything with it (yet!)
+    m_nState = TCDState::DataOut;
+    m_pEP[EPOut]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataOut,
+                                m_OutBuffer, transferLength);
 
-        case 0xA5:  // PLAY AUDIO (12)
-        {
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (12)");
-
-            // Where to start reading (LBA)
-            m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16) | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
-
-            // Number of blocks to read (LBA)
-            m_nnumber_blocks = (u32)(m_CBW.CBWCB[6] << 24) | (u32)(m_CBW.CBWCB[7] << 16) | (u32)(m_CBW.CBWCB[8] << 8) | m_CBW.CBWCB[9];
-
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (12) Playing from %lu for %lu blocks", m_nblock_address, m_nnumber_blocks);
-
-	    // Play the audio, but only if length > 0
-	    if (m_nnumber_blocks > 0) {
-		    CUETrackInfo trackInfo = GetTrackInfoForLBA(m_nblock_address);
-		    if (trackInfo.track_number != -1 && trackInfo.track_mode == CUETrack_AUDIO) {
-			CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
-			if (cdplayer) {
-			    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "PLAY AUDIO (12) Play command sent");
-			    if (m_nblock_address == 0xffffffff)
-				cdplayer->Resume();
-			    else
-				cdplayer->Play(m_nblock_address, m_nnumber_blocks);
-			}
-		    } else {
-			bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
-			m_SenseParams.bSenseKey = 0x05;
-			m_SenseParams.bAddlSenseCode = 0x64;      // ILLEGAL MODE FOR THIS TRACK OR INCOMPATIBLE MEDIUM
-			m_SenseParams.bAddlSenseCodeQual = 0x00;  
-		    }
-	    }
+    // Unfortunately the payload doesn't arrive here. Check out the
+    // ProcessOut method for payload processing
 
-            m_CSW.bmCSWStatus = bmCSWStatus;
-            SendCSW();
-            break;
-        }
+    m_CSW.bmCSWStatus = bmCSWStatus;
+}
 
+// We only need this because MacOS is a problem child
+// Mode Sense (6) (0x1A)
+void CUSBCDGadget::HandleModeSense6() {
+        MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6)");
+        //int DBD = (m_CBW.CBWCB[1] >> 3) & 0x01; // We don't implement block descriptors
+        int page_control = (m_CBW.CBWCB[2] >> 6) & 0x03;
+        int page = m_CBW.CBWCB[2] & 0x3f;
+        //int sub_page_code = m_CBW.CBWCB[3];
+        int allocationLength = m_CBW.CBWCB[4];
+        int control = m_CBW.CBWCB[5];
+
+        int length = 0;
+
+        // We don't support saved values
+        if (page_control == 0x03) {
+                bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
+                m_SenseParams.bSenseKey = 0x05;		  // Illegal Request
+                m_SenseParams.bAddlSenseCode = 0x39;      // Saving parameters not supported
+                m_SenseParams.bAddlSenseCodeQual = 0x00;
+        } else {
 
-        case 0x55:  // Mode Select (10)
-        {
-            u16 transferLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
-            // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Select (10), transferLength is %u", transferLength);
+            // Define our response
+            ModeSense6Header reply_header;
+            memset(&reply_header, 0, sizeof(reply_header));
+            reply_header.mediumType = GetMediumType();
 
-            // Read the data from the host but don't do anything with it (yet!)
-            m_nState = TCDState::DataOut;
-            m_pEP[EPOut]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataOut,
-                                        m_OutBuffer, transferLength);
+            switch (page) {
 
-            // Unfortunately the payload doesn't arrive here. Check out the
-            // ProcessOut method for payload processing
+                case 0x3f: // This required all mode pages
+                MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6) 0x3f: All Mode Pages");
+                // Fall through...
+                case 0x01: {
+                    // Mode Page 0x01 (Read/Write Error Recovery Parameters Mode Page)
+                     MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6) 0x01 response");
 
-            m_CSW.bmCSWStatus = bmCSWStatus;
-            break;
-        }
+                    // Define our Code Page
+                    ModePage0x01Data codepage;
+                    memset(&codepage, 0, sizeof(codepage));
 
-	// We only need this because MacOS is a problem child
-	case 0x1a: // Mode Sense (6)
-	{
-		MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6)");
-		//int DBD = (m_CBW.CBWCB[1] >> 3) & 0x01; // We don't implement block descriptors
-		int page_control = (m_CBW.CBWCB[2] >> 6) & 0x03;
-		int page = m_CBW.CBWCB[2] & 0x3f;
-		//int sub_page_code = m_CBW.CBWCB[3];
-		int allocationLength = m_CBW.CBWCB[4];
-		int control = m_CBW.CBWCB[5];
-
-		int length = 0;
-
-		// We don't support saved values
-		if (page_control == 0x03) {
-			bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
-			m_SenseParams.bSenseKey = 0x05;		  // Illegal Request
-			m_SenseParams.bAddlSenseCode = 0x39;      // Saving parameters not supported
-			m_SenseParams.bAddlSenseCodeQual = 0x00;
-		} else {
-			
-		    // Define our response
-		    ModeSense6Header reply_header;
-		    memset(&reply_header, 0, sizeof(reply_header));
-		    reply_header.mediumType = GetMediumType();
-
-		    switch (page) {
-
-			case 0x3f: // This required all mode pages
-			MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6) 0x3f: All Mode Pages");
-			// Fall through...
-			case 0x01: {
-			    // Mode Page 0x01 (Read/Write Error Recovery Parameters Mode Page)
-			     MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6) 0x01 response");
-
-			    // Define our Code Page
-			    ModePage0x01Data codepage;
-			    memset(&codepage, 0, sizeof(codepage));
-
-			    // Copy the header & Code Page
-			    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
-			    length += sizeof(codepage);
-
-			    if (page != 0x3f)
-			    	break;
-			}
-
-			case 0x1a: {
-			    // Mode Page 0x1A (Power Condition)
-			    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6) 0x2a response");
-
-			    // Define our Code Page
-			    ModePage0x1AData codepage;
-			    memset(&codepage, 0, sizeof(codepage));
-			    codepage.pageCodeAndPS = 0x1a;
-			    codepage.pageLength = 0x0a;
-
-			    // Copy the header & Code Page
-			    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
-			    length += sizeof(codepage);
-
-			    if (page != 0x3f)
-			        break;
-			}
-
-			case 0x2a: {
-			    // Mode Page 0x2A (MM Capabilities and Mechanical Status) Data
-			    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6) 0x2a response");
-
-			    // Define our Code Page
-			    ModePage0x2AData codepage;
-			    memset(&codepage, 0, sizeof(codepage));
-			    codepage.pageCodeAndPS = 0x2a;
-			    codepage.pageLength = 18;
-			    codepage.capabilityBits[0] = 0x01;  // Can read CD-R
-			    codepage.capabilityBits[1] = 0x00;  // Can't write
-			    codepage.capabilityBits[2] = 0x01;  // AudioPlay
-			    codepage.capabilityBits[3] = 0x03;  // CD-DA Commands Supported, CD-DA Stream is accurate
-			    codepage.capabilityBits[4] = 0x28;  // tray loading mechanism, with eject
-			    codepage.capabilityBits[5] = 0x00;
-			    codepage.maxSpeed = htons(706);  // 4x
-			    codepage.numVolumeLevels = htons(0x00ff);
-			    codepage.bufferSize = htons(0);
-			    codepage.currentSpeed = htons(1412);
-
-			    // Copy the header & Code Page
-			    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
-			    length += sizeof(codepage);
-
-			    if (page != 0x3f)
-			        break;
-			}
-
-			case 0x0e: {
-			    // Mode Page 0x0E (CD Audio Control Page)
-			    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6) 0x0e response");
-
-			    CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
-			    u8 volume = 0xff;
-			    if (cdplayer) {
-			        // When we return real volume, games that allow volume control don't send proper volume levels
-			        // but when we hard code this to 0xff, everything seems to work fine. Weird.
-				//volume = cdplayer->GetVolume();
-				volume = 0xff;
-			    }
-
-			    // Define our Code Page
-			    ModePage0x0EData codepage;
-			    memset(&codepage, 0, sizeof(codepage));
-			    codepage.pageCodeAndPS = 0x0e;
-			    codepage.pageLength = 16;
-			    codepage.IMMEDAndSOTC = 0x04;
-			    codepage.CDDAOutput0Select = 0x01;  // audio channel 0
-			    codepage.Output0Volume = volume;
-			    codepage.CDDAOutput1Select = 0x02;  // audio channel 1
-			    codepage.Output1Volume = volume;
-			    codepage.CDDAOutput2Select = 0x00;  // none
-			    codepage.Output2Volume = 0x00;      // muted
-			    codepage.CDDAOutput3Select = 0x00;  // none
-			    codepage.Output3Volume = 0x00;      // muted
-
-
-			    // Copy the header & Code Page
-			    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
-			    length += sizeof(codepage);
-
-			    break;
-			}
-
-			default: {
-			    // We don't support this code page
-			    bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
-			    m_SenseParams.bSenseKey = 0x05;		  // Illegal Request
-			    m_SenseParams.bAddlSenseCode = 0x24;      // INVALID FIELD IN COMMAND PACKET
-			    m_SenseParams.bAddlSenseCodeQual = 0x00;
-			    break;
-			}
-
-		    }
-
-		    reply_header.modeDataLength = htons(length - 1);
-		    memcpy(m_InBuffer, &reply_header, sizeof(reply_header));
-	    }
+                    // Copy the header & Code Page
+                    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
+                    length += sizeof(codepage);
 
-            // Trim the reply length according to what the host requested
-            if (allocationLength < length)
-                length = allocationLength;
+                    if (page != 0x3f)
+                        break;
+                }
 
-            // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6), Sending response with length %d", length);
+                case 0x1a: {
+                    // Mode Page 0x1A (Power Condition)
+                    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6) 0x2a response");
 
-            m_nnumber_blocks = 0;  // nothing more after this send
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = bmCSWStatus;
-		break;
-	}
+                    // Define our Code Page
+                    ModePage0x1AData codepage;
+                    memset(&codepage, 0, sizeof(codepage));
+                    codepage.pageCodeAndPS = 0x1a;
+                    codepage.pageLength = 0x0a;
 
-        case 0x5a:  // Mode Sense (10)
-        {
-            // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10)");
-
-            int LLBAA = (m_CBW.CBWCB[1] >> 7) & 0x01; // We don't support this
-            int DBD = (m_CBW.CBWCB[1] >> 6) & 0x01; // TODO: Implement this!
-            int page = m_CBW.CBWCB[2] & 0x3F;
-            int page_control = (m_CBW.CBWCB[2] >> 6) & 0x03;
-            u16 allocationLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) with LLBAA = %d, DBD = %d, page = %02x, allocationLength = %lu", LLBAA, DBD, page, allocationLength);
-
-            int length = 0;
-
-	    // We don't support saved values
-	    if (page_control == 0x03) {
-                        bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
-                        m_SenseParams.bSenseKey = 0x05;		  // Illegal Request
-                        m_SenseParams.bAddlSenseCode = 0x39;      // Saving parameters not supported
-                        m_SenseParams.bAddlSenseCodeQual = 0x00;  
-	    } else {
-		    // Define our response
-		    ModeSense10Header reply_header;
-		    memset(&reply_header, 0, sizeof(reply_header));
-		    reply_header.mediumType = GetMediumType();
-		    length += sizeof(reply_header);
-
-		    switch (page) {
-			case 0x3f: // This required all mode pages
-			     MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) 0x3f: All Mode Pages");
-			     // Fall through...
-			case 0x01: {
-			    // Mode Page 0x01 (Read/Write Error Recovery Parameters Mode Page)
-			     MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) 0x01 response");
-
-			    // Define our Code Page
-			    ModePage0x01Data codepage;
-			    memset(&codepage, 0, sizeof(codepage));
-
-			    // Copy the header & Code Page
-			    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
-			    length += sizeof(codepage);
-
-			    if (page != 0x3f)
-			    	break;
-			}
-
-			case 0x1a: {
-			    // Mode Page 0x1A (Power Condition)
-			    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) 0x2a response");
-
-			    // Define our Code Page
-			    ModePage0x1AData codepage;
-			    memset(&codepage, 0, sizeof(codepage));
-			    codepage.pageCodeAndPS = 0x1a;
-			    codepage.pageLength = 0x0a;
-
-			    // Copy the header & Code Page
-			    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
-			    length += sizeof(codepage);
-
-			    if (page != 0x3f)
-			        break;
-			}
-
-			case 0x2a: {
-			    // Mode Page 0x2A (MM Capabilities and Mechanical Status) Data
-			    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) 0x2a response");
-
-			    // Define our Code Page
-			    ModePage0x2AData codepage;
-			    memset(&codepage, 0, sizeof(codepage));
-			    codepage.pageCodeAndPS = 0x2a;
-			    codepage.pageLength = 18;
-			    codepage.capabilityBits[0] = 0x01;  // Can read CD-R
-			    codepage.capabilityBits[1] = 0x00;  // Can't write
-			    codepage.capabilityBits[2] = 0x01;  // AudioPlay
-			    codepage.capabilityBits[3] = 0x03;  // CD-DA Commands Supported, CD-DA Stream is accurate
-			    codepage.capabilityBits[4] = 0x28;  // tray loading mechanism, with eject
-			    codepage.capabilityBits[5] = 0x00;
-			    codepage.maxSpeed = htons(706);  // 4x
-			    codepage.numVolumeLevels = htons(0x00ff);
-			    codepage.bufferSize = htons(0);
-			    codepage.currentSpeed = htons(1412);
-
-			    // Copy the header & Code Page
-			    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
-			    length += sizeof(codepage);
-
-			    if (page != 0x3f)
-			        break;
-			}
-
-			case 0x0e: {
-			    // Mode Page 0x0E (CD Audio Control Page)
-			    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) 0x0e response");
-
-			    CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
-			    u8 volume = 0xff;
-			    if (cdplayer) {
-			        // When we return real volume, games that allow volume control don't send proper volume levels
-			        // but when we hard code this to 0xff, everything seems to work fine. Weird.
-				//volume = cdplayer->GetVolume();
-				volume = 0xff;
-			    }
-
-			    // Define our Code Page
-			    ModePage0x0EData codepage;
-			    memset(&codepage, 0, sizeof(codepage));
-			    codepage.pageCodeAndPS = 0x0e;
-			    codepage.pageLength = 16;
-			    codepage.IMMEDAndSOTC = 0x04;
-			    codepage.CDDAOutput0Select = 0x01;  // audio channel 0
-			    codepage.Output0Volume = volume;  
-			    codepage.CDDAOutput1Select = 0x02;  // audio channel 1
-			    codepage.Output1Volume = volume;
-			    codepage.CDDAOutput2Select = 0x00;  // none
-			    codepage.Output2Volume = 0x00;      // muted
-			    codepage.CDDAOutput3Select = 0x00;  // none
-			    codepage.Output3Volume = 0x00;      // muted
-
-
-			    // Copy the header & Code Page
-			    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
-			    length += sizeof(codepage);
-
-			    break;
-			}
-
-			default: {
-			    // We don't support this code page
-			    bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
-			    m_SenseParams.bSenseKey = 0x05;		  // Illegal Request
-			    m_SenseParams.bAddlSenseCode = 0x24;      // INVALID FIELD IN COMMAND PACKET
-			    m_SenseParams.bAddlSenseCodeQual = 0x00;  
-			    break;
-			}
-		    }
-		    
-		    reply_header.modeDataLength = htons(length - 2);
-		    memcpy(m_InBuffer, &reply_header, sizeof(reply_header));
-	    }
+                    // Copy the header & Code Page
+                    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
+                    length += sizeof(codepage);
 
-            // Trim the reply length according to what the host requested
-            if (allocationLength < length)
-                length = allocationLength;
+                    if (page != 0x3f)
+                        break;
+                }
 
-            // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10), Sending response with length %d", length);
+                case 0x2a: {
+                    // Mode Page 0x2A (MM Capabilities and Mechanical Status) Data
+                    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6) 0x2a response");
+
+                    // Define our Code Page
+                    ModePage0x2AData codepage;
+                    memset(&codepage, 0, sizeof(codepage));
+                    codepage.pageCodeAndPS = 0x2a;
+                    codepage.pageLength = 18;
+                    codepage.capabilityBits[0] = 0x01;  // Can read CD-R
+                    codepage.capabilityBits[1] = 0x00;  // Can't write
+                    codepage.capabilityBits[2] = 0x01;  // AudioPlay
+                    codepage.capabilityBits[3] = 0x03;  // CD-DA Commands Supported, CD-DA Stream is accurate
+                    codepage.capabilityBits[4] = 0x28;  // tray loading mechanism, with eject
+                    codepage.capabilityBits[5] = 0x00;
+                    codepage.maxSpeed = htons(706);  // 4x
+                    codepage.numVolumeLevels = htons(0x00ff);
+                    codepage.bufferSize = htons(0);
+                    codepage.currentSpeed = htons(1412);
 
-            m_nnumber_blocks = 0;  // nothing more after this send
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = bmCSWStatus;
-            break;
-        }
+                    // Copy the header & Code Page
+                    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
+                    length += sizeof(codepage);
 
-        case 0xAC:  // GET PERFORMANCE
-        {
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "GET PERFORMANCE (0xAC)");
+                    if (page != 0x3f)
+                        break;
+                }
 
-            u8 getPerformanceStub[20] = {
-                0x00, 0x00, 0x00, 0x10,  // Header: Length = 16 bytes (descriptor)
-                0x00, 0x00, 0x00, 0x00,  // Reserved or Start LBA
-                0x00, 0x00, 0x00, 0x00,  // Reserved or End LBA
-                0x00, 0x00, 0x00, 0x01,  // Performance metric (e.g. 1x speed)
-                0x00, 0x00, 0x00, 0x00   // Additional reserved
-            };
+                case 0x0e: {
+                    // Mode Page 0x0E (CD Audio Control Page)
+                    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6) 0x0e response");
 
-            memcpy(m_InBuffer, getPerformanceStub, sizeof(getPerformanceStub));
+                    CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
+                    u8 volume = 0xff;
+                    if (cdplayer) {
+                        // When we return real volume, games that allow volume control don't send proper volume levels
+                        // but when we hard code this to 0xff, everything seems to work fine. Weird.
+                        //volume = cdplayer->GetVolume();
+                        volume = 0xff;
+                    }
 
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
-                                       m_InBuffer, sizeof(getPerformanceStub));
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = bmCSWStatus;
+                    // Define our Code Page
+                    ModePage0x0EData codepage;
+                    memset(&codepage, 0, sizeof(codepage));
+                    codepage.pageCodeAndPS = 0x0e;
+                    codepage.pageLength = 16;
+                    codepage.IMMEDAndSOTC = 0x04;
+                    codepage.CDDAOutput0Select = 0x01;  // audio channel 0
+                    codepage.Output0Volume = volume;
+                    codepage.CDDAOutput1Select = 0x02;  // audio channel 1
+                    codepage.Output1Volume = volume;
+                    codepage.CDDAOutput2Select = 0x00;  // none
+                    codepage.Output2Volume = 0x00;      // muted
+                    codepage.CDDAOutput3Select = 0x00;  // none
+                    codepage.Output3Volume = 0x00;      // muted
 
-            break;
-        }
 
+                    // Copy the header & Code Page
+                    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
+                    length += sizeof(codepage);
 
-        case 0xa4:  // Weird thing from Windows 2000
-	{
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "A4 from Win2k");
+                    break;
+                }
 
-	    // Response copied from an ASUS CDROM drive. It seems to know
-	    // what this is, so let's just copy it
-	    u8 response[] = {0x0, 0x6, 0x0, 0x0, 0x25, 0xff, 0x1, 0x0};
+                default: {
+                    // We don't support this code page
+                    bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
+                    m_SenseParams.bSenseKey = 0x05;		  // Illegal Request
+                    m_SenseParams.bAddlSenseCode = 0x24;      // INVALID FIELD IN COMMAND PACKET
+                    m_SenseParams.bAddlSenseCodeQual = 0x00;
+                    break;
+                }
 
-            memcpy(m_InBuffer, response, sizeof(response));
+            }
 
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
-                                       m_InBuffer, sizeof(response));
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-	    break;
-	}
+            reply_header.modeDataLength = htons(length - 1);
+            memcpy(m_InBuffer, &reply_header, sizeof(reply_header));
+    }
 
-	// SCSI TOOLBOX
-        case 0xD9:  // LIST DEVICES
-	{
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SCSITB List Devices");
+    CacheResponse(length);
 
-	    // First device is CDROM and the other are not implemented
-	    u8 devices[] = {0x02,0xff,0xff,0xff,0xff,0xff,0xff,0xff};
+    // Trim the reply length according to what the host requested
+    if (allocationLength < length)
+        length = allocationLength;
 
-            memcpy(m_InBuffer, devices, sizeof(devices));
+    // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (6), Sending response with length %d", length);
 
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
-                                       m_InBuffer, sizeof(devices));
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-	    break;
-	}
+    m_nnumber_blocks = 0;  // nothing more after this send
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = bmCSWStatus;
+}
 
-        case 0xD2:  // NUMBER OF FILES
-        case 0xDA:  // NUMBER OF CDS
-	{
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SCSITB Number of Files/CDs");
+// Mode Sense (10) (0x5A)
+void CUSBCDGadget::HandleModeSense10() {
+    // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10)");
+
+    int LLBAA = (m_CBW.CBWCB[1] >> 7) & 0x01; // We don't support this
+    int DBD = (m_CBW.CBWCB[1] >> 6) & 0x01; // TODO: Implement this!
+    int page = m_CBW.CBWCB[2] & 0x3F;
+    int page_control = (m_CBW.CBWCB[2] >> 6) & 0x03;
+    u16 allocationLength = m_CBW.CBWCB[7] << 8 | (m_CBW.CBWCB[8]);
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) with LLBAA = %d, DBD = %d, page = %02x, allocationLength = %lu", LLBAA, DBD, page, allocationLength);
+
+    int length = 0;
+
+    // We don't support saved values
+    if (page_control == 0x03) {
+                bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
+                m_SenseParams.bSenseKey = 0x05;		  // Illegal Request
+                m_SenseParams.bAddlSenseCode = 0x39;      // Saving parameters not supported
+                m_SenseParams.bAddlSenseCodeQual = 0x00;  
+    } else {
+            // Define our response
+            ModeSense10Header reply_header;
+            memset(&reply_header, 0, sizeof(reply_header));
+            reply_header.mediumType = GetMediumType();
+            length += sizeof(reply_header);
+
+            switch (page) {
+                case 0x3f: // This required all mode pages
+                     MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) 0x3f: All Mode Pages");
+                     // Fall through...
+                case 0x01: {
+                    // Mode Page 0x01 (Read/Write Error Recovery Parameters Mode Page)
+                     MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) 0x01 response");
 
-	    SCSITBService* scsitbservice = static_cast<SCSITBService*>(CScheduler::Get()->GetTask("scsitbservice"));
+                    // Define our Code Page
+                    ModePage0x01Data codepage;
+                    memset(&codepage, 0, sizeof(codepage));
 
-            // SCSITB defines max entries as 100
-            const size_t MAX_ENTRIES = 100;
-	    size_t count = scsitbservice->GetCount();
-	    if (count > MAX_ENTRIES)
-		    count = MAX_ENTRIES;
+                    // Copy the header & Code Page
+                    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
+                    length += sizeof(codepage);
 
-	    u8 num = (u8)count;
+                    if (page != 0x3f)
+                        break;
+                }
 
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SCSITB Discovered %d Files/CDs", num);
+                case 0x1a: {
+                    // Mode Page 0x1A (Power Condition)
+                    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) 0x2a response");
 
-            memcpy(m_InBuffer, &num, sizeof(num));
+                    // Define our Code Page
+                    ModePage0x1AData codepage;
+                    memset(&codepage, 0, sizeof(codepage));
+                    codepage.pageCodeAndPS = 0x1a;
+                    codepage.pageLength = 0x0a;
 
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
-                                       m_InBuffer, sizeof(num));
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-	    break;
-	}
-
-        case 0xD0:  // LIST FILES
-        case 0xD7:  // LIST CDS
-	{
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SCSITB List Files/CDs");
-
-	    SCSITBService* scsitbservice = static_cast<SCSITBService*>(CScheduler::Get()->GetTask("scsitbservice"));
-
-            // SCSITB defines max entries as 100
-            const size_t MAX_ENTRIES = 100;
-	    size_t count = scsitbservice->GetCount();
-	    if (count > MAX_ENTRIES)
-		    count = MAX_ENTRIES;
-
-	    TUSBCDToolboxFileEntry *entries = new TUSBCDToolboxFileEntry[MAX_ENTRIES];
-	    for (u8 i = 0; i < count; ++i) {
-		    TUSBCDToolboxFileEntry *entry = &entries[i];
-		    entry->index = i;
-		    entry->type = 0; // file type
-
-		    // Copy name capped to 32 chars + NUL
-		    const char* name = scsitbservice->GetName(i);
-		    size_t j = 0;
-		    for (; j < 32 && name[j] != '\0'; ++j) {
-			entry->name[j] = (u8)name[j];
-		    }
-		    entry->name[j] = 0; // null terminate
-
-		    // Get size and store as 40-bit big endian (highest byte zero)
-		    DWORD size = scsitbservice->GetSize(i);
-		    entry->size[0] = 0;
-		    entry->size[1] = (size >> 24) & 0xFF;
-		    entry->size[2] = (size >> 16) & 0xFF;
-		    entry->size[3] = (size >> 8) & 0xFF;
-		    entry->size[4] = size & 0xFF;
-	    }
+                    // Copy the header & Code Page
+                    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
+                    length += sizeof(codepage);
 
-            memcpy(m_InBuffer, entries, count * sizeof(TUSBCDToolboxFileEntry));
+                    if (page != 0x3f)
+                        break;
+                }
 
-            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
-                                       m_InBuffer, count * sizeof(TUSBCDToolboxFileEntry));
-            m_nState = TCDState::DataIn;
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+                case 0x2a: {
+                    // Mode Page 0x2A (MM Capabilities and Mechanical Status) Data
+                    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) 0x2a response");
+
+                    // Define our Code Page
+                    ModePage0x2AData codepage;
+                    memset(&codepage, 0, sizeof(codepage));
+                    codepage.pageCodeAndPS = 0x2a;
+                    codepage.pageLength = 18;
+                    codepage.capabilityBits[0] = 0x01;  // Can read CD-R
+                    codepage.capabilityBits[1] = 0x00;  // Can't write
+                    codepage.capabilityBits[2] = 0x01;  // AudioPlay
+                    codepage.capabilityBits[3] = 0x03;  // CD-DA Commands Supported, CD-DA Stream is accurate
+                    codepage.capabilityBits[4] = 0x28;  // tray loading mechanism, with eject
+                    codepage.capabilityBits[5] = 0x00;
+                    codepage.maxSpeed = htons(706);  // 4x
+                    codepage.numVolumeLevels = htons(0x00ff);
+                    codepage.bufferSize = htons(0);
+                    codepage.currentSpeed = htons(1412);
 
-	    delete[] entries;
+                    // Copy the header & Code Page
+                    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
+                    length += sizeof(codepage);
 
-	    break;
-	}
+                    if (page != 0x3f)
+                        break;
+                }
 
-        case 0xD8:  // SET NEXT CD
-        {
+                case 0x0e: {
+                    // Mode Page 0x0E (CD Audio Control Page)
+                    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10) 0x0e response");
 
-            int index = m_CBW.CBWCB[1];
-	    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SET NEXT CD index %d", index);
+                    CCDPlayer* cdplayer = static_cast<CCDPlayer*>(CScheduler::Get()->GetTask("cdplayer"));
+                    u8 volume = 0xff;
+                    if (cdplayer) {
+                        // When we return real volume, games that allow volume control don't send proper volume levels
+                        // but when we hard code this to 0xff, everything seems to work fine. Weird.
+                        //volume = cdplayer->GetVolume();
+                        volume = 0xff;
+                    }
 
-	    //TODO set bounds checking here and throw check condition if index is not valid
-	    //currently, it will silently ignore OOB indexes
+                    // Define our Code Page
+                    ModePage0x0EData codepage;
+                    memset(&codepage, 0, sizeof(codepage));
+                    codepage.pageCodeAndPS = 0x0e;
+                    codepage.pageLength = 16;
+                    codepage.IMMEDAndSOTC = 0x04;
+                    codepage.CDDAOutput0Select = 0x01;  // audio channel 0
+                    codepage.Output0Volume = volume;  
+                    codepage.CDDAOutput1Select = 0x02;  // audio channel 1
+                    codepage.Output1Volume = volume;
+                    codepage.CDDAOutput2Select = 0x00;  // none
+                    codepage.Output2Volume = 0x00;      // muted
+                    codepage.CDDAOutput3Select = 0x00;  // none
+                    codepage.Output3Volume = 0x00;      // muted
 
-	    SCSITBService* scsitbservice = static_cast<SCSITBService*>(CScheduler::Get()->GetTask("scsitbservice"));
-	    scsitbservice->SetNextCD(index);
 
-            m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
-            SendCSW();
-            break;
+                    // Copy the header & Code Page
+                    memcpy(m_InBuffer + length, &codepage, sizeof(codepage));
+                    length += sizeof(codepage);
+
+                    break;
+                }
+
+                default: {
+                    // We don't support this code page
+                    bmCSWStatus = CD_CSW_STATUS_FAIL;  // CD_CSW_STATUS_FAIL
+                    m_SenseParams.bSenseKey = 0x05;		  // Illegal Request
+                    m_SenseParams.bAddlSenseCode = 0x24;      // INVALID FIELD IN COMMAND PACKET
+                    m_SenseParams.bAddlSenseCodeQual = 0x00;  
+                    break;
+                }
+            }
+
+            reply_header.modeDataLength = htons(length - 2);
+            memcpy(m_InBuffer, &reply_header, sizeof(reply_header));
+    }
+
+    CacheResponse(length);
+
+    // Trim the reply length according to what the host requested
+    if (allocationLength < length)
+        length = allocationLength;
+
+    // MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Mode Sense (10), Sending response with length %d", length);
+
+    m_nnumber_blocks = 0;  // nothing more after this send
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, length);
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = bmCSWStatus;
+}
+
+// GET PERFORMANCE (0xAC)
+void CUSBCDGadget::HandleGetPerformance() {
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "GET PERFORMANCE (0xAC)");
+
+    u8 getPerformanceStub[20] = {
+        0x00, 0x00, 0x00, 0x10,  // Header: Length = 16 bytes (descriptor)
+        0x00, 0x00, 0x00, 0x00,  // Reserved or Start LBA
+        0x00, 0x00, 0x00, 0x00,  // Reserved or End LBA
+        0x00, 0x00, 0x00, 0x01,  // Performance metric (e.g. 1x speed)
+        0x00, 0x00, 0x00, 0x00   // Additional reserved
+    };
+
+    memcpy(m_InBuffer, getPerformanceStub, sizeof(getPerformanceStub));
+
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                               m_InBuffer, sizeof(getPerformanceStub));
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = bmCSWStatus;
+}
+
+// Weird thing from Windows 2000 (0xA4)
+void CUSBCDGadget::HandleReportKey() {
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "A4 from Win2k");
+
+    // Response copied from an ASUS CDROM drive. It seems to know
+    // what this is, so let's just copy it
+    u8 response[] = {0x0, 0x6, 0x0, 0x0, 0x25, 0xff, 0x1, 0x0};
+
+    memcpy(m_InBuffer, response, sizeof(response));
+
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                               m_InBuffer, sizeof(response));
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+}
+
+// SCSI TOOLBOX
+// LIST DEVICES (0xD9)
+void CUSBCDGadget::HandleToolboxListDevices() {
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SCSITB List Devices");
+
+    // First device is CDROM and the other are not implemented
+    u8 devices[] = {0x02,0xff,0xff,0xff,0xff,0xff,0xff,0xff};
+
+    memcpy(m_InBuffer, devices, sizeof(devices));
+
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                               m_InBuffer, sizeof(devices));
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+}
+
+// NUMBER OF FILES (0xD2), NUMBER OF CDS (0xDA)
+void CUSBCDGadget::HandleToolboxNumberOfFiles() {
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SCSITB Number of Files/CDs");
+
+    SCSITBService* scsitbservice = static_cast<SCSITBService*>(CScheduler::Get()->GetTask("scsitbservice"));
+
+    // SCSITB defines max entries as 100
+    const size_t MAX_ENTRIES = 100;
+    size_t count = scsitbservice->GetCount();
+    if (count > MAX_ENTRIES)
+            count = MAX_ENTRIES;
+
+    u8 num = (u8)count;
+
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SCSITB Discovered %d Files/CDs", num);
+
+    memcpy(m_InBuffer, &num, sizeof(num));
+
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                               m_InBuffer, sizeof(num));
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+}
+
+// LIST FILES (0xD0), LIST CDS (0xD7)
+void CUSBCDGadget::HandleToolboxListFiles() {
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SCSITB List Files/CDs");
+
+    SCSITBService* scsitbservice = static_cast<SCSITBService*>(CScheduler::Get()->GetTask("scsitbservice"));
+
+    // SCSITB defines max entries as 100
+    const size_t MAX_ENTRIES = 100;
+    size_t count = scsitbservice->GetCount();
+    if (count > MAX_ENTRIES)
+            count = MAX_ENTRIES;
+
+    // Built in place, the reply buffer holds all of them
+    TUSBCDToolboxFileEntry *entries = (TUSBCDToolboxFileEntry *)m_InBuffer;
+    for (u8 i = 0; i < count; ++i) {
+            TUSBCDToolboxFileEntry *entry = &entries[i];
+            entry->index = i;
+            entry->type = 0; // file type
+
+            // Copy name capped to 32 chars + NUL
+            const char* name = scsitbservice->GetName(i);
+            size_t j = 0;
+            for (; j < 32 && name[j] != '\0'; ++j) {
+                entry->name[j] = (u8)name[j];
+            }
+            entry->name[j] = 0; // null terminate
+
+            // Get size and store as 40-bit big endian (highest byte zero)
+            DWORD size = scsitbservice->GetSize(i);
+            entry->size[0] = 0;
+            entry->size[1] = (size >> 24) & 0xFF;
+            entry->size[2] = (size >> 16) & 0xFF;
+            entry->size[3] = (size >> 8) & 0xFF;
+            entry->size[4] = size & 0xFF;
+    }
+
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                               m_InBuffer, count * sizeof(TUSBCDToolboxFileEntry));
+    m_nState = TCDState::DataIn;
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+}
+
+// SET NEXT CD (0xD8)
+void CUSBCDGadget::HandleToolboxSetNextCD() {
+    int index = m_CBW.CBWCB[1];
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "SET NEXT CD index %d", index);
+
+    //TODO set bounds checking here and throw check condition if index is not valid
+    //currently, it will silently ignore OOB indexes
+
+    SCSITBService* scsitbservice = static_cast<SCSITBService*>(CScheduler::Get()->GetTask("scsitbservice"));
+    scsitbservice->SetNextCD(index);
+
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_OK;
+    SendCSW();
+}
+
+// Anything we don't know about
+void CUSBCDGadget::HandleUnknownCommand() {
+    MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Unknown SCSI Command is 0x%02x", m_CBW.CBWCB[0]);
+    m_SenseParams.bSenseKey = 0x5;  // Illegal/not supported
+    m_SenseParams.bAddlSenseCode = 0x20; // INVALID COMMAND OPERATION CODE
+    m_SenseParams.bAddlSenseCodeQual = 0x00;
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;
+    SendCSW();
+}
+
+
+// Reads the next batch of the current READ command into pBuffer and
+// advances m_nblock_address/m_nnumber_blocks. On failure the CSW status and
+// sense data are set up, but the CSW is not sent.
+// Called from task level only
+boolean CUSBCDGadget::FillDataInBuffer(u8* pBuffer, size_t* pLength) {
+    u64 offset = 0;
+    int readCount = 0;
+    if (m_CDReady) {
+
+        // Positional read on the gadget's own cursor (via the read-ahead
+        // cache), the CD player reads through a different one so neither
+        // disturbs the other's position
+        offset = (u64)block_size * m_nblock_address;
+
+        // Cap at m_nMaxBlocksToRead blocks. Any excess blocks of a READ
+	    // request will be read next time around
+        u32 blocks_to_read_in_batch = m_nnumber_blocks;
+        if (blocks_to_read_in_batch > m_nMaxBlocksToRead) {
+            blocks_to_read_in_batch = m_nMaxBlocksToRead;
         }
 
-        default: {
-            MLOGNOTE("CUSBCDGadget::HandleSCSICommand", "Unknown SCSI Command is 0x%02x", m_CBW.CBWCB[0]);
-            m_SenseParams.bSenseKey = 0x5;  // Illegal/not supported
-            m_SenseParams.bAddlSenseCode = 0x20; // INVALID COMMAND OPERATION CODE
-            m_SenseParams.bAddlSenseCodeQual = 0x00;
+        // Calculate total size of the batch read
+        u32 total_batch_size = blocks_to_read_in_batch * block_size;
+
+        MLOGDEBUG("UpdateRead", "Starting batch read for %lu blocks (total %lu bytes)", blocks_to_read_in_batch, total_batch_size);
+
+        // If the host wants the sectors exactly as they are stored in the
+        // image (MODE1/2048 via READ(10), raw 2352 via READ CD), read them
+        // straight into the DMA buffer. Otherwise read into m_FileChunk
+        // and extract the requested part of each sector from there
+        boolean bPassThrough = skip_bytes == 0 && transfer_block_size == block_size;
+
+        // Pinned file system metadata first, otherwise the single large read
+        u8* pReadBuffer = bPassThrough ? pBuffer : m_FileChunk;
+        if (m_pMetadataCache->Read(m_nblock_address, blocks_to_read_in_batch, block_size, pReadBuffer))
+            readCount = total_batch_size;
+        else
+            readCount = m_pReadAheadCache->Read(m_nblock_address, blocks_to_read_in_batch, block_size,
+                                                pReadBuffer);
+        MLOGDEBUG("UpdateRead", "Read %d bytes in batch", readCount);
+
+        if (readCount < static_cast<int>(total_batch_size)) {
+            // Handle error: partial read
             m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;
-            SendCSW();
-            break;
+            m_SenseParams.bSenseKey = 0x04;       // hardware error
+            m_SenseParams.bAddlSenseCode = 0x11;  // UNRECOVERED READ ERROR
+            m_SenseParams.bAddlSenseCodeQual = 0x00;
+            return FALSE;
         }
+
+        u32 total_copied = blocks_to_read_in_batch * transfer_block_size;
+
+        if (bPassThrough) {
+            // nothing to do, data is already in place
+        } else if (transfer_block_size <= block_size) {
+            // Strided extraction, copy the requested slice of each sector
+            CopySectorSlices(pBuffer, m_FileChunk, blocks_to_read_in_batch,
+                             block_size, skip_bytes, transfer_block_size);
+        } else {
+            // We've been asked to return more bytes than the image stores,
+            // raw sectors from a 2048 byte image. Build each sector in full,
+            // then copy out the part the host selected. The EDC/ECC is only
+            // generated when the host asked for it
+            boolean bEDCECC = (mcs & 0x02) != 0;
+            u8 sector2352[CCDSectorEncoder::SectorSize];
+            u8* dest_ptr = pBuffer;
+            for (u32 i = 0; i < blocks_to_read_in_batch; ++i) {
+                memcpy(sector2352 + CCDSectorEncoder::UserDataOffset, m_FileChunk + i * block_size, 2048);
+                m_SectorEncoder.EncodeMode1(sector2352, m_nblock_address + i, bEDCECC);
+                memcpy(dest_ptr, sector2352 + skip_bytes, transfer_block_size);
+                dest_ptr += transfer_block_size;
+            }
+        }
+        // Update m_nblock_address after the batch read
+        m_nblock_address += blocks_to_read_in_batch;
+        m_nnumber_blocks -= blocks_to_read_in_batch;  // remaining for subsequent reads if needed
+
+        // Adjust m_nbyteCount based on how many bytes were copied
+        m_nbyteCount -= total_copied;
+
+        *pLength = total_copied;
+        return TRUE;
     }
 
-    // Reset the status
-    //bmCSWStatus = CD_CSW_STATUS_OK;
+    MLOGERR("UpdateRead", "failed, %s, offset=%llu",
+            m_CDReady ? "ready" : "not ready", offset);
+    m_CSW.bmCSWStatus = CD_CSW_STATUS_PHASE_ERR;
+    m_SenseParams.bSenseKey = 0x02;           // Not Ready
+    m_SenseParams.bAddlSenseCode = 0x04;      // LOGICAL UNIT NOT READY
+    m_SenseParams.bAddlSenseCodeQual = 0x00;  // CAUSE NOT REPORTABLE
+    return FALSE;
+}
+
+// Swap the DataIn buffers and send the batch prepared by the read-ahead.
+// Called from IRQ or with IRQs disabled
+void CUSBCDGadget::BeginReadAheadTransfer(void) {
+    assert(m_ReadAheadState == ReadAheadReady || m_ReadAheadState == ReadAheadBusy);
+    m_nDataInBuffer ^= 1;
+    m_ReadAheadState = ReadAheadIdle;
+    m_nState = TCDState::DataIn;
+    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                               m_pDataInBuffer[m_nDataInBuffer], m_nReadAheadLength);
 }
 
 // this function is called periodically from task level for IO
 //(IO must not be attempted in functions called from IRQ)
 void CUSBCDGadget::Update() {
     //MLOGDEBUG ("CUSBCDGadget::Update", "entered skip=%u, transfer=%u", skip_bytes, transfer_block_size);
+    // Put in the next disc between commands, when nothing is reading the
+    // old one
+    if (m_bMediaPending) {
+        switch (m_nState) {
+            case TCDState::ReceiveCBW:
+            case TCDState::SentCSW:
+            case TCDState::CommandQueued:
+                InstallPendingMedia();
+                break;
+
+            default:
+                break;
+        }
+    }
+
     switch (m_nState) {
-        case TCDState::DataInRead: {
-            u64 offset = 0;
-            int readCount = 0;
-            if (m_CDReady) {
-
-                MLOGDEBUG("UpdateRead", "Seek to %lu", block_size * m_nblock_address);
-                offset = m_pDevice->Seek(block_size * m_nblock_address);
-                if (offset != (u64)(-1)) {
-                    // Cap at MAX_BLOCKS_READ blocks. This is what a READ CD request will
-		    // require any excess blocks will be read next time around this loop
-                    u32 blocks_to_read_in_batch = m_nnumber_blocks;
-                    if (blocks_to_read_in_batch > MaxBlocksToRead) {
-                        blocks_to_read_in_batch = MaxBlocksToRead;
-                        m_nnumber_blocks -= MaxBlocksToRead;  // Update remaining for subsequent reads if needed
-                        MLOGDEBUG("UpdateRead", "Blocks is now %lu, remaining blocks is %lu", blocks_to_read_in_batch, m_nnumber_blocks);
-                    } else {
-                        MLOGDEBUG("UpdateRead", "Blocks is now %lu, remaining blocks is now zero", blocks_to_read_in_batch);
-                        m_nnumber_blocks = 0;
-                    }
+        case TCDState::CommandQueued:
+            HandleQueuedCBW();
+            break;
 
-                    // Calculate total size of the batch read
-                    u32 total_batch_size = blocks_to_read_in_batch * block_size;
+        case TCDState::DataOutReceived:
+            ProcessOut(m_nDataOutLength);
+            SendCSW();
+            break;
 
-                    MLOGDEBUG("UpdateRead", "Starting batch read for %lu blocks (total %lu bytes)", blocks_to_read_in_batch, total_batch_size);
-                    // Perform the single large read
-                    readCount = m_pDevice->Read(m_FileChunk, total_batch_size);
-                    MLOGDEBUG("UpdateRead", "Read %d bytes in batch", readCount);
+        case TCDState::DataInRead: {
+            // Nothing on the wire, read a batch and send it
+            size_t nLength = 0;
+            if (!FillDataInBuffer(m_pDataInBuffer[m_nDataInBuffer], &nLength)) {
+                SendCSW();
+                break;
+            }
 
-                    if (readCount < static_cast<int>(total_batch_size)) {
-                        // Handle error: partial read
-                        m_CSW.bmCSWStatus = CD_CSW_STATUS_FAIL;
-                        m_SenseParams.bSenseKey = 0x04;       // hardware error
-                        m_SenseParams.bAddlSenseCode = 0x11;  // UNRECOVERED READ ERROR
-                        m_SenseParams.bAddlSenseCodeQual = 0x00;
-                        SendCSW();
-                        return;  // Exit if read failed
-                    }
+            m_nState = TCDState::DataIn;
 
-                    u8* dest_ptr = m_InBuffer;  // Pointer to current write position in m_InBuffer
-                    u32 total_copied = 0;
-
-                    // Iterate through the *read data* in memory
-		    // TODO Optimization, if transfer_block_size and block_size are the same, and 
-		    // skip_bytes is zero, we can just copy without looping
-                    for (u32 i = 0; i < blocks_to_read_in_batch; ++i) {
-			if (transfer_block_size > block_size) {
-				// We've been asked to return more bytes than we've read from
-				// the underlying image. We have to generate some bytes
-				//
-				// This is all a bit shonky for now :O
-
-				u8 sector2352[2352] = {0};
-				
-				int offset = 0;
-
-				// SYNC (12 bytes)
-				if (mcs & 0x10) {
-					memset(sector2352 + offset, 0x00, 1);           // 0x00
-					memset(sector2352 + offset + 1, 0xFF, 10);      // 0xFF * 10
-					sector2352[offset + 11] = 0x00;                 // 0x00
-					offset += 12;
-				}
-
-				// HEADER (4 bytes)
-				if (mcs & 0x08) {
-					u32 lba = m_nblock_address + i;
-					lba += 150; // the 2 sec nonesense
-					u8 minutes = lba / (75 * 60);
-    					u8 seconds = (lba / 75) % 60;
-    					u8 frames = lba % 75;
-
-					sector2352[offset + 0] = minutes;  // MSF Minute
-					sector2352[offset + 1] = seconds;  // MSF Second
-					sector2352[offset + 2] = frames;  // MSF Frame
-					sector2352[offset + 3] = 0x01;  // Mode 1
-					offset += 4;
-				}
-
-				// USER DATA (2048 bytes)
-				if (mcs & 0x04) {
-					u8 *current_block_start = m_FileChunk + (i * block_size);
-					memcpy(sector2352 + offset, current_block_start, 2048);
-					offset += 2048;
-				}
-
-				// EDC/ECC (remaining bytes)
-				if (mcs & 0x02) {
-					// Mode 1 has 288 ECC bytes at end. For now
-					// we'll send zeros and hope the host ignores it
-					memset(sector2352 + offset, 0x00, 288);
-					offset += 288;
-				}
-
-				memcpy(dest_ptr, sector2352 + skip_bytes, transfer_block_size);
-			} else {
-				// Calculate the starting point for the current block within the m_FileChunk
-				u8 *current_block_start = m_FileChunk + (i * block_size);
-
-				// Copy only the portion after skip_bytes into the destination buffer
-				memcpy(dest_ptr, current_block_start + skip_bytes, transfer_block_size);
-			}
-			dest_ptr += transfer_block_size;
-			total_copied += transfer_block_size;
-                    }
-                    // Update m_nblock_address after the batch read
-                    m_nblock_address += blocks_to_read_in_batch;
+            // Begin USB transfer of the in-buffer (only valid data)
+            m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn,
+                                       m_pDataInBuffer[m_nDataInBuffer], nLength);
+            break;
+        }
 
-                    // Adjust m_nbyteCount based on how many bytes were copied
-                    m_nbyteCount -= total_copied;
-                    m_nState = TCDState::DataIn;
+        case TCDState::DataIn: {
+            // A batch is on the wire. Read the next one of the same command
+            // into the other buffer, so that the SD card and the USB bus are
+            // busy at the same time. OnTransferComplete() sends it.
+            EnterCritical(IRQ_LEVEL);
+            boolean bReadAhead = m_nState == TCDState::DataIn
+                                 && m_nnumber_blocks > 0
+                                 && m_ReadAheadState == ReadAheadIdle;
+            if (bReadAhead)
+                m_ReadAheadState = ReadAheadBusy;
+            u32 nTag = m_CSW.dCSWTag;
+            LeaveCritical();
+
+            if (!bReadAhead) {
+                // Nothing more to read for this command. Use the time the
+                // last batch is on the wire to read ahead of the host
+                m_pReadAheadCache->Prefetch();
+                break;
+            }
 
-                    // Begin USB transfer of the in-buffer (only valid data)
-                    m_pEP[EPIn]->BeginTransfer(CUSBCDGadgetEndpoint::TransferDataIn, m_InBuffer, total_copied);
+            size_t nLength = 0;
+            boolean bOK = FillDataInBuffer(m_pDataInBuffer[m_nDataInBuffer ^ 1], &nLength);
+
+            EnterCritical(IRQ_LEVEL);
+            if (m_ReadAheadState != ReadAheadBusy || nTag != m_CSW.dCSWTag) {
+                // The command has gone away (bus reset), drop the batch
+                if (m_ReadAheadState == ReadAheadBusy)
+                    m_ReadAheadState = ReadAheadIdle;
+            } else if (m_nState == TCDState::DataInWait) {
+                // The previous batch has already completed, send this one now
+                if (bOK) {
+                    m_nReadAheadLength = nLength;
+                    BeginReadAheadTransfer();
+                } else {
+                    m_ReadAheadState = ReadAheadIdle;
+                    SendCSW();
                 }
+            } else {
+                m_nReadAheadLength = nLength;
+                m_ReadAheadState = bOK ? ReadAheadReady : ReadAheadFailed;
             }
-            if (!m_CDReady || offset == (u64)(-1)) {
-                MLOGERR("UpdateRead", "failed, %s, offset=%llu",
-                        m_CDReady ? "ready" : "not ready", offset);
-                m_CSW.bmCSWStatus = CD_CSW_STATUS_PHASE_ERR;
-                m_SenseParams.bSenseKey = 0x02;           // Not Ready
-                m_SenseParams.bAddlSenseCode = 0x04;      // LOGICAL UNIT NOT READY
-                m_SenseParams.bAddlSenseCodeQual = 0x00;  // CAUSE NOT REPORTABLE
-                SendCSW();
-            }
+            LeaveCritical();
             break;
         }
 
@@ -2576,6 +2912,12 @@ void CUSBCDGadget::Update() {
                             }
             */
 
+        case TCDState::ReceiveCBW:
+        case TCDState::SentCSW:
+            // Waiting for the host, read ahead of it if it is streaming
+            m_pReadAheadCache->Prefetch();
+            break;
+
         default:
             break;
     }
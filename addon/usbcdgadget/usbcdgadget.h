@@ -31,9 +31,16 @@
 #include <circle/types.h>
 #include <circle/usb/gadget/dwusbgadget.h>
 #include <usbcdgadget/usbcdgadgetendpoint.h>
+#include <usbcdgadget/scsiresponsecache.h>
 #include <circle/usb/usb.h>
 #include <cueparser/cueparser.h>
 #include <discimage/cuebinfile.h>
+#include <discimage/tracktable.h>
+#include <discimage/readaheadcache.h>
+#include <discimage/isometadatacache.h>
+#include <discimage/cdsectorencoder.h>
+#include <scsistats/scsistats.h>
+#include <scsitrace/scsitrace.h>
 
 #ifndef USB_GADGET_DEVICE_ID_CD
 #define USB_GADGET_DEVICE_ID_CD 0x1d6b
@@ -470,12 +477,18 @@ class CUSBCDGadget : public CDWUSBGadget  /// USB mass storage device gadget
     /// \param pDevice Pointer to the block device, to be controlled by this gadget
     /// \note pDevice must be initialized yet, when it is specified here.
     /// \note SetDevice() has to be called later, when pDevice is not specified here.
-    CUSBCDGadget(CInterruptSystem *pInterruptSystem, boolean isFullSpeed, ICueDevice *pDevice = nullptr);
+    /// \param nMaxBlocks Maximum number of blocks per IN transfer (0 for default)
+    /// \param nReadAheadBlocks Size of the read-ahead window in sectors (0 to disable)
+    CUSBCDGadget(CInterruptSystem *pInterruptSystem, boolean isFullSpeed, ICueDevice *pDevice = nullptr,
+                 unsigned nMaxBlocks = 0, unsigned nReadAheadBlocks = 0);
 
     ~CUSBCDGadget(void);
 
-    /// \param pDevice Pointer to the block device, to be controlled by this gadget
+    /// \param pDevice Pointer to the block device, to be controlled by this gadget,
+    ///        or nullptr for no disc
     /// \note Call this, if pDevice has not been specified in the constructor.
+    /// \note Swapping discs is asynchronous. The new disc is prepared here and
+    ///       put in by Update() between commands, the old one is deleted then
     void SetDevice(ICueDevice *pDevice);
 
     /// \brief Call this periodically from TASK_LEVEL to allow I/O operations!
@@ -521,12 +534,65 @@ class CUSBCDGadget : public CDWUSBGadget  /// USB mass storage device gadget
     void ProcessOut(size_t nLength);
 
    private:
-    void HandleSCSICommand();
+    boolean QueueCBW(void);
+    void HandleQueuedCBW(void);
+    void HandleSCSICommand(unsigned nStartTicks);
+
+    void InstallPendingMedia(void);
+    boolean CheckMedium(void);
+    static boolean NeedsMedium(u8 nOpCode);
+    static boolean ReportsUnitAttention(u8 nOpCode);
+
+    // One handler per SCSI opcode, see InitSCSIHandlers()
+    typedef void (CUSBCDGadget::*TSCSIHandler)();
+    static TSCSIHandler s_SCSIHandlers[256];
+    static void InitSCSIHandlers();
+
+    void HandleTestUnitReady();
+    void HandleRequestSense();
+    void HandleInquiry();
+    void HandleStartStopUnit();
+    void HandlePreventAllowMediumRemoval();
+    void HandleReadCapacity();
+    void HandleRead10();
+    void HandleReadCD();
+    void HandleUnimplemented();
+    void HandleReadTOC();
+    void HandleReadSubChannel();
+    void HandleReadTrackInformation();
+    void HandleGetEventStatusNotification();
+    void HandleReadDiscStructure();
+    void HandleReadDiscInformation();
+    void HandleGetConfiguration();
+    void HandlePauseResume();
+    void HandleSeek();
+    void HandlePlayAudioMSF();
+    void HandleStopScan();
+    void HandlePlayAudio10();
+    void HandlePlayAudio12();
+    void HandleModeSelect10();
+    void HandleModeSense6();
+    void HandleModeSense10();
+    void HandleGetPerformance();
+    void HandleReportKey();
+    void HandleToolboxListDevices();
+    void HandleToolboxNumberOfFiles();
+    void HandleToolboxListFiles();
+    void HandleToolboxSetNextCD();
+    void HandleUnknownCommand();
+
+    void BeginCommandStats(unsigned nStartTicks);
+    void EndCommandStats();
+
+    boolean SendCachedResponse();
+    void CacheResponse(size_t nLength);
 
     void SendCSW();
-    CUETrackInfo GetTrackInfoForLBA(u32 lba);
-    CUETrackInfo GetTrackInfoForTrack(int track);
-    int GetSkipbytesForTrack(CUETrackInfo trackInfo);
+    boolean FillDataInBuffer(u8 *pBuffer, size_t *pLength);
+    void BeginReadAheadTransfer(void);
+    TTrackEntry GetTrackInfoForLBA(u32 lba);
+    TTrackEntry GetTrackInfoForTrack(int track);
+    int GetSkipbytesForTrack(const TTrackEntry &trackInfo);
     int GetSkipbytes();
     int GetMediumType();
     u32 msf_to_lba(u8 minutes, u8 seconds, u8 frames);
@@ -534,7 +600,7 @@ class CUSBCDGadget : public CDWUSBGadget  /// USB mass storage device gadget
     const char *m_StringDescriptor[4];
 
     int GetBlocksize();
-    int GetBlocksizeForTrack(CUETrackInfo trackInfo);
+    int GetBlocksizeForTrack(const TTrackEntry &trackInfo);
 
     void InitDeviceSize(u64 blocks);
     u32 GetLeadoutLBA();
@@ -581,14 +647,92 @@ class CUSBCDGadget : public CDWUSBGadget  /// USB mass storage device gadget
         SentCSW,
         SendReqSenseReply,
         DataInRead,
-        DataOutWrite
+        DataOutWrite,
+        DataInWait,     // batch sent, waiting for Update() to finish the read-ahead batch
+        CommandQueued,  // CBW received, waiting for Update() to decode it
+        CommandHandling, // Update() is running the command's handler
+        DataOutReceived  // parameter list received, Update() applies it and sends the CSW
     };
 
     TCDState m_nState = Init;
 
+    // While one DataIn buffer is on the wire, Update() fills the other one
+    // with the next batch of the same READ command
+    enum TReadAheadState {
+        ReadAheadIdle,
+        ReadAheadBusy,
+        ReadAheadReady,
+        ReadAheadFailed
+    };
+
+    TReadAheadState m_ReadAheadState = ReadAheadIdle;
+    unsigned m_nDataInBuffer = 0;     // index of the buffer on the wire
+    size_t m_nReadAheadLength = 0;
+
     TUSBCDCBW m_CBW;
     TUSBCDCSW m_CSW;
 
+    // What the host is told about the disc. Commands that need the disc
+    // are failed with the state's sense data until it is loaded
+    enum TMediaState {
+        MediaLoaded,
+        MediaEjecting,       // SetDevice() is preparing the next disc
+        MediaBecomingReady,  // the next disc waits for Update() to put it in
+        MediaUnitAttention,  // put in, the next command reports the change
+        MediaNoMedium        // nothing mounted, or ejected by the host
+    };
+    volatile TMediaState m_MediaState = MediaNoMedium;
+
+    // Media class event codes for GET EVENT STATUS NOTIFICATION, reported
+    // once each
+    enum TMediaEvent {
+        MediaEventNone = 0,
+        MediaEventNewMedia = 2,
+        MediaEventRemoval = 3
+    };
+    volatile u8 m_nMediaEvent = MediaEventNone;
+
+    // Output0/Output1 volumes of the last Mode Select audio control page
+    u8 m_nLastVolume0 = 0xff;
+    u8 m_nLastVolume1 = 0xff;
+
+    // The next disc, with its tables built by SetDevice() before the host
+    // can see any of it. Update() swaps it in as a whole
+    volatile boolean m_bMediaPending = FALSE;
+    ICueDevice *m_pPendingDevice = nullptr;
+    CTrackTable *m_pPendingTrackTable = nullptr;
+    CIsoMetadataCache *m_pPendingMetadataCache = nullptr;
+    int m_nPendingBlockSize = 2048;
+    int m_nPendingSkipBytes = 0;
+    unsigned m_nMediaChangeStart = 0;  // for logging how long a swap took
+
+    // The IRQ handler only checks a CBW and queues it, Update() decodes it
+    // and builds the reply at task level. There is one producer and one
+    // consumer, so the queue needs no lock
+    struct TQueuedCBW {
+        TUSBCDCBW CBW;
+        unsigned nTicks;  // when it arrived, for SCSIStats
+    };
+    static const unsigned CBWQueueSize = 4;  // a power of two
+    TQueuedCBW m_CBWQueue[CBWQueueSize];
+    volatile unsigned m_nCBWHead = 0;  // written by the IRQ handler only
+    volatile unsigned m_nCBWTail = 0;  // written by Update() only
+
+    // A transfer started by a handler may complete before the handler has
+    // set the state, the CSW status and the block count for it. While a
+    // handler runs, the IRQ handler leaves completions to Update()
+    volatile boolean m_bHandlerRunning = FALSE;
+    volatile boolean m_bCompletionDeferred = FALSE;
+    boolean m_bDeferredIn = FALSE;
+    size_t m_nDeferredLength = 0;
+
+    size_t m_nDataOutLength = 0;  // of the parameter list in m_OutBuffer
+
+    // Timing and data phase bytes of the command in progress, for SCSIStats
+    boolean m_bCommandActive = FALSE;
+    unsigned m_nCommandStart = 0;
+    u32 m_nCommandBytes = 0;
+
     TUSBCDInquiryReply m_InqReply{
 	 0x05, // Peripheral type = CD/DVD
 	 0x80, // RMB set = removable media 
@@ -777,12 +921,26 @@ class CUSBCDGadget : public CDWUSBGadget  /// USB mass storage device gadget
     // TUSBTOCData m_TOCData;
 
     static const size_t MaxOutMessageSize = 2048;
-    static const size_t MaxBlocksToRead = 16; // WARNING increasing this overflow some buffer. Not sure why because we size the buffer correctly
     static const size_t MaxSectorSize = 2352;
-    static const size_t MaxInMessageSize = MaxBlocksToRead * MaxSectorSize;
-    u8 *m_FileChunk = new u8[MaxInMessageSize];
 
-    DMA_BUFFER(u8, m_InBuffer, MaxInMessageSize);
+    // Number of blocks per IN transfer, set with cd_max_blocks and
+    // cd_max_blocks_fullspeed in config.txt. The DWC endpoint can move at
+    // most 1023 packets in one transfer, so with 64 byte full-speed packets
+    // more than 27 raw sectors used to overflow the packet count
+    static const unsigned DefaultMaxBlocksHighSpeed = 64;
+    static const unsigned DefaultMaxBlocksFullSpeed = 16;
+    static const unsigned MinMaxBlocks = 8;  // all non-READ replies must fit
+    static const size_t MaxPacketsPerTransfer = 1023;
+
+    static u8 *AllocateDMABuffer(size_t nSize);
+
+    unsigned m_nMaxBlocksToRead;
+    size_t m_nMaxInMessageSize;
+    u8 *m_FileChunk;
+
+    u8 *m_InBuffer;         // DMA buffers of m_nMaxInMessageSize bytes
+    u8 *m_ReadAheadBuffer;
+    u8 *m_pDataInBuffer[2];
     DMA_BUFFER(u8, m_OutBuffer, MaxOutMessageSize);
 
     u32 m_nblock_address;
@@ -791,7 +949,20 @@ class CUSBCDGadget : public CDWUSBGadget  /// USB mass storage device gadget
     u32 m_nbyteCount;
     boolean m_CDReady = false;
 
-    CUEParser cueParser;
+    // Built once per image in SetDevice() and replaced as a whole
+    CTrackTable *m_pTrackTable;
+
+    // All data reads go through here. Only used at task level
+    CReadAheadCache *m_pReadAheadCache;
+
+    // File system metadata of the current image, pinned in SetDevice()
+    CIsoMetadataCache *m_pMetadataCache;
+
+    // Replies that only depend on the mounted disc. Used from Update()
+    CSCSIResponseCache m_ResponseCache;
+
+    // Synthesizes raw sectors for READ CD from 2048 byte images
+    CCDSectorEncoder m_SectorEncoder;
 
     u8 bmCSWStatus = 0;
     SenseParameters m_SenseParams;
@@ -802,7 +973,6 @@ class CUSBCDGadget : public CDWUSBGadget  /// USB mass storage device gadget
     int transfer_block_size = 2048;
     int file_mode = 1;
     boolean m_IsFullSpeed = 0;
-    boolean discChanged = false;
     uint8_t mcs = 0;
 
     // Hardware serial number for USB device identification
@@ -21,7 +21,9 @@
 //
 #include <usbmsdgadget/usbmsdgadget.h>
 #include <circle/logger.h>
+#include <circle/sched/scheduler.h>
 #include <circle/sysconfig.h>
+#include <circle/timer.h>
 #include <circle/util.h>
 #include <assert.h>
 
@@ -131,13 +133,59 @@ const char *const CUSBMMSDGadget::s_StringDescriptor[] =
 	"Mass Storage Gadget"
 };
 
-CUSBMMSDGadget::CUSBMMSDGadget (CInterruptSystem *pInterruptSystem, boolean isFullSpeed, CDevice *pDevice)
+CUSBMMSDGadget::TSCSIHandler CUSBMMSDGadget::s_SCSIHandlers[256];
+
+CUSBMMSDGadget::CUSBMMSDGadget (CInterruptSystem *pInterruptSystem, boolean isFullSpeed, CDevice *pDevice,
+				unsigned nMaxBlocks, unsigned nWriteBehindChunks)
 :	CDWUSBGadget (pInterruptSystem, isFullSpeed ? FullSpeed : HighSpeed),
 	m_pDevice (pDevice),
 	m_pEP {nullptr, nullptr, nullptr}
 {
 	MLOGNOTE("CUSBMMSDGadget::CUSBMMSDGadget", "entered %d", isFullSpeed);
         m_IsFullSpeed = isFullSpeed;
+	InitSCSIHandlers();
+
+	// Size the transfers. A batch must not need more packets than the
+	// endpoint can send in one go
+	size_t nPacketSize = isFullSpeed ? 64 : 512;
+	unsigned nHardwareLimit = MaxPacketsPerTransfer * nPacketSize / BLOCK_SIZE;
+	if (nMaxBlocks == 0)
+		nMaxBlocks = DefaultMaxBlocks;
+	if (nMaxBlocks > MaxMaxBlocks)
+		nMaxBlocks = MaxMaxBlocks;
+	if (nMaxBlocks > nHardwareLimit)
+		nMaxBlocks = nHardwareLimit;
+	if (nMaxBlocks < MinMaxBlocks)
+		nMaxBlocks = MinMaxBlocks;
+	m_nMaxBlocks = nMaxBlocks;
+	m_nMaxMessageSize = m_nMaxBlocks * BLOCK_SIZE;
+
+	m_InBuffer = AllocateDMABuffer(m_nMaxMessageSize);
+	m_ReadAheadBuffer = AllocateDMABuffer(m_nMaxMessageSize);
+	m_pDataInBuffer[0] = m_InBuffer;
+	m_pDataInBuffer[1] = m_ReadAheadBuffer;
+	m_pPrefetchBuffer = AllocateDMABuffer(m_nMaxMessageSize);
+
+	// Without write-behind there is still one chunk to receive into, it
+	// is just written before the command completes
+	m_bWriteBehind = nWriteBehindChunks > 0;
+	if (nWriteBehindChunks > MaxWriteBehindChunks)
+		nWriteBehindChunks = MaxWriteBehindChunks;
+	m_nWriteChunks = 1;
+	while (m_nWriteChunks < nWriteBehindChunks)
+		m_nWriteChunks <<= 1;
+	m_pWriteChunk = new TWriteChunk[m_nWriteChunks];
+	for (unsigned i = 0; i < m_nWriteChunks; i++)
+		m_pWriteChunk[i].pBuffer = AllocateDMABuffer(m_nMaxMessageSize);
+
+	m_pStageBuffer = AllocateDMABuffer(StageBlocks * BLOCK_SIZE);
+
+	MLOGNOTE("CUSBMMSDGadget::CUSBMMSDGadget", "Up to %u blocks per transfer, %u chunks written behind",
+		 m_nMaxBlocks, m_bWriteBehind ? m_nWriteChunks : 0);
+
+	memset(&m_ReqSenseReply, 0, sizeof m_ReqSenseReply);
+	m_ReqSenseReply.bErrCode = 0x70;	// current error
+	SCSIStats::Get().SetGadget("msd");
 	if(pDevice)SetDevice(pDevice);
 }
 
@@ -146,6 +194,18 @@ CUSBMMSDGadget::~CUSBMMSDGadget (void)
 	assert (0);
 }
 
+// Returns a cache line aligned buffer with a cache line padded size, so that
+// it can be used for DMA. The gadget lives as long as the system, so these
+// buffers are never freed
+u8 *CUSBMMSDGadget::AllocateDMABuffer (size_t nSize)
+{
+	const uintptr nAlign = DATA_CACHE_LINE_SIZE_MAX;
+	nSize = (nSize + nAlign - 1) & ~(nAlign - 1);
+	uintptr nBuffer = (uintptr) new u8[nSize + nAlign - 1];
+	assert (nBuffer != 0);
+	return (u8 *) ((nBuffer + nAlign - 1) & ~(nAlign - 1));
+}
+
 const void *CUSBMMSDGadget::GetDescriptor (u16 wValue, u16 wIndex, size_t *pLength)
 {
 	assert (pLength);
@@ -235,7 +295,8 @@ void CUSBMMSDGadget::SetDevice (CDevice* dev)
 
 void CUSBMMSDGadget::InitDeviceSize(u64 blocks)
 {
-	u32 lastBlock=blocks-1;//address of last block
+	//address of last block, READ CAPACITY (16) is needed beyond this
+	u32 lastBlock=blocks>0x100000000ULL?0xFFFFFFFF:blocks-1;
 	m_nDeviceBlocks=blocks;
 	m_ReadCapReply.nLastBlockAddr= ((lastBlock&0xFF)<<24)|((lastBlock&0xFF00)<<8)
 	                               |((lastBlock&0xFF0000)>>8)|((lastBlock&0xFF000000)>>24);
@@ -249,6 +310,11 @@ u64 CUSBMMSDGadget::GetBlocks (void) const
 	return m_nDeviceBlocks;
 }
 
+unsigned CUSBMMSDGadget::GetWriteQueueDepth (void) const
+{
+	return m_nWriteHead - m_nWriteTail;
+}
+
 //use when device does not report size
 void CUSBMMSDGadget::SetDeviceBlocks(u64 numBlocks)
 {
@@ -260,8 +326,17 @@ void CUSBMMSDGadget::CreateDevice (void)
 	assert(m_pDevice);
 }
 
+// Chunks that are already queued were acknowledged, so Update() writes
+// them all out at once, with any partly staged unit, in case the power
+// goes next. A chunk still on the wire is dropped, its command was never
+// acknowledged
 void CUSBMMSDGadget::OnSuspend (void)
 {
+	unsigned nQueued = GetWriteQueueDepth();
+	if (nQueued > 0 || m_nStageBlocks > 0)
+		MLOGNOTE("OnSuspend", "%u chunks and %u staged blocks still to be written",
+			 nQueued, m_nStageBlocks);
+	m_bFlushPending = TRUE;
 
 	delete m_pEP[EPOut];
 	m_pEP[EPOut] = nullptr;
@@ -269,6 +344,7 @@ void CUSBMMSDGadget::OnSuspend (void)
 	delete m_pEP[EPIn];
 	m_pEP[EPIn] = nullptr;
 
+	m_ReadAheadState = ReadAheadIdle;
 	m_nState=TMMSDState::Init;
 }
 
@@ -324,7 +400,21 @@ void CUSBMMSDGadget::OnTransferComplete (boolean bIn, size_t nLength)
 			}
 		case TMMSDState::DataIn:
 			{
-				if(m_nnumber_blocks>0)
+				m_nCommandBytes += nLength;
+				if(m_ReadAheadState == ReadAheadReady)
+				{
+					BeginReadAheadTransfer(); //next batch is ready
+				}
+				else if(m_ReadAheadState == ReadAheadBusy)
+				{
+					m_nState=TMMSDState::DataInWait; //Update() sends it when read
+				}
+				else if(m_ReadAheadState == ReadAheadFailed)
+				{
+					m_ReadAheadState = ReadAheadIdle;
+					SendCSW(); //status set by FillDataInBuffer()
+				}
+				else if(m_nnumber_blocks>0)
 				{
 					if(m_MMSDReady)
 					{
@@ -348,6 +438,7 @@ void CUSBMMSDGadget::OnTransferComplete (boolean bIn, size_t nLength)
 			}
 		case TMMSDState::SendReqSenseReply:
 			{
+				m_nCommandBytes += nLength;
 				SendCSW();
 				break;
 			}
@@ -389,11 +480,34 @@ void CUSBMMSDGadget::OnTransferComplete (boolean bIn, size_t nLength)
 			}
 		case TMMSDState::DataOut:
 			{
-				//process block from host
+				//chunk from host is in the slot at the head of the queue
+				m_nCommandBytes += nLength;
 				assert(m_nnumber_blocks>0);
 				if(m_MMSDReady)
 				{
-					m_nState=TMMSDState::DataOutWrite; //see Update function
+					unsigned nHead = m_nWriteHead;
+					const TWriteChunk &Chunk = m_pWriteChunk[nHead & (m_nWriteChunks-1)];
+					m_nnumber_blocks -= Chunk.nBlocks;
+					m_nblock_address += Chunk.nBlocks;
+
+					// Queue it for Update()
+					DataMemBarrier();
+					m_nWriteHead = nHead + 1;
+					if(nHead + 1 - m_nWriteTail > m_nWriteQueueHighWater)
+						m_nWriteQueueHighWater = nHead + 1 - m_nWriteTail;
+
+					if(m_nnumber_blocks==0)
+					{
+						FinishWrite();
+					}
+					else if(m_nWriteHead - m_nWriteTail < m_nWriteChunks)
+					{
+						BeginWriteChunk(); //get next chunk
+					}
+					else
+					{
+						m_nState=TMMSDState::DataOutWait; //see Update function
+					}
 				}
 				else
 				{
@@ -428,323 +542,803 @@ void CUSBMMSDGadget::OnActivate()
 
 void CUSBMMSDGadget::SendCSW()
 {
-	memcpy(&m_InBuffer,&m_CSW,SIZE_CSW);
+	EndCommandStats();
+	memcpy(m_InBuffer,&m_CSW,SIZE_CSW);
 	m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferCSWIn,m_InBuffer,SIZE_CSW);
 	m_nState=TMMSDState::SentCSW;
 }
 
+void CUSBMMSDGadget::BeginCommandStats()
+{
+	m_bCommandActive = TRUE;
+	m_nCommandStart = CTimer::GetClockTicks();
+	m_nCommandBytes = 0;
+}
+
+void CUSBMMSDGadget::EndCommandStats()
+{
+	if(!m_bCommandActive)
+		return;
+	m_bCommandActive = FALSE;
+	unsigned nTicks = CTimer::GetClockTicks() - m_nCommandStart;
+	SCSIStats::Get().Record(m_CBW.CBWCB[0], nTicks, m_nCommandBytes);
+	SCSITrace::Get().Record(m_CBW.CBWCB, m_CSW.bmCSWStatus, SCSITraceGadgetMSD,
+	                        m_nCommandStart, nTicks, m_nCommandBytes);
+}
+
+// Dispatched through a table indexed by opcode, like the CD gadget.
+// Each command is timed from the CBW to its CSW and counted in SCSIStats
 void CUSBMMSDGadget::HandleSCSICommand()
 {
-	switch(m_CBW.CBWCB[0])
+	BeginCommandStats();
+
+	// A write we had already acknowledged has failed since. The next
+	// command reports it, unless it is one the host needs to find out why
+	u8 nOpCode = m_CBW.CBWCB[0];
+	if(m_bWriteError && nOpCode != 0x03 && nOpCode != 0x12)
 	{
-	case 0x0: // Test unit ready
-		{
-			m_CSW.bmCSWStatus=m_MMSDReady?MMSD_CSW_STATUS_OK:MMSD_CSW_STATUS_FAIL;
-			if(!m_MMSDReady)
-			{
-				m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
-				m_ReqSenseReply.bSenseKey = 2;
-				m_ReqSenseReply.bAddlSenseCode = 1;
-			}
-			else
-			{
-				m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
-				m_ReqSenseReply.bSenseKey = 0;
-				m_ReqSenseReply.bAddlSenseCode = 0;
-			}
-			SendCSW();
-			break;
-		}
-	case 0x3: // Request sense CMD
-		{
-			memcpy(&m_InBuffer,&m_ReqSenseReply,SIZE_RSR);
-			m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
-			                           m_InBuffer,SIZE_RSR);
-			m_nState=TMMSDState::SendReqSenseReply;
-			m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
-			m_ReqSenseReply.bSenseKey = 0;
-			m_ReqSenseReply.bAddlSenseCode = 0;
-			break;
-		}
-	case 0x12: // Inquiry
-		{
-			memcpy(&m_InBuffer,&m_InqReply,SIZE_INQR);
-			m_nnumber_blocks=0; //nothing more after this send
-			m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
-			                           m_InBuffer,SIZE_INQR);
-			m_nState=TMMSDState::DataIn;
-			m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
-			m_ReqSenseReply.bSenseKey = 0;
-			m_ReqSenseReply.bAddlSenseCode = 0;
-			break;
-		}
-	case 0x1A: // Mode sense (6)
+		ReportWriteError();
+		SendCSW();
+		return;
+	}
+
+	// Any sense this command sets is for a current error. REQUEST SENSE
+	// still has to return a deferred one in its own format
+	if(nOpCode != 0x03)
+		m_ReqSenseReply.bErrCode = 0x70;
+
+	(this->*s_SCSIHandlers[nOpCode])();
+}
+
+// Deferred error, MEDIUM ERROR / WRITE ERROR
+void CUSBMMSDGadget::ReportWriteError()
+{
+	m_bWriteError = FALSE;
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
+	m_ReqSenseReply.bErrCode = 0x71;
+	m_ReqSenseReply.bSenseKey = 0x3;
+	m_ReqSenseReply.bAddlSenseCode = 0x0C;
+}
+
+void CUSBMMSDGadget::InitSCSIHandlers()
+{
+	for (unsigned i = 0; i < 256; i++)
+		s_SCSIHandlers[i] = &CUSBMMSDGadget::HandleUnknownCommand;
+
+	s_SCSIHandlers[0x00] = &CUSBMMSDGadget::HandleTestUnitReady;
+	s_SCSIHandlers[0x03] = &CUSBMMSDGadget::HandleRequestSense;
+	s_SCSIHandlers[0x12] = &CUSBMMSDGadget::HandleInquiry;
+	s_SCSIHandlers[0x1A] = &CUSBMMSDGadget::HandleModeSense6;
+	s_SCSIHandlers[0x1B] = &CUSBMMSDGadget::HandleStartStopUnit;
+	s_SCSIHandlers[0x1E] = &CUSBMMSDGadget::HandleAllowRemoval;
+	s_SCSIHandlers[0x23] = &CUSBMMSDGadget::HandleReadFormatCapacities;
+	s_SCSIHandlers[0x25] = &CUSBMMSDGadget::HandleReadCapacity;
+	s_SCSIHandlers[0x28] = &CUSBMMSDGadget::HandleRead10;
+	s_SCSIHandlers[0x2A] = &CUSBMMSDGadget::HandleWrite10;
+	s_SCSIHandlers[0x2F] = &CUSBMMSDGadget::HandleVerify;
+	s_SCSIHandlers[0x35] = &CUSBMMSDGadget::HandleSynchronizeCache;
+	// TODO: UNMAP (0x42) and the 0xB2 provisioning page. They need a way to
+	// erase blocks on the card, which Circle's EMMC driver doesn't have yet.
+	// That would come as a patch under patches/circle, like fast seek did
+	s_SCSIHandlers[0x9E] = &CUSBMMSDGadget::HandleServiceActionIn16;
+}
+
+// Test unit ready (0x00)
+void CUSBMMSDGadget::HandleTestUnitReady()
+{
+	m_CSW.bmCSWStatus=m_MMSDReady?MMSD_CSW_STATUS_OK:MMSD_CSW_STATUS_FAIL;
+	if(!m_MMSDReady)
+	{
+		m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
+		m_ReqSenseReply.bSenseKey = 2;
+		m_ReqSenseReply.bAddlSenseCode = 1;
+	}
+	else
+	{
+		m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+		m_ReqSenseReply.bSenseKey = 0;
+		m_ReqSenseReply.bAddlSenseCode = 0;
+	}
+	SendCSW();
+}
+
+// Request sense CMD (0x03)
+void CUSBMMSDGadget::HandleRequestSense()
+{
+	memcpy(m_InBuffer,&m_ReqSenseReply,SIZE_RSR);
+	m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
+				   m_InBuffer,SIZE_RSR);
+	m_nState=TMMSDState::SendReqSenseReply;
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+	m_ReqSenseReply.bErrCode = 0x70;
+	m_ReqSenseReply.bSenseKey = 0;
+	m_ReqSenseReply.bAddlSenseCode = 0;
+}
+
+// Inquiry (0x12)
+void CUSBMMSDGadget::HandleInquiry()
+{
+	if(m_CBW.CBWCB[1] & 0x01) //EVPD
+	{
+		SendVPDPage(m_CBW.CBWCB[2]);
+		return;
+	}
+
+	memcpy(m_InBuffer,&m_InqReply,SIZE_INQR);
+	m_nnumber_blocks=0; //nothing more after this send
+	m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
+				   m_InBuffer,SIZE_INQR);
+	m_nState=TMMSDState::DataIn;
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+	m_ReqSenseReply.bSenseKey = 0;
+	m_ReqSenseReply.bAddlSenseCode = 0;
+}
+
+// Vital product data pages of Inquiry (0x12)
+void CUSBMMSDGadget::SendVPDPage(u8 nPage)
+{
+	u8 *pPage = m_InBuffer;
+	size_t nLength;
+
+	switch(nPage)
+	{
+	case 0x00: //supported pages
 		{
-			memcpy(&m_InBuffer,&m_ModeSenseReply,SIZE_MODEREP);
-			m_nnumber_blocks=0; //nothing more after this send
-			m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
-			                           m_InBuffer,SIZE_MODEREP);
-			m_nState=TMMSDState::DataIn;
-			m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
-			m_ReqSenseReply.bSenseKey = 0;
-			m_ReqSenseReply.bAddlSenseCode = 0;
+			static const u8 Supported[] = {0x00, 0xB0};
+			memset(pPage, 0, 4);
+			pPage[3] = sizeof Supported;
+			memcpy(pPage + 4, Supported, sizeof Supported);
+			nLength = 4 + sizeof Supported;
 			break;
 		}
-	case 0x1B: // Start/stop unit
+	case 0xB0: //block limits
 		{
-			m_MMSDReady = (m_CBW.CBWCB[4] >> 1) == 0;
-			MLOGNOTE("HandleSCSI","start/stop, %s",m_MMSDReady?"ready":"not ready");
-			m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
-			m_ReqSenseReply.bSenseKey = 0;
-			m_ReqSenseReply.bAddlSenseCode = 0;
-			SendCSW();
+			nLength = 64;
+			memset(pPage, 0, nLength);
+			pPage[1] = 0xB0;
+			pPage[3] = nLength - 4;
+			// optimal transfer length granularity, what we coalesce to
+			pPage[6] = (StageBlocks >> 8) & 0xFF;
+			pPage[7] = StageBlocks & 0xFF;
+			// optimal transfer length
+			pPage[14] = (m_nMaxBlocks >> 8) & 0xFF;
+			pPage[15] = m_nMaxBlocks & 0xFF;
 			break;
 		}
-	case 0x1E: // allow removal
+	default:
+		m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
+		m_ReqSenseReply.bSenseKey = 0x5; // Illegal request
+		m_ReqSenseReply.bAddlSenseCode = 0x24; // invalid field in CDB
+		SendCSW();
+		return;
+	}
+
+	size_t nAllocation = (m_CBW.CBWCB[3] << 8) | m_CBW.CBWCB[4];
+	if(nLength > nAllocation)
+		nLength = nAllocation;
+
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+	m_ReqSenseReply.bSenseKey = 0;
+	m_ReqSenseReply.bAddlSenseCode = 0;
+	if(nLength == 0)
+	{
+		SendCSW();
+		return;
+	}
+
+	m_nnumber_blocks=0; //nothing more after this send
+	m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
+				   m_InBuffer,nLength);
+	m_nState=TMMSDState::DataIn;
+}
+
+// Mode sense (6) (0x1A)
+void CUSBMMSDGadget::HandleModeSense6()
+{
+	memcpy(m_InBuffer,&m_ModeSenseReply,SIZE_MODEREP);
+	m_nnumber_blocks=0; //nothing more after this send
+	m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
+				   m_InBuffer,SIZE_MODEREP);
+	m_nState=TMMSDState::DataIn;
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+	m_ReqSenseReply.bSenseKey = 0;
+	m_ReqSenseReply.bAddlSenseCode = 0;
+}
+
+// Start/stop unit (0x1B)
+// The host may power us off after this, so the write-behind queue is
+// written out before we answer
+void CUSBMMSDGadget::HandleStartStopUnit()
+{
+	m_MMSDReady = (m_CBW.CBWCB[4] >> 1) == 0;
+	MLOGNOTE("HandleSCSI","start/stop, %s",m_MMSDReady?"ready":"not ready");
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+	m_ReqSenseReply.bSenseKey = 0;
+	m_ReqSenseReply.bAddlSenseCode = 0;
+	BeginFlush();
+}
+
+// allow removal (0x1E)
+void CUSBMMSDGadget::HandleAllowRemoval()
+{
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
+	m_ReqSenseReply.bSenseKey = 0x5; // Illegal/not supported
+	m_ReqSenseReply.bAddlSenseCode = 0x20;
+	SendCSW();
+}
+
+// format capacity (0x23)
+void CUSBMMSDGadget::HandleReadFormatCapacities()
+{
+	memcpy(m_InBuffer,&m_FormatCapReply,SIZE_FORMATR);
+	m_nnumber_blocks=0; //nothing more after this send
+	m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
+				   m_InBuffer,SIZE_FORMATR);
+	m_nState=TMMSDState::DataIn;
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+	m_ReqSenseReply.bSenseKey = 0;
+	m_ReqSenseReply.bAddlSenseCode = 0;
+}
+
+// Read capacity (10) (0x25)
+void CUSBMMSDGadget::HandleReadCapacity()
+{
+	memcpy(m_InBuffer,&m_ReadCapReply,SIZE_READCAPREP);
+	m_nnumber_blocks=0; //nothing more after this send
+	m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
+				   m_InBuffer,SIZE_READCAPREP);
+	m_nState=TMMSDState::DataIn;
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+	m_ReqSenseReply.bSenseKey = 0;
+	m_ReqSenseReply.bAddlSenseCode = 0;
+}
+
+// Read (10) (0x28)
+void CUSBMMSDGadget::HandleRead10()
+{
+	if(m_MMSDReady)
+	{
+		//will be updated if read fails on any block
+		m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+
+		m_ReqSenseReply.bSenseKey = 0;
+		m_ReqSenseReply.bAddlSenseCode = 0;
+		m_nnumber_blocks = (u32)((m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8]);
+		m_nblock_address =   (u32)(m_CBW.CBWCB[2] << 24)
+				   | (u32)(m_CBW.CBWCB[3] << 16)
+				   | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
+		m_nbyteCount=m_CBW.dCBWDataTransferLength;
+		if(m_nnumber_blocks==0)
 		{
-			m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
-			m_ReqSenseReply.bSenseKey = 0x5; // Illegal/not supported
-			m_ReqSenseReply.bAddlSenseCode = 0x20;
-			SendCSW();
-			break;
+			m_nnumber_blocks=1+(m_nbyteCount)/BLOCK_SIZE;
 		}
+		MLOGDEBUG("Read(10)","addr = %u len = %u",
+			  m_nblock_address,m_nnumber_blocks);
+		m_nState=TMMSDState::DataInRead; //see Update() function
+	}
+	else
+	{
+		MLOGERR("handleSCSI Read(10)","failed, %s",
+			m_MMSDReady?"ready":"not ready");
+		m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
+		m_ReqSenseReply.bSenseKey = 2;
+		m_ReqSenseReply.bAddlSenseCode = 1;
+		SendCSW();
+	}
+}
+
+// Write (10) (0x2A)
+void CUSBMMSDGadget::HandleWrite10()
+{
+	if(m_MMSDReady)
+	{
+		//->big endian
+		m_nnumber_blocks = (u32)(m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8];
+		m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16)
+				   |(u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
+		MLOGDEBUG("Write(10)","addr = %u len = %u",m_nblock_address,m_nnumber_blocks);
+		m_nPrefetchGeneration = m_nPrefetchGeneration + 1;
+
+		m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;	   //will be updated if write fails
+		m_ReqSenseReply.bSenseKey = 0;
+		m_ReqSenseReply.bAddlSenseCode = 0;
 
-	case 0x23: // format capacity
+		if(m_nnumber_blocks==0)
 		{
-			memcpy(&m_InBuffer,&m_FormatCapReply,SIZE_FORMATR);
-			m_nnumber_blocks=0; //nothing more after this send
-			m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
-			                           m_InBuffer,SIZE_FORMATR);
-			m_nState=TMMSDState::DataIn;
-			m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
-			m_ReqSenseReply.bSenseKey = 0;
-			m_ReqSenseReply.bAddlSenseCode = 0;
-			break;
+			SendCSW();
 		}
-	case 0x25: // Read capacity (10))
+		else if(m_nWriteHead - m_nWriteTail < m_nWriteChunks)
 		{
-			memcpy(&m_InBuffer,&m_ReadCapReply,SIZE_READCAPREP);
-			m_nnumber_blocks=0; //nothing more after this send
-			m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
-			                           m_InBuffer,SIZE_READCAPREP);
-			m_nState=TMMSDState::DataIn;
-			m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
-			m_ReqSenseReply.bSenseKey = 0;
-			m_ReqSenseReply.bAddlSenseCode = 0;
-			break;
+			BeginWriteChunk();
 		}
-	case 0x28: // Read (10)
+		else
 		{
-			if(m_MMSDReady)
-			{
-				//will be updated if read fails on any block
-				m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
-
-				m_ReqSenseReply.bSenseKey = 0;
-				m_ReqSenseReply.bAddlSenseCode = 0;
-				m_nnumber_blocks = (u32)((m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8]);
-				m_nblock_address =   (u32)(m_CBW.CBWCB[2] << 24)
-				                   | (u32)(m_CBW.CBWCB[3] << 16)
-				                   | (u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
-				m_nbyteCount=m_CBW.dCBWDataTransferLength;
-				if(m_nnumber_blocks==0)
-				{
-					m_nnumber_blocks=1+(m_nbyteCount)/BLOCK_SIZE;
-				}
-				MLOGDEBUG("Read(10)","addr = %u len = %u",
-					  m_nblock_address,m_nnumber_blocks);
-				m_nState=TMMSDState::DataInRead; //see Update() function
-			}
-			else
-			{
-				MLOGERR("handleSCSI Read(10)","failed, %s",
-					m_MMSDReady?"ready":"not ready");
-				m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
-				m_ReqSenseReply.bSenseKey = 2;
-				m_ReqSenseReply.bAddlSenseCode = 1;
-				SendCSW();
-			}
-			break;
+			m_nState=TMMSDState::DataOutWait; //see Update function
 		}
+	}
+	else
+	{
+		MLOGERR("handleSCSI write(10)","failed, %s",
+			m_MMSDReady?"ready":"not ready");
+		m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
+		m_ReqSenseReply.bSenseKey = 2;
+		m_ReqSenseReply.bAddlSenseCode = 1;
+		SendCSW();
+	}
+}
 
-	case 0x2A: // Write (10)
-		{
-			if(m_MMSDReady)
-			{
-				//->big endian
-				m_nnumber_blocks = (u32)(m_CBW.CBWCB[7] << 8) | m_CBW.CBWCB[8];
-				m_nblock_address = (u32)(m_CBW.CBWCB[2] << 24) | (u32)(m_CBW.CBWCB[3] << 16)
-				                   |(u32)(m_CBW.CBWCB[4] << 8) | m_CBW.CBWCB[5];
-				MLOGDEBUG("Write(10)","addr = %u len = %u",m_nblock_address,m_nnumber_blocks);
-
-				m_nnumber_blocks_chunk = (m_nnumber_blocks > 16) ? 16 : m_nnumber_blocks;
-
-				m_pEP[EPOut]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataOut,
-				                            m_OutBuffer, BLOCK_SIZE * m_nnumber_blocks_chunk);
-				m_nState=TMMSDState::DataOut;
-				m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;	   //will be updated if write fails
-				m_ReqSenseReply.bSenseKey = 0;
-				m_ReqSenseReply.bAddlSenseCode = 0;
-			}
-			else
-			{
-				MLOGERR("handleSCSI write(10)","failed, %s",
-					m_MMSDReady?"ready":"not ready");
-				m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
-				m_ReqSenseReply.bSenseKey = 2;
-				m_ReqSenseReply.bAddlSenseCode = 1;
-				SendCSW();
-			}
-			break;
-		}
+// Receive the next chunk of the command into the slot at the head of the
+// write-behind queue, which must have room. Called from IRQ or with IRQs
+// disabled
+void CUSBMMSDGadget::BeginWriteChunk()
+{
+	assert(m_nWriteHead - m_nWriteTail < m_nWriteChunks);
+	TWriteChunk &Chunk = m_pWriteChunk[m_nWriteHead & (m_nWriteChunks-1)];
+	Chunk.nBlockAddress = m_nblock_address;
+	Chunk.nBlocks = (m_nnumber_blocks > m_nMaxBlocks) ? m_nMaxBlocks : m_nnumber_blocks;
+
+	m_pEP[EPOut]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataOut,
+				    Chunk.pBuffer, BLOCK_SIZE * Chunk.nBlocks);
+	m_nState=TMMSDState::DataOut;
+}
 
-	case 0x2F: // Verify, not implemented but don't tell host
+// All data of the WRITE is queued. With write-behind that is as good as
+// written, otherwise Update() answers once it is on the device
+void CUSBMMSDGadget::FinishWrite()
+{
+	if(!m_bWriteBehind)
+	{
+		m_nState=TMMSDState::Flushing;
+		return;
+	}
+
+	if(m_bWriteError)
+		ReportWriteError();
+	SendCSW();
+}
+
+// Answer the command once the write-behind queue is empty, see Update()
+void CUSBMMSDGadget::BeginFlush()
+{
+	unsigned nQueued = GetWriteQueueDepth();
+	if(nQueued > 0)
+		MLOGNOTE("Flush","%u of %u chunks queued, at most %u so far. %u aligned and %u partial writes",
+			 nQueued, m_nWriteChunks, m_nWriteQueueHighWater, m_nAlignedWrites, m_nPartialWrites);
+	m_nState=TMMSDState::Flushing;
+}
+
+// Verify, not implemented but don't tell host (0x2F)
+void CUSBMMSDGadget::HandleVerify()
+{
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+	m_ReqSenseReply.bSenseKey = 0;
+	m_ReqSenseReply.bAddlSenseCode = 0;
+	SendCSW();
+}
+
+// Synchronize cache (10) (0x35)
+void CUSBMMSDGadget::HandleSynchronizeCache()
+{
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+	m_ReqSenseReply.bSenseKey = 0;
+	m_ReqSenseReply.bAddlSenseCode = 0;
+	BeginFlush();
+}
+
+// Service action in (16) (0x9E), only Read capacity (16)
+void CUSBMMSDGadget::HandleServiceActionIn16()
+{
+	if((m_CBW.CBWCB[1] & 0x1F) != 0x10)
+	{
+		HandleUnknownCommand();
+		return;
+	}
+
+	TUSBMMSDReadCapacity16Reply Reply;
+	memset(&Reply, 0, sizeof Reply);
+	u64 lastBlock = m_nDeviceBlocks-1;
+	for(unsigned i = 0; i < 8; i++)
+		Reply.nLastBlockAddr[i] = (lastBlock >> (56 - 8*i)) & 0xFF;
+	Reply.nBlockLength[2] = (BLOCK_SIZE >> 8) & 0xFF;
+	Reply.nBlockLength[3] = BLOCK_SIZE & 0xFF;
+
+	size_t nLength = SIZE_READCAP16REP;
+	size_t nAllocation = (m_CBW.CBWCB[10] << 24) | (m_CBW.CBWCB[11] << 16)
+			     | (m_CBW.CBWCB[12] << 8) | m_CBW.CBWCB[13];
+	if(nLength > nAllocation)
+		nLength = nAllocation;
+
+	m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
+	m_ReqSenseReply.bSenseKey = 0;
+	m_ReqSenseReply.bAddlSenseCode = 0;
+	if(nLength == 0)
+	{
+		SendCSW();
+		return;
+	}
+
+	memcpy(m_InBuffer,&Reply,nLength);
+	m_nnumber_blocks=0; //nothing more after this send
+	m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
+				   m_InBuffer,nLength);
+	m_nState=TMMSDState::DataIn;
+}
+
+// Anything we don't know about
+void CUSBMMSDGadget::HandleUnknownCommand()
+{
+	m_ReqSenseReply.bSenseKey = 0x5; // Illegal/not supported
+	m_ReqSenseReply.bAddlSenseCode = 0x20;
+	m_CSW.bmCSWStatus = MMSD_CSW_STATUS_FAIL;
+	SendCSW();
+}
+
+
+// Read the next batch of the READ command into pBuffer. Sets the status
+// and returns FALSE if that fails
+boolean CUSBMMSDGadget::FillDataInBuffer(u8 *pBuffer, size_t *pLength)
+{
+	if(!m_MMSDReady)
+	{
+		MLOGERR("UpdateRead","failed, not ready");
+		m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
+		m_ReqSenseReply.bSenseKey = 2;
+		m_ReqSenseReply.bAddlSenseCode = 1;
+		return FALSE;
+	}
+
+	u32 blocks_to_read = (m_nnumber_blocks > m_nMaxBlocks) ? m_nMaxBlocks : m_nnumber_blocks;
+
+	// The batch Prefetch() read while the host was busy with the CSW
+	boolean bPrefetched = m_bPrefetchValid && m_nblock_address == m_nPrefetchAddress
+			      && m_nPrefetchedGeneration == m_nPrefetchGeneration;
+	m_bPrefetchValid = FALSE;
+	if(bPrefetched && blocks_to_read > m_nPrefetchBlocks)
+		blocks_to_read = m_nPrefetchBlocks;
+	u32 bytes_to_read = blocks_to_read * BLOCK_SIZE;
+
+	MLOGDEBUG("UpdateRead", "Attempting to read %u blocks (%u bytes) starting at block %lu",
+		  blocks_to_read, bytes_to_read, m_nblock_address);
+
+	int read_count = -1;
+	if(bPrefetched)
+	{
+		memcpy(pBuffer, m_pPrefetchBuffer, bytes_to_read);
+		read_count = bytes_to_read;
+		m_nPrefetchHits++;
+	}
+	else if(m_pDevice->Seek((u64)BLOCK_SIZE * m_nblock_address) != (u64)-1)
+	{
+		read_count = m_pDevice->Read(pBuffer, bytes_to_read);
+	}
+
+	if (read_count != static_cast<int>(bytes_to_read)) {
+		// Handle a failed or partial read
+		MLOGERR("UpdateRead", "Read error: expected %u bytes, got %d", bytes_to_read, read_count);
+		m_CSW.bmCSWStatus = MMSD_CSW_STATUS_FAIL;
+		m_ReqSenseReply.bSenseKey = 0x2;
+		m_ReqSenseReply.bAddlSenseCode = 0x1;
+		return FALSE;
+	}
+
+	// Update counts for the next batch
+	m_nblock_address += blocks_to_read;
+	m_nnumber_blocks -= blocks_to_read;
+	m_nbyteCount -= bytes_to_read;
+
+	// Last batch of the command, have Update() read on from here
+	if(m_nnumber_blocks == 0)
+	{
+		m_bPrefetchWanted = TRUE;
+		m_nPrefetchAddress = m_nblock_address;
+	}
+
+	*pLength = bytes_to_read;
+	return TRUE;
+}
+
+// Read the batch following the last READ into m_pPrefetchBuffer
+void CUSBMMSDGadget::Prefetch()
+{
+	if(!m_bPrefetchWanted || !m_MMSDReady)
+		return;
+	m_bPrefetchWanted = FALSE;
+
+	u32 nBlocks = m_nMaxBlocks;
+	if(m_nPrefetchAddress >= m_nDeviceBlocks)
+		return;
+	if(nBlocks > m_nDeviceBlocks - m_nPrefetchAddress)
+		nBlocks = m_nDeviceBlocks - m_nPrefetchAddress;
+
+	// Queued writes aren't on the device yet
+	if(WriteQueueOverlaps(m_nPrefetchAddress, nBlocks))
+		return;
+
+	unsigned nGeneration = m_nPrefetchGeneration;
+	int read_count = -1;
+	if(m_pDevice->Seek((u64)BLOCK_SIZE * m_nPrefetchAddress) != (u64)-1)
+		read_count = m_pDevice->Read(m_pPrefetchBuffer, nBlocks * BLOCK_SIZE);
+
+	m_nPrefetchBlocks = nBlocks;
+	m_nPrefetchedGeneration = nGeneration;
+	m_bPrefetchValid = read_count == (int)(nBlocks * BLOCK_SIZE);
+	MLOGDEBUG("Prefetch","%u blocks at %u, %u hits so far",
+		  nBlocks, m_nPrefetchAddress, m_nPrefetchHits);
+}
+
+// Swap the DataIn buffers and send the batch prepared by the read-ahead.
+// Called from IRQ or with IRQs disabled
+void CUSBMMSDGadget::BeginReadAheadTransfer()
+{
+	assert(m_ReadAheadState == ReadAheadReady || m_ReadAheadState == ReadAheadBusy);
+	m_nDataInBuffer ^= 1;
+	m_ReadAheadState = ReadAheadIdle;
+	m_nState = TMMSDState::DataIn;
+	m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
+				   m_pDataInBuffer[m_nDataInBuffer], m_nReadAheadLength);
+}
+
+// Write the oldest chunk of the write-behind queue to the device. Its
+// command has been acknowledged already, so a failure is kept for the next
+// command to report
+boolean CUSBMMSDGadget::WriteNextChunk()
+{
+	unsigned nTail = m_nWriteTail;
+	assert(nTail != m_nWriteHead);
+
+	// Read the chunk only after seeing the head that covers it
+	DataMemBarrier();
+	const TWriteChunk &Chunk = m_pWriteChunk[nTail & (m_nWriteChunks-1)];
+
+	boolean bOK = WriteBlocks(Chunk.nBlockAddress, Chunk.nBlocks, Chunk.pBuffer);
+
+	// Hand the slot back once we are done with its buffer
+	DataMemBarrier();
+	m_nWriteTail = nTail + 1;
+
+	return bOK;
+}
+
+// Gather the blocks into StageBlocks aligned runs. Whole aligned units are
+// written straight from pData, the rest goes through the stage buffer
+boolean CUSBMMSDGadget::WriteBlocks(u32 nBlockAddress, u32 nBlocks, const u8 *pData)
+{
+	boolean bOK = TRUE;
+
+	while(nBlocks > 0)
+	{
+		u32 nUnit = nBlockAddress & ~(StageBlocks-1);
+
+		// Not the continuation of the staged run, so that is all we get
+		if(m_nStageBlocks > 0
+		   && (nBlockAddress != m_nStageFirst + m_nStageBlocks
+		       || nUnit != (m_nStageFirst & ~(StageBlocks-1))))
 		{
-			m_CSW.bmCSWStatus=MMSD_CSW_STATUS_OK;
-			m_ReqSenseReply.bSenseKey = 0;
-			m_ReqSenseReply.bAddlSenseCode = 0;
-			SendCSW();
-			break;
+			bOK = FlushStage() && bOK;
 		}
 
-	default:
+		if(m_nStageBlocks == 0 && nBlockAddress == nUnit && nBlocks >= StageBlocks)
 		{
-			m_ReqSenseReply.bSenseKey = 0x5; // Illegal/not supported
-			m_ReqSenseReply.bAddlSenseCode = 0x20;
-			m_CSW.bmCSWStatus = MMSD_CSW_STATUS_FAIL;
-			SendCSW();
-			break;
+			u32 nWhole = nBlocks & ~(StageBlocks-1);
+			bOK = WriteDevice(nBlockAddress, nWhole, pData) && bOK;
+			m_nAlignedWrites++;
+
+			nBlockAddress += nWhole;
+			nBlocks -= nWhole;
+			pData += nWhole * BLOCK_SIZE;
+			continue;
 		}
 
+		// Stage up to the end of this unit
+		u32 nPiece = nUnit + StageBlocks - nBlockAddress;
+		if(nPiece > nBlocks)
+			nPiece = nBlocks;
+		if(m_nStageBlocks == 0)
+			m_nStageFirst = nBlockAddress;
+		memcpy(m_pStageBuffer + (nBlockAddress - nUnit) * BLOCK_SIZE, pData, nPiece * BLOCK_SIZE);
+		m_nStageBlocks += nPiece;
+		m_nStageTicks = CTimer::GetClockTicks();
+
+		nBlockAddress += nPiece;
+		nBlocks -= nPiece;
+		pData += nPiece * BLOCK_SIZE;
+
+		// Nothing can be added past the end of the unit
+		if(m_nStageFirst + m_nStageBlocks == nUnit + StageBlocks)
+			bOK = FlushStage() && bOK;
+	}
+
+	return bOK;
+}
+
+boolean CUSBMMSDGadget::FlushStage()
+{
+	if(m_nStageBlocks == 0)
+		return TRUE;
+
+	u32 nUnit = m_nStageFirst & ~(StageBlocks-1);
+	if(m_nStageFirst == nUnit && m_nStageBlocks == StageBlocks)
+		m_nAlignedWrites++;
+	else
+		m_nPartialWrites++;
+
+	boolean bOK = WriteDevice(m_nStageFirst, m_nStageBlocks,
+				  m_pStageBuffer + (m_nStageFirst - nUnit) * BLOCK_SIZE);
+	m_nStageBlocks = 0;
+	return bOK;
+}
+
+boolean CUSBMMSDGadget::WriteDevice(u32 nBlockAddress, u32 nBlocks, const u8 *pData)
+{
+	int write_length = BLOCK_SIZE * nBlocks;
+	int writeCount = -1;
+	if(m_pDevice->Seek((u64)BLOCK_SIZE * nBlockAddress) != (u64)-1)
+		writeCount = m_pDevice->Write(pData, write_length);
+
+	if(writeCount != write_length)
+	{
+		MLOGERR("UpdateWrite","%u blocks at %u failed, writeCount=%i",
+			nBlocks, nBlockAddress, writeCount);
+		m_bWriteError = TRUE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+boolean CUSBMMSDGadget::WriteQueueOverlaps(u32 nBlockAddress, u32 nBlocks) const
+{
+	u64 nEnd = (u64)nBlockAddress + nBlocks;
+	if(m_nStageBlocks > 0 && m_nStageFirst < nEnd
+	   && nBlockAddress < (u64)m_nStageFirst + m_nStageBlocks)
+		return TRUE;
+	for(unsigned i = m_nWriteTail; i != m_nWriteHead; i++)
+	{
+		const TWriteChunk &Chunk = m_pWriteChunk[i & (m_nWriteChunks-1)];
+		if(Chunk.nBlockAddress < nEnd && nBlockAddress < (u64)Chunk.nBlockAddress + Chunk.nBlocks)
+			return TRUE;
 	}
+	return FALSE;
+}
+
+void CUSBMMSDGadget::DrainWriteQueue()
+{
+	while(m_nWriteTail != m_nWriteHead)
+		WriteNextChunk();
+	FlushStage();
 }
 
 //this function is called periodically from task level for IO
 //(IO must not be attempted in functions called from IRQ)
 void CUSBMMSDGadget::Update()
 {
+	// Suspended, all of it goes to the card without waiting
+	if(m_bFlushPending)
+	{
+		m_bFlushPending = FALSE;
+		DrainWriteQueue();
+	}
+
+	// Write out what the host has sent, a chunk per call so that other
+	// tasks get to run in between
+	if(m_nWriteTail != m_nWriteHead)
+		WriteNextChunk();
+	else if(m_nStageBlocks > 0
+		&& CTimer::GetClockTicks() - m_nStageTicks >= StageTimeoutMs * (CLOCKHZ / 1000))
+		FlushStage(); //the rest of the unit isn't coming
+
 	switch(m_nState)
 	{
 	case TMMSDState::DataInRead:
 		{
-			u64 offset=0;
-			int readCount=0;
-
-			if (m_MMSDReady) {
-				// TODO: Try to avoid seek
-			    // Seek to the correct block address
-			    if (m_pDevice->Seek(BLOCK_SIZE * m_nblock_address) != (u64)-1) {
-				// Determine the number of blocks to read, capping at a maximum of 16
-				u32 blocks_to_read = (m_nnumber_blocks > 16) ? 16 : m_nnumber_blocks;
-				u32 bytes_to_read = blocks_to_read * BLOCK_SIZE;
-
-				MLOGDEBUG("UpdateRead", "Attempting to read %u blocks (%u bytes) starting at block %lu",
-					  blocks_to_read, bytes_to_read, m_nblock_address);
-
-				// Read directly into the input buffer
-				int read_count = m_pDevice->Read(m_InBuffer, bytes_to_read);
-
-				if (read_count != static_cast<int>(bytes_to_read)) {
-				    // Handle a failed or partial read
-				    MLOGERR("UpdateRead", "Read error: expected %u bytes, got %d", bytes_to_read, read_count);
-				    m_CSW.bmCSWStatus = MMSD_CSW_STATUS_FAIL;
-					m_ReqSenseReply.bSenseKey = 0x2;
-					m_ReqSenseReply.bAddlSenseCode = 0x1;
-				    SendCSW();
-				    return;
-				}
-
-				// Update counts and state for the next operation
-				m_nblock_address += blocks_to_read;
-				m_nnumber_blocks -= blocks_to_read;
-				m_nbyteCount -= bytes_to_read;
-				m_nState = TMMSDState::DataIn;
+			// Nothing on the wire. The read must see the data of any
+			// write that is still queued
+			if(WriteQueueOverlaps(m_nblock_address, m_nnumber_blocks))
+				DrainWriteQueue();
 
-				MLOGDEBUG("UpdateRead", "Read successful. Remaining blocks: %lu", m_nnumber_blocks);
-
-				// Initiate the USB transfer with the data read
-				m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn, m_InBuffer, bytes_to_read);
-			    }
-			}
-
-			if(!m_MMSDReady || offset==(u64)(-1))
+			size_t nLength = 0;
+			if(!FillDataInBuffer(m_pDataInBuffer[m_nDataInBuffer], &nLength))
 			{
-				MLOGERR("UpdateRead","failed, %s, offset=%i",
-				        m_MMSDReady?"ready":"not ready",offset);
-				m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
-				m_ReqSenseReply.bSenseKey = 2;
-				m_ReqSenseReply.bAddlSenseCode = 1;
 				SendCSW();
+				break;
 			}
+
+			m_nState = TMMSDState::DataIn;
+			m_pEP[EPIn]->BeginTransfer(CUSBMMSDGadgetEndpoint::TransferDataIn,
+						   m_pDataInBuffer[m_nDataInBuffer], nLength);
 			break;
 		}
-	case TMMSDState::DataOutWrite:
+
+	case TMMSDState::DataIn:
 		{
-			//process block from host
-			assert(m_nnumber_blocks>0);
-			u64 offset=0;
-			int writeCount=0;
-			if(m_MMSDReady)
+			// A batch is on the wire. Read the next one of the same
+			// command into the other buffer, so that the SD card and the
+			// USB bus are busy at the same time. OnTransferComplete()
+			// sends it
+			EnterCritical(IRQ_LEVEL);
+			boolean bReadAhead = m_nState == TMMSDState::DataIn
+					     && m_nnumber_blocks > 0
+					     && m_ReadAheadState == ReadAheadIdle;
+			if(bReadAhead)
+				m_ReadAheadState = ReadAheadBusy;
+			u32 nTag = m_CSW.dCSWTag;
+			LeaveCritical();
+
+			if(!bReadAhead)
 			{
-				// Try to avoid seeking
-				u64 desired_file_position = (BLOCK_SIZE * m_nblock_address);
-				if (m_currentDevicePointer != desired_file_position) {
-					offset=m_pDevice->Seek(desired_file_position);
-					m_currentDevicePointer = desired_file_position;
-				} 
-
-				// Try to write all 16 blocks
-				int write_length = BLOCK_SIZE * m_nnumber_blocks_chunk;
-				if(offset!=(u64)(-1))
+				// Nothing more to read for this command. Use the
+				// time the last batch is on the wire to read on
+				Prefetch();
+				break;
+			}
+
+			size_t nLength = 0;
+			boolean bOK = FillDataInBuffer(m_pDataInBuffer[m_nDataInBuffer ^ 1], &nLength);
+
+			EnterCritical(IRQ_LEVEL);
+			if(m_ReadAheadState != ReadAheadBusy || nTag != m_CSW.dCSWTag)
+			{
+				// The command has gone away (bus reset), drop the batch
+				if(m_ReadAheadState == ReadAheadBusy)
+					m_ReadAheadState = ReadAheadIdle;
+			}
+			else if(m_nState == TMMSDState::DataInWait)
+			{
+				// The previous batch has already completed, send this one now
+				if(bOK)
 				{
-					writeCount=m_pDevice->Write(m_OutBuffer, write_length);
+					m_nReadAheadLength = nLength;
+					BeginReadAheadTransfer();
 				}
-				if(writeCount>0)
+				else
 				{
-					if(writeCount < write_length)
-					{
-						MLOGERR("UpdateWrite","writeCount = %u ",writeCount);
-						m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
-						m_ReqSenseReply.bSenseKey = 0x2;
-						m_ReqSenseReply.bAddlSenseCode = 0x1;
-						SendCSW();
-						break;
-					}
-					m_nnumber_blocks -= m_nnumber_blocks_chunk;
-					m_nblock_address += m_nnumber_blocks_chunk;
-					m_currentDevicePointer += writeCount;
-					if(m_nnumber_blocks==0)  //done receiving data from host
-					{
-						SendCSW();
-						break;
-					}
+					m_ReadAheadState = ReadAheadIdle;
+					SendCSW();
 				}
 			}
-
-			if(!m_MMSDReady || offset==(u64)(-1) || writeCount<=0)
-			{
-				MLOGERR("UpdateWrite","failed, %s, offset=%i, writeCount=%i",
-				        m_MMSDReady?"ready":"not ready",offset,writeCount);
-				m_CSW.bmCSWStatus=MMSD_CSW_STATUS_FAIL;
-				m_ReqSenseReply.bSenseKey = 2;
-				m_ReqSenseReply.bAddlSenseCode = 1;
-				SendCSW();
-				break;
-			}
 			else
 			{
-				if(m_nnumber_blocks>0)  //get next block
-				{
-					m_nnumber_blocks_chunk = (m_nnumber_blocks > 16) ? 16 : m_nnumber_blocks;
+				m_nReadAheadLength = nLength;
+				m_ReadAheadState = bOK ? ReadAheadReady : ReadAheadFailed;
+			}
+			LeaveCritical();
+			break;
+		}
 
-					m_pEP[EPOut]->BeginTransfer(
-						CUSBMMSDGadgetEndpoint::TransferDataOut,
-					        m_OutBuffer, BLOCK_SIZE * m_nnumber_blocks_chunk);
-					m_nState=TMMSDState::DataOut;
-				}
+	case TMMSDState::DataOutWait:
+		{
+			// The chunk written above made room for the next one
+			EnterCritical(IRQ_LEVEL);
+			if(m_nState == TMMSDState::DataOutWait
+			   && m_nWriteHead - m_nWriteTail < m_nWriteChunks)
+				BeginWriteChunk();
+			LeaveCritical();
+			break;
+		}
+
+	case TMMSDState::Flushing:
+		{
+			if(m_nWriteTail != m_nWriteHead)
+				break;
+			FlushStage();
+
+			EnterCritical(IRQ_LEVEL);
+			if(m_nState == TMMSDState::Flushing)
+			{
+				if(m_bWriteError)
+					ReportWriteError();
+				SendCSW();
 			}
+			LeaveCritical();
 			break;
 		}
+
+	case TMMSDState::ReceiveCBW:
+	case TMMSDState::SentCSW:
+		// Waiting for the host, read on if it is streaming
+		if(m_nWriteTail == m_nWriteHead)
+			Prefetch();
+		break;
+
 	default:
 		break;
 	}
@@ -30,6 +30,8 @@
 #include <circle/synchronize.h>
 #include <circle/macros.h>
 #include <circle/types.h>
+#include <scsistats/scsistats.h>
+#include <scsitrace/scsitrace.h>
 
 #define BLOCK_SIZE 512
 
@@ -134,6 +136,20 @@ struct TUSBMMSDFormatCapacityReply   //10 bytes
 PACKED;
 #define SIZE_FORMATR 10
 
+//reply to SCSI Read Capacity (16) 0x9E/0x10
+struct TUSBMMSDReadCapacity16Reply   //32 bytes
+{
+	u8 nLastBlockAddr[8];
+	u8 nBlockLength[4];
+	u8 bProtection;
+	u8 bLogicalPerPhysical;
+	u8 bLBPMEetc;		// LBPME, LBPRZ, lowest aligned LBA
+	u8 bLowestAligned;
+	u8 reserved[16];
+}
+PACKED;
+#define SIZE_READCAP16REP 32
+
 
 
 class CUSBMMSDGadget : public CDWUSBGadget	/// USB mass storage device gadget
@@ -141,9 +157,14 @@ class CUSBMMSDGadget : public CDWUSBGadget	/// USB mass storage device gadget
 public:
 	/// \param pInterruptSystem Pointer to the interrupt system object
 	/// \param pDevice Pointer to the block device, to be controlled by this gadget
+	/// \param nMaxBlocks Maximum number of blocks per transfer (0 for default)
+	/// \param nWriteBehindChunks Transfers from the host that are acknowledged
+	///	   before they are written, rounded up to a power of two (0 to write
+	///	   each one before acknowledging the command)
 	/// \note pDevice must be initialized yet, when it is specified here.
 	/// \note SetDevice() has to be called later, when pDevice is not specified here.
-	CUSBMMSDGadget (CInterruptSystem *pInterruptSystem, boolean isFullSpeed, CDevice *pDevice = nullptr);
+	CUSBMMSDGadget (CInterruptSystem *pInterruptSystem, boolean isFullSpeed, CDevice *pDevice = nullptr,
+			unsigned nMaxBlocks = 0, unsigned nWriteBehindChunks = DefaultWriteBehindChunks);
 
 	~CUSBMMSDGadget (void);
 
@@ -160,6 +181,11 @@ public:
 	/// \return Capacity of the block device in number of blocks (a 512 bytes)
 	u64 GetBlocks (void) const;
 
+	/// \return Number of transfers from the host waiting to be written
+	unsigned GetWriteQueueDepth (void) const;
+
+	static const unsigned DefaultWriteBehindChunks = 4;
+
 protected:
 	/// \brief Get device-specific descriptor
 	/// \param wValue Parameter from setup packet (descriptor type (MSB) and index (LSB))
@@ -194,8 +220,50 @@ private:
 private:
 	void HandleSCSICommand();
 
+	// One handler per SCSI opcode, see InitSCSIHandlers()
+	typedef void (CUSBMMSDGadget::*TSCSIHandler)();
+	static TSCSIHandler s_SCSIHandlers[256];
+	static void InitSCSIHandlers();
+
+	void HandleTestUnitReady();
+	void HandleRequestSense();
+	void HandleInquiry();
+	void HandleModeSense6();
+	void HandleStartStopUnit();
+	void HandleAllowRemoval();
+	void HandleReadFormatCapacities();
+	void HandleReadCapacity();
+	void HandleRead10();
+	void HandleWrite10();
+	void HandleVerify();
+	void HandleSynchronizeCache();
+	void HandleServiceActionIn16();
+	void SendVPDPage(u8 nPage);
+	void HandleUnknownCommand();
+
+	void BeginCommandStats();
+	void EndCommandStats();
+
 	void SendCSW();
 
+	boolean FillDataInBuffer(u8 *pBuffer, size_t *pLength);
+	void BeginReadAheadTransfer();
+	void Prefetch();
+
+	void BeginWriteChunk();
+	void FinishWrite();
+	boolean WriteNextChunk();
+	boolean WriteQueueOverlaps(u32 nBlockAddress, u32 nBlocks) const;
+	void DrainWriteQueue();
+	void BeginFlush();
+	void ReportWriteError();
+
+	boolean WriteBlocks(u32 nBlockAddress, u32 nBlocks, const u8 *pData);
+	boolean FlushStage();
+	boolean WriteDevice(u32 nBlockAddress, u32 nBlocks, const u8 *pData);
+
+	static u8 *AllocateDMABuffer(size_t nSize);
+
 	void InitDeviceSize(u64 blocks);
 
 private:
@@ -239,14 +307,90 @@ private:
 		SentCSW,
 		SendReqSenseReply,
 		DataInRead,
-		DataOutWrite
+		DataOutWrite,
+		DataInWait,	// batch sent, waiting for Update() to finish the read-ahead batch
+		DataOutWait,	// write-behind queue full, Update() asks for more when it has room
+		Flushing	// Update() sends the CSW once the write-behind queue is empty
+	};
+
+	volatile TMMSDState m_nState=Init;
+
+	// While one DataIn buffer is on the wire, Update() fills the other one
+	// with the next batch of the same READ command
+	enum TReadAheadState
+	{
+		ReadAheadIdle,
+		ReadAheadBusy,
+		ReadAheadReady,
+		ReadAheadFailed
 	};
 
-	TMMSDState m_nState=Init;
+	volatile TReadAheadState m_ReadAheadState = ReadAheadIdle;
+	unsigned m_nDataInBuffer = 0;	// index of the buffer on the wire
+	size_t m_nReadAheadLength = 0;
+
+	// Bulk-only transport leaves the SD card idle while the CSW goes out
+	// and the next CBW comes in. When a READ ends, Update() uses that time
+	// to read the batch that follows it, so a host reading sequentially
+	// finds its first batch ready. Any WRITE bumps the generation,
+	// which throws away a batch read before it
+	u8 *m_pPrefetchBuffer;
+	boolean m_bPrefetchWanted = FALSE;
+	boolean m_bPrefetchValid = FALSE;
+	u32 m_nPrefetchAddress = 0;
+	u32 m_nPrefetchBlocks = 0;
+	volatile unsigned m_nPrefetchGeneration = 0;
+	unsigned m_nPrefetchedGeneration = 0;	// when the batch was read
+	unsigned m_nPrefetchHits = 0;
+
+	// Data from the host goes straight into a ring of chunk buffers. A
+	// chunk counts as done once it is in the ring, Update() writes it to
+	// the device later. Head and tail only ever grow, the slot is the
+	// count masked
+	struct TWriteChunk
+	{
+		u8 *pBuffer;		// m_nMaxBlocks blocks
+		u32 nBlockAddress;
+		u32 nBlocks;
+	};
+
+	TWriteChunk *m_pWriteChunk;
+	unsigned m_nWriteChunks;
+	boolean m_bWriteBehind;
+	volatile unsigned m_nWriteHead = 0;	// written by OnTransferComplete() only
+	volatile unsigned m_nWriteTail = 0;	// written by Update() only
+	unsigned m_nWriteQueueHighWater = 0;
+
+	// A write that failed after its command was acknowledged. Reported
+	// as a deferred error by the next command
+	volatile boolean m_bWriteError = FALSE;
+
+	// Set by OnSuspend(), Update() then drains the queue and the stage
+	// buffer in one go instead of a chunk per call
+	volatile boolean m_bFlushPending = FALSE;
+
+	// Writes on their way to the device are gathered into runs that start
+	// and end on a StageBlocks boundary, so the card sees whole aligned
+	// units instead of whatever the host's transfers add up to. Partial
+	// units wait here until the rest arrives or StageTimeout passes
+	static const unsigned StageBlocks = 128;	// 64KB
+	static const unsigned StageTimeoutMs = 20;
+
+	u8 *m_pStageBuffer;
+	u32 m_nStageFirst = 0;		// first block in the buffer
+	u32 m_nStageBlocks = 0;		// 0 if empty
+	unsigned m_nStageTicks = 0;	// when the last block arrived
+	unsigned m_nAlignedWrites = 0;
+	unsigned m_nPartialWrites = 0;
 
 	TUSBMMSDCBW m_CBW;
 	TUSBMMSDCSW m_CSW;
 
+	// Timing and data phase bytes of the command in progress, for SCSIStats
+	boolean m_bCommandActive = FALSE;
+	unsigned m_nCommandStart = 0;
+	u32 m_nCommandBytes = 0;
+
 	TUSBMMSDInquiryReply m_InqReply {0,0x80,0x04,0x02,0x1F,0,0,0,{'C','i','r','c','l','e',0,0},
 					{'M','a','s','s',' ','S','t','o','r','a','g','e',0,0,0,0},
 					{'0','0','0',0}};
@@ -256,16 +400,30 @@ private:
 	TUSBMMSDRequestSenseReply m_ReqSenseReply;
 	TUSBMMSDFormatCapacityReply m_FormatCapReply {{0,0,0},8,0x803E0000,2,0,{2,0}};
 
-	static const size_t MaxOutMessageSize = 16 * 512;
-	static const size_t MaxInMessageSize = 16 * 512;
+	// Number of blocks per transfer, set with msd_max_blocks in config.txt.
+	// The DWC endpoint can move at most 1023 packets in one transfer, which
+	// caps a full-speed transfer at 127 blocks
+	static const unsigned DefaultMaxBlocks = 128;
+	static const unsigned MinMaxBlocks = 16;
+	static const unsigned MaxMaxBlocks = 512;
+	static const size_t MaxPacketsPerTransfer = 1023;
+	static const unsigned MaxWriteBehindChunks = 16;
+
+	unsigned m_nMaxBlocks;
+	size_t m_nMaxMessageSize;
+
+	// Data from the host goes into the write-behind chunks, so this only
+	// ever holds a CBW
+	static const size_t MaxOutMessageSize = 512;
 	DMA_BUFFER (u8, m_OutBuffer, MaxOutMessageSize);
-	DMA_BUFFER (u8, m_InBuffer, MaxInMessageSize);
+
+	u8 *m_InBuffer;		// DMA buffers of m_nMaxMessageSize bytes
+	u8 *m_ReadAheadBuffer;
+	u8 *m_pDataInBuffer[2];
 
 	u32 m_nblock_address;
 	u32 m_nnumber_blocks;
-	u32 m_nnumber_blocks_chunk;
 	u64 m_nDeviceBlocks=0;
-	u32 m_currentDevicePointer = 0;
 	u32 m_nbyteCount;
 	boolean m_MMSDReady=false;
 	boolean m_IsFullSpeed = 0;
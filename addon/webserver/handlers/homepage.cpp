@@ -4,7 +4,6 @@
 #include <mustache/mustache.hpp>
 #include <scsitbservice/scsitbservice.h>
 #include <circle/koptions.h>
-#include <vector>
 #include <string>
 #include <algorithm>
 #include <gitinfo/gitinfo.h>
@@ -42,41 +41,32 @@ THTTPStatus HomePageHandler::PopulateContext(kainjow::mustache::data& context,
 	std::string current_image = svc->GetCurrentCDName();
 	context.set("image_name", current_image);
 
-	std::vector<kainjow::mustache::data> all_links_vec;
-
-	for (const FileEntry* it = svc->begin(); it != svc->end(); ++it) {
-
-            std::string full_name(it->name);
-
-            //LOGDBG("Read directory index %s", full_name.c_str());
-
-            // Define the display name
-            size_t dot_pos = full_name.rfind('.');
-            std::string display_name;
-            if (dot_pos != std::string::npos) {
-                display_name = full_name.substr(0, dot_pos);
-            } else {
-                display_name = full_name;
-            }
-
-            std::string current = "";
-            std::string style = "";
-            if (full_name == current_image) {
-                current = " (Current)";
-                style = " style=\"font-weight:bold;border:2px solid #4CAF50;\"";
-            }
+	auto params = parse_query_params(pParams);
 
-            mustache::data link;
-            link.set("display_name", display_name);
-            link.set("file_name", full_name);
-            link.set("current", current);
-            link.set("style", style);
-            all_links_vec.push_back(link);
-        }
+	// The directory of the library we're looking at, only this one is read
+	std::string path;
+	auto path_it = params.find("path");
+	if (path_it != params.end())
+	    path = path_it->second;
+	while (!path.empty() && path.back() == '/')
+	    path.pop_back();
+
+	const TLibraryDirectory* dir = svc->GetLibrary()->GetDirectory(path.c_str());
+	if (!dir)
+	    return HTTPNotFound;
+
+	std::string path_prefix = path.empty() ? "" : path + "/";
+	context.set("path", "/" + path);
+	context.set("path_param", url_encode(path));
+	if (!path.empty()) {
+	    size_t slash = path.rfind('/');
+	    mustache::data parent;
+	    parent.set("parent_param", url_encode(slash == std::string::npos ? "" : path.substr(0, slash)));
+	    context.set("parent", parent);
+	}
 
         // Get the requested page number from parameters
         int page = 1;
-	auto params = parse_query_params(pParams);
 	auto it = params.find("page");
 	if (it != params.end()) {
 	    try {
@@ -90,21 +80,18 @@ THTTPStatus HomePageHandler::PopulateContext(kainjow::mustache::data& context,
 	}
 
         // Calculate total pages and ensure page is valid
-        int total_items = all_links_vec.size();
+        int total_items = dir->nEntries;
         int total_pages = (total_items + ITEMS_PER_PAGE - 1) / ITEMS_PER_PAGE;
         
         if (total_pages == 0) total_pages = 1;
         if (page > total_pages) page = total_pages;
         
-        // Find page with current image
+        // Find page with current image, if it's in this directory
         int current_image_page = 0;
-        for (size_t i = 0; i < all_links_vec.size(); i++) {
-            auto link = all_links_vec[i];
-            const auto* file_name_ptr = link.get("file_name");
-            if (file_name_ptr && file_name_ptr->string_value() == current_image) {
-                current_image_page = (i / ITEMS_PER_PAGE) + 1;
-                break;
-            }
+        if (current_image.compare(0, path_prefix.size(), path_prefix) == 0) {
+            int index = CImageLibrary::Find(dir, current_image.c_str() + path_prefix.size());
+            if (index >= 0)
+                current_image_page = (index / ITEMS_PER_PAGE) + 1;
         }
         
         // If no page specified and we found current image, go to that page
@@ -117,15 +104,45 @@ THTTPStatus HomePageHandler::PopulateContext(kainjow::mustache::data& context,
 	    }
 	}
         
-        // Get subset of links for current page
+        // Only the entries of the current page are looked at
         int start_idx = (page - 1) * ITEMS_PER_PAGE;
         int end_idx = start_idx + ITEMS_PER_PAGE;
         if (end_idx > total_items) end_idx = total_items;
         
-        // Create list of current page links
         mustache::data links{mustache::data::type::list};
         for (int i = start_idx; i < end_idx; i++) {
-            links.push_back(all_links_vec[i]);
+            const TLibraryEntry* entry = &dir->pEntries[i];
+            std::string full_name = path_prefix + entry->pName;
+
+            mustache::data link;
+            if (entry->nFormat == ImageFormatDirectory) {
+                link.set("display_name", std::string(entry->pName) + "/");
+                link.set("href", "/?path=" + url_encode(full_name));
+                link.set("current", "");
+                link.set("style", "");
+                links.push_back(link);
+                continue;
+            }
+
+            // Define the display name
+            std::string display_name(entry->pName);
+            size_t dot_pos = display_name.rfind('.');
+            if (dot_pos != std::string::npos) {
+                display_name = display_name.substr(0, dot_pos);
+            }
+
+            std::string current = "";
+            std::string style = "";
+            if (full_name == current_image) {
+                current = " (Current)";
+                style = " style=\"font-weight:bold;border:2px solid #4CAF50;\"";
+            }
+
+            link.set("display_name", display_name);
+            link.set("href", "/mount?file=" + url_encode(full_name));
+            link.set("current", current);
+            link.set("style", style);
+            links.push_back(link);
         }
         context.set("links", links);
         
@@ -24,8 +24,59 @@ THTTPStatus ListAPIHandler::GetJson(nlohmann::json& j,
             return HTTPInternalServerError;
     }
 
-    for (const FileEntry* it = svc->begin(); it != svc->end(); ++it) {
-	    j["names"].push_back(it->name);
+    auto params = parse_query_params(pParams);
+
+    // One directory of the library, "" is the top. Large ones can be
+    // fetched a slice at a time with offset and limit
+    std::string path = params.count("path") ? params["path"] : "";
+    while (!path.empty() && path.back() == '/')
+	    path.pop_back();
+
+    unsigned offset = 0;
+    unsigned limit = ~0U;
+    try {
+	    if (params.count("offset"))
+		    offset = std::stoul(params["offset"]);
+	    if (params.count("limit"))
+		    limit = std::stoul(params["limit"]);
+    } catch (const std::exception&) {
+	    return HTTPBadRequest;
+    }
+
+    const TLibraryDirectory* dir = svc->GetLibrary()->GetDirectory(path.c_str());
+    if (!dir)
+	    return HTTPNotFound;
+
+    j["path"] = path;
+    j["total"] = dir->nEntries;
+    j["offset"] = offset;
+    j["dirs"] = nlohmann::json::array();
+    j["names"] = nlohmann::json::array();
+    j["images"] = nlohmann::json::array();
+
+    for (unsigned i = offset; i < dir->nEntries && i - offset < limit; i++) {
+	    const TLibraryEntry* entry = &dir->pEntries[i];
+	    if (entry->nFormat == ImageFormatDirectory) {
+		    j["dirs"].push_back(entry->pName);
+		    continue;
+	    }
+
+	    j["names"].push_back(entry->pName);
+
+	    nlohmann::json image;
+	    image["name"] = entry->pName;
+	    image["size"] = entry->nSize;
+	    image["format"] = entry->nFormat;
+
+	    // Images in the top directory are in the catalog too, which
+	    // knows their tracks and label once it has probed them
+	    int index = path.empty() ? svc->FindByName(entry->pName) : -1;
+	    const FileEntry* catalog = index >= 0 ? svc->GetFileEntry(index) : nullptr;
+	    if (catalog != nullptr && catalog->probed) {
+		    image["tracks"] = catalog->tracks;
+		    image["label"] = catalog->label;
+	    }
+	    j["images"].push_back(image);
     }
 
     return HTTPOK;
@@ -0,0 +1,53 @@
+#include <circle/logger.h>
+#include <circle/util.h>
+#include <circle/net/httpdaemon.h>
+#include <json/json.hpp>
+#include <scsistats/scsistats.h>
+#include <string>
+#include <cstring>
+#include <map>
+#include "scsistatsapi.h"
+#include "util.h"
+
+LOGMODULE("scsistatsapi");
+
+// Per opcode SCSI command counters of the active gadget. Times are in
+// CTimer clock ticks (microseconds). Add reset=1 to clear them afterwards
+THTTPStatus SCSIStatsAPIHandler::GetJson(nlohmann::json& j,
+                const char *pPath,
+                const char *pParams,
+                const char *pFormData,
+                CPropertiesFatFsFile *m_pProperties)
+{
+    auto params = parse_query_params(pParams);
+
+    // Too big for the stack of the web server task
+    TSCSICommandStats *pStats = new TSCSICommandStats[SCSIStats::MaxOpCodes];
+    boolean bReset = params.count("reset") && params["reset"] == "1";
+    SCSIStats::Get().GetSnapshot(pStats, bReset);
+
+    j["gadget"] = SCSIStats::Get().GetGadget();
+    j["commands"] = nlohmann::json::array();
+
+    for (unsigned i = 0; i < SCSIStats::MaxOpCodes; i++) {
+	    const TSCSICommandStats &stats = pStats[i];
+	    if (stats.nCount == 0)
+		    continue;
+
+	    char opcode[8];
+	    snprintf(opcode, sizeof(opcode), "0x%02x", i);
+
+	    j["commands"].push_back({
+		    {"opcode", opcode},
+		    {"count", stats.nCount},
+		    {"total_ticks", stats.nTotalTicks},
+		    {"max_ticks", stats.nMaxTicks},
+		    {"avg_ticks", stats.nTotalTicks / stats.nCount},
+		    {"bytes", stats.nBytes}
+	    });
+    }
+
+    delete[] pStats;
+    return HTTPOK;
+
+}
@@ -0,0 +1,14 @@
+#ifndef SCSISTATSAPI_HANDLER_H
+#define SCSISTATSAPI_HANDLER_H
+
+#include "apihandlerbase.h"
+
+class SCSIStatsAPIHandler : public APIHandlerBase {
+public:
+   THTTPStatus GetJson(nlohmann::json& j,
+		const char *pPath,
+		const char *pParams,
+		const char *pFormData,
+		CPropertiesFatFsFile *m_pProperties);
+};
+#endif
@@ -20,6 +20,7 @@
 #include "handlers/listapi.h"
 #include "handlers/shutdownapi.h"
 #include "handlers/imagenameapi.h"
+#include "handlers/scsistatsapi.h"
 
 // instances of your page handlers
 static HomePageHandler s_homePageHandler;
@@ -35,6 +36,7 @@ static MountAPIHandler s_mountAPIHandler;
 static ListAPIHandler s_listAPIHandler;
 static ShutdownAPIHandler s_shutdownAPIHandler;
 static ImageNameAPIHandler s_imageNameAPIHandler;
+static SCSIStatsAPIHandler s_scsiStatsAPIHandler;
 
 // routes for your handlers
 static const std::map<std::string, IPageHandler*> g_pageHandlers = {
@@ -53,6 +55,7 @@ static const std::map<std::string, IPageHandler*> g_pageHandlers = {
     { "/api/shutdown", &s_shutdownAPIHandler },
     { "/api/reboot", &s_shutdownAPIHandler },
     { "/api/imagename", &s_imageNameAPIHandler },
+    { "/api/scsistats", &s_scsiStatsAPIHandler },
 };
 
 IPageHandler* PageHandlerRegistry::getHandler(const char* path) {
@@ -4,29 +4,32 @@
 "                <div class=\"info-box\">\n"
 "                    <p>Current File Loaded: <strong>{{image_name}}</strong></p>\n"
 "                </div>\n"
-"                <h4>Available Files</h4>\n"
+"                <h4>Available Files in {{path}}</h4>\n"
+"                {{#parent}}\n"
+"                <div class=\"file-link file-link-even\"><a href=\"/?path={{parent_param}}\">..</a></div>\n"
+"                {{/parent}}\n"
 "                {{#links}}\n"
-"                <div class=\"file-link file-link-even\"{{{style}}}><a href=\"/mount?file={{file_name}}\">{{display_name}}{{current}}</a></div>\n"
+"                <div class=\"file-link file-link-even\"{{{style}}}><a href=\"{{href}}\">{{display_name}}{{current}}</a></div>\n"
 "                {{/links}}\n"
 "        \n"
 "\t\t{{#pagination}}\n"
 "\t\t<div class=\"pagination\">\n"
 "\t\t    {{#has_first}}\n"
-"\t\t    <a href=\"/?page=1\">1</a>\n"
+"\t\t    <a href=\"/?path={{path_param}}&amp;page=1\">1</a>\n"
 "\t\t    {{/has_first}}\n"
 "\t\t    \n"
 "\t\t    {{#has_prev}}\n"
-"\t\t    <a href=\"/?page={{prev_page}}\">{{prev_page}}</a>\n"
+"\t\t    <a href=\"/?path={{path_param}}&amp;page={{prev_page}}\">{{prev_page}}</a>\n"
 "\t\t    {{/has_prev}}\n"
 "\t\t    \n"
 "\t\t    <span class=\"current\">{{current_page}}</span>\n"
 "\t\t    \n"
 "\t\t    {{#has_next}}\n"
-"\t\t    <a href=\"/?page={{next_page}}\">{{next_page}}</a>\n"
+"\t\t    <a href=\"/?path={{path_param}}&amp;page={{next_page}}\">{{next_page}}</a>\n"
 "\t\t    {{/has_next}}\n"
 "\t\t    \n"
 "\t\t    {{#has_last}}\n"
-"\t\t    <a href=\"/?page={{last_page}}\">{{last_page}}</a>\n"
+"\t\t    <a href=\"/?path={{path_param}}&amp;page={{last_page}}\">{{last_page}}</a>\n"
 "\t\t    {{/has_last}}\n"
 "\t\t</div>\n"
 "\t\t{{/pagination}}\n"
@@ -20,6 +20,23 @@ std::string url_decode(const std::string& str) {
     return result;
 }
 
+// For file names and paths in links. Slashes are kept, so paths stay readable
+std::string url_encode(const std::string& str) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string result;
+    for (unsigned char c : str) {
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+            c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+            result += c;
+        } else {
+            result += '%';
+            result += hex[c >> 4];
+            result += hex[c & 0xF];
+        }
+    }
+    return result;
+}
+
 std::map<std::string, std::string> parse_query_params(const char* pParams) {
     std::map<std::string, std::string> params;
     if (pParams == nullptr) return params;
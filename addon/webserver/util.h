@@ -5,6 +5,7 @@
 #include <map>
 
 std::string url_decode(const std::string& str);
+std::string url_encode(const std::string& str);
 std::map<std::string, std::string> parse_query_params(const char* pParams);
 
 #endif // WS_UTIL_H
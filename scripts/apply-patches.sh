@@ -52,13 +52,9 @@ apply_patches_for_submodule() {
     
     cd "$submodule_path"
     
-    # Check if patches are already applied by looking for a marker file
+    # The marker only tells reset that something was applied. Each patch is
+    # checked on its own, so one added after the last run still gets applied
     local marker_file=".patches_applied"
-    if [ -f "$marker_file" ]; then
-        log_warn "Patches already applied for $submodule_name (marker file exists)"
-        cd "$PROJECT_ROOT"
-        return 0
-    fi
     
     # Apply each patch
     for patch_file in "${patch_files[@]}"; do
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+#
+# Decodes a SCSI trace written by USBODE (see the scsitrace option in
+# sdcard/config-options.txt) into one line per command, or CSV with --csv
+#
+# Usage: decode-scsitrace.py [--csv] scsitrace.bin
+#
+
+import argparse
+import struct
+import sys
+
+MAGIC = b"USBODETR"
+HEADER = struct.Struct("<8sHHI")
+RECORD = struct.Struct("<IIIIIBBBB")
+
+GADGETS = {0: "cd", 1: "msd"}
+STATUS = {0: "ok", 1: "fail", 2: "phase"}
+
+OPCODES = {
+    0x00: "TEST UNIT READY",
+    0x03: "REQUEST SENSE",
+    0x12: "INQUIRY",
+    0x1A: "MODE SENSE(6)",
+    0x1B: "START STOP UNIT",
+    0x1E: "PREVENT ALLOW MEDIUM REMOVAL",
+    0x23: "READ FORMAT CAPACITIES",
+    0x25: "READ CAPACITY",
+    0x28: "READ(10)",
+    0x2A: "WRITE(10)",
+    0x2B: "SEEK",
+    0x2F: "VERIFY(10)",
+    0x35: "SYNCHRONIZE CACHE",
+    0x42: "READ SUB-CHANNEL",
+    0x43: "READ TOC",
+    0x45: "PLAY AUDIO(10)",
+    0x46: "GET CONFIGURATION",
+    0x47: "PLAY AUDIO MSF",
+    0x4A: "GET EVENT STATUS NOTIFICATION",
+    0x4B: "PAUSE/RESUME",
+    0x4E: "STOP PLAY/SCAN",
+    0x51: "READ DISC INFORMATION",
+    0x52: "READ TRACK INFORMATION",
+    0x55: "MODE SELECT(10)",
+    0x5A: "MODE SENSE(10)",
+    0xA4: "REPORT KEY",
+    0xA5: "PLAY AUDIO(12)",
+    0xA8: "READ(12)",
+    0xAA: "WRITE(12)",
+    0xAC: "GET PERFORMANCE",
+    0xAD: "READ DISC STRUCTURE",
+    0xBB: "SET CD SPEED",
+    0xBE: "READ CD",
+    0xD0: "TOOLBOX LIST FILES",
+    0xD2: "TOOLBOX NUMBER OF FILES",
+    0xD7: "TOOLBOX LIST CDS",
+    0xD8: "TOOLBOX SET NEXT CD",
+    0xD9: "TOOLBOX LIST DEVICES",
+    0xDA: "TOOLBOX NUMBER OF CDS",
+}
+
+
+def records(f, record_size):
+    while True:
+        data = f.read(record_size)
+        if len(data) < record_size:
+            # The last record may be cut short if the Pi lost power
+            return
+        yield RECORD.unpack_from(data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a USBODE SCSI trace")
+    parser.add_argument("--csv", action="store_true", help="write CSV instead of text")
+    parser.add_argument("trace", help="trace file from the SD card")
+    args = parser.parse_args()
+
+    with open(args.trace, "rb") as f:
+        magic, version, record_size, ticks_per_second = HEADER.unpack(f.read(HEADER.size))
+        if magic != MAGIC:
+            sys.exit(f"{args.trace}: not a USBODE SCSI trace")
+        if version != 1 or record_size < RECORD.size:
+            sys.exit(f"{args.trace}: unsupported trace version {version}")
+
+        if args.csv:
+            print("time_us,gadget,opcode,command,lba,blocks,bytes,status,service_us")
+
+        # The timestamps are 32 bit clock ticks, so unwrap them
+        first = None
+        last = 0
+        wraps = 0
+        us_per_tick = 1000000.0 / ticks_per_second
+
+        for (timestamp, service, lba, blocks, nbytes,
+             opcode, status, gadget, _) in records(f, record_size):
+            if first is not None and timestamp < last:
+                wraps += 1
+            last = timestamp
+            ticks = timestamp + (wraps << 32)
+            if first is None:
+                first = ticks
+
+            time_us = (ticks - first) * us_per_tick
+            service_us = service * us_per_tick
+            name = OPCODES.get(opcode, "UNKNOWN")
+            gadget_name = GADGETS.get(gadget, str(gadget))
+            status_name = STATUS.get(status, str(status))
+
+            if args.csv:
+                print(f"{time_us:.0f},{gadget_name},0x{opcode:02x},{name},{lba},{blocks},"
+                      f"{nbytes},{status_name},{service_us:.0f}")
+            else:
+                print(f"{time_us / 1000000.0:12.6f} {gadget_name:3} {opcode:02x} {name:30} "
+                      f"lba={lba:<8} blocks={blocks:<5} bytes={nbytes:<7} "
+                      f"{status_name:5} {service_us:8.0f}us")
+
+
+if __name__ == "__main__":
+    main()
@@ -84,18 +84,13 @@ CKernel::CKernel(void)
       m_ScreenState(ScreenStateMain),
       m_nCurrentISOIndex(0),
       m_nTotalISOCount(0),
-      m_pISOList(nullptr) {
+      m_pImageCatalog(nullptr) {
+    m_ISOBrowsePath[0] = '\0';
     // m_ActLED.Blink(5);  // show we are alive
     //  m_CDGadget(&m_Interrupt),
 }
 
 CKernel::~CKernel(void) {
-    // Clean up ISO list if allocated
-    if (m_pISOList != nullptr) {
-        delete[] m_pISOList;
-        m_pISOList = nullptr;
-    }
-
     if (m_pButtonManager != nullptr) {
         delete m_pButtonManager;
         m_pButtonManager = nullptr;
@@ -222,23 +217,45 @@ TShutdownMode CKernel::Run(void) {
     		unsigned int volume = Properties.GetNumber("default_volume", 0xff);
 		if (volume > 0xff)
 			volume = 0xff;
-		CCDPlayer *player = new CCDPlayer(pSoundDevice);
+		// Sectors of audio read ahead of the DAC
+		unsigned nAudioBuffer = Properties.GetNumber("cd_audio_buffer", DEFAULT_RING_SECTORS);
+		CCDPlayer *player = new CCDPlayer(pSoundDevice, nAudioBuffer);
 		player->SetDefaultVolume((u8)volume);
 		LOGNOTE("Started the CD Player service. Default volume is %d", volume);
 	    }
 
 	    // Initialize USB CD Service
 	    // TODO get USB speed from Properties
-	    new CDROMService();
+	    // Blocks per USB transfer, with separate limits for each USB speed
+	    unsigned nMaxBlocks = m_Options.GetUSBFullSpeed()
+	    			? Properties.GetNumber("cd_max_blocks_fullspeed", 0)
+	    			: Properties.GetNumber("cd_max_blocks", 0);
+	    // Sectors kept ahead of a host that is reading sequentially
+	    unsigned nReadAheadBlocks = Properties.GetNumber("cd_readahead", 128);
+	    new CDROMService(nMaxBlocks, nReadAheadBlocks);
 	    LOGNOTE("Started CDROM service");
 
 	    // Load our SCSITB Service
-	    new SCSITBService(&Properties);
+	    // Directories of the image library kept in RAM while browsing
+	    unsigned nLibraryDirectories = Properties.GetNumber("image_dir_cache", CImageLibrary::DefaultMaxDirectories);
+	    new SCSITBService(&Properties, nLibraryDirectories);
 	    LOGNOTE("Started SCSITB service");
 
+	    // Binary trace of the SCSI commands. Only in CD mode, in mass
+	    // storage mode the host owns the SD card
+	    const char* scsitrace = Properties.GetString("scsitrace", nullptr);
+	    if (scsitrace) {
+		new CSCSITraceDaemon(scsitrace);
+		LOGNOTE("Started the SCSI trace service");
+	    }
+
     } else { // Mass Storage Device Mode
 	    // Start our SD Card Service
-	    new SDCARDService(&m_EMMC);
+	    // Blocks per USB transfer and transfers written behind the host
+	    unsigned nMaxBlocks = Properties.GetNumber("msd_max_blocks", 0);
+	    unsigned nWriteBehind = Properties.GetNumber("msd_write_behind",
+	    				CUSBMMSDGadget::DefaultWriteBehindChunks);
+	    new SDCARDService(&m_EMMC, nMaxBlocks, nWriteBehind);
 	    LOGNOTE("Started SDCARD Service");
     }
 
@@ -726,10 +743,14 @@ void CKernel::ButtonEventHandler(unsigned nButtonIndex, boolean bPressed, void*
                             pKernel->ShowISOSelectionScreen();
                         }
                     } else if (nButtonIndex == 5) {  // KEY1 button - load selected ISO
+                        // A directory is opened instead
+                        if (pKernel->EnterSelectedISODirectory())
+                            break;
+
                         // Show loading message
                         if (pKernel->m_pDisplayManager != nullptr) {
                             const char* selectedFile =
-                                (pKernel->m_nTotalISOCount > 0 && pKernel->m_pISOList != nullptr) ? (const char*)pKernel->m_pISOList[pKernel->m_nCurrentISOIndex] : "Unknown";
+                                pKernel->GetISOName(pKernel->m_nCurrentISOIndex);
 
                             pKernel->m_pDisplayManager->ShowStatusScreen(
                                 "Please Wait",
@@ -757,10 +778,14 @@ void CKernel::ButtonEventHandler(unsigned nButtonIndex, boolean bPressed, void*
                     }
                     // Add handling for center joystick button (usually button 4 or 8) to select an ISO:
                     else if (nButtonIndex == 4 || nButtonIndex == 8) {  // JOYSTICK_PRESS button - load selected ISO
+                        // A directory is opened instead
+                        if (pKernel->EnterSelectedISODirectory())
+                            break;
+
                         // Show loading message
                         if (pKernel->m_pDisplayManager != nullptr) {
                             const char* selectedFile =
-                                (pKernel->m_nTotalISOCount > 0 && pKernel->m_pISOList != nullptr) ? (const char*)pKernel->m_pISOList[pKernel->m_nCurrentISOIndex] : "Unknown";
+                                pKernel->GetISOName(pKernel->m_nCurrentISOIndex);
 
                             pKernel->m_pDisplayManager->ShowStatusScreen(
                                 "Please Wait",
@@ -912,9 +937,13 @@ void CKernel::ButtonEventHandler(unsigned nButtonIndex, boolean bPressed, void*
                         pKernel->UpdateDisplayStatus(currentImage);
                     } else if (nButtonIndex == 3) {
                         // Button Y (Select) - load selected ISO
+                        // A directory is opened instead
+                        if (pKernel->EnterSelectedISODirectory())
+                            break;
+
                         // Show loading message
                         const char* selectedFile =
-                            (pKernel->m_nTotalISOCount > 0 && pKernel->m_pISOList != nullptr) ? (const char*)pKernel->m_pISOList[pKernel->m_nCurrentISOIndex] : "Unknown";
+                            pKernel->GetISOName(pKernel->m_nCurrentISOIndex);
 
                         pKernel->m_pDisplayManager->ShowStatusScreen(
                             "Please Wait",
@@ -1023,112 +1052,111 @@ void CKernel::InitializeButtons(TDisplayType displayType) {
 }
 
 void CKernel::ScanForISOFiles(void) {
-    // Show loading indicator immediately before starting the operation
-    if (m_pDisplayManager != nullptr) {
-        m_pDisplayManager->ShowStatusScreen(
-            "Please Wait",
-            "Scanning for ISOs...",
-            "This may take a moment",
-            m_Options.GetUSBFullSpeed() ? "USB1.1" : "USB2.0");  // Add USB speed parameter
-
-        // Ensure the display is updated immediately
-        m_pDisplayManager->Refresh();
+    // The list comes from the image library, which the web UI uses too.
+    // Directories are only read when they are opened
+    if (m_pImageCatalog == nullptr) {
+        m_pImageCatalog = static_cast<SCSITBService*>(CScheduler::Get()->GetTask("scsitbservice"));
+        if (m_pImageCatalog == nullptr) {
+            LOGERR("Couldn't fetch SCSITB Service");
+            m_nTotalISOCount = 0;
+            m_nCurrentISOIndex = 0;
+            return;
+        }
     }
 
-    // Clean up previous list
-    if (m_pISOList != nullptr) {
-        delete[] m_pISOList;
-        m_pISOList = nullptr;
-    }
+    // Get current ISO from config just once
+    CPropertiesFatFsFile Properties(CONFIG_FILE, &m_FileSystem);
+    Properties.Load();
+    Properties.SelectSection("usbode");
+    const char* currentImage = Properties.GetString("current_image", "image.iso");
 
-    // Reset counters
+    // Start in the directory of the current image, with it selected
+    const char* pName = CImageLibrary::SplitPath(currentImage, m_ISOBrowsePath, sizeof(m_ISOBrowsePath));
+    ReadISODirectory(pName);
+
+    LOGNOTE("Found %u entries in /%s, current is %u (%s)",
+            m_nTotalISOCount,
+            m_ISOBrowsePath,
+            m_nCurrentISOIndex,
+            m_nTotalISOCount > 0 ? GetISOName(m_nCurrentISOIndex) : "none");
+}
+
+void CKernel::ReadISODirectory(const char* pSelect) {
     m_nTotalISOCount = 0;
     m_nCurrentISOIndex = 0;
+    if (m_pImageCatalog == nullptr)
+        return;
 
-    // Allocate with larger MAX_ISO_FILES value
-    m_pISOList = new CString[MAX_ISO_FILES];
-    if (m_pISOList == nullptr) {
-        LOGERR("Failed to allocate memory for ISO list");
+    CImageLibrary* pLibrary = m_pImageCatalog->GetLibrary();
+    const TLibraryDirectory* pDirectory = pLibrary->GetDirectory(m_ISOBrowsePath);
+    if (pDirectory == nullptr && m_ISOBrowsePath[0] != '\0') {
+        // Gone since, back to the top
+        m_ISOBrowsePath[0] = '\0';
+        pDirectory = pLibrary->GetDirectory("");
+    }
+    if (pDirectory == nullptr)
         return;
+
+    unsigned nParent = m_ISOBrowsePath[0] != '\0' ? 1 : 0;
+    m_nTotalISOCount = pDirectory->nEntries + nParent;
+
+    if (pSelect != nullptr) {
+        int nIndex = CImageLibrary::Find(pDirectory, pSelect);
+        if (nIndex >= 0)
+            m_nCurrentISOIndex = nIndex + nParent;
     }
+}
 
-    // Get current ISO from config just once
-    CPropertiesFatFsFile Properties(CONFIG_FILE, &m_FileSystem);
-    Properties.Load();
-    Properties.SelectSection("usbode");
-    const char* currentImage = Properties.GetString("current_image", "image.iso");
+const TLibraryEntry* CKernel::GetISOEntry(unsigned nIndex) {
+    unsigned nParent = m_ISOBrowsePath[0] != '\0' ? 1 : 0;
+    if (m_pImageCatalog == nullptr || nIndex < nParent)
+        return nullptr;
 
-    // First try to scan the images directory
-    DIR Directory;
-    FILINFO FileInfo;
-
-    FRESULT result = f_opendir(&Directory, IMAGES_DIR);
-    if (result == FR_OK) {
-        LOGNOTE("Scanning for ISO files in %s", IMAGES_DIR);
-
-        // Read all files in this directory
-        while (f_readdir(&Directory, &FileInfo) == FR_OK && FileInfo.fname[0] != 0) {
-            // Skip directories
-            if (FileInfo.fattrib & AM_DIR)
-                continue;
-
-            // Check for .iso, .cue, or .bin extensions
-            const char* Extension = FindLastOccurrence(FileInfo.fname, '.');
-            if (Extension == nullptr)
-                continue;
-
-            if (strcasecmp(Extension, ".iso") == 0 ||
-                strcasecmp(Extension, ".cue") == 0 ||
-                strcasecmp(Extension, ".bin") == 0) {
-                // Check if we have space left
-                if (m_nTotalISOCount >= MAX_ISO_FILES) {
-                    LOGWARN("Maximum ISO file count reached (%u)", MAX_ISO_FILES);
-                    break;
-                }
+    // Read again if it was dropped from the cache since
+    const TLibraryDirectory* pDirectory = m_pImageCatalog->GetLibrary()->GetDirectory(m_ISOBrowsePath);
+    if (pDirectory == nullptr || nIndex - nParent >= pDirectory->nEntries)
+        return nullptr;
 
-                // Add to our list
-                m_pISOList[m_nTotalISOCount] = FileInfo.fname;
+    return &pDirectory->pEntries[nIndex - nParent];
+}
 
-                // Check if this is the current image
-                if (strcasecmp(FileInfo.fname, currentImage) == 0) {
-                    m_nCurrentISOIndex = m_nTotalISOCount;
-                }
+const char* CKernel::GetISOName(unsigned nIndex) {
+    if (m_ISOBrowsePath[0] != '\0' && nIndex == 0)
+        return "..";
 
-                m_nTotalISOCount++;
-            }
-        }
+    const TLibraryEntry* pEntry = GetISOEntry(nIndex);
+    if (pEntry == nullptr)
+        return "Unknown";
 
-        f_closedir(&Directory);
-    }
+    // Directories are shown with a slash
+    snprintf(m_ISOName, sizeof(m_ISOName), pEntry->nFormat == ImageFormatDirectory ? "%s/" : "%s", pEntry->pName);
+    return m_ISOName;
+}
 
-    // Sort files alphabetically using a more efficient algorithm
-    for (unsigned i = 0; i < m_nTotalISOCount - 1; i++) {
-        unsigned minIndex = i;
+boolean CKernel::EnterSelectedISODirectory(void) {
+    char Path[MAX_IMAGE_PATH_LEN + 1];
 
-        for (unsigned j = i + 1; j < m_nTotalISOCount; j++) {
-            if (strcasecmp((const char*)m_pISOList[j], (const char*)m_pISOList[minIndex]) < 0) {
-                minIndex = j;
-            }
-        }
+    if (m_ISOBrowsePath[0] != '\0' && m_nCurrentISOIndex == 0) {
+        // Up a level, with the directory we came from selected
+        char Name[MAX_IMAGE_PATH_LEN + 1];
+        strcpy(Name, CImageLibrary::SplitPath(m_ISOBrowsePath, Path, sizeof(Path)));
+        strcpy(m_ISOBrowsePath, Path);
+        ReadISODirectory(Name);
+    } else {
+        const TLibraryEntry* pEntry = GetISOEntry(m_nCurrentISOIndex);
+        if (pEntry == nullptr || pEntry->nFormat != ImageFormatDirectory)
+            return FALSE;
 
-        if (minIndex != i) {
-            // Swap
-            CString Temp = m_pISOList[i];
-            m_pISOList[i] = m_pISOList[minIndex];
-            m_pISOList[minIndex] = Temp;
-
-            // Update current index if affected
-            if (m_nCurrentISOIndex == i)
-                m_nCurrentISOIndex = minIndex;
-            else if (m_nCurrentISOIndex == minIndex)
-                m_nCurrentISOIndex = i;
+        if (!CImageLibrary::JoinPath(m_ISOBrowsePath, pEntry->pName, Path, sizeof(Path))) {
+            LOGWARN("Path too long: %s/%s", m_ISOBrowsePath, pEntry->pName);
+            return TRUE;
         }
+        strcpy(m_ISOBrowsePath, Path);
+        ReadISODirectory(nullptr);
     }
 
-    LOGNOTE("Found %u ISO/CUE/BIN files, current is %u (%s)",
-            m_nTotalISOCount,
-            m_nCurrentISOIndex,
-            m_nTotalISOCount > 0 ? (const char*)m_pISOList[m_nCurrentISOIndex] : "none");
+    ShowISOSelectionScreen();
+    return TRUE;
 }
 
 void CKernel::ShowISOSelectionScreen(void) {
@@ -1151,7 +1179,7 @@ void CKernel::ShowISOSelectionScreen(void) {
             m_Options.GetUSBFullSpeed() ? "USB1.1" : "USB2.0");  // Add USB speed parameter
     } else {
         // Display current file in the selection
-        const char* selectedFile = (const char*)m_pISOList[m_nCurrentISOIndex];
+        const char* selectedFile = GetISOName(m_nCurrentISOIndex);
 
         // Pass both current and selected ISO
         m_pDisplayManager->ShowFileSelectionScreen(
@@ -1164,13 +1192,19 @@ void CKernel::ShowISOSelectionScreen(void) {
 
 void CKernel::LoadSelectedISO(void) {
     // Early validation checks...
-    if (m_nTotalISOCount == 0 || m_pISOList == nullptr) {
+    if (m_nTotalISOCount == 0 || m_pImageCatalog == nullptr) {
         LOGERR("No ISO files available");
         return;
     }
 
-    // Get the selected ISO filename
-    const char* SelectedISO = (const char*)m_pISOList[m_nCurrentISOIndex];
+    // Get the selected ISO, as a path from the top of the library
+    const TLibraryEntry* pEntry = GetISOEntry(m_nCurrentISOIndex);
+    char SelectedISO[MAX_IMAGE_PATH_LEN + 1];
+    if (pEntry == nullptr ||
+        !CImageLibrary::JoinPath(m_ISOBrowsePath, pEntry->pName, SelectedISO, sizeof(SelectedISO))) {
+        LOGERR("No ISO file selected");
+        return;
+    }
 
     // CRITICAL CHANGE: Don't construct the full path here,
     // just pass the filename to loadCueBinFileDevice
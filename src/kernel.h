@@ -42,6 +42,7 @@
 #include <discimage/cuebinfile.h>
 #include <fatfs/ff.h>
 #include <filelogdaemon/filelogdaemon.h>
+#include <scsitrace/scsitracedaemon.h>
 #include <cdplayer/cdplayer.h>
 #include <wlan/bcm4343.h>
 #include <wlan/hostap/wpa_supplicant/wpasupplicant.h>
@@ -147,14 +148,20 @@ private:
 	
 	TScreenState m_ScreenState;
 	
-	// ISO file browsing
+	// ISO file browsing, a directory of the image library at a time. The
+	// first entry is ".." below the top directory
 	unsigned m_nCurrentISOIndex;
 	unsigned m_nTotalISOCount;
-	CString *m_pISOList;
-	static const unsigned MAX_ISO_FILES = 500;
+	SCSITBService *m_pImageCatalog;
+	char m_ISOBrowsePath[MAX_IMAGE_PATH_LEN + 1];
+	char m_ISOName[MAX_IMAGE_PATH_LEN + 2];
 	
 	// Helper methods for ISO file management
 	void ScanForISOFiles(void);
+	void ReadISODirectory(const char* pSelect);
+	const TLibraryEntry* GetISOEntry(unsigned nIndex);
+	const char* GetISOName(unsigned nIndex);
+	boolean EnterSelectedISODirectory(void);
 	void ShowISOSelectionScreen(void);
 	void LoadSelectedISO(void);
 
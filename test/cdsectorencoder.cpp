@@ -0,0 +1,208 @@
+//
+// Checks CCDSectorEncoder against ECMA-130 Annex A on the host
+//
+// The reference below is written straight from the standard, with its own
+// GF(2^8) log tables and a bit at a time CRC, so it shares no tables or
+// loop structure with the encoder. With "bench" as the argument it also
+// times both.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <discimage/cdsectorencoder.h>
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RANDOM_SECTORS  2000
+#define BENCH_SECTORS   2000
+
+// The P and Q codes work on 1170 16 bit words from the header on, the
+// high and low bytes of each word as two separate planes
+#define WORDS_START     12
+#define P_WORDS         1032    // header, user data, EDC and zero bytes
+#define Q_WORDS         1118    // and the P parity
+
+static u8 s_Exp[512];
+static u8 s_Log[256];
+
+static void InitGF(void) {
+    unsigned x = 1;
+    for (unsigned i = 0; i < 255; i++) {
+        s_Exp[i] = s_Exp[i + 255] = x;
+        s_Log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11D;  // x^8 + x^4 + x^3 + x^2 + 1
+    }
+}
+
+static u8 Mul(u8 a, u8 b) {
+    return a && b ? s_Exp[s_Log[a] + s_Log[b]] : 0;
+}
+
+static u8 Div(u8 a, u8 b) {
+    return a ? s_Exp[s_Log[a] + 255 - s_Log[b]] : 0;
+}
+
+// A codeword of nData bytes plus two parity bytes V0 and V1 satisfies
+// sum(V) = 0 and sum(alpha^(n-1-i) * V[i]) = 0. With S0 and S1 those sums
+// over the data, V0 = (S0 + S1) / (alpha + 1) and V1 = S0 + V0
+static void Parity(const u8* pData, unsigned nData, u8* pV0, u8* pV1) {
+    u8 s0 = 0, s1 = 0;
+    for (unsigned i = 0; i < nData; i++) {
+        s0 ^= pData[i];
+        s1 ^= Mul(s_Exp[nData + 1 - i], pData[i]);
+    }
+    *pV0 = Div(s0 ^ s1, 3);  // alpha + 1 = 3
+    *pV1 = s0 ^ *pV0;
+}
+
+static u8* Word(u8* pSector, unsigned nWord, unsigned nPlane) {
+    return pSector + WORDS_START + nWord * 2 + nPlane;
+}
+
+static void ReferenceEncode(u8* pSector, u32 lba) {
+    static const u8 Sync[12] = {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                                0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+    memcpy(pSector, Sync, sizeof(Sync));
+
+    // Minute, second and frame in BCD, counted from the start of the pregap
+    u32 address = lba + 150;
+    u32 msf[3] = {address / 4500, address / 75 % 60, address % 75};
+    for (unsigned i = 0; i < 3; i++)
+        pSector[12 + i] = (msf[i] / 10) << 4 | msf[i] % 10;
+    pSector[15] = 1;
+
+    // (x^16 + x^15 + x^2 + 1)(x^16 + x^2 + x + 1), least significant bit
+    // first, stored least significant byte first
+    u32 edc = 0;
+    for (unsigned i = 0; i < 2064; i++) {
+        edc ^= pSector[i];
+        for (unsigned bit = 0; bit < 8; bit++)
+            edc = edc & 1 ? (edc >> 1) ^ 0xD8018001 : edc >> 1;
+    }
+    for (unsigned i = 0; i < 4; i++)
+        pSector[2064 + i] = edc >> (i * 8);
+    memset(pSector + 2068, 0, 8);
+
+    // P: 43 columns of 24 words, word 43 * M + N for column N. The parity
+    // words go at 1032 + N and 1075 + N
+    for (unsigned plane = 0; plane < 2; plane++) {
+        for (unsigned n = 0; n < 43; n++) {
+            u8 column[24];
+            for (unsigned m = 0; m < 24; m++)
+                column[m] = *Word(pSector, 43 * m + n, plane);
+            Parity(column, 24, Word(pSector, P_WORDS + n, plane),
+                   Word(pSector, P_WORDS + 43 + n, plane));
+        }
+    }
+
+    // Q: 26 diagonals of 43 words, word (44 * M + 43 * N) mod 1118 for
+    // diagonal N. The parity words go at 1118 + N and 1144 + N
+    for (unsigned plane = 0; plane < 2; plane++) {
+        for (unsigned n = 0; n < 26; n++) {
+            u8 diagonal[43];
+            for (unsigned m = 0; m < 43; m++)
+                diagonal[m] = *Word(pSector, (44 * m + 43 * n) % Q_WORDS, plane);
+            Parity(diagonal, 43, Word(pSector, Q_WORDS + n, plane),
+                   Word(pSector, Q_WORDS + 26 + n, plane));
+        }
+    }
+}
+
+static void FillUserData(u8* pSector) {
+    for (unsigned i = 0; i < 2048; i++)
+        pSector[CCDSectorEncoder::UserDataOffset + i] = (u8)rand();
+}
+
+static unsigned Check(const CCDSectorEncoder& encoder) {
+    u8 expected[CCDSectorEncoder::SectorSize];
+    u8 actual[CCDSectorEncoder::SectorSize];
+    unsigned nFailures = 0;
+
+    for (unsigned i = 0; i < RANDOM_SECTORS + 2; i++) {
+        // All zero and all 0xff user data first, then random
+        memset(expected, 0x5A, sizeof(expected));
+        if (i < 2)
+            memset(expected + CCDSectorEncoder::UserDataOffset, i ? 0xFF : 0x00, 2048);
+        else
+            FillUserData(expected);
+        u32 lba = i < 2 ? 0 : (u32)rand() % (80 * 60 * 75);
+        memcpy(actual, expected, sizeof(actual));
+
+        // Without EDC/ECC only the sync and header are written
+        u8 partial[CCDSectorEncoder::SectorSize];
+        memcpy(partial, expected, sizeof(partial));
+        encoder.EncodeMode1(partial, lba, FALSE);
+
+        ReferenceEncode(expected, lba);
+        encoder.EncodeMode1(actual, lba, TRUE);
+
+        if (memcmp(expected, actual, sizeof(actual)) != 0) {
+            if (nFailures++ < 5)
+                printf("sector %u, LBA %u: EncodeMode1() differs\n", i, lba);
+            continue;
+        }
+        if (memcmp(partial, expected, 2064) != 0 || memcmp(partial + 2064, "\x5A\x5A\x5A\x5A", 4) != 0) {
+            if (nFailures++ < 5)
+                printf("sector %u, LBA %u: EncodeMode1() without EDC/ECC differs\n", i, lba);
+            continue;
+        }
+
+        // GenerateECC() only redoes the parity
+        memset(actual + 0x81C, 0, CCDSectorEncoder::SectorSize - 0x81C);
+        encoder.GenerateECC(actual);
+        if (memcmp(expected, actual, sizeof(actual)) != 0 && nFailures++ < 5)
+            printf("sector %u, LBA %u: GenerateECC() differs\n", i, lba);
+    }
+
+    return nFailures;
+}
+
+static void Bench(const CCDSectorEncoder& encoder) {
+    static u8 sectors[BENCH_SECTORS][CCDSectorEncoder::SectorSize];
+    for (unsigned i = 0; i < BENCH_SECTORS; i++)
+        FillUserData(sectors[i]);
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < BENCH_SECTORS; i++)
+        ReferenceEncode(sectors[i], i);
+    std::chrono::duration<double> reference = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < BENCH_SECTORS; i++)
+        encoder.EncodeMode1(sectors[i], i, TRUE);
+    std::chrono::duration<double> encode = std::chrono::steady_clock::now() - start;
+
+    printf("reference  %8.2f us/sector\n", reference.count() * 1e6 / BENCH_SECTORS);
+    printf("encoder    %8.2f us/sector\n", encode.count() * 1e6 / BENCH_SECTORS);
+}
+
+int main(int argc, char** argv) {
+    InitGF();
+    CCDSectorEncoder encoder;
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        Bench(encoder);
+        return 0;
+    }
+
+    unsigned nFailures = Check(encoder);
+    printf("sector encoder (AARCH %d) %s\n", AARCH, nFailures ? "FAILED" : "ok");
+    return nFailures ? 1 : 0;
+}
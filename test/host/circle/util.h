@@ -0,0 +1,10 @@
+//
+// Host stand-in for Circle's <circle/util.h>, the C library has the rest
+//
+#ifndef _circle_util_h
+#define _circle_util_h
+
+#include <circle/types.h>
+#include <string.h>
+
+#endif
@@ -0,0 +1,132 @@
+//
+// Host stand-in for <arm_neon.h>, so the AARCH == 64 paths can be checked
+// on a machine without NEON. Only the intrinsics the tree uses are here,
+// written lane by lane. It says nothing about their speed
+//
+#ifndef _arm_neon_h
+#define _arm_neon_h
+
+#include <stdint.h>
+
+struct uint8x16_t { uint8_t v[16]; };
+struct int8x16_t { int8_t v[16]; };
+struct int16x4_t { int16_t v[4]; };
+struct int16x8_t { int16_t v[8]; };
+struct int32x4_t { int32_t v[4]; };
+
+static inline uint8x16_t vdupq_n_u8(uint8_t x) {
+    uint8x16_t r;
+    for (int i = 0; i < 16; i++)
+        r.v[i] = x;
+    return r;
+}
+
+static inline uint8x16_t vld1q_u8(const uint8_t* p) {
+    uint8x16_t r;
+    for (int i = 0; i < 16; i++)
+        r.v[i] = p[i];
+    return r;
+}
+
+static inline void vst1q_u8(uint8_t* p, uint8x16_t a) {
+    for (int i = 0; i < 16; i++)
+        p[i] = a.v[i];
+}
+
+static inline uint8x16_t veorq_u8(uint8x16_t a, uint8x16_t b) {
+    for (int i = 0; i < 16; i++)
+        a.v[i] ^= b.v[i];
+    return a;
+}
+
+static inline uint8x16_t vandq_u8(uint8x16_t a, uint8x16_t b) {
+    for (int i = 0; i < 16; i++)
+        a.v[i] &= b.v[i];
+    return a;
+}
+
+static inline uint8x16_t vshlq_n_u8(uint8x16_t a, int n) {
+    for (int i = 0; i < 16; i++)
+        a.v[i] = (uint8_t)(a.v[i] << n);
+    return a;
+}
+
+// Arithmetic shift, the sign bit is copied in
+static inline int8x16_t vshrq_n_s8(int8x16_t a, int n) {
+    for (int i = 0; i < 16; i++)
+        a.v[i] = (int8_t)(a.v[i] >> n);
+    return a;
+}
+
+static inline int8x16_t vreinterpretq_s8_u8(uint8x16_t a) {
+    int8x16_t r;
+    for (int i = 0; i < 16; i++)
+        r.v[i] = (int8_t)a.v[i];
+    return r;
+}
+
+static inline uint8x16_t vreinterpretq_u8_s8(int8x16_t a) {
+    uint8x16_t r;
+    for (int i = 0; i < 16; i++)
+        r.v[i] = (uint8_t)a.v[i];
+    return r;
+}
+
+static inline int16x4_t vld1_s16(const int16_t* p) {
+    int16x4_t r;
+    for (int i = 0; i < 4; i++)
+        r.v[i] = p[i];
+    return r;
+}
+
+static inline int16x8_t vld1q_s16(const int16_t* p) {
+    int16x8_t r;
+    for (int i = 0; i < 8; i++)
+        r.v[i] = p[i];
+    return r;
+}
+
+static inline void vst1q_s16(int16_t* p, int16x8_t a) {
+    for (int i = 0; i < 8; i++)
+        p[i] = a.v[i];
+}
+
+static inline int16x4_t vget_low_s16(int16x8_t a) {
+    int16x4_t r;
+    for (int i = 0; i < 4; i++)
+        r.v[i] = a.v[i];
+    return r;
+}
+
+static inline int16x4_t vget_high_s16(int16x8_t a) {
+    int16x4_t r;
+    for (int i = 0; i < 4; i++)
+        r.v[i] = a.v[i + 4];
+    return r;
+}
+
+static inline int16x8_t vcombine_s16(int16x4_t a, int16x4_t b) {
+    int16x8_t r;
+    for (int i = 0; i < 4; i++) {
+        r.v[i] = a.v[i];
+        r.v[i + 4] = b.v[i];
+    }
+    return r;
+}
+
+static inline int32x4_t vmull_s16(int16x4_t a, int16x4_t b) {
+    int32x4_t r;
+    for (int i = 0; i < 4; i++)
+        r.v[i] = (int32_t)a.v[i] * b.v[i];
+    return r;
+}
+
+// Shift right and keep the low half of each lane
+static inline int16x4_t vshrn_n_s32(int32x4_t a, int n) {
+    int16x4_t r;
+    for (int i = 0; i < 4; i++)
+        r.v[i] = (int16_t)(a.v[i] >> n);
+    return r;
+}
+
+#endif
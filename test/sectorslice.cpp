@@ -0,0 +1,122 @@
+//
+// Checks the DataIn paths of CUSBCDGadget::FillDataInBuffer() on the host
+//
+// Synthetic MODE1/2048, MODE1/2352, MODE2/2352 and AUDIO images are read
+// the way the gadget reads them, with the block size, skip and transfer
+// size the READ(10) and READ CD handlers pick for each sector type. The
+// result of the pass-through and strided paths must match the bytes taken
+// one at a time from the image at the expected offsets.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <usbcdgadget/sectorslice.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#define IMAGE_BLOCKS    200
+#define MAX_BATCH       32      // blocks per FillDataInBuffer() call
+#define GUARD           64      // bytes after the batch that must stay put
+#define GUARD_BYTE      0xA5
+
+struct TReadCase {
+    const char* pName;
+    u32 nBlockSize;     // block_size, as stored in the image
+    u32 nSkip;          // skip_bytes
+    u32 nTransferSize;  // transfer_block_size, as sent to the host
+};
+
+// What HandleSCSICommand() sets up for these images. The 2048 -> 2352
+// synthesis case goes through CCDSectorEncoder and is checked separately
+static const TReadCase s_Cases[] = {
+    {"MODE1/2048 READ(10)", 2048, 0, 2048},
+    {"MODE1/2352 READ(10)", 2352, 16, 2048},
+    {"MODE1/2352 READ CD raw", 2352, 0, 2352},
+    {"MODE1/2352 READ CD header+data", 2352, 12, 2052},
+    {"MODE1/2352 READ CD data+EDC/ECC", 2352, 16, 2336},
+    {"MODE2/2352 READ(10)", 2352, 24, 2048},
+    {"MODE2/2352 READ CD formless", 2352, 16, 2336},
+    {"MODE2/2352 READ CD form 2", 2352, 24, 2048},
+    {"AUDIO READ CD", 2352, 0, 2352},
+};
+
+// Every byte depends on its block and offset, so a slice from the wrong
+// place can't match by accident
+static std::vector<u8> MakeImage(u32 nBlockSize) {
+    std::vector<u8> image(IMAGE_BLOCKS * nBlockSize);
+    for (u32 block = 0; block < IMAGE_BLOCKS; block++)
+        for (u32 i = 0; i < nBlockSize; i++)
+            image[block * nBlockSize + i] = (u8)(block * 131 + i * 7 + (i >> 8));
+    return image;
+}
+
+// FillDataInBuffer() for one batch, with the image standing in for the
+// read-ahead cache
+static void ReadBatch(const std::vector<u8>& image, const TReadCase& c, u32 nLBA,
+                      u32 nBlocks, u8* pFileChunk, u8* pBuffer) {
+    boolean bPassThrough = c.nSkip == 0 && c.nTransferSize == c.nBlockSize;
+    u8* pReadBuffer = bPassThrough ? pBuffer : pFileChunk;
+    memcpy(pReadBuffer, &image[nLBA * c.nBlockSize], nBlocks * c.nBlockSize);
+
+    if (!bPassThrough)
+        CopySectorSlices(pBuffer, pFileChunk, nBlocks, c.nBlockSize, c.nSkip, c.nTransferSize);
+}
+
+static int CheckCase(const TReadCase& c) {
+    std::vector<u8> image = MakeImage(c.nBlockSize);
+    std::vector<u8> fileChunk(MAX_BATCH * c.nBlockSize);
+    std::vector<u8> buffer(MAX_BATCH * c.nTransferSize + GUARD);
+
+    unsigned nFailures = 0;
+    for (u32 nBlocks = 1; nBlocks <= MAX_BATCH; nBlocks++) {
+        for (u32 nLBA = 0; nLBA + nBlocks <= IMAGE_BLOCKS; nLBA += 7) {
+            memset(&buffer[0], GUARD_BYTE, buffer.size());
+            ReadBatch(image, c, nLBA, nBlocks, &fileChunk[0], &buffer[0]);
+
+            u32 nLength = nBlocks * c.nTransferSize;
+            for (u32 i = 0; i < nLength; i++) {
+                u32 block = nLBA + i / c.nTransferSize;
+                u32 offset = c.nSkip + i % c.nTransferSize;
+                if (buffer[i] != image[block * c.nBlockSize + offset]) {
+                    if (nFailures++ < 5)
+                        printf("%s: LBA %u, %u blocks, byte %u differs\n", c.pName, nLBA, nBlocks, i);
+                    break;
+                }
+            }
+            for (u32 i = nLength; i < nLength + GUARD; i++) {
+                if (buffer[i] != GUARD_BYTE) {
+                    if (nFailures++ < 5)
+                        printf("%s: LBA %u, %u blocks, wrote past the batch\n", c.pName, nLBA, nBlocks);
+                    break;
+                }
+            }
+        }
+    }
+
+    return nFailures;
+}
+
+int main(int argc, char** argv) {
+    unsigned nFailures = 0;
+    for (unsigned i = 0; i < sizeof(s_Cases) / sizeof(s_Cases[0]); i++) {
+        unsigned nCaseFailures = CheckCase(s_Cases[i]);
+        printf("%-34s %s\n", s_Cases[i].pName, nCaseFailures ? "FAILED" : "ok");
+        nFailures += nCaseFailures;
+    }
+
+    return nFailures ? 1 : 0;
+}
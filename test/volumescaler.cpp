@@ -0,0 +1,109 @@
+//
+// Checks CVolumeScaler::Scale() against ScaleReference() on the host
+//
+// Every left/right pair of volume bytes the CD player can be given is
+// applied to the same random samples, which include the extremes, over
+// every frame count up to a few vector widths. With "bench" as the
+// argument it also times both over a second of CD audio.
+//
+// Copyright (C) 2025 Ian Cass
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <cdplayer/volumescaler.h>
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_FRAMES      19      // covers the leftovers of both paths
+#define GUARD           16
+#define GUARD_BYTE      0xA5
+#define BENCH_BYTES     (44100 * 4)
+#define BENCH_ROUNDS    200
+
+// What CCDPlayer::ScaleVolume() passes for a volume byte, with the
+// default volume at 0xff
+static u16 ScaleForVolume(unsigned nVolume) {
+    return nVolume == 0xff ? VOLUME_SCALE_ONE : nVolume << 4;
+}
+
+static void FillSamples(u8* pBuffer, u32 nByteCount) {
+    static const s16 Extremes[] = {-32768, 32767, -1, 0, 1, -4096, 4095};
+    for (u32 i = 0; i < nByteCount / 2; i++) {
+        s16 nSample = i < sizeof(Extremes) / sizeof(Extremes[0]) ? Extremes[i] : (s16)rand();
+        pBuffer[i * 2] = (u8)nSample;
+        pBuffer[i * 2 + 1] = (u8)(nSample >> 8);
+    }
+}
+
+static unsigned Check(void) {
+    // u32 aligned, as the CD player's buffers are
+    u32 Samples[MAX_FRAMES];
+    u32 Expected[MAX_FRAMES + GUARD / 4];
+    u32 Actual[MAX_FRAMES + GUARD / 4];
+    u8* pExpected = (u8*)Expected;
+    u8* pActual = (u8*)Actual;
+
+    unsigned nFailures = 0;
+    for (unsigned nLeft = 0; nLeft <= 0xff; nLeft++) {
+        for (unsigned nRight = 0; nRight <= 0xff; nRight++) {
+            FillSamples((u8*)Samples, sizeof(Samples));
+            u16 nLeftScale = ScaleForVolume(nLeft);
+            u16 nRightScale = ScaleForVolume(nRight);
+
+            for (u32 nFrames = 0; nFrames <= MAX_FRAMES; nFrames++) {
+                memset(Expected, GUARD_BYTE, sizeof(Expected));
+                memcpy(Expected, Samples, nFrames * 4);
+                memcpy(Actual, Expected, sizeof(Actual));
+
+                CVolumeScaler::ScaleReference(pExpected, nFrames * 4, nLeftScale, nRightScale);
+                CVolumeScaler::Scale(pActual, nFrames * 4, nLeftScale, nRightScale);
+
+                if (memcmp(Expected, Actual, sizeof(Actual)) != 0 && nFailures++ < 5)
+                    printf("volume %02x/%02x, %u frames: differs\n", nLeft, nRight, nFrames);
+            }
+        }
+    }
+
+    return nFailures;
+}
+
+static double Time(void (*pScale)(u8*, u32, u16, u16), u8* pBuffer) {
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < BENCH_ROUNDS; i++)
+        pScale(pBuffer, BENCH_BYTES, ScaleForVolume(0xC0), ScaleForVolume(0x80));
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return (double)BENCH_BYTES * BENCH_ROUNDS / elapsed.count() / 1e6;
+}
+
+static void Bench(void) {
+    static u32 Buffer[BENCH_BYTES / 4];
+    FillSamples((u8*)Buffer, BENCH_BYTES);
+
+    printf("reference  %8.1f MB/s\n", Time(CVolumeScaler::ScaleReference, (u8*)Buffer));
+    printf("scale      %8.1f MB/s\n", Time(CVolumeScaler::Scale, (u8*)Buffer));
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        Bench();
+        return 0;
+    }
+
+    unsigned nFailures = Check();
+    printf("volume scaler (AARCH %d) %s\n", AARCH, nFailures ? "FAILED" : "ok");
+    return nFailures ? 1 : 0;
+}